@@ -16,81 +16,202 @@
 
 #include "diatheke_asr_stream.h"
 
+#include "diatheke_async_stream.h"
 #include "diatheke_client_error.h"
 
 #include <atomic>
-#include <thread>
+#include <chrono>
+#include <mutex>
 
 namespace Diatheke
 {
 
-/* Private data struct */
-struct ASRStreamPrivate
+/* gRPC state for the stream, which may outlive the ASRStream object. */
+struct ASRStreamCall : public AsyncStreamCall<ASRStream::GRPCWriter>
 {
-    grpc::ClientContext context;
     cobaltspeech::diatheke::ASRResult result;
-    std::shared_ptr<ASRStream::GRPCWriter> stream;
     std::atomic_bool hasResult;
-    std::thread resultThread;
-    grpc::Status status;
 
-    ~ASRStreamPrivate()
+    // Reused for every audio chunk, so its buffer is only allocated once.
+    cobaltspeech::diatheke::ASRInput audioRequest;
+
+    // Holds a token sent by sendTokenAsync() until the write is done.
+    cobaltspeech::diatheke::ASRInput tokenRequest;
+
+    /*
+     * The session the stream was bound to by its first token, which is
+     * only tracked if the call has a timeline observer. The result may
+     * arrive on a completion queue thread while the token is sent.
+     */
+    std::mutex sessionLock;
+    std::string sessionID;
+    bool tokenSent;
+    bool audioSent;
+    std::atomic_bool resultMarked;
+
+    ASRStreamCall(const std::shared_ptr<ChannelLease> &channel,
+                  const std::shared_ptr<CompletionQueuePool> &pool)
+        : AsyncStreamCall<ASRStream::GRPCWriter>(channel, pool,
+                                                 CALL_STREAM_ASR),
+          hasResult(false), tokenSent(false), audioSent(false),
+          resultMarked(false)
     {
-        if (!hasResult.load()) {
-            // This indicates that the stream hasn't returned
-            // yet, so we need to force it to close by
-            // cancelling the stream's context.
-            context.TryCancel();
-        }
-        
-        // Make sure the thread has joined
-        join();
     }
 
-    void startResultThread()
+    // Report the point to the timeline observer, if there is one.
+    void markTimeline(TimelinePoint point)
     {
-        // Wait for results on a separate thread.
-        mJoined = false;
-        resultThread = std::thread([](ASRStreamPrivate *data){
-            data->status = data->stream->Finish();
-            data->hasResult = true;
-        }, this);
+        TimelineObserver *observer = timeline();
+        if (!observer)
+        {
+            return;
+        }
+
+        std::chrono::steady_clock::time_point now =
+            std::chrono::steady_clock::now();
+        std::string id;
+        {
+            std::lock_guard<std::mutex> lock(sessionLock);
+            id = sessionID;
+        }
+        observer->onTimelinePoint(id, point, now);
     }
 
-    void join()
+    // Called before a token is sent, to mark the first one.
+    void markToken(const cobaltspeech::diatheke::TokenData &token)
     {
-        if (mJoined) {
+        if (!timeline())
+        {
             return;
         }
 
-        mJoined = true;
-        resultThread.join();
+        {
+            std::lock_guard<std::mutex> lock(sessionLock);
+            if (tokenSent)
+            {
+                return;
+            }
+            tokenSent = true;
+            sessionID = token.id();
+        }
+        markTimeline(POINT_ASR_TOKEN_SENT);
+    }
+
+    // Called before audio is sent, to mark the first audio.
+    void markAudio()
+    {
+        if (!audioSent && timeline())
+        {
+            audioSent = true;
+            markTimeline(POINT_ASR_FIRST_AUDIO_SENT);
+        }
+    }
+
+    /*
+     * Called once the result is ready. A thread waiting in result() may
+     * see it before the completion queue thread runs the finish handler,
+     * so both call this and the first one marks the point.
+     */
+    void markResult()
+    {
+        if (timeline() && status.ok() && !resultMarked.exchange(true))
+        {
+            markTimeline(POINT_ASR_RESULT);
+        }
     }
+};
 
-private:
-    bool mJoined;
+/* Private data struct */
+struct ASRStreamPrivate
+{
+    std::shared_ptr<ASRStreamCall> call;
+
+    ~ASRStreamPrivate()
+    {
+        // If the stream hasn't returned yet, this forces it to close
+        // by cancelling the stream's context. It does not block.
+        call->shutdown();
+    }
 };
 
-ASRStream::ASRStream(cobaltspeech::diatheke::Diatheke::Stub *stub)
+ASRStream::ASRStream(const std::shared_ptr<ChannelLease> &channel,
+                     const std::shared_ptr<CompletionQueuePool> &pool)
     : dPtr(std::make_shared<ASRStreamPrivate>())
 {
-    dPtr->stream = stub->StreamASR(&dPtr->context, &dPtr->result);
-    dPtr->hasResult = false;
-    dPtr->startResultThread();
+    std::shared_ptr<ASRStreamCall> call =
+        std::make_shared<ASRStreamCall>(channel, pool);
+    call->stream = call->stub()->PrepareAsyncStreamASR(
+        &call->context, &call->result, call->queue());
+
+    /*
+     * Wait for the result as soon as the call starts. It arrives on the
+     * completion queue when the server closes the stream, which lets
+     * sendAudio() report that a result is ready.
+     */
+    call->start([call](bool) {
+        StreamOperation::Handler onResult = [call](bool) {
+            call->markResult();
+            if (call->status.ok())
+            {
+                call->traceMessage(EVENT_RECEIVE, call->result);
+            }
+            call->hasResult = true;
+        };
+
+        // result() may have requested the status first, in which case we
+        // run once it arrives.
+        if (!call->finishAsync(onResult))
+        {
+            call->finishOp.then(onResult);
+        }
+    });
+
+    dPtr->call = call;
 }
 
 ASRStream::~ASRStream() {}
 
 bool ASRStream::sendAudio(const std::string &data)
 {
-    // Set up the request and write to the input stream
-    cobaltspeech::diatheke::ASRInput request;
-    request.set_audio(data);
-    if (!dPtr->stream->Write(request)) {
+    return this->sendAudio(data.data(), data.size());
+}
+
+bool ASRStream::sendAudio(const char *data, size_t size)
+{
+    // Copy the audio into the reused request and write to the input stream
+    ASRStreamCall *call = dPtr->call.get();
+    call->markAudio();
+    call->audioRequest.mutable_audio()->assign(data, size);
+    if (!call->write(call->audioRequest)) {
         return false;
     }
 
-    return !dPtr->hasResult.load();
+    return !call->hasResult.load();
+}
+
+bool ASRStream::sendAudio(std::string &&data)
+{
+    // Swap the audio into the reused request and write to the input stream
+    ASRStreamCall *call = dPtr->call.get();
+    call->markAudio();
+    call->audioRequest.mutable_audio()->swap(data);
+    if (!call->write(call->audioRequest)) {
+        return false;
+    }
+
+    return !call->hasResult.load();
+}
+
+void ASRStream::sendAudioAsync(const char *data, size_t size,
+                               SendCallback callback)
+{
+    // The reused request holds the audio until the write is done.
+    std::shared_ptr<ASRStreamCall> call = dPtr->call;
+    call->markAudio();
+    call->audioRequest.mutable_audio()->assign(data, size);
+    call->writeAsync(call->audioRequest, [call, callback](bool ok) {
+        callback(ok && !call->hasResult.load());
+    });
 }
 
 bool ASRStream::sendToken(const cobaltspeech::diatheke::TokenData &token)
@@ -98,11 +219,23 @@ bool ASRStream::sendToken(const cobaltspeech::diatheke::TokenData &token)
     // Set up the request and write to the input stream
     cobaltspeech::diatheke::ASRInput request;
     *(request.mutable_token()) = token;
-    if (!dPtr->stream->Write(request)) {
+    dPtr->call->markToken(token);
+    if (!dPtr->call->write(request)) {
         return false;
     }
 
-    return !dPtr->hasResult.load();
+    return !dPtr->call->hasResult.load();
+}
+
+void ASRStream::sendTokenAsync(const cobaltspeech::diatheke::TokenData &token,
+                               SendCallback callback)
+{
+    std::shared_ptr<ASRStreamCall> call = dPtr->call;
+    call->markToken(token);
+    *(call->tokenRequest.mutable_token()) = token;
+    call->writeAsync(call->tokenRequest, [call, callback](bool ok) {
+        callback(ok && !call->hasResult.load());
+    });
 }
 
 cobaltspeech::diatheke::ASRResult ASRStream::result()
@@ -110,21 +243,54 @@ cobaltspeech::diatheke::ASRResult ASRStream::result()
     // If Diatheke hasn't already sent the result,
     // notify it that no more writes are coming, which
     // should force a result.
-    if (!dPtr->hasResult.load()) {
-        dPtr->stream->WritesDone();
+    if (!dPtr->call->hasResult.load()) {
+        dPtr->call->markTimeline(POINT_ASR_WRITES_DONE);
+        dPtr->call->writesDone();
     }
 
     // Wait for the result to come back.
-    dPtr->join();
+    grpc::Status status = dPtr->call->finish();
+    dPtr->call->hasResult = true;
+    dPtr->call->markResult();
 
     // Check the status and return the result.
-    if (!dPtr->status.ok()) {
-        throw Diatheke::ClientError(dPtr->status);
+    if (!status.ok()) {
+        throw Diatheke::ClientError(status);
     }
 
-    return dPtr->result;
+    return dPtr->call->result;
 }
 
-ASRStream::GRPCWriter *ASRStream::getStream() { return dPtr->stream.get(); }
+void ASRStream::resultAsync(ResultCallback callback)
+{
+    std::shared_ptr<ASRStreamCall> call = dPtr->call;
+    if (!call->hasResult.load())
+    {
+        call->markTimeline(POINT_ASR_WRITES_DONE);
+        call->writesDoneAsync(StreamOperation::Handler());
+    }
+
+    /*
+     * The status was requested when the call started, so wait for that
+     * to happen and then for the status to arrive.
+     */
+    call->startOp.then([call, callback](bool) {
+        call->finishOp.then([call, callback](bool) {
+            call->hasResult = true;
+            call->markResult();
+            callback(call->status, call->result);
+        });
+    });
+}
+
+void ASRStream::cancel()
+{
+    dPtr->call->cancel();
+}
+
+ASRStream::GRPCWriter *ASRStream::getStream()
+{
+    return dPtr->call->stream.get();
+}
 
 } // namespace Diatheke
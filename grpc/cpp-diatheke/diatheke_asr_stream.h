@@ -19,6 +19,7 @@
 
 #include "diatheke.grpc.pb.h"
 
+#include <functional>
 #include <memory>
 #include <string>
 
@@ -26,18 +27,37 @@ namespace Diatheke
 {
 
 class ASRStreamPrivate;
+class ChannelLease;
+class CompletionQueuePool;
 
 class ASRStream
 {
 public:
-    using GRPCWriter = grpc::ClientWriter<cobaltspeech::diatheke::ASRInput>;
+    using GRPCWriter =
+        grpc::ClientAsyncWriter<cobaltspeech::diatheke::ASRInput>;
 
     /*
-     * Create a new ASR stream object using the given gRPC objects.
-     * Most callers should use Client::newSessionASRStream() instead
-     * of creating a new stream directly.
+     * Callback used by sendAudioAsync(). If ok is false, the server has
+     * closed the stream and resultAsync() should be called to get the
+     * final ASR result.
      */
-    ASRStream(cobaltspeech::diatheke::Diatheke::Stub *stub);
+    using SendCallback = std::function<void(bool ok)>;
+
+    /*
+     * Callback used by resultAsync(). If the status is OK, result holds
+     * the ASR result, which the callback may swap or move from.
+     */
+    using ResultCallback = std::function<void(
+        const grpc::Status &status, cobaltspeech::diatheke::ASRResult &result)>;
+
+    /*
+     * Create a new ASR stream object using the given gRPC objects. The
+     * stream runs on the given completion queue pool, so no thread is
+     * created for it. Most callers should use Client::newSessionASRStream()
+     * instead of creating a new stream directly.
+     */
+    ASRStream(const std::shared_ptr<ChannelLease> &channel,
+              const std::shared_ptr<CompletionQueuePool> &pool);
     ~ASRStream();
 
     /*
@@ -48,18 +68,51 @@ public:
      */
     bool sendAudio(const std::string &data);
 
+    /*
+     * Send size bytes of audio data from the given buffer. This avoids
+     * building a temporary string for the audio.
+     */
+    bool sendAudio(const char *data, size_t size);
+
+    /*
+     * Send the given audio data, taking its contents instead of copying
+     * them. After the call, data holds a buffer left over from a previous
+     * call (with unspecified contents) that may be reused for the next
+     * chunk, so alternating calls don't allocate or copy.
+     */
+    bool sendAudio(std::string &&data);
+
+    /*
+     * Send size bytes of audio without blocking. The audio is copied, so
+     * the buffer may be reused right away. The callback is called from one
+     * of the client's completion queue threads once the audio is sent, so
+     * it should return quickly and must not throw. It may call
+     * sendAudioAsync() or resultAsync(). Only one send may be in progress
+     * at a time, and the other send functions must not be used until it
+     * is done.
+     */
+    void sendAudioAsync(const char *data, size_t size, SendCallback callback);
+
     /*
      * Send the given session token to Diatheke to update the speech
      * recognition context. The session token must first be sent on the
      * ASR stream before any audio will be recognized. If the stream was
      * created using Client::newSessionASRStream(), the first token was
-     * already sent.
+     * already sent. Streams opened ahead of time with Client::newASRStream()
+     * or an ASRStreamPool receive their first token this way.
      *
      * If this function returns false, the server has closed the stream
      * and result() should be called to get the final ASR result.
      */
     bool sendToken(const cobaltspeech::diatheke::TokenData &token);
 
+    /*
+     * Send the given session token without blocking. The callback is
+     * called as for sendAudioAsync(), and the same rules apply.
+     */
+    void sendTokenAsync(const cobaltspeech::diatheke::TokenData &token,
+                        SendCallback callback);
+
     /*
      * Returns the result of speech recognition. This function may be
      * called to end the audio stream early, which will force a
@@ -73,6 +126,25 @@ public:
      */
     cobaltspeech::diatheke::ASRResult result();
 
+    /*
+     * Get the result of speech recognition without blocking, ending the
+     * audio as result() does. The callback is called from one of the
+     * client's completion queue threads once the result arrives (or the
+     * stream fails), so it should return quickly and must not throw. It
+     * must not destroy the ASRStream. This must not be called while a
+     * sendAudioAsync() is in progress.
+     */
+    void resultAsync(ResultCallback callback);
+
+    /*
+     * Cancel the stream right away, without waiting for a result. Any
+     * sendAudio() or sendToken() in progress (including one blocked on
+     * another thread) returns false, as do later calls. It is safe to
+     * call this from any thread. After cancelling, result() throws a
+     * ClientError.
+     */
+    void cancel();
+
     /*
      * Provides access to the underlying gRPC stream without
      * transferring ownership of the stream.
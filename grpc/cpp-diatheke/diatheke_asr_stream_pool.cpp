@@ -0,0 +1,275 @@
+/*
+ * Copyright (2021-present) Cobalt Speech and Language, Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "diatheke_asr_stream_pool.h"
+
+#include "diatheke_client.h"
+#include "diatheke_completion_queue.h"
+
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+namespace Diatheke
+{
+
+static unsigned int defaultMaxAge = 20000;
+
+/*
+ * Private data for the pool. The expiry timer holds a weak reference to
+ * it, so a timer that fires while the pool is being destroyed does
+ * nothing.
+ */
+class ASRStreamPoolPrivate
+{
+public:
+    struct Entry
+    {
+        ASRStream stream;
+        std::chrono::steady_clock::time_point opened;
+    };
+
+    Client *client;
+    unsigned int count;
+    std::chrono::milliseconds maxAge;
+    std::mutex lock;
+    bool closed;
+
+    // The open streams to each endpoint, oldest first.
+    std::vector<std::deque<Entry>> streams;
+
+    // The pending expiry timer, if any, and when it fires.
+    std::shared_ptr<QueueTimer> timer;
+    std::chrono::steady_clock::time_point timerDeadline;
+
+    ASRStreamPoolPrivate(Client &client, unsigned int count)
+        : client(&client), count(count),
+          maxAge(std::chrono::milliseconds(defaultMaxAge)), closed(false)
+    {
+    }
+
+    /*
+     * Cancel the streams that are too old and move them to expired, to
+     * be released after the lock. If replace is set, a new stream is
+     * opened to the same endpoint for each one. Call with the lock held.
+     */
+    void removeExpired(std::deque<Entry> &expired, bool replace)
+    {
+        std::chrono::steady_clock::time_point now =
+            std::chrono::steady_clock::now();
+        for (size_t i = 0; i < streams.size(); i++)
+        {
+            std::deque<Entry> &queue = streams[i];
+            while (!queue.empty() && queue.front().opened + maxAge <= now)
+            {
+                queue.front().stream.cancel();
+                expired.push_back(queue.front());
+                queue.pop_front();
+                if (replace)
+                {
+                    Entry entry = {client->newASRStreamOn(i), now};
+                    queue.push_back(entry);
+                }
+            }
+        }
+    }
+
+    // Open streams until each endpoint has the full count. Call with the
+    // lock held.
+    void fill()
+    {
+        for (size_t i = 0; i < streams.size(); i++)
+        {
+            while (streams[i].size() < count)
+            {
+                // Opening a stream does not block.
+                Entry entry = {client->newASRStreamOn(i),
+                               std::chrono::steady_clock::now()};
+                streams[i].push_back(entry);
+            }
+        }
+    }
+
+    /*
+     * Make sure the timer fires when the oldest stream expires. Call
+     * with the lock held.
+     */
+    void schedule(const std::shared_ptr<ASRStreamPoolPrivate> &self)
+    {
+        bool haveStreams = false;
+        std::chrono::steady_clock::time_point deadline;
+        for (size_t i = 0; i < streams.size(); i++)
+        {
+            if (streams[i].empty())
+            {
+                continue;
+            }
+
+            std::chrono::steady_clock::time_point expiry =
+                streams[i].front().opened + maxAge;
+            if (!haveStreams || expiry < deadline)
+            {
+                deadline = expiry;
+                haveStreams = true;
+            }
+        }
+
+        if (!haveStreams || (timer && timerDeadline <= deadline))
+        {
+            return;
+        }
+
+        if (timer)
+        {
+            timer->cancel();
+        }
+
+        std::weak_ptr<ASRStreamPoolPrivate> weak = self;
+        timer = QueueTimer::start(client->asyncPool(), deadline, [weak]() {
+            std::shared_ptr<ASRStreamPoolPrivate> data = weak.lock();
+            if (data)
+            {
+                data->expire(data);
+            }
+        });
+        timerDeadline = deadline;
+    }
+
+    // Called by the timer to replace the streams that are too old.
+    void expire(const std::shared_ptr<ASRStreamPoolPrivate> &self)
+    {
+        std::deque<Entry> expired;
+        std::lock_guard<std::mutex> guard(lock);
+        if (closed)
+        {
+            return;
+        }
+
+        timer.reset();
+        removeExpired(expired, true);
+        schedule(self);
+    }
+};
+
+ASRStreamPool::ASRStreamPool(Client &client, unsigned int count)
+    : dPtr(std::make_shared<ASRStreamPoolPrivate>(client, count))
+{
+    dPtr->streams.resize(client.endpointCount());
+    prepare();
+}
+
+ASRStreamPool::~ASRStreamPool()
+{
+    std::deque<ASRStreamPoolPrivate::Entry> streams;
+    std::shared_ptr<QueueTimer> timer;
+    {
+        // Wait for a running timer, so it does not use the client after
+        // we return.
+        std::lock_guard<std::mutex> lock(dPtr->lock);
+        dPtr->closed = true;
+        timer.swap(dPtr->timer);
+        for (size_t i = 0; i < dPtr->streams.size(); i++)
+        {
+            streams.insert(streams.end(), dPtr->streams[i].begin(),
+                           dPtr->streams[i].end());
+            dPtr->streams[i].clear();
+        }
+    }
+
+    if (timer)
+    {
+        timer->cancel();
+    }
+    for (size_t i = 0; i < streams.size(); i++)
+    {
+        streams[i].stream.cancel();
+    }
+}
+
+void ASRStreamPool::setMaxAge(unsigned int milliseconds)
+{
+    std::lock_guard<std::mutex> lock(dPtr->lock);
+    dPtr->maxAge = std::chrono::milliseconds(milliseconds);
+    dPtr->schedule(dPtr);
+}
+
+void ASRStreamPool::prepare()
+{
+    // Cancel expired streams after releasing the lock.
+    std::deque<ASRStreamPoolPrivate::Entry> expired;
+    std::lock_guard<std::mutex> lock(dPtr->lock);
+    dPtr->removeExpired(expired, false);
+    dPtr->fill();
+    dPtr->schedule(dPtr);
+}
+
+ASRStream ASRStreamPool::acquire(const cobaltspeech::diatheke::TokenData &token)
+{
+    // Use a stream to the server the session is routed to.
+    size_t endpoint = dPtr->client->sessionEndpoint(token.id());
+
+    std::deque<ASRStreamPoolPrivate::Entry> expired;
+    std::vector<ASRStream> streams;
+    {
+        // Take the newest stream, which has the most time left.
+        std::lock_guard<std::mutex> lock(dPtr->lock);
+        dPtr->removeExpired(expired, false);
+        std::deque<ASRStreamPoolPrivate::Entry> &queue =
+            dPtr->streams[endpoint];
+        if (!queue.empty())
+        {
+            streams.push_back(queue.back().stream);
+            queue.pop_back();
+        }
+    }
+
+    if (streams.empty() || !streams[0].sendToken(token))
+    {
+        // The pool was empty, or the server closed the stream while it
+        // was idle, so fall back to opening a new one.
+        if (!streams.empty())
+        {
+            streams[0].cancel();
+            streams.clear();
+        }
+        streams.push_back(dPtr->client->newSessionASRStream(token));
+    }
+
+    prepare();
+    return streams[0];
+}
+
+void ASRStreamPool::clear()
+{
+    std::deque<ASRStreamPoolPrivate::Entry> streams;
+    {
+        std::lock_guard<std::mutex> lock(dPtr->lock);
+        for (size_t i = 0; i < dPtr->streams.size(); i++)
+        {
+            streams.insert(streams.end(), dPtr->streams[i].begin(),
+                           dPtr->streams[i].end());
+            dPtr->streams[i].clear();
+        }
+    }
+
+    for (size_t i = 0; i < streams.size(); i++)
+    {
+        streams[i].stream.cancel();
+    }
+}
+
+} // namespace Diatheke
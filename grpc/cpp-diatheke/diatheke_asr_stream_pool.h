@@ -0,0 +1,96 @@
+/*
+ * Copyright (2021-present) Cobalt Speech and Language, Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DIATHEKE_ASR_STREAM_POOL_H
+#define DIATHEKE_ASR_STREAM_POOL_H
+
+#include "diatheke_asr_stream.h"
+
+#include <memory>
+
+namespace Diatheke
+{
+
+class ASRStreamPoolPrivate;
+class Client;
+
+/*
+ * ASRStreamPool keeps ASR streams open ahead of time, so that a stream is
+ * ready (including its HTTP/2 stream setup) as soon as the user starts
+ * speaking. A pre-opened stream is bound to a session when it is taken
+ * from the pool, by sending the session token at that moment.
+ *
+ * When the client balances several servers, the pool keeps streams open
+ * to each of them, and a session is always given a stream to the server
+ * it is routed to.
+ *
+ * Streams that are not used within the maximum age are closed and
+ * replaced by a timer on the client's completion queues, so the server
+ * does not hold idle streams for long even while the application is not
+ * using the pool. Streams still in the pool when it is destroyed are
+ * cancelled.
+ *
+ * It is safe to use the pool from multiple threads. The client must
+ * outlive the pool.
+ */
+class ASRStreamPool
+{
+public:
+    /*
+     * Create a pool that keeps the given number of streams open to each
+     * server. The streams are opened right away.
+     */
+    explicit ASRStreamPool(Client &client, unsigned int count = 1);
+    ~ASRStreamPool();
+
+    /*
+     * Set the longest time in milliseconds that a stream is kept open
+     * before it is used. The default is 20000 (i.e., 20 seconds).
+     */
+    void setMaxAge(unsigned int milliseconds);
+
+    /*
+     * Open streams until the pool has its full count, replacing any that
+     * are too old. acquire() does this after every stream it hands out,
+     * but it may also be called shortly before a stream will be needed
+     * (e.g., on receiving a WaitForUserAction) to start with fresh ones.
+     */
+    void prepare();
+
+    /*
+     * Returns an open stream with the given session token already sent,
+     * as with Client::newSessionASRStream(). A pre-opened stream to the
+     * session's server is used if one is available, and the pool is then
+     * refilled.
+     */
+    ASRStream acquire(const cobaltspeech::diatheke::TokenData &token);
+
+    /*
+     * Cancel all of the streams in the pool. The pool is not refilled
+     * until the next call to prepare() or acquire().
+     */
+    void clear();
+
+private:
+    std::shared_ptr<ASRStreamPoolPrivate> dPtr; // Opaque pointer
+
+    ASRStreamPool(const ASRStreamPool &) = delete;
+    ASRStreamPool &operator=(const ASRStreamPool &) = delete;
+};
+
+} // namespace Diatheke
+
+#endif // DIATHEKE_ASR_STREAM_POOL_H
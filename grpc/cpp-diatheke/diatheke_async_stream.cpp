@@ -0,0 +1,98 @@
+/*
+ * Copyright (2021-present) Cobalt Speech and Language, Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "diatheke_async_stream.h"
+
+namespace Diatheke
+{
+
+StreamOperation::StreamOperation() : mPending(false), mOk(false) {}
+
+StreamOperation::~StreamOperation() {}
+
+void StreamOperation::arm()
+{
+    std::lock_guard<std::mutex> lock(mLock);
+    mPending = true;
+    mHandler = Handler();
+}
+
+void StreamOperation::arm(const Handler &handler)
+{
+    std::lock_guard<std::mutex> lock(mLock);
+    mPending = true;
+    mHandler = handler;
+}
+
+bool StreamOperation::wait()
+{
+    std::unique_lock<std::mutex> lock(mLock);
+    while (mPending)
+    {
+        mCond.wait(lock);
+    }
+
+    return mOk;
+}
+
+void StreamOperation::then(const Handler &handler)
+{
+    bool ok = false;
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        if (mPending)
+        {
+            mContinuations.push_back(handler);
+            return;
+        }
+
+        ok = mOk;
+    }
+
+    handler(ok);
+}
+
+void StreamOperation::proceed(bool ok)
+{
+    Handler handler;
+    std::vector<Handler> continuations;
+    {
+        /*
+         * Notify while holding the lock. A waiting thread may destroy
+         * this object as soon as it wakes up, so we must not touch any
+         * members after releasing the lock.
+         */
+        std::lock_guard<std::mutex> lock(mLock);
+        mPending = false;
+        mOk = ok;
+        handler.swap(mHandler);
+        continuations.swap(mContinuations);
+        mCond.notify_all();
+    }
+
+    // Run the handlers last, since they may arm this operation again.
+    if (handler)
+    {
+        handler(ok);
+    }
+
+    for (size_t i = 0; i < continuations.size(); i++)
+    {
+        continuations[i](ok);
+    }
+}
+
+} // namespace Diatheke
@@ -0,0 +1,370 @@
+/*
+ * Copyright (2021-present) Cobalt Speech and Language, Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DIATHEKE_ASYNC_STREAM_H
+#define DIATHEKE_ASYNC_STREAM_H
+
+#include "diatheke_channel_pool.h"
+#include "diatheke_completion_queue.h"
+#include "diatheke_timeline.h"
+#include "diatheke_trace.h"
+
+#include <grpcpp/client_context.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace Diatheke
+{
+
+/*
+ * StreamOperation is a reusable AsyncTag for one kind of stream operation
+ * (start, read, write, etc.). gRPC allows at most one operation of each
+ * kind to be in flight on a stream, so a stream needs only one of these
+ * per kind.
+ *
+ * The thread that starts an operation may wait() for it, or it may give
+ * the operation a handler to run on the completion queue thread instead.
+ * Blocking waits must never be made from a completion queue thread.
+ */
+class StreamOperation : public AsyncTag
+{
+public:
+    using Handler = std::function<void(bool ok)>;
+
+    StreamOperation();
+    ~StreamOperation() override;
+
+    // Mark the operation as in flight. Call before giving it to gRPC.
+    void arm();
+
+    /*
+     * Mark the operation as in flight, and call the given handler from
+     * the completion queue thread when it is done. The handler may arm
+     * this operation again.
+     */
+    void arm(const Handler &handler);
+
+    /*
+     * Block until the operation is no longer in flight and return the
+     * ok flag it completed with. Returns immediately if the operation
+     * is not in flight.
+     */
+    bool wait();
+
+    /*
+     * Call the given handler with the ok flag once the operation is no
+     * longer in flight. If it is not in flight, the handler is called
+     * right away from the calling thread. Unlike wait(), this is safe to
+     * use from a completion queue thread.
+     */
+    void then(const Handler &handler);
+
+    void proceed(bool ok) override;
+
+private:
+    std::mutex mLock;
+    std::condition_variable mCond;
+    bool mPending;
+    bool mOk;
+    Handler mHandler;
+    std::vector<Handler> mContinuations;
+};
+
+/*
+ * AsyncStreamCall holds the gRPC state of one streaming call that runs on
+ * a CompletionQueuePool. It is always owned by a shared_ptr. Handlers for
+ * operations in flight hold a reference to it, so the call stays alive
+ * until all of its operations complete, even if the stream object that
+ * created it is already gone.
+ *
+ * The GRPCStream type is one of the gRPC async client stream types. The
+ * caller creates it with the PrepareAsync method of stub(), using the
+ * context and queue() of this object, and then calls start(). The call
+ * holds its channel lease until it is destroyed.
+ *
+ * If the lease has a trace, the messages written and read, and the final
+ * status, are recorded in it as the given kind of call.
+ */
+template <typename GRPCStream>
+class AsyncStreamCall
+    : public std::enable_shared_from_this<AsyncStreamCall<GRPCStream>>
+{
+public:
+    grpc::ClientContext context;
+    std::unique_ptr<GRPCStream> stream;
+    grpc::Status status;
+
+    StreamOperation startOp;
+    StreamOperation readOp;
+    StreamOperation writeOp;
+    StreamOperation writesDoneOp;
+    StreamOperation finishOp;
+
+    AsyncStreamCall(const std::shared_ptr<ChannelLease> &channel,
+                    const std::shared_ptr<CompletionQueuePool> &pool,
+                    TraceCall traceCall)
+        : mChannel(channel), mPool(pool), mQueue(pool->next()),
+          mTrace(channel->trace()), mTraceCall(traceCall), mTraceID(0),
+          mFinishStarted(false), mCancelled(false)
+    {
+        if (mTrace)
+        {
+            mTraceID = mTrace->newCallID();
+        }
+    }
+
+    virtual ~AsyncStreamCall() {}
+
+    // The stub for the channel this call runs on.
+    cobaltspeech::diatheke::Diatheke::Stub *stub() { return mChannel->stub(); }
+
+    // The completion queue this call runs on.
+    grpc::CompletionQueue *queue() { return mQueue; }
+
+    // The observer to report the call's timeline points to, or null.
+    TimelineObserver *timeline() const { return mChannel->timeline(); }
+
+    /*
+     * Start the call without blocking. Later operations wait for the
+     * start to complete before they are issued. The optional handler
+     * is called from the completion queue thread once the call starts.
+     */
+    void start(const StreamOperation::Handler &onStarted =
+                   StreamOperation::Handler())
+    {
+        std::shared_ptr<AsyncStreamCall> self = this->shared_from_this();
+        startOp.arm([self, onStarted](bool ok) {
+            if (onStarted)
+            {
+                onStarted(ok);
+            }
+        });
+        stream->StartCall(&startOp);
+    }
+
+    /*
+     * Record a message sent or received outside of write() and read(),
+     * such as the request of a server streaming call, if it is traced.
+     */
+    void traceMessage(TraceEvent event,
+                      const google::protobuf::MessageLite &msg)
+    {
+        if (mTrace)
+        {
+            mTrace->writeMessage(mTraceID, mTraceCall, event, msg);
+        }
+    }
+
+    // Write the message and wait for the write to complete.
+    template <typename Message> bool write(const Message &msg)
+    {
+        traceMessage(EVENT_SEND, msg);
+        startOp.wait();
+        writeOp.arm();
+        stream->Write(msg, &writeOp);
+        return writeOp.wait();
+    }
+
+    /*
+     * Start writing the message without blocking. The handler is called
+     * from the completion queue thread when the write is done. The message
+     * must remain valid until then, and only one write may be in flight.
+     */
+    template <typename Message>
+    void writeAsync(const Message &msg, const StreamOperation::Handler &handler)
+    {
+        traceMessage(EVENT_SEND, msg);
+        std::shared_ptr<AsyncStreamCall> self = this->shared_from_this();
+        const Message *pending = &msg;
+        startOp.then([self, pending, handler](bool) {
+            // The handler keeps the call alive until the write is done.
+            self->writeOp.arm([self, handler](bool ok) {
+                if (handler)
+                {
+                    handler(ok);
+                }
+            });
+            self->stream->Write(*pending, &self->writeOp);
+        });
+    }
+
+    // Tell the server no more writes are coming and wait for it to be sent.
+    bool writesDone()
+    {
+        startOp.wait();
+        if (mTrace)
+        {
+            mTrace->writeEvent(mTraceID, mTraceCall, EVENT_WRITES_DONE);
+        }
+        writesDoneOp.arm();
+        stream->WritesDone(&writesDoneOp);
+        return writesDoneOp.wait();
+    }
+
+    /*
+     * Tell the server no more writes are coming without blocking. The
+     * handler (if any) is called from the completion queue thread once it
+     * is sent. No write may be in flight.
+     */
+    void writesDoneAsync(const StreamOperation::Handler &handler)
+    {
+        if (mTrace)
+        {
+            mTrace->writeEvent(mTraceID, mTraceCall, EVENT_WRITES_DONE);
+        }
+        std::shared_ptr<AsyncStreamCall> self = this->shared_from_this();
+        startOp.then([self, handler](bool) {
+            self->writesDoneOp.arm([self, handler](bool ok) {
+                if (handler)
+                {
+                    handler(ok);
+                }
+            });
+            self->stream->WritesDone(&self->writesDoneOp);
+        });
+    }
+
+    // Read the next message and wait for it to arrive.
+    template <typename Message> bool read(Message *msg)
+    {
+        startOp.wait();
+        readOp.arm();
+        stream->Read(msg, &readOp);
+        if (!readOp.wait())
+        {
+            return false;
+        }
+        traceMessage(EVENT_RECEIVE, *msg);
+        return true;
+    }
+
+    /*
+     * Start reading the next message without blocking. The handler is
+     * called from the completion queue thread when the read is done. The
+     * message must remain valid until then (it is typically a member of
+     * a subclass of this object).
+     */
+    template <typename Message>
+    void readAsync(Message *msg, const StreamOperation::Handler &handler)
+    {
+        // Issue the read once the call has started, without blocking.
+        std::shared_ptr<AsyncStreamCall> self = this->shared_from_this();
+        startOp.then([self, msg, handler](bool) {
+            self->readOp.arm([self, msg, handler](bool ok) {
+                if (ok)
+                {
+                    self->traceMessage(EVENT_RECEIVE, *msg);
+                }
+                handler(ok);
+            });
+            self->stream->Read(msg, &self->readOp);
+        });
+    }
+
+    /*
+     * Request the final status of the call without blocking. The handler
+     * (if any) is called from the completion queue thread once the status
+     * is available. Returns false if the status was already requested, in
+     * which case the handler is not used. The status is traced after the
+     * handler runs, so the handler may trace a response that arrived with
+     * it.
+     *
+     * The operation is armed under the same lock that marks the status
+     * as requested, so a thread that finds it already requested (e.g.,
+     * finish()) can wait on finishOp and see it in flight.
+     */
+    bool finishAsync(const StreamOperation::Handler &handler)
+    {
+        std::shared_ptr<AsyncStreamCall> self = this->shared_from_this();
+        std::unique_lock<std::mutex> lock(mFinishLock);
+        if (mFinishStarted)
+        {
+            return false;
+        }
+
+        mFinishStarted = true;
+        finishOp.arm([self, handler](bool ok) {
+            self->mChannel->reportStatus(self->status);
+            if (handler)
+            {
+                handler(ok);
+            }
+            if (self->mTrace)
+            {
+                self->mTrace->writeStatus(self->mTraceID, self->mTraceCall,
+                                          self->status);
+            }
+        });
+        lock.unlock();
+        stream->Finish(&status, &finishOp);
+        return true;
+    }
+
+    // Wait for the final status of the call, requesting it if needed.
+    grpc::Status finish()
+    {
+        startOp.wait();
+        finishAsync(StreamOperation::Handler());
+        finishOp.wait();
+        return status;
+    }
+
+    /*
+     * Cancel the call if it is still running and make sure its final
+     * status is collected, without blocking. Called when the stream
+     * object that owns this call is destroyed.
+     */
+    void shutdown()
+    {
+        context.TryCancel();
+        finishAsync(StreamOperation::Handler());
+    }
+
+    /*
+     * Cancel the call at the caller's request, without blocking. This
+     * may be called from any thread. Operations that are in flight,
+     * including blocking ones on other threads, complete right away with
+     * ok set to false.
+     */
+    void cancel()
+    {
+        mCancelled = true;
+        shutdown();
+    }
+
+    // Returns true if cancel() was called.
+    bool cancelled() const { return mCancelled.load(); }
+
+private:
+    std::shared_ptr<ChannelLease> mChannel;
+    std::shared_ptr<CompletionQueuePool> mPool;
+    grpc::CompletionQueue *mQueue;
+    TraceWriter *mTrace;
+    TraceCall mTraceCall;
+    uint64_t mTraceID;
+    std::mutex mFinishLock;
+    bool mFinishStarted;
+    std::atomic<bool> mCancelled;
+};
+
+} // namespace Diatheke
+
+#endif // DIATHEKE_ASYNC_STREAM_H
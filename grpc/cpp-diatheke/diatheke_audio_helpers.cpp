@@ -18,10 +18,12 @@
 
 #include "diatheke_client_error.h"
 
+#include <condition_variable>
+#include <deque>
 #include <exception>
+#include <memory>
 #include <mutex>
 #include <string>
-#include <thread>
 #include <vector>
 
 namespace Diatheke
@@ -36,18 +38,24 @@ AudioWriter::~AudioWriter() {}
 cobaltspeech::diatheke::ASRResult
 ReadASRAudio(ASRStream &stream, AudioReader *reader, size_t buffSize)
 {
-    std::vector<char> buffer(buffSize);
+    /*
+     * The reader fills the string directly, and the stream swaps it with
+     * the buffer from its previous request, so no audio is copied.
+     */
+    std::string buffer;
     while (true)
     {
         // Pull audio data from the reader
-        size_t bytesRead = reader->readAudio(buffer.data(), buffSize);
+        buffer.resize(buffSize);
+        size_t bytesRead = reader->readAudio(&buffer[0], buffSize);
         if (bytesRead == 0)
         {
             break;
         }
 
         // Send the audio to the stream
-        if (!stream.sendAudio(std::string(buffer.data(), bytesRead)))
+        buffer.resize(bytesRead);
+        if (!stream.sendAudio(std::move(buffer)))
         {
             break;
         }
@@ -61,7 +69,7 @@ ReadASRAudio(ASRStream &stream, AudioReader *reader, size_t buffSize)
  * Helper class to capture the first exception that occurs on multiple
  * threads. Also allows each thread to check if there was an error on
  * any other thread, and rethrows the first exception encountered from
- * the thread where all the other threads were spawned.
+ * the thread that owns the helper.
  */
 class MultiThreadExceptionHelper {
 private:
@@ -106,7 +114,7 @@ public:
 
     /*
      * Call from the thread where this class was instantiated,
-     * after all threads using it have been join()-ed. Will
+     * after all other threads are done using it. Will
      * rethrow the first exception that was encountered.
      */
     void rethrow()
@@ -115,66 +123,142 @@ public:
     }
 };
 
-void ReadTranscribeAudio(TranscribeStream &stream, AudioReader *reader, size_t buffSize,
-                         std::function<void(const cobaltspeech::diatheke::TranscribeResult&)> callback)
+/*
+ * Helper class to forward results from a TranscribeStream to a callback.
+ * Results are received on the completion queue threads, and the next
+ * result is not requested until the callback for the current one has
+ * returned, so results are always delivered in order. Results are read
+ * until the server closes the stream.
+ */
+class TranscribeResultForwarder
 {
-    // Used to capture exceptions on the threads.
-    MultiThreadExceptionHelper err;
+public:
+    using Callback =
+        std::function<void(const cobaltspeech::diatheke::TranscribeResult &)>;
 
-    // Handle reading audio on a separate thread.
-    std::thread audioThread([&](){
-        std::vector<char> buffer(buffSize);
-        try
-        {
-            while(true)
-            {
-                // Pull audio from the reader
-                size_t bytesRead = reader->readAudio(buffer.data(), buffSize);
-                if (bytesRead == 0 || err.isSet())
+    TranscribeResultForwarder(const TranscribeStream &stream,
+                              const Callback &callback,
+                              MultiThreadExceptionHelper *err)
+        : mStream(stream), mCallback(callback), mErr(err), mDone(false)
+    {
+    }
+
+    // Request the next result from the stream.
+    static void next(const std::shared_ptr<TranscribeResultForwarder> &self)
+    {
+        self->mStream.receiveResultAsync(
+            [self](bool ok, cobaltspeech::diatheke::TranscribeResult &result) {
+                if (!ok)
                 {
-                    stream.sendFinished();
+                    self->setDone();
                     return;
                 }
 
-                // Send audio to the stream
-                if (!stream.sendAudio(std::string(buffer.data(), bytesRead)) || err.isSet())
+                /*
+                 * After an error we keep reading, but discard the results.
+                 * The stream's final status is not available until every
+                 * result has been received.
+                 */
+                if (!self->mErr->isSet())
                 {
-                    return;
+                    try
+                    {
+                        self->mCallback(result);
+                    }
+                    catch (...)
+                    {
+                        self->mErr->captureException();
+                    }
                 }
-            }
-        }
-        catch(...)
+
+                next(self);
+            });
+    }
+
+    // Block until there are no more results to forward.
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(mLock);
+        while (!mDone)
         {
-            err.captureException();
+            mCond.wait(lock);
         }
-    });
+    }
 
-    // Handle forwarding results on a separate thread.
-    std::thread resultsThread([&](){
-        try
+private:
+    TranscribeStream mStream;
+    Callback mCallback;
+    MultiThreadExceptionHelper *mErr;
+    std::mutex mLock;
+    std::condition_variable mCond;
+    bool mDone;
+
+    void setDone()
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mDone = true;
+        mCond.notify_all();
+    }
+};
+
+void ReadTranscribeAudio(TranscribeStream &stream, AudioReader *reader, size_t buffSize,
+                         std::function<void(const cobaltspeech::diatheke::TranscribeResult&)> callback)
+{
+    // Used to capture exceptions from the reader and the callback.
+    MultiThreadExceptionHelper err;
+
+    // Forward results from the completion queue threads.
+    std::shared_ptr<TranscribeResultForwarder> forwarder =
+        std::make_shared<TranscribeResultForwarder>(stream, callback, &err);
+    TranscribeResultForwarder::next(forwarder);
+
+    // Send audio from this thread, swapping buffers with the stream.
+    std::string buffer;
+    bool finished = false;
+    try
+    {
+        while (true)
         {
-            while(true)
+            // Pull audio from the reader
+            buffer.resize(buffSize);
+            size_t bytesRead = reader->readAudio(&buffer[0], buffSize);
+            if (bytesRead == 0 || err.isSet())
             {
-                // Wait for the next result
-                cobaltspeech::diatheke::TranscribeResult result;
-                if(!stream.receiveResult(&result) || err.isSet())
-                {
-                    return;
-                }
+                finished = true;
+                stream.sendFinished();
+                break;
+            }
 
-                // Pass the result to the callback
-                callback(result);
+            // Send audio to the stream
+            buffer.resize(bytesRead);
+            if (!stream.sendAudio(std::move(buffer)) || err.isSet())
+            {
+                break;
             }
         }
-        catch(...)
+    }
+    catch (...)
+    {
+        err.captureException();
+    }
+
+    /*
+     * If the reader failed, still tell the server we are done sending so
+     * that it can close the stream and we don't wait forever for it.
+     */
+    if (!finished && err.isSet())
+    {
+        try
         {
-            err.captureException();
+            stream.sendFinished();
         }
-    });
+        catch (...)
+        {
+        }
+    }
 
-    // Wait for the threads to finish, then close the stream.
-    audioThread.join();
-    resultsThread.join();
+    // Wait for the results to finish, then close the stream.
+    forwarder->wait();
     stream.close();
 
     // If there was an error, rethrow it on the calling thread.
@@ -186,7 +270,10 @@ void ReadTranscribeAudio(TranscribeStream &stream, AudioReader *reader, size_t b
 
 void WriteTTSAudio(TTSStream &stream, AudioWriter *writer)
 {
-    // Wait for the next audio chunk
+    /*
+     * Wait for the next audio chunk. Reusing one buffer lets the stream
+     * swap storage with it instead of copying or allocating per chunk.
+     */
     std::string buffer;
     while (stream.receiveAudio(buffer))
     {
@@ -199,4 +286,237 @@ void WriteTTSAudio(TTSStream &stream, AudioWriter *writer)
     }
 }
 
+TTSPlaybackOptions::TTSPlaybackOptions()
+    : bytesPerSecond(32000), prebufferMs(200), maxBufferMs(2000)
+{
+}
+
+TTSPlaybackStats::TTSPlaybackStats()
+    : underruns(0), overruns(0), bytesWritten(0), maxBufferedBytes(0)
+{
+}
+
+/*
+ * Helper class for the pipelined WriteTTSAudio(). Audio is received into
+ * the buffer on the completion queue threads, and taken out of it by the
+ * playback thread. Chunk buffers are recycled between the two stages, so
+ * no allocations are made once playback is running.
+ */
+class TTSJitterBuffer
+{
+public:
+    TTSJitterBuffer(const TTSStream &stream, size_t maxBytes)
+        : mStream(stream), mMaxBytes(maxBytes), mBufferedBytes(0),
+          mPaused(false), mDone(false), mStopped(false)
+    {
+    }
+
+    // Request the next chunk of audio from the stream.
+    static void receive(const std::shared_ptr<TTSJitterBuffer> &self)
+    {
+        self->mStream.receiveAudioAsync([self](bool hasAudio,
+                                               std::string &audio,
+                                               const grpc::Status &status) {
+            bool more = false;
+            {
+                std::lock_guard<std::mutex> lock(self->mLock);
+                if (!hasAudio)
+                {
+                    self->mDone = true;
+                    self->mStatus = status;
+                }
+                else if (!self->mStopped)
+                {
+                    // Give the stream a used buffer to receive into next.
+                    self->mChunks.push_back(std::string());
+                    if (!self->mFree.empty())
+                    {
+                        self->mChunks.back().swap(self->mFree.back());
+                        self->mFree.pop_back();
+                    }
+                    self->mChunks.back().swap(audio);
+
+                    self->mBufferedBytes += self->mChunks.back().size();
+                    if (self->mBufferedBytes > self->mStats.maxBufferedBytes)
+                    {
+                        self->mStats.maxBufferedBytes = self->mBufferedBytes;
+                    }
+
+                    if (self->mBufferedBytes >= self->mMaxBytes)
+                    {
+                        // Stop receiving until the playback thread has
+                        // made room.
+                        self->mPaused = true;
+                        self->mStats.overruns++;
+                    }
+                    else
+                    {
+                        more = true;
+                    }
+                }
+                self->mCond.notify_all();
+            }
+
+            if (more)
+            {
+                receive(self);
+            }
+        });
+    }
+
+    /*
+     * Wait until at least minBytes are buffered or the stream ends, and
+     * then take the next chunk, swapping it into the given buffer (whose
+     * storage is recycled). Returns false if there is no more audio.
+     */
+    bool take(std::string &buffer, size_t minBytes,
+              const std::shared_ptr<TTSJitterBuffer> &self)
+    {
+        bool resume = false;
+        {
+            std::unique_lock<std::mutex> lock(mLock);
+            while ((mChunks.empty() || mBufferedBytes < minBytes) && !mDone)
+            {
+                mCond.wait(lock);
+            }
+
+            if (mChunks.empty())
+            {
+                return false;
+            }
+
+            mFree.push_back(std::string());
+            mFree.back().swap(buffer);
+            buffer.swap(mChunks.front());
+            mChunks.pop_front();
+            mBufferedBytes -= buffer.size();
+
+            if (mPaused && mBufferedBytes < mMaxBytes)
+            {
+                mPaused = false;
+                resume = true;
+            }
+        }
+
+        if (resume)
+        {
+            receive(self);
+        }
+
+        return true;
+    }
+
+    /*
+     * Returns true if the buffer is empty but the stream has not ended,
+     * and counts it as an underrun.
+     */
+    bool underrun()
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        if (mChunks.empty() && !mDone)
+        {
+            mStats.underruns++;
+            return true;
+        }
+
+        return false;
+    }
+
+    /*
+     * Stop receiving audio. Chunks that arrive later are discarded.
+     * Returns the statistics so far, and stores the final status of the
+     * stream (which is only meaningful if it has ended).
+     */
+    TTSPlaybackStats stop(grpc::Status *status)
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mStopped = true;
+        *status = mStatus;
+        return mStats;
+    }
+
+private:
+    TTSStream mStream;
+    size_t mMaxBytes;
+    TTSPlaybackStats mStats;
+    std::mutex mLock;
+    std::condition_variable mCond;
+    std::deque<std::string> mChunks;
+    std::vector<std::string> mFree;
+    size_t mBufferedBytes;
+    grpc::Status mStatus;
+    bool mPaused;
+    bool mDone;
+    bool mStopped;
+};
+
+TTSPlaybackStats WriteTTSAudio(TTSStream &stream, AudioWriter *writer,
+                               const TTSPlaybackOptions &options)
+{
+    size_t prebufferBytes =
+        static_cast<size_t>(options.bytesPerSecond) * options.prebufferMs / 1000;
+    size_t maxBytes =
+        static_cast<size_t>(options.bytesPerSecond) * options.maxBufferMs / 1000;
+    if (maxBytes < prebufferBytes)
+    {
+        maxBytes = prebufferBytes;
+    }
+    if (maxBytes == 0)
+    {
+        maxBytes = 1;
+    }
+
+    std::shared_ptr<TTSJitterBuffer> jitter =
+        std::make_shared<TTSJitterBuffer>(stream, maxBytes);
+    TTSJitterBuffer::receive(jitter);
+
+    std::string buffer;
+    size_t bytesWritten = 0;
+    try
+    {
+        // Fill the prebuffer before writing anything.
+        size_t minBytes = prebufferBytes;
+        while (jitter->take(buffer, minBytes, jitter))
+        {
+            minBytes = 0;
+
+            // Write the audio chunk
+            size_t written = writer->writeAudio(buffer.data(), buffer.size());
+            bytesWritten += written;
+            if (written != buffer.size())
+            {
+                throw ClientError("AudioWriter did not write all data");
+            }
+
+            // If the writer got ahead of the network, fill the prebuffer
+            // again before resuming.
+            if (jitter->underrun())
+            {
+                minBytes = prebufferBytes;
+            }
+        }
+    }
+    catch (...)
+    {
+        grpc::Status ignored;
+        jitter->stop(&ignored);
+        throw;
+    }
+
+    /*
+     * A stream we cancelled (e.g., for barge-in) is not an error, but a
+     * CANCELLED status from the server or the channel is.
+     */
+    grpc::Status status;
+    TTSPlaybackStats stats = jitter->stop(&status);
+    if (!status.ok() &&
+        !(status.error_code() == grpc::StatusCode::CANCELLED && stream.cancelled()))
+    {
+        throw ClientError(status);
+    }
+
+    stats.bytesWritten = bytesWritten;
+    return stats;
+}
+
 } // namespace Diatheke
@@ -65,6 +65,8 @@ public:
 /*
  * ReadASRAudio is a convenience function to send audio from the given
  * reader to the stream in buffSize chunks until a result is returned.
+ * Each chunk returned by the reader is sent as one message; wrap the
+ * reader in a CoalescingReader to send fewer, larger messages.
  */
 cobaltspeech::diatheke::ASRResult
 ReadASRAudio(ASRStream &stream, AudioReader *reader, size_t buffSize);
@@ -72,9 +74,10 @@ ReadASRAudio(ASRStream &stream, AudioReader *reader, size_t buffSize);
 /*
  * ReadTranscribeAudio is a convenience function to send audio from the given
  * reader to the stream in buffSize chunks for transcription. The results are
- * sent to the given callback function. The reader and the callback function
- * will be called from different threads, but with no guarantee that either of
- * them are run on the same thread that called this function.
+ * sent to the given callback function. The reader is called from the thread
+ * that called this function, and the callback is called from one of the
+ * client's completion queue threads, so no threads are created. The callback
+ * should return quickly, as the next result is not received until it does.
  */
 void ReadTranscribeAudio(TranscribeStream &stream, AudioReader *reader, size_t buffSize,
                          std::function<void(const cobaltspeech::diatheke::TranscribeResult&)> callback);
@@ -86,6 +89,61 @@ void ReadTranscribeAudio(TranscribeStream &stream, AudioReader *reader, size_t b
  */
 void WriteTTSAudio(TTSStream &stream, AudioWriter *writer);
 
+/*
+ * TTSPlaybackOptions configures the pipelined version of WriteTTSAudio().
+ * Buffer sizes are given in milliseconds of audio, which are converted to
+ * bytes using bytesPerSecond. The default of 32000 matches 16 kHz, 16-bit
+ * mono audio, and should be changed to match the TTS model's format.
+ */
+struct TTSPlaybackOptions
+{
+    // The size of one second of audio, in bytes.
+    unsigned int bytesPerSecond;
+
+    /*
+     * The amount of audio to buffer before playback starts, and again
+     * after an underrun.
+     */
+    unsigned int prebufferMs;
+
+    /*
+     * The most audio to buffer. When the buffer is full, no more audio
+     * is received until the writer has caught up.
+     */
+    unsigned int maxBufferMs;
+
+    TTSPlaybackOptions();
+};
+
+// TTSPlaybackStats reports what happened during pipelined playback.
+struct TTSPlaybackStats
+{
+    // Number of times the writer ran out of audio before the stream ended.
+    unsigned int underruns;
+
+    // Number of times receiving stopped because the buffer was full.
+    unsigned int overruns;
+
+    // Total number of bytes sent to the writer.
+    size_t bytesWritten;
+
+    // The most audio held in the buffer at once, in bytes.
+    size_t maxBufferedBytes;
+
+    TTSPlaybackStats();
+};
+
+/*
+ * A pipelined version of WriteTTSAudio(). Audio is received from the
+ * stream on the client's completion queue threads into a bounded jitter
+ * buffer, while the writer is called from the calling thread. Playback
+ * starts once the prebuffer is full (or the stream ends), so a slow or
+ * real-time writer does not stall the network, and brief network delays
+ * do not starve the writer. Returns the playback statistics.
+ */
+TTSPlaybackStats WriteTTSAudio(TTSStream &stream, AudioWriter *writer,
+                               const TTSPlaybackOptions &options);
+
 } // namespace Diatheke
 
 #endif // DIATHEKE_AUDIO_HELPERS_H
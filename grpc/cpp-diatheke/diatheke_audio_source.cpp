@@ -0,0 +1,184 @@
+/*
+ * Copyright (2021-present) Cobalt Speech and Language, Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "diatheke_audio_source.h"
+
+#include "diatheke_client_error.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+namespace Diatheke
+{
+
+/*
+ * How long the consumer waits before checking the buffer again. This
+ * covers the (rare) case where a notification is sent just before the
+ * consumer starts waiting, since the producer does not take the lock.
+ */
+static const std::chrono::milliseconds maxWait(10);
+
+AudioSourceStats::AudioSourceStats()
+    : bytesPushed(0), bytesDropped(0), overflows(0), highWaterMark(0)
+{
+}
+
+AudioSource::AudioSource(size_t capacity, size_t frameSize,
+                         OverflowPolicy policy)
+    : mBuffer(capacity),
+      mFrameSize(frameSize == 0 ? 1 : frameSize),
+      mPolicy(policy),
+      mWritePos(0),
+      mReadPos(0),
+      mClosed(false),
+      mBytesDropped(0),
+      mOverflows(0),
+      mHighWaterMark(0),
+      mWaiting(false)
+{
+    if (capacity < mFrameSize)
+    {
+        throw ClientError("audio source capacity is smaller than one frame");
+    }
+}
+
+AudioSource::~AudioSource() {}
+
+size_t AudioSource::pushAudio(const char *data, size_t size)
+{
+    if (mClosed.load(std::memory_order_relaxed))
+    {
+        mBytesDropped.fetch_add(size, std::memory_order_relaxed);
+        mOverflows.fetch_add(1, std::memory_order_relaxed);
+        return 0;
+    }
+
+    // Only this thread changes the write position.
+    uint64_t writePos = mWritePos.load(std::memory_order_relaxed);
+    uint64_t readPos = mReadPos.load(std::memory_order_acquire);
+    size_t used = static_cast<size_t>(writePos - readPos);
+    size_t space = mBuffer.size() - used;
+
+    size_t count = size;
+    if (count > space)
+    {
+        if (mPolicy == OVERFLOW_DROP_CHUNK)
+        {
+            count = 0;
+        }
+        else
+        {
+            count = space - space % mFrameSize;
+        }
+        mBytesDropped.fetch_add(size - count, std::memory_order_relaxed);
+        mOverflows.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    if (count > 0)
+    {
+        // Copy in up to two pieces, in case the data wraps around.
+        size_t offset = static_cast<size_t>(writePos % mBuffer.size());
+        size_t first = std::min(count, mBuffer.size() - offset);
+        memcpy(&mBuffer[offset], data, first);
+        memcpy(&mBuffer[0], data + first, count - first);
+        mWritePos.store(writePos + count, std::memory_order_release);
+
+        if (used + count > mHighWaterMark.load(std::memory_order_relaxed))
+        {
+            mHighWaterMark.store(used + count, std::memory_order_relaxed);
+        }
+
+        wakeConsumer();
+    }
+
+    return count;
+}
+
+void AudioSource::close()
+{
+    mClosed.store(true, std::memory_order_release);
+    wakeConsumer();
+}
+
+size_t AudioSource::readAudio(char *buffer, size_t buffSize)
+{
+    // Only this thread changes the read position.
+    uint64_t readPos = mReadPos.load(std::memory_order_relaxed);
+    uint64_t writePos = mWritePos.load(std::memory_order_acquire);
+    while (writePos == readPos)
+    {
+        // Check for close() before waiting, so no audio is missed.
+        bool closed = mClosed.load(std::memory_order_acquire);
+        writePos = mWritePos.load(std::memory_order_acquire);
+        if (writePos != readPos)
+        {
+            break;
+        }
+        if (closed)
+        {
+            return 0;
+        }
+
+        std::unique_lock<std::mutex> lock(mWaitLock);
+        mWaiting.store(true, std::memory_order_seq_cst);
+        writePos = mWritePos.load(std::memory_order_seq_cst);
+        if (writePos == readPos && !mClosed.load(std::memory_order_seq_cst))
+        {
+            mWaitCond.wait_for(lock, maxWait);
+        }
+        mWaiting.store(false, std::memory_order_relaxed);
+        writePos = mWritePos.load(std::memory_order_acquire);
+    }
+
+    // Copy out up to two pieces, in case the data wraps around.
+    size_t count = std::min(buffSize, static_cast<size_t>(writePos - readPos));
+    size_t offset = static_cast<size_t>(readPos % mBuffer.size());
+    size_t first = std::min(count, mBuffer.size() - offset);
+    memcpy(buffer, &mBuffer[offset], first);
+    memcpy(buffer + first, &mBuffer[0], count - first);
+    mReadPos.store(readPos + count, std::memory_order_release);
+    return count;
+}
+
+size_t AudioSource::bufferedBytes() const
+{
+    uint64_t readPos = mReadPos.load(std::memory_order_acquire);
+    uint64_t writePos = mWritePos.load(std::memory_order_acquire);
+    return static_cast<size_t>(writePos - readPos);
+}
+
+AudioSourceStats AudioSource::stats() const
+{
+    AudioSourceStats result;
+    result.bytesPushed = mWritePos.load(std::memory_order_acquire);
+    result.bytesDropped = mBytesDropped.load(std::memory_order_relaxed);
+    result.overflows = mOverflows.load(std::memory_order_relaxed);
+    result.highWaterMark = mHighWaterMark.load(std::memory_order_relaxed);
+    return result;
+}
+
+void AudioSource::wakeConsumer()
+{
+    // Signalling without the lock may wake the consumer early, or just
+    // before it waits, in which case it waits out maxWait at most.
+    if (mWaiting.load(std::memory_order_seq_cst))
+    {
+        mWaitCond.notify_one();
+    }
+}
+
+} // namespace Diatheke
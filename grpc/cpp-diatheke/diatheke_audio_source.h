@@ -0,0 +1,141 @@
+/*
+ * Copyright (2021-present) Cobalt Speech and Language, Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DIATHEKE_AUDIO_SOURCE_H
+#define DIATHEKE_AUDIO_SOURCE_H
+
+#include "diatheke_audio_helpers.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace Diatheke
+{
+
+// AudioSourceStats reports what has happened to an AudioSource so far.
+struct AudioSourceStats
+{
+    // Total number of bytes accepted by pushAudio().
+    uint64_t bytesPushed;
+
+    // Total number of bytes dropped because the buffer was full.
+    uint64_t bytesDropped;
+
+    // Number of calls to pushAudio() that dropped some audio.
+    uint64_t overflows;
+
+    // The most audio held in the buffer at once, in bytes.
+    size_t highWaterMark;
+
+    AudioSourceStats();
+};
+
+/*
+ * AudioSource is an AudioReader that is fed by pushing audio into it,
+ * for use with ReadASRAudio() and ReadTranscribeAudio() when audio
+ * arrives on a real-time thread (e.g., a soundcard or RTP callback).
+ *
+ * The audio is held in a fixed-size ring buffer that is allocated when
+ * the source is created. pushAudio() never blocks, locks or allocates,
+ * so it is safe to call from a real-time callback. If the buffer is
+ * full, audio is dropped according to the overflow policy, and the
+ * statistics record it.
+ *
+ * There must be only one thread pushing audio (the producer) and one
+ * thread reading it (the consumer) at a time.
+ */
+class AudioSource : public AudioReader
+{
+public:
+    enum OverflowPolicy
+    {
+        // Keep as many whole frames of the new audio as will fit.
+        OVERFLOW_TRUNCATE,
+
+        // Drop the whole chunk of new audio if it does not fit.
+        OVERFLOW_DROP_CHUNK,
+    };
+
+    /*
+     * Create a source that buffers up to capacity bytes of audio.
+     * The frame size (in bytes) keeps truncated audio aligned to whole
+     * samples; the default of 2 matches 16-bit mono audio.
+     */
+    explicit AudioSource(size_t capacity, size_t frameSize = 2,
+                         OverflowPolicy policy = OVERFLOW_TRUNCATE);
+    ~AudioSource();
+
+    /*
+     * Add audio to the buffer from the producer thread. Returns the
+     * number of bytes accepted, which is less than size if audio was
+     * dropped. Audio pushed after close() is dropped.
+     */
+    size_t pushAudio(const char *data, size_t size);
+
+    /*
+     * Tell the consumer that no more audio will be pushed. readAudio()
+     * returns zero once the buffered audio has been read.
+     */
+    void close();
+
+    /*
+     * Wait for audio to be pushed, then copy up to buffSize bytes of it
+     * to the given buffer from the consumer thread. Returns the number
+     * of bytes read, or zero after close() when there is no more audio.
+     */
+    size_t readAudio(char *buffer, size_t buffSize) override;
+
+    // Returns the number of bytes currently in the buffer.
+    size_t bufferedBytes() const;
+
+    // Returns the statistics so far. This may be called from any thread.
+    AudioSourceStats stats() const;
+
+private:
+    std::vector<char> mBuffer;
+    size_t mFrameSize;
+    OverflowPolicy mPolicy;
+
+    // Total bytes written and read. Each is only changed by one side.
+    std::atomic<uint64_t> mWritePos;
+    std::atomic<uint64_t> mReadPos;
+    std::atomic<bool> mClosed;
+
+    // Statistics, only changed by the producer.
+    std::atomic<uint64_t> mBytesDropped;
+    std::atomic<uint64_t> mOverflows;
+    std::atomic<size_t> mHighWaterMark;
+
+    /*
+     * Used to wake the consumer. The producer only signals when the
+     * consumer is waiting, and never takes the lock.
+     */
+    std::mutex mWaitLock;
+    std::condition_variable mWaitCond;
+    std::atomic<bool> mWaiting;
+
+    void wakeConsumer();
+
+    AudioSource(const AudioSource &) = delete;
+    AudioSource &operator=(const AudioSource &) = delete;
+};
+
+} // namespace Diatheke
+
+#endif // DIATHEKE_AUDIO_SOURCE_H
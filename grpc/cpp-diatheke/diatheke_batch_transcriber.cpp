@@ -0,0 +1,378 @@
+/*
+ * Copyright (2021-present) Cobalt Speech and Language, Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "diatheke_batch_transcriber.h"
+
+#include "diatheke_audio_helpers.h"
+#include "diatheke_client.h"
+#include "diatheke_client_error.h"
+#include "diatheke_mmap_audio_reader.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace Diatheke
+{
+
+static const unsigned int defaultConcurrency = 4;
+static const unsigned int defaultMaxAttempts = 3;
+static const size_t defaultChunkSize = 32000;
+
+// Wait between attempts at the same file, multiplied by the attempt.
+static const std::chrono::milliseconds retryDelay(200);
+
+// Returns true for errors that may succeed if the file is tried again.
+static bool isTransient(grpc::StatusCode code)
+{
+    return code == grpc::StatusCode::UNAVAILABLE ||
+           code == grpc::StatusCode::DEADLINE_EXCEEDED ||
+           code == grpc::StatusCode::RESOURCE_EXHAUSTED;
+}
+
+BatchFileResult::BatchFileResult() : ok(false), attempts(0), audioSeconds(0)
+{
+}
+
+BatchStats::BatchStats()
+    : filesDone(0), filesFailed(0), audioSeconds(0), wallSeconds(0)
+{
+}
+
+double BatchStats::throughput() const
+{
+    return wallSeconds > 0 ? audioSeconds / wallSeconds : 0.0;
+}
+
+// Returns the string quoted and escaped for JSON.
+static std::string jsonString(const std::string &str)
+{
+    std::string out = "\"";
+    for (size_t i = 0; i < str.size(); i++)
+    {
+        char c = str[i];
+        switch (c)
+        {
+        case '"':
+            out += "\\\"";
+            break;
+        case '\\':
+            out += "\\\\";
+            break;
+        case '\n':
+            out += "\\n";
+            break;
+        case '\r':
+            out += "\\r";
+            break;
+        case '\t':
+            out += "\\t";
+            break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20)
+            {
+                char escaped[8];
+                snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                out += escaped;
+            }
+            else
+            {
+                out += c;
+            }
+        }
+    }
+    out += "\"";
+    return out;
+}
+
+/*
+ * A file waiting to be transcribed. Failed files go back on the queue of
+ * the worker that tried them, with the attempt count increased, and are
+ * not taken again before the retry time.
+ */
+struct BatchTask
+{
+    size_t index;
+    unsigned int attempts;
+    std::chrono::steady_clock::time_point notBefore;
+};
+
+// The outcome of BatchRun::take().
+enum BatchTake
+{
+    TAKE_READY, // A task was taken
+    TAKE_WAIT,  // All of the remaining tasks are waiting to be retried
+    TAKE_DONE   // There are no tasks left
+};
+
+struct BatchQueue
+{
+    std::mutex lock;
+    std::deque<BatchTask> tasks;
+};
+
+// State shared by the workers during run().
+struct BatchRun
+{
+    const std::vector<std::string> *paths;
+    std::vector<std::unique_ptr<BatchQueue>> queues;
+
+    // Guards the stats, the output and the callback.
+    std::mutex resultLock;
+    BatchStats stats;
+
+    /*
+     * Take the next task for the given worker that is ready to run: the
+     * oldest from its own queue, or else the newest from another's. If
+     * the only tasks left are waiting to be retried, sets retryAt to the
+     * earliest time one will be ready.
+     */
+    BatchTake take(size_t worker, BatchTask *task,
+                   std::chrono::steady_clock::time_point *retryAt)
+    {
+        std::chrono::steady_clock::time_point now =
+            std::chrono::steady_clock::now();
+        bool waiting = false;
+        for (size_t i = 0; i < queues.size(); i++)
+        {
+            BatchQueue &queue = *queues[(worker + i) % queues.size()];
+            std::lock_guard<std::mutex> lock(queue.lock);
+            size_t count = queue.tasks.size();
+            for (size_t j = 0; j < count; j++)
+            {
+                size_t pos = i == 0 ? j : count - 1 - j;
+                const BatchTask &candidate = queue.tasks[pos];
+                if (candidate.notBefore <= now)
+                {
+                    *task = candidate;
+                    queue.tasks.erase(queue.tasks.begin() + pos);
+                    return TAKE_READY;
+                }
+
+                if (!waiting || candidate.notBefore < *retryAt)
+                {
+                    *retryAt = candidate.notBefore;
+                    waiting = true;
+                }
+            }
+        }
+        return waiting ? TAKE_WAIT : TAKE_DONE;
+    }
+
+    void retry(size_t worker, const BatchTask &task)
+    {
+        BatchQueue &queue = *queues[worker];
+        std::lock_guard<std::mutex> lock(queue.lock);
+        queue.tasks.push_back(task);
+    }
+};
+
+BatchTranscriber::BatchTranscriber(
+    Client &client, const cobaltspeech::diatheke::TranscribeAction &action)
+    : mClient(&client),
+      mAction(action),
+      mConcurrency(defaultConcurrency),
+      mMaxAttempts(defaultMaxAttempts),
+      mChunkSize(defaultChunkSize),
+      mValidate(false),
+      mOutput(nullptr)
+{
+}
+
+BatchTranscriber::~BatchTranscriber() {}
+
+void BatchTranscriber::setConcurrency(unsigned int count)
+{
+    mConcurrency = count == 0 ? 1 : count;
+}
+
+void BatchTranscriber::setMaxAttempts(unsigned int count)
+{
+    mMaxAttempts = count == 0 ? 1 : count;
+}
+
+void BatchTranscriber::setChunkSize(size_t bytes)
+{
+    mChunkSize = bytes == 0 ? defaultChunkSize : bytes;
+}
+
+void BatchTranscriber::setModel(const cobaltspeech::diatheke::ModelInfo &model)
+{
+    mModel = model;
+    mValidate = true;
+}
+
+void BatchTranscriber::setOutput(std::ostream *output) { mOutput = output; }
+
+void BatchTranscriber::setResultCallback(ResultCallback callback)
+{
+    mCallback = callback;
+}
+
+BatchStats BatchTranscriber::run(const std::vector<std::string> &paths)
+{
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+
+    // Deal the files out to the workers' queues.
+    BatchRun batch;
+    batch.paths = &paths;
+    size_t workers = std::min<size_t>(mConcurrency, paths.size());
+    for (size_t i = 0; i < workers; i++)
+    {
+        batch.queues.push_back(std::unique_ptr<BatchQueue>(new BatchQueue()));
+    }
+    for (size_t i = 0; i < paths.size(); i++)
+    {
+        BatchTask task = {i, 0, start};
+        batch.queues[i % workers]->tasks.push_back(task);
+    }
+
+    // Report a file once it is done or has run out of attempts.
+    auto report = [this, &batch](const BatchFileResult &result) {
+        std::lock_guard<std::mutex> lock(batch.resultLock);
+        if (result.ok)
+        {
+            batch.stats.filesDone++;
+            batch.stats.audioSeconds += result.audioSeconds;
+        }
+        else
+        {
+            batch.stats.filesFailed++;
+        }
+
+        if (mOutput)
+        {
+            std::string text;
+            for (size_t i = 0; i < result.results.size(); i++)
+            {
+                if (!text.empty())
+                {
+                    text += " ";
+                }
+                text += result.results[i].text();
+            }
+
+            *mOutput << "{\"file\":" << jsonString(result.path)
+                     << ",\"ok\":" << (result.ok ? "true" : "false")
+                     << ",\"error\":" << jsonString(result.error)
+                     << ",\"attempts\":" << result.attempts
+                     << ",\"audio_seconds\":" << result.audioSeconds
+                     << ",\"text\":" << jsonString(text) << "}\n";
+            mOutput->flush();
+        }
+
+        if (mCallback)
+        {
+            mCallback(result);
+        }
+    };
+
+    auto work = [this, &batch, &report](size_t worker) {
+        BatchTask task;
+        std::chrono::steady_clock::time_point retryAt;
+        while (true)
+        {
+            BatchTake taken = batch.take(worker, &task, &retryAt);
+            if (taken == TAKE_DONE)
+            {
+                break;
+            }
+            if (taken == TAKE_WAIT)
+            {
+                std::this_thread::sleep_until(retryAt);
+                continue;
+            }
+
+            BatchFileResult result;
+            result.path = (*batch.paths)[task.index];
+            result.attempts = ++task.attempts;
+
+            // Problems with the file itself will not go away on retry.
+            std::unique_ptr<MmapAudioReader> reader;
+            try
+            {
+                reader.reset(new MmapAudioReader(result.path));
+                if (mValidate)
+                {
+                    reader->validate(mModel);
+                }
+                result.audioSeconds = reader->duration();
+            }
+            catch (const std::exception &e)
+            {
+                result.error = e.what();
+                report(result);
+                continue;
+            }
+
+            bool transient = false;
+            try
+            {
+                TranscribeStream stream = mClient->newTranscribeStream(mAction);
+                ReadTranscribeAudio(
+                    stream, reader.get(), mChunkSize,
+                    [&result](const cobaltspeech::diatheke::TranscribeResult &r) {
+                        if (!r.is_partial())
+                        {
+                            result.results.push_back(r);
+                        }
+                    });
+                result.ok = true;
+            }
+            catch (const ClientError &e)
+            {
+                result.error = e.what();
+                transient = isTransient(e.code());
+            }
+            catch (const std::exception &e)
+            {
+                result.error = e.what();
+            }
+
+            if (transient && task.attempts < mMaxAttempts)
+            {
+                // Move on to other files until this one is due again.
+                task.notBefore = std::chrono::steady_clock::now() +
+                                 retryDelay * task.attempts;
+                batch.retry(worker, task);
+                continue;
+            }
+            report(result);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < workers; i++)
+    {
+        threads.push_back(std::thread(work, i));
+    }
+    for (size_t i = 0; i < threads.size(); i++)
+    {
+        threads[i].join();
+    }
+
+    batch.stats.wallSeconds = std::chrono::duration<double>(
+                                  std::chrono::steady_clock::now() - start)
+                                  .count();
+    return batch.stats;
+}
+
+} // namespace Diatheke
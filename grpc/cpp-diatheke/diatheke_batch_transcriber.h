@@ -0,0 +1,155 @@
+/*
+ * Copyright (2021-present) Cobalt Speech and Language, Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DIATHEKE_BATCH_TRANSCRIBER_H
+#define DIATHEKE_BATCH_TRANSCRIBER_H
+
+#include "diatheke.grpc.pb.h"
+
+#include <functional>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace Diatheke
+{
+
+class Client;
+
+// BatchFileResult holds the outcome of transcribing one file.
+struct BatchFileResult
+{
+    std::string path;
+
+    // True if the file was transcribed. Otherwise error says why.
+    bool ok;
+    std::string error;
+
+    // Number of times the file was tried.
+    unsigned int attempts;
+
+    // Length of the file's audio, in seconds.
+    double audioSeconds;
+
+    // The final (i.e., not partial) results, in order.
+    std::vector<cobaltspeech::diatheke::TranscribeResult> results;
+
+    BatchFileResult();
+};
+
+// BatchStats summarizes a batch run.
+struct BatchStats
+{
+    size_t filesDone;
+    size_t filesFailed;
+
+    // Audio transcribed from the files that were done, in seconds.
+    double audioSeconds;
+
+    // Time taken by the whole run, in seconds.
+    double wallSeconds;
+
+    // Seconds of audio transcribed per second of wall time.
+    double throughput() const;
+
+    BatchStats();
+};
+
+/*
+ * BatchTranscriber transcribes many WAV files using several Transcribe
+ * streams at once. Each worker runs one stream at a time, taking files
+ * from its own queue, and takes files from the end of another worker's
+ * queue when its own is empty, so long files do not leave workers idle.
+ * Audio is sent as fast as the server accepts it rather than in real
+ * time, with the files memory mapped (see MmapAudioReader).
+ *
+ * Files that fail with a transient server error (UNAVAILABLE,
+ * DEADLINE_EXCEEDED or RESOURCE_EXHAUSTED) are put back on the queue to
+ * be retried after a delay, and the worker moves on to other files in
+ * the meantime. Other errors are reported at once. Each result is
+ * written to the output stream, if one is set, as one line of JSON as
+ * soon as its file is done, so partial runs can be resumed.
+ */
+class BatchTranscriber
+{
+public:
+    using ResultCallback = std::function<void(const BatchFileResult &result)>;
+
+    /*
+     * Create a transcriber that starts each stream with the given action.
+     * The client must outlive the transcriber.
+     */
+    BatchTranscriber(Client &client,
+                     const cobaltspeech::diatheke::TranscribeAction &action);
+    ~BatchTranscriber();
+
+    // Set the number of streams run at once. The default is 4.
+    void setConcurrency(unsigned int count);
+
+    /*
+     * Set the most times a file is tried before it is reported as
+     * failed. The default is 3. Only transient server errors are
+     * retried, so files that cannot be read, that do not match the model
+     * (see setModel()) or that the server rejects fail on the first try.
+     */
+    void setMaxAttempts(unsigned int count);
+
+    // Set the size of the audio chunks sent to the server, in bytes.
+    // The default is 32000.
+    void setChunkSize(size_t bytes);
+
+    /*
+     * Check each file against the given model's ASR sample rate and
+     * format before sending it, using MmapAudioReader::validate().
+     */
+    void setModel(const cobaltspeech::diatheke::ModelInfo &model);
+
+    /*
+     * Write each result as a line of JSON with the fields "file", "ok",
+     * "error", "attempts", "audio_seconds" and "text" (the final results
+     * joined by spaces). The stream is not owned, and is only written
+     * during run().
+     */
+    void setOutput(std::ostream *output);
+
+    /*
+     * Call the given function with each result. Calls are made from the
+     * worker threads, but never more than one at a time. The callback
+     * must not throw.
+     */
+    void setResultCallback(ResultCallback callback);
+
+    // Transcribe the given files, returning once all of them are done.
+    BatchStats run(const std::vector<std::string> &paths);
+
+private:
+    Client *mClient;
+    cobaltspeech::diatheke::TranscribeAction mAction;
+    unsigned int mConcurrency;
+    unsigned int mMaxAttempts;
+    size_t mChunkSize;
+    bool mValidate;
+    cobaltspeech::diatheke::ModelInfo mModel;
+    std::ostream *mOutput;
+    ResultCallback mCallback;
+
+    BatchTranscriber(const BatchTranscriber &) = delete;
+    BatchTranscriber &operator=(const BatchTranscriber &) = delete;
+};
+
+} // namespace Diatheke
+
+#endif // DIATHEKE_BATCH_TRANSCRIBER_H
@@ -0,0 +1,433 @@
+/*
+ * Copyright (2021-present) Cobalt Speech and Language, Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "diatheke_channel_pool.h"
+
+#include <grpcpp/create_channel.h>
+#include <grpcpp/support/channel_arguments.h>
+
+#include <chrono>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+namespace Diatheke
+{
+
+// How long an endpoint is avoided after a connection error.
+static const std::chrono::milliseconds unhealthyRetryDelay(5000);
+
+/*
+ * The most session routes to remember. Sessions that expire on the
+ * server, or are deleted by another client, are never released, so the
+ * least recently used routes are dropped beyond this.
+ */
+static const size_t maxSessionRoutes = 100000;
+
+static long long steadyNow()
+{
+    return std::chrono::steady_clock::now().time_since_epoch().count();
+}
+
+EndpointState::EndpointState(const std::string &url)
+    : mURL(url), mOutstanding(0), mRetryAt(0)
+{
+}
+
+EndpointState::~EndpointState() {}
+
+const std::string &EndpointState::url() const { return mURL; }
+
+bool EndpointState::healthy() const
+{
+    long long retryAt = mRetryAt.load();
+    return retryAt == 0 || steadyNow() >= retryAt;
+}
+
+unsigned int EndpointState::outstanding() const
+{
+    return mOutstanding.load();
+}
+
+void EndpointState::reportStatus(const grpc::Status &status)
+{
+    if (status.error_code() == grpc::StatusCode::UNAVAILABLE)
+    {
+        std::chrono::steady_clock::time_point retryAt =
+            std::chrono::steady_clock::now() + unhealthyRetryDelay;
+        mRetryAt = retryAt.time_since_epoch().count();
+    }
+    else if (status.ok())
+    {
+        mRetryAt = 0;
+    }
+}
+
+ClientChannel::ClientChannel(size_t endpointIndex,
+                             const std::shared_ptr<EndpointState> &endpoint,
+                             const std::shared_ptr<grpc::Channel> &channel)
+    : mEndpointIndex(endpointIndex), mEndpoint(endpoint),
+      mStub(cobaltspeech::diatheke::Diatheke::NewStub(channel)),
+      mOutstanding(0)
+{
+}
+
+ClientChannel::~ClientChannel() {}
+
+cobaltspeech::diatheke::Diatheke::Stub *ClientChannel::stub()
+{
+    return mStub.get();
+}
+
+unsigned int ClientChannel::outstanding() const
+{
+    return mOutstanding.load();
+}
+
+ChannelLease::ChannelLease(const std::shared_ptr<ClientChannel> &channel,
+                           const std::shared_ptr<TraceWriter> &trace,
+                           const std::shared_ptr<TimelineObserver> &timeline)
+    : mChannel(channel), mTrace(trace), mTimeline(timeline)
+{
+    mChannel->mOutstanding++;
+    mChannel->mEndpoint->mOutstanding++;
+}
+
+ChannelLease::~ChannelLease()
+{
+    mChannel->mEndpoint->mOutstanding--;
+    mChannel->mOutstanding--;
+}
+
+cobaltspeech::diatheke::Diatheke::Stub *ChannelLease::stub() const
+{
+    return mChannel->stub();
+}
+
+TraceWriter *ChannelLease::trace() const { return mTrace.get(); }
+
+TimelineObserver *ChannelLease::timeline() const { return mTimeline.get(); }
+
+size_t ChannelLease::endpointIndex() const { return mChannel->mEndpointIndex; }
+
+void ChannelLease::reportStatus(const grpc::Status &status)
+{
+    mChannel->mEndpoint->reportStatus(status);
+}
+
+/*
+ * The endpoint assigned to each session, shared by resized pools. Only
+ * the most recently used maxSessionRoutes are kept. A session whose
+ * route was dropped is simply assigned a new endpoint, since Diatheke
+ * keeps the session state in the token.
+ */
+class SessionRoutes
+{
+public:
+    // Look up the session's endpoint and mark it as recently used.
+    bool find(const std::string &sessionID, size_t *endpoint)
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        auto iter = mRoutes.find(sessionID);
+        if (iter == mRoutes.end())
+        {
+            return false;
+        }
+
+        mOrder.splice(mOrder.begin(), mOrder, iter->second.order);
+        *endpoint = iter->second.endpoint;
+        return true;
+    }
+
+    void assign(const std::string &sessionID, size_t endpoint)
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        auto iter = mRoutes.find(sessionID);
+        if (iter != mRoutes.end())
+        {
+            mOrder.splice(mOrder.begin(), mOrder, iter->second.order);
+            iter->second.endpoint = endpoint;
+            return;
+        }
+
+        if (mRoutes.size() >= maxSessionRoutes)
+        {
+            mRoutes.erase(mOrder.back());
+            mOrder.pop_back();
+        }
+
+        mOrder.push_front(sessionID);
+        Route route = {endpoint, mOrder.begin()};
+        mRoutes[sessionID] = route;
+    }
+
+    void erase(const std::string &sessionID)
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        auto iter = mRoutes.find(sessionID);
+        if (iter != mRoutes.end())
+        {
+            mOrder.erase(iter->second.order);
+            mRoutes.erase(iter);
+        }
+    }
+
+private:
+    struct Route
+    {
+        size_t endpoint;
+        std::list<std::string>::iterator order;
+    };
+
+    std::mutex mLock;
+    std::unordered_map<std::string, Route> mRoutes;
+
+    // Session IDs, most recently used first.
+    std::list<std::string> mOrder;
+};
+
+ChannelPool::ChannelPool(const std::vector<std::string> &urls,
+                         const std::shared_ptr<grpc::ChannelCredentials> &creds,
+                         unsigned int channelCount)
+    : mCreds(creds), mSessions(std::make_shared<SessionRoutes>()),
+      mTraced(false), mObserved(false), mNextEndpoint(0), mNextChannel(0)
+{
+    for (size_t i = 0; i < urls.size(); i++)
+    {
+        mEndpoints.push_back(std::make_shared<EndpointState>(urls[i]));
+    }
+
+    createChannels(channelCount);
+}
+
+ChannelPool::ChannelPool(const std::shared_ptr<grpc::Channel> &channel)
+    : mFixedChannel(channel), mSessions(std::make_shared<SessionRoutes>()),
+      mTraced(false), mObserved(false), mNextEndpoint(0), mNextChannel(0)
+{
+    mEndpoints.push_back(std::make_shared<EndpointState>("in-process"));
+    createChannels(1);
+}
+
+ChannelPool::ChannelPool(const ChannelPool &other, unsigned int channelCount)
+    : mCreds(other.mCreds), mFixedChannel(other.mFixedChannel),
+      mEndpoints(other.mEndpoints), mSessions(other.mSessions),
+      mTrace(std::atomic_load(&other.mTrace)),
+      mTimeline(std::atomic_load(&other.mTimeline)),
+      mTraced(mTrace != nullptr), mObserved(mTimeline != nullptr),
+      mNextEndpoint(0), mNextChannel(0)
+{
+    createChannels(channelCount);
+}
+
+ChannelPool::~ChannelPool() {}
+
+void ChannelPool::createChannels(unsigned int channelCount)
+{
+    if (channelCount == 0)
+    {
+        channelCount = 1;
+    }
+
+    if (mFixedChannel)
+    {
+        // There is no way to open more connections like this one.
+        mChannels.push_back(std::vector<std::shared_ptr<ClientChannel>>(
+            1, std::make_shared<ClientChannel>(0, mEndpoints[0], mFixedChannel)));
+        return;
+    }
+
+    for (size_t e = 0; e < mEndpoints.size(); e++)
+    {
+        std::vector<std::shared_ptr<ClientChannel>> channels;
+        for (unsigned int i = 0; i < channelCount; i++)
+        {
+            /*
+             * gRPC shares subchannels (and therefore connections) between
+             * channels that have the same target and arguments. Give each
+             * channel its own subchannel pool and a unique argument so
+             * that it gets a connection of its own.
+             */
+            grpc::ChannelArguments args;
+            args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+            args.SetInt("diatheke.channel_index", static_cast<int>(i));
+
+            channels.push_back(std::make_shared<ClientChannel>(
+                e, mEndpoints[e],
+                grpc::CreateCustomChannel(mEndpoints[e]->url(), mCreds,
+                                          args)));
+        }
+
+        mChannels.push_back(channels);
+    }
+}
+
+size_t ChannelPool::chooseEndpoint()
+{
+    size_t count = mEndpoints.size();
+    if (count == 1)
+    {
+        return 0;
+    }
+
+    /*
+     * Pick the healthy endpoint with the fewest calls in flight. If none
+     * are healthy, pick from all of them, since one may have recovered.
+     */
+    size_t start = mNextEndpoint.fetch_add(1) % count;
+    for (int pass = 0; pass < 2; pass++)
+    {
+        bool found = false;
+        size_t best = start;
+        unsigned int bestLoad = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            size_t idx = (start + i) % count;
+            if (pass == 0 && !mEndpoints[idx]->healthy())
+            {
+                continue;
+            }
+
+            unsigned int load = mEndpoints[idx]->outstanding();
+            if (!found || load < bestLoad)
+            {
+                found = true;
+                best = idx;
+                bestLoad = load;
+            }
+        }
+
+        if (found)
+        {
+            return best;
+        }
+    }
+
+    return start;
+}
+
+std::shared_ptr<ChannelLease> ChannelPool::acquireOn(size_t endpointIndex)
+{
+    // Start the search at a different channel each time so that idle
+    // channels take turns.
+    const std::vector<std::shared_ptr<ClientChannel>> &channels =
+        mChannels[endpointIndex];
+    size_t count = channels.size();
+    size_t start = mNextChannel.fetch_add(1) % count;
+    size_t best = start;
+    unsigned int bestLoad = channels[start]->outstanding();
+    for (size_t i = 1; i < count && bestLoad > 0; i++)
+    {
+        size_t idx = (start + i) % count;
+        unsigned int load = channels[idx]->outstanding();
+        if (load < bestLoad)
+        {
+            best = idx;
+            bestLoad = load;
+        }
+    }
+
+    std::shared_ptr<TraceWriter> trace;
+    if (mTraced.load(std::memory_order_acquire))
+    {
+        trace = std::atomic_load(&mTrace);
+    }
+    std::shared_ptr<TimelineObserver> timeline;
+    if (mObserved.load(std::memory_order_acquire))
+    {
+        timeline = std::atomic_load(&mTimeline);
+    }
+    return std::make_shared<ChannelLease>(channels[best], trace, timeline);
+}
+
+std::shared_ptr<ChannelLease> ChannelPool::acquire()
+{
+    return acquireOn(chooseEndpoint());
+}
+
+std::shared_ptr<ChannelLease>
+ChannelPool::acquire(const std::string &sessionID)
+{
+    return acquireOn(endpointFor(sessionID));
+}
+
+size_t ChannelPool::endpointFor(const std::string &sessionID)
+{
+    if (mEndpoints.size() == 1)
+    {
+        return 0;
+    }
+
+    size_t endpoint = 0;
+    if (mSessions->find(sessionID, &endpoint) &&
+        mEndpoints[endpoint]->healthy())
+    {
+        return endpoint;
+    }
+
+    // Move the session to a new endpoint. Diatheke keeps the session
+    // state in the token, so any server can continue it.
+    endpoint = chooseEndpoint();
+    mSessions->assign(sessionID, endpoint);
+    return endpoint;
+}
+
+std::shared_ptr<ChannelLease> ChannelPool::acquireEndpoint(size_t endpointIndex)
+{
+    return acquireOn(endpointIndex);
+}
+
+size_t ChannelPool::endpointCount() const { return mEndpoints.size(); }
+
+void ChannelPool::bindSession(const std::string &sessionID,
+                              const ChannelLease &lease)
+{
+    if (mEndpoints.size() == 1)
+    {
+        return;
+    }
+
+    mSessions->assign(sessionID, lease.endpointIndex());
+}
+
+void ChannelPool::releaseSession(const std::string &sessionID)
+{
+    if (mEndpoints.size() == 1)
+    {
+        return;
+    }
+
+    mSessions->erase(sessionID);
+}
+
+unsigned int ChannelPool::channelCount() const
+{
+    return static_cast<unsigned int>(mChannels[0].size());
+}
+
+void ChannelPool::setTrace(const std::shared_ptr<TraceWriter> &trace)
+{
+    std::atomic_store(&mTrace, trace);
+    mTraced.store(trace != nullptr, std::memory_order_release);
+}
+
+void ChannelPool::setTimelineObserver(
+    const std::shared_ptr<TimelineObserver> &timeline)
+{
+    std::atomic_store(&mTimeline, timeline);
+    mObserved.store(timeline != nullptr, std::memory_order_release);
+}
+
+} // namespace Diatheke
@@ -0,0 +1,273 @@
+/*
+ * Copyright (2021-present) Cobalt Speech and Language, Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DIATHEKE_CHANNEL_POOL_H
+#define DIATHEKE_CHANNEL_POOL_H
+
+#include "diatheke.grpc.pb.h"
+
+#include <grpcpp/security/credentials.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace Diatheke
+{
+
+class TimelineObserver;
+class TraceWriter;
+
+/*
+ * EndpointState tracks the health and load of one Diatheke server
+ * address. It is shared by every channel to that address.
+ */
+class EndpointState
+{
+public:
+    explicit EndpointState(const std::string &url);
+    ~EndpointState();
+
+    const std::string &url() const;
+
+    /*
+     * Returns true unless a call to this endpoint recently failed with
+     * a connection error. Unhealthy endpoints are tried again once the
+     * retry delay has passed.
+     */
+    bool healthy() const;
+
+    // Returns the number of calls and streams in flight to this endpoint.
+    unsigned int outstanding() const;
+
+    // Update the endpoint's health using the final status of a call.
+    void reportStatus(const grpc::Status &status);
+
+private:
+    friend class ChannelLease;
+
+    std::string mURL;
+    std::atomic<unsigned int> mOutstanding;
+    std::atomic<long long> mRetryAt;
+
+    EndpointState(const EndpointState &) = delete;
+    EndpointState &operator=(const EndpointState &) = delete;
+};
+
+/*
+ * ClientChannel is one connection to a Diatheke server, along with the
+ * number of calls and streams currently using it.
+ */
+class ClientChannel
+{
+public:
+    ClientChannel(size_t endpointIndex,
+                  const std::shared_ptr<EndpointState> &endpoint,
+                  const std::shared_ptr<grpc::Channel> &channel);
+    ~ClientChannel();
+
+    cobaltspeech::diatheke::Diatheke::Stub *stub();
+
+    // Returns the number of leases currently held on this channel.
+    unsigned int outstanding() const;
+
+private:
+    friend class ChannelLease;
+
+    size_t mEndpointIndex;
+    std::shared_ptr<EndpointState> mEndpoint;
+    std::unique_ptr<cobaltspeech::diatheke::Diatheke::Stub> mStub;
+    std::atomic<unsigned int> mOutstanding;
+
+    ClientChannel(const ClientChannel &) = delete;
+    ClientChannel &operator=(const ClientChannel &) = delete;
+};
+
+/*
+ * ChannelLease marks a channel as in use by one call or stream for as
+ * long as the lease exists. It also keeps the channel alive, so a call
+ * holding a lease may outlive the pool that created it.
+ */
+class ChannelLease
+{
+public:
+    /*
+     * Create a lease on the given channel. Calls made with the lease are
+     * recorded in the given trace, and report their progress to the
+     * given timeline observer, if they are not null.
+     */
+    explicit ChannelLease(const std::shared_ptr<ClientChannel> &channel,
+                          const std::shared_ptr<TraceWriter> &trace =
+                              std::shared_ptr<TraceWriter>(),
+                          const std::shared_ptr<TimelineObserver> &timeline =
+                              std::shared_ptr<TimelineObserver>());
+    ~ChannelLease();
+
+    cobaltspeech::diatheke::Diatheke::Stub *stub() const;
+
+    // The trace to record calls in, or null if they are not traced.
+    TraceWriter *trace() const;
+
+    // The observer to report timeline points to, or null if there is none.
+    TimelineObserver *timeline() const;
+
+    // The index of the channel's endpoint in its pool.
+    size_t endpointIndex() const;
+
+    /*
+     * Report the final status of a call made on this channel, which is
+     * used to track the health of its endpoint.
+     */
+    void reportStatus(const grpc::Status &status);
+
+private:
+    std::shared_ptr<ClientChannel> mChannel;
+    std::shared_ptr<TraceWriter> mTrace;
+    std::shared_ptr<TimelineObserver> mTimeline;
+
+    ChannelLease(const ChannelLease &) = delete;
+    ChannelLease &operator=(const ChannelLease &) = delete;
+};
+
+class SessionRoutes;
+
+/*
+ * ChannelPool owns a fixed number of channels to each of one or more
+ * Diatheke servers. Each channel is created with distinct channel
+ * arguments so that gRPC opens a separate HTTP/2 connection for it,
+ * rather than sharing one. Calls and streams are spread across the
+ * channels, which keeps any one connection from reaching its concurrent
+ * stream limit.
+ *
+ * With more than one server, new sessions go to the healthy server with
+ * the fewest calls in flight, and calls for an existing session go to
+ * the server that created it. If that server becomes unhealthy, the
+ * session moves to another one. Only the routes of recently used
+ * sessions are kept, so sessions that expire on the server, or are
+ * deleted elsewhere, do not accumulate.
+ */
+class ChannelPool
+{
+public:
+    /*
+     * Create a new pool with the given number of channels to each of the
+     * given urls. A count of zero is treated as one.
+     */
+    ChannelPool(const std::vector<std::string> &urls,
+                const std::shared_ptr<grpc::ChannelCredentials> &creds,
+                unsigned int channelCount);
+
+    /*
+     * Create a new pool that uses the given channel for every call. This
+     * is for channels that cannot be created from a url, such as an
+     * in-process channel to a server in the same program. The pool has
+     * one endpoint, and always one channel.
+     */
+    explicit ChannelPool(const std::shared_ptr<grpc::Channel> &channel);
+
+    /*
+     * Create a new pool to the same servers as the given pool, with a
+     * different number of channels to each. Endpoint health and session
+     * assignments are shared with the other pool.
+     */
+    ChannelPool(const ChannelPool &other, unsigned int channelCount);
+
+    ~ChannelPool();
+
+    /*
+     * Returns a lease on the least loaded channel to the least loaded
+     * healthy endpoint. Ties are broken in round-robin order.
+     */
+    std::shared_ptr<ChannelLease> acquire();
+
+    /*
+     * Returns a lease on a channel to the endpoint assigned to the given
+     * session. If the session has no endpoint yet, or its endpoint is
+     * unhealthy, a new one is chosen as in acquire() and assigned to the
+     * session.
+     */
+    std::shared_ptr<ChannelLease> acquire(const std::string &sessionID);
+
+    /*
+     * Returns the index of the endpoint assigned to the given session,
+     * assigning one as in acquire() if needed, without taking a lease.
+     */
+    size_t endpointFor(const std::string &sessionID);
+
+    // Returns a lease on the least loaded channel to the given endpoint.
+    std::shared_ptr<ChannelLease> acquireEndpoint(size_t endpointIndex);
+
+    // Returns the number of endpoints.
+    size_t endpointCount() const;
+
+    /*
+     * Assign the given session to the endpoint of the given lease, which
+     * is usually the one that created the session. Does nothing if the
+     * pool has only one endpoint.
+     */
+    void bindSession(const std::string &sessionID, const ChannelLease &lease);
+
+    // Forget the endpoint assigned to the given session.
+    void releaseSession(const std::string &sessionID);
+
+    // Returns the number of channels to each endpoint.
+    unsigned int channelCount() const;
+
+    /*
+     * Set the trace that calls on leases acquired from now on are
+     * recorded in. A null trace (the default) turns tracing off.
+     */
+    void setTrace(const std::shared_ptr<TraceWriter> &trace);
+
+    /*
+     * Set the observer that calls on leases acquired from now on report
+     * their timeline points to. A null observer (the default) turns the
+     * reports off.
+     */
+    void setTimelineObserver(const std::shared_ptr<TimelineObserver> &timeline);
+
+private:
+    std::shared_ptr<grpc::ChannelCredentials> mCreds;
+    std::shared_ptr<grpc::Channel> mFixedChannel;
+    std::vector<std::shared_ptr<EndpointState>> mEndpoints;
+    std::vector<std::vector<std::shared_ptr<ClientChannel>>> mChannels;
+    std::shared_ptr<SessionRoutes> mSessions;
+    std::shared_ptr<TraceWriter> mTrace;
+    std::shared_ptr<TimelineObserver> mTimeline;
+
+    /*
+     * Set while mTrace or mTimeline is not null, so that acquiring a
+     * lease skips the atomic shared_ptr loads (which take a lock) when
+     * they are off.
+     */
+    std::atomic<bool> mTraced;
+    std::atomic<bool> mObserved;
+
+    std::atomic<unsigned int> mNextEndpoint;
+    std::atomic<unsigned int> mNextChannel;
+
+    void createChannels(unsigned int channelCount);
+    size_t chooseEndpoint();
+    std::shared_ptr<ChannelLease> acquireOn(size_t endpointIndex);
+
+    ChannelPool(const ChannelPool &) = delete;
+    ChannelPool &operator=(const ChannelPool &) = delete;
+};
+
+} // namespace Diatheke
+
+#endif // DIATHEKE_CHANNEL_POOL_H
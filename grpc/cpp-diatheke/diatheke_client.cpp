@@ -17,7 +17,12 @@
 #include "diatheke_client.h"
 
 #include "diatheke.grpc.pb.h"
+#include "diatheke_channel_pool.h"
 #include "diatheke_client_error.h"
+#include "diatheke_completion_queue.h"
+#include "diatheke_timeline.h"
+#include "diatheke_trace.h"
+#include "diatheke_tts_cache.h"
 
 #include <chrono>
 #include <grpc/grpc.h>
@@ -29,8 +34,215 @@ namespace Diatheke
 {
 
 static unsigned int defaultTimeout = 30000;
+static unsigned int defaultAsyncThreads = 2;
+static unsigned int defaultChannels = 1;
 
-Client::Client(const std::string &url) : mTimeout(defaultTimeout)
+/*
+ * UnaryTrace records one unary call in its channel's trace. It does
+ * nothing if the channel is not traced.
+ */
+class UnaryTrace
+{
+public:
+    UnaryTrace(const ChannelLease &channel, TraceCall call,
+               const google::protobuf::MessageLite &request)
+        : mTrace(channel.trace()), mCall(call), mID(0)
+    {
+        if (mTrace)
+        {
+            mID = mTrace->newCallID();
+            mTrace->writeMessage(mID, mCall, EVENT_SEND, request);
+        }
+    }
+
+    void finish(const grpc::Status &status,
+                const google::protobuf::MessageLite &response)
+    {
+        if (!mTrace)
+        {
+            return;
+        }
+
+        if (status.ok())
+        {
+            mTrace->writeMessage(mID, mCall, EVENT_RECEIVE, response);
+        }
+        mTrace->writeStatus(mID, mCall, status);
+    }
+
+private:
+    TraceWriter *mTrace;
+    TraceCall mCall;
+    uint64_t mID;
+};
+
+/*
+ * AsyncUnaryCall holds the state of a single asynchronous unary request
+ * while it is in flight. It deletes itself after running the callback.
+ */
+template <typename Response> class AsyncUnaryCall : public AsyncTag
+{
+public:
+    using Callback = std::function<void(const grpc::Status &, Response &)>;
+    using Reader = grpc::ClientAsyncResponseReader<Response>;
+
+    grpc::ClientContext context;
+
+    AsyncUnaryCall(const std::shared_ptr<ChannelLease> &channel,
+                   const std::shared_ptr<CompletionQueuePool> &pool,
+                   const Callback &callback)
+        : mChannel(channel), mPool(pool), mCallback(callback)
+    {
+    }
+
+    /*
+     * Start the request using the given PrepareAsync method of the
+     * channel's stub. The call is traced as the given kind of call.
+     */
+    template <typename Stub, typename Request>
+    void start(std::unique_ptr<Reader> (Stub::*prepare)(
+                   grpc::ClientContext *, const Request &, grpc::CompletionQueue *),
+               const Request &request, TraceCall traceCall)
+    {
+        mTrace.reset(new UnaryTrace(*mChannel, traceCall, request));
+        mReader =
+            (mChannel->stub()->*prepare)(&context, request, mPool->next());
+        mReader->StartCall();
+        mReader->Finish(&mResponse, &mStatus, this);
+    }
+
+    void proceed(bool) override
+    {
+        mChannel->reportStatus(mStatus);
+        mTrace->finish(mStatus, mResponse);
+        if (!mStatus.ok())
+        {
+            mResponse.Clear();
+        }
+
+        try
+        {
+            mCallback(mStatus, mResponse);
+        }
+        catch (...)
+        {
+            // There is no caller to report the error to, and letting
+            // it escape would take down the polling thread.
+        }
+
+        // Hold the pool until after this object is gone, since releasing
+        // it may shut the pool down.
+        std::shared_ptr<CompletionQueuePool> pool;
+        pool.swap(mPool);
+        delete this;
+    }
+
+private:
+    std::shared_ptr<ChannelLease> mChannel;
+    std::shared_ptr<CompletionQueuePool> mPool;
+    Callback mCallback;
+    std::unique_ptr<UnaryTrace> mTrace;
+    std::unique_ptr<Reader> mReader;
+    Response mResponse;
+    grpc::Status mStatus;
+};
+
+/*
+ * Returns a SessionCallback that fulfills the given promise. Errors
+ * are stored in the promise as a ClientError.
+ */
+static Client::SessionCallback sessionPromiseCallback(
+    const std::shared_ptr<std::promise<cobaltspeech::diatheke::SessionOutput>>
+        &promise)
+{
+    return [promise](const grpc::Status &status,
+                     cobaltspeech::diatheke::SessionOutput &output) {
+        if (!status.ok())
+        {
+            promise->set_exception(std::make_exception_ptr(ClientError(status)));
+            return;
+        }
+
+        promise->set_value(std::move(output));
+    };
+}
+
+/*
+ * SessionRequest builds the SessionInput for one UpdateSession call. The
+ * message lives on a protobuf arena whose first block is on the stack,
+ * so small requests don't touch the heap. The session token (and any ASR
+ * or command result) is referenced rather than copied, since tokens can
+ * be large. This is safe because gRPC serializes the request before the
+ * call is started, and arena messages never delete their fields.
+ */
+class SessionRequest
+{
+public:
+    explicit SessionRequest(const cobaltspeech::diatheke::TokenData &token)
+        : mArena(arenaOptions(mBlock, sizeof(mBlock)))
+    {
+        mInput = google::protobuf::Arena::CreateMessage<
+            cobaltspeech::diatheke::SessionInput>(&mArena);
+        mInput->unsafe_arena_set_allocated_token(
+            const_cast<cobaltspeech::diatheke::TokenData *>(&token));
+    }
+
+    cobaltspeech::diatheke::SessionInput &input() { return *mInput; }
+
+    void setASRResult(const cobaltspeech::diatheke::ASRResult &result)
+    {
+        mInput->unsafe_arena_set_allocated_asr(
+            const_cast<cobaltspeech::diatheke::ASRResult *>(&result));
+    }
+
+    void setCommandResult(const cobaltspeech::diatheke::CommandResult &result)
+    {
+        mInput->unsafe_arena_set_allocated_cmd(
+            const_cast<cobaltspeech::diatheke::CommandResult *>(&result));
+    }
+
+    void setStory(const std::string &storyID,
+                  const std::map<std::string, std::string> &params)
+    {
+        auto story = mInput->mutable_story();
+        story->set_story_id(storyID);
+
+        // Set parameters
+        auto outputParams = story->mutable_parameters();
+        for (auto iter = params.begin(); iter != params.end(); iter++)
+        {
+            (*outputParams)[iter->first] = iter->second;
+        }
+    }
+
+private:
+    char mBlock[1024];
+    google::protobuf::Arena mArena;
+    cobaltspeech::diatheke::SessionInput *mInput;
+
+    static google::protobuf::ArenaOptions arenaOptions(char *block,
+                                                       size_t size)
+    {
+        google::protobuf::ArenaOptions opts;
+        opts.initial_block = block;
+        opts.initial_block_size = size;
+        return opts;
+    }
+};
+
+Client::Client(const std::string &url) :
+    Client(std::vector<std::string>(1, url))
+{
+}
+
+Client::Client(const std::string &url, const grpc::SslCredentialsOptions &opts) :
+    Client(std::vector<std::string>(1, url), opts)
+{
+}
+
+Client::Client(const std::vector<std::string> &urls) :
+    mPool(std::make_shared<CompletionQueuePool>(defaultAsyncThreads)),
+    mTimeout(defaultTimeout)
 {
     /*
      * Quick runtime check to verify that the user has linked against
@@ -39,14 +251,35 @@ Client::Client(const std::string &url) : mTimeout(defaultTimeout)
      */
     GOOGLE_PROTOBUF_VERIFY_VERSION;
 
+    if (urls.empty())
+    {
+        throw ClientError("no Diatheke server url given");
+    }
+
     // Set up credentials
     auto creds = grpc::InsecureChannelCredentials();
 
-    // Create the channel and stub
-    mStub = DiathekeGRPC::NewStub(grpc::CreateChannel(url, creds));
+    // Create the channels and stubs
+    mChannels = std::make_shared<ChannelPool>(urls, creds, defaultChannels);
 }
 
-Client::Client(const std::string &url, const grpc::SslCredentialsOptions &opts) :
+Client::Client(const std::shared_ptr<grpc::Channel> &channel) :
+    mPool(std::make_shared<CompletionQueuePool>(defaultAsyncThreads)),
+    mTimeout(defaultTimeout)
+{
+    GOOGLE_PROTOBUF_VERIFY_VERSION;
+
+    if (!channel)
+    {
+        throw ClientError("no Diatheke channel given");
+    }
+
+    mChannels = std::make_shared<ChannelPool>(channel);
+}
+
+Client::Client(const std::vector<std::string> &urls,
+               const grpc::SslCredentialsOptions &opts) :
+    mPool(std::make_shared<CompletionQueuePool>(defaultAsyncThreads)),
     mTimeout(defaultTimeout)
 {
     /*
@@ -56,11 +289,16 @@ Client::Client(const std::string &url, const grpc::SslCredentialsOptions &opts)
      */
     GOOGLE_PROTOBUF_VERIFY_VERSION;
 
+    if (urls.empty())
+    {
+        throw ClientError("no Diatheke server url given");
+    }
+
     // Set up secure credentials
     auto creds = grpc::SslCredentials(opts);
 
-    // Create the channel and stub
-    mStub = DiathekeGRPC::NewStub(grpc::CreateChannel(url, creds));
+    // Create the channels and stubs
+    mChannels = std::make_shared<ChannelPool>(urls, creds, defaultChannels);
 }
 
 Client::~Client() {}
@@ -75,7 +313,11 @@ cobaltspeech::diatheke::VersionResponse Client::version()
     setContextDeadline(ctx);
 
     // Get the version from the server
-    grpc::Status status = mStub->Version(&ctx, request, &response);
+    std::shared_ptr<ChannelLease> channel = mChannels->acquire();
+    UnaryTrace trace(*channel, CALL_VERSION, request);
+    grpc::Status status = channel->stub()->Version(&ctx, request, &response);
+    channel->reportStatus(status);
+    trace.finish(status, response);
     if (!status.ok())
     {
         throw ClientError(status);
@@ -94,7 +336,11 @@ cobaltspeech::diatheke::ListModelsResponse Client::listModels()
     setContextDeadline(ctx);
 
     // Get the list of models from the server
-    grpc::Status status = mStub->ListModels(&ctx, request, &response);
+    std::shared_ptr<ChannelLease> channel = mChannels->acquire();
+    UnaryTrace trace(*channel, CALL_LIST_MODELS, request);
+    grpc::Status status = channel->stub()->ListModels(&ctx, request, &response);
+    channel->reportStatus(status);
+    trace.finish(status, response);
     if (!status.ok())
     {
         throw ClientError(status);
@@ -115,12 +361,18 @@ Client::createSession(const std::string &modelID)
 
     // Send and get a response
     cobaltspeech::diatheke::SessionOutput response;
-    grpc::Status status = mStub->CreateSession(&ctx, request, &response);
+    std::shared_ptr<ChannelLease> channel = mChannels->acquire();
+    UnaryTrace trace(*channel, CALL_CREATE_SESSION, request);
+    grpc::Status status = channel->stub()->CreateSession(&ctx, request, &response);
+    channel->reportStatus(status);
+    trace.finish(status, response);
     if (!status.ok())
     {
         throw ClientError(status);
     }
 
+    // Keep the rest of the session on the same server
+    mChannels->bindSession(response.token().id(), *channel);
     return response;
 }
 
@@ -137,12 +389,18 @@ Client::createSessionWithWakeWord(const std::string &modelID, const std::string
 
     // Send and get a response
     cobaltspeech::diatheke::SessionOutput response;
-    grpc::Status status = mStub->CreateSession(&ctx, request, &response);
+    std::shared_ptr<ChannelLease> channel = mChannels->acquire();
+    UnaryTrace trace(*channel, CALL_CREATE_SESSION, request);
+    grpc::Status status = channel->stub()->CreateSession(&ctx, request, &response);
+    channel->reportStatus(status);
+    trace.finish(status, response);
     if (!status.ok())
     {
         throw ClientError(status);
     }
 
+    // Keep the rest of the session on the same server
+    mChannels->bindSession(response.token().id(), *channel);
     return response;
 }
 
@@ -153,7 +411,16 @@ void Client::deleteSession(const cobaltspeech::diatheke::TokenData &token)
     grpc::ClientContext ctx;
     setContextDeadline(ctx);
 
-    grpc::Status status = mStub->DeleteSession(&ctx, token, &response);
+    std::shared_ptr<ChannelLease> channel = mChannels->acquire(token.id());
+    UnaryTrace trace(*channel, CALL_DELETE_SESSION, token);
+    grpc::Status status = channel->stub()->DeleteSession(&ctx, token, &response);
+    channel->reportStatus(status);
+    trace.finish(status, response);
+    mChannels->releaseSession(token.id());
+    if (channel->timeline())
+    {
+        channel->timeline()->onSessionEnded(token.id());
+    }
     if (!status.ok())
     {
         throw ClientError(status);
@@ -164,64 +431,90 @@ cobaltspeech::diatheke::SessionOutput
 Client::processText(const cobaltspeech::diatheke::TokenData &token,
                     const std::string &text)
 {
-    // Set up the server request
-    cobaltspeech::diatheke::SessionInput request;
-    *(request.mutable_token()) = token;
-    request.mutable_text()->set_text(text);
-
-    return this->updateSession(request);
+    cobaltspeech::diatheke::SessionOutput output;
+    this->processText(token, text, &output);
+    return output;
 }
 
 cobaltspeech::diatheke::SessionOutput
 Client::processASRResult(const cobaltspeech::diatheke::TokenData &token,
                          const cobaltspeech::diatheke::ASRResult &result)
 {
-    // Set up the server request
-    cobaltspeech::diatheke::SessionInput request;
-    *(request.mutable_token()) = token;
-    *(request.mutable_asr()) = result;
-
-    return this->updateSession(request);
+    cobaltspeech::diatheke::SessionOutput output;
+    this->processASRResult(token, result, &output);
+    return output;
 }
 
 cobaltspeech::diatheke::SessionOutput Client::processCommandResult(
     const cobaltspeech::diatheke::TokenData &token,
     const cobaltspeech::diatheke::CommandResult &result)
 {
-    // Set up the server request
-    cobaltspeech::diatheke::SessionInput request;
-    *(request.mutable_token()) = token;
-    *(request.mutable_cmd()) = result;
-
-    return this->updateSession(request);
+    cobaltspeech::diatheke::SessionOutput output;
+    this->processCommandResult(token, result, &output);
+    return output;
 }
 
 cobaltspeech::diatheke::SessionOutput
 Client::setStory(const cobaltspeech::diatheke::TokenData &token,
                  const std::string &storyID,
                  const std::map<std::string, std::string> &params)
+{
+    cobaltspeech::diatheke::SessionOutput output;
+    this->setStory(token, storyID, params, &output);
+    return output;
+}
+
+void Client::processText(const cobaltspeech::diatheke::TokenData &token,
+                         const std::string &text,
+                         cobaltspeech::diatheke::SessionOutput *output)
 {
     // Set up the server request
-    cobaltspeech::diatheke::SessionInput request;
-    *(request.mutable_token()) = token;
-    auto story = request.mutable_story();
-    story->set_story_id(storyID);
-
-    // Set parameters
-    auto outputParams = story->mutable_parameters();
-    for (auto iter = params.begin(); iter != params.end(); iter++)
-    {
-        (*outputParams)[iter->first] = iter->second;
-    }
+    SessionRequest request(token);
+    request.input().mutable_text()->set_text(text);
+
+    this->updateSession(request.input(), output);
+}
+
+void Client::processASRResult(const cobaltspeech::diatheke::TokenData &token,
+                              const cobaltspeech::diatheke::ASRResult &result,
+                              cobaltspeech::diatheke::SessionOutput *output)
+{
+    // Set up the server request
+    SessionRequest request(token);
+    request.setASRResult(result);
+
+    this->updateSession(request.input(), output);
+}
+
+void Client::processCommandResult(
+    const cobaltspeech::diatheke::TokenData &token,
+    const cobaltspeech::diatheke::CommandResult &result,
+    cobaltspeech::diatheke::SessionOutput *output)
+{
+    // Set up the server request
+    SessionRequest request(token);
+    request.setCommandResult(result);
 
-    return this->updateSession(request);
+    this->updateSession(request.input(), output);
+}
+
+void Client::setStory(const cobaltspeech::diatheke::TokenData &token,
+                      const std::string &storyID,
+                      const std::map<std::string, std::string> &params,
+                      cobaltspeech::diatheke::SessionOutput *output)
+{
+    // Set up the server request
+    SessionRequest request(token);
+    request.setStory(storyID, params);
+
+    this->updateSession(request.input(), output);
 }
 
 ASRStream
 Client::newSessionASRStream(const cobaltspeech::diatheke::TokenData &token)
 {
-     // Create the ASR stream object.
-    ASRStream stream(mStub.get());
+    // Create the ASR stream object.
+    ASRStream stream(mChannels->acquire(token.id()), mPool);
     if (!stream.sendToken(token))
     {
         throw ClientError(
@@ -231,38 +524,43 @@ Client::newSessionASRStream(const cobaltspeech::diatheke::TokenData &token)
     return stream;
 }
 
+ASRStream Client::newASRStream()
+{
+    // Create the ASR stream object. It runs on the client's completion
+    // queues, and is bound to a session by the first token sent on it.
+    return ASRStream(mChannels->acquire(), mPool);
+}
+
+ASRStream Client::newASRStream(const std::string &sessionID)
+{
+    return ASRStream(mChannels->acquire(sessionID), mPool);
+}
+
 TTSStream Client::newTTSStream(const cobaltspeech::diatheke::ReplyAction &reply)
 {
-    /*
-     * Create the context. We need it to exist for the lifetime of the
-     * stream, so we create it as a managed pointer. We don't set a
-     * deadline on the context because we expect the stream to be long-
-     * lived.
-     */
-    std::shared_ptr<grpc::ClientContext> ctx(new grpc::ClientContext);
+    return this->newTTSStream(reply, cobaltspeech::diatheke::TokenData());
+}
 
-    // Create the gRPC stream
-    std::shared_ptr<TTSStream::GRPCReader> reader(
-        mStub->StreamTTS(ctx.get(), reply));
+TTSStream Client::newTTSStream(const cobaltspeech::diatheke::ReplyAction &reply,
+                               const cobaltspeech::diatheke::TokenData &token)
+{
+    if (mTTSCache)
+    {
+        std::shared_ptr<const TTSCacheEntry> audio = mTTSCache->find(reply);
+        if (audio)
+        {
+            return TTSStream(audio);
+        }
+    }
 
-    // Store the pointers in our TTSStream object.
-    return TTSStream(ctx, reader);
+    // Create the stream. It runs on the client's completion queues.
+    return TTSStream(mChannels->acquire(), mPool, reply, mTTSCache, token.id());
 }
 
 TranscribeStream Client::newTranscribeStream(const cobaltspeech::diatheke::TranscribeAction &action)
 {
-    /*
-     * Create the context. We need it to exist for the lifetime of the
-     * stream, so we create it as a managed pointer. We don't set a
-     * deadline on the context because we expect the stream to be long-
-     * lived.
-     */
-    std::shared_ptr<grpc::ClientContext> ctx(new grpc::ClientContext);
-
-    // Create the stream
-    std::shared_ptr<TranscribeStream::GRPCReaderWriter> gStream(
-        mStub->Transcribe(ctx.get()));
-    TranscribeStream stream(ctx, gStream);
+    // Create the stream. It runs on the client's completion queues.
+    TranscribeStream stream(mChannels->acquire(), mPool);
 
     /*
      * Send the first message (the TranscribeAction) to Diatheke. We must
@@ -270,17 +568,267 @@ TranscribeStream Client::newTranscribeStream(const cobaltspeech::diatheke::Trans
      */
     if (!stream.sendAction(action))
     {
+        // Report the stream's status (e.g., UNAVAILABLE) if it has one.
+        stream.close();
         throw ClientError("failed to send TranscribeAction to Diatheke");
     }
 
     return stream;
 }
 
+std::future<cobaltspeech::diatheke::SessionOutput>
+Client::createSessionAsync(const std::string &modelID)
+{
+    std::shared_ptr<std::promise<cobaltspeech::diatheke::SessionOutput>> promise(
+        new std::promise<cobaltspeech::diatheke::SessionOutput>);
+    std::future<cobaltspeech::diatheke::SessionOutput> result =
+        promise->get_future();
+    this->createSessionAsync(modelID, sessionPromiseCallback(promise));
+    return result;
+}
+
+void Client::createSessionAsync(const std::string &modelID,
+                                SessionCallback callback)
+{
+    this->createSessionWithWakeWordAsync(modelID, "", callback);
+}
+
+std::future<cobaltspeech::diatheke::SessionOutput>
+Client::createSessionWithWakeWordAsync(const std::string &modelID,
+                                       const std::string &wakeword)
+{
+    std::shared_ptr<std::promise<cobaltspeech::diatheke::SessionOutput>> promise(
+        new std::promise<cobaltspeech::diatheke::SessionOutput>);
+    std::future<cobaltspeech::diatheke::SessionOutput> result =
+        promise->get_future();
+    this->createSessionWithWakeWordAsync(modelID, wakeword,
+                                         sessionPromiseCallback(promise));
+    return result;
+}
+
+void Client::createSessionWithWakeWordAsync(const std::string &modelID,
+                                            const std::string &wakeword,
+                                            SessionCallback callback)
+{
+    // Set up the server request
+    cobaltspeech::diatheke::SessionStart request;
+    request.set_model_id(modelID);
+    request.set_wakeword(wakeword);
+
+    /*
+     * Send the request. The call object cleans itself up. If the session
+     * is created, keep the rest of it on the same server.
+     */
+    std::shared_ptr<ChannelLease> channel = mChannels->acquire();
+    std::shared_ptr<ChannelPool> channels = mChannels;
+    auto call = new AsyncUnaryCall<cobaltspeech::diatheke::SessionOutput>(
+        channel, mPool,
+        [channels, channel, callback](
+            const grpc::Status &status,
+            cobaltspeech::diatheke::SessionOutput &output) {
+            if (status.ok())
+            {
+                channels->bindSession(output.token().id(), *channel);
+            }
+
+            callback(status, output);
+        });
+    setContextDeadline(call->context);
+    call->start(&DiathekeGRPC::Stub::PrepareAsyncCreateSession, request,
+                CALL_CREATE_SESSION);
+}
+
+std::future<void>
+Client::deleteSessionAsync(const cobaltspeech::diatheke::TokenData &token)
+{
+    std::shared_ptr<std::promise<void>> promise(new std::promise<void>);
+    std::future<void> result = promise->get_future();
+    this->deleteSessionAsync(token, [promise](const grpc::Status &status) {
+        if (!status.ok())
+        {
+            promise->set_exception(std::make_exception_ptr(ClientError(status)));
+            return;
+        }
+
+        promise->set_value();
+    });
+    return result;
+}
+
+void Client::deleteSessionAsync(const cobaltspeech::diatheke::TokenData &token,
+                                StatusCallback callback)
+{
+    std::shared_ptr<ChannelPool> channels = mChannels;
+    std::string sessionID = token.id();
+    std::shared_ptr<ChannelLease> channel = mChannels->acquire(sessionID);
+
+    // The call holds the lease, which keeps the observer alive until the
+    // callback is done.
+    TimelineObserver *timeline = channel->timeline();
+    auto call = new AsyncUnaryCall<cobaltspeech::diatheke::Empty>(
+        channel, mPool,
+        [channels, sessionID, timeline,
+         callback](const grpc::Status &status, cobaltspeech::diatheke::Empty &) {
+            channels->releaseSession(sessionID);
+            if (timeline)
+            {
+                timeline->onSessionEnded(sessionID);
+            }
+            callback(status);
+        });
+    setContextDeadline(call->context);
+    call->start(&DiathekeGRPC::Stub::PrepareAsyncDeleteSession, token,
+                CALL_DELETE_SESSION);
+}
+
+std::future<cobaltspeech::diatheke::SessionOutput>
+Client::processTextAsync(const cobaltspeech::diatheke::TokenData &token,
+                         const std::string &text)
+{
+    std::shared_ptr<std::promise<cobaltspeech::diatheke::SessionOutput>> promise(
+        new std::promise<cobaltspeech::diatheke::SessionOutput>);
+    std::future<cobaltspeech::diatheke::SessionOutput> result =
+        promise->get_future();
+    this->processTextAsync(token, text, sessionPromiseCallback(promise));
+    return result;
+}
+
+void Client::processTextAsync(const cobaltspeech::diatheke::TokenData &token,
+                              const std::string &text, SessionCallback callback)
+{
+    // Set up the server request
+    SessionRequest request(token);
+    request.input().mutable_text()->set_text(text);
+
+    this->updateSessionAsync(request.input(), callback);
+}
+
+std::future<cobaltspeech::diatheke::SessionOutput>
+Client::processASRResultAsync(const cobaltspeech::diatheke::TokenData &token,
+                              const cobaltspeech::diatheke::ASRResult &result)
+{
+    std::shared_ptr<std::promise<cobaltspeech::diatheke::SessionOutput>> promise(
+        new std::promise<cobaltspeech::diatheke::SessionOutput>);
+    std::future<cobaltspeech::diatheke::SessionOutput> output =
+        promise->get_future();
+    this->processASRResultAsync(token, result, sessionPromiseCallback(promise));
+    return output;
+}
+
+void Client::processASRResultAsync(
+    const cobaltspeech::diatheke::TokenData &token,
+    const cobaltspeech::diatheke::ASRResult &result, SessionCallback callback)
+{
+    // Set up the server request
+    SessionRequest request(token);
+    request.setASRResult(result);
+
+    this->updateSessionAsync(request.input(), callback);
+}
+
+std::future<cobaltspeech::diatheke::SessionOutput>
+Client::processCommandResultAsync(
+    const cobaltspeech::diatheke::TokenData &token,
+    const cobaltspeech::diatheke::CommandResult &result)
+{
+    std::shared_ptr<std::promise<cobaltspeech::diatheke::SessionOutput>> promise(
+        new std::promise<cobaltspeech::diatheke::SessionOutput>);
+    std::future<cobaltspeech::diatheke::SessionOutput> output =
+        promise->get_future();
+    this->processCommandResultAsync(token, result,
+                                    sessionPromiseCallback(promise));
+    return output;
+}
+
+void Client::processCommandResultAsync(
+    const cobaltspeech::diatheke::TokenData &token,
+    const cobaltspeech::diatheke::CommandResult &result,
+    SessionCallback callback)
+{
+    // Set up the server request
+    SessionRequest request(token);
+    request.setCommandResult(result);
+
+    this->updateSessionAsync(request.input(), callback);
+}
+
+std::future<cobaltspeech::diatheke::SessionOutput>
+Client::setStoryAsync(const cobaltspeech::diatheke::TokenData &token,
+                      const std::string &storyID,
+                      const std::map<std::string, std::string> &params)
+{
+    std::shared_ptr<std::promise<cobaltspeech::diatheke::SessionOutput>> promise(
+        new std::promise<cobaltspeech::diatheke::SessionOutput>);
+    std::future<cobaltspeech::diatheke::SessionOutput> result =
+        promise->get_future();
+    this->setStoryAsync(token, storyID, params, sessionPromiseCallback(promise));
+    return result;
+}
+
+void Client::setStoryAsync(const cobaltspeech::diatheke::TokenData &token,
+                           const std::string &storyID,
+                           const std::map<std::string, std::string> &params,
+                           SessionCallback callback)
+{
+    // Set up the server request
+    SessionRequest request(token);
+    request.setStory(storyID, params);
+
+    this->updateSessionAsync(request.input(), callback);
+}
+
 void Client::setRequestTimeout(unsigned int milliseconds)
 {
     mTimeout = milliseconds;
 }
 
+void Client::setAsyncThreadCount(unsigned int count)
+{
+    // Calls in flight hold their own reference to the old pool, which
+    // shuts down once they have all finished.
+    mPool = std::make_shared<CompletionQueuePool>(count);
+}
+
+void Client::setChannelCount(unsigned int count)
+{
+    // Calls in flight hold a lease that keeps their old channel open
+    // until they finish.
+    mChannels = std::make_shared<ChannelPool>(*mChannels, count);
+}
+
+void Client::setTTSCache(const std::shared_ptr<TTSCache> &cache)
+{
+    mTTSCache = cache;
+}
+
+void Client::setTrace(const std::shared_ptr<TraceWriter> &trace)
+{
+    mChannels->setTrace(trace);
+}
+
+void Client::setTimelineObserver(
+    const std::shared_ptr<TimelineObserver> &observer)
+{
+    mChannels->setTimelineObserver(observer);
+}
+
+size_t Client::endpointCount() const { return mChannels->endpointCount(); }
+
+size_t Client::sessionEndpoint(const std::string &sessionID)
+{
+    return mChannels->endpointFor(sessionID);
+}
+
+ASRStream Client::newASRStreamOn(size_t endpoint)
+{
+    return ASRStream(mChannels->acquireEndpoint(endpoint), mPool);
+}
+
+std::shared_ptr<CompletionQueuePool> Client::asyncPool() const
+{
+    return mPool;
+}
+
 void Client::setContextDeadline(grpc::ClientContext &ctx)
 {
     if (mTimeout == 0)
@@ -293,22 +841,82 @@ void Client::setContextDeadline(grpc::ClientContext &ctx)
     ctx.set_deadline(deadline);
 }
 
-cobaltspeech::diatheke::SessionOutput
-Client::updateSession(const cobaltspeech::diatheke::SessionInput &request)
+void Client::updateSession(const cobaltspeech::diatheke::SessionInput &request,
+                           cobaltspeech::diatheke::SessionOutput *response)
 {
     // Create the context
     grpc::ClientContext ctx;
     setContextDeadline(ctx);
 
     // Send and get a response
-    cobaltspeech::diatheke::SessionOutput response;
-    grpc::Status status = mStub->UpdateSession(&ctx, request, &response);
+    std::shared_ptr<ChannelLease> channel =
+        mChannels->acquire(request.token().id());
+
+    /*
+     * Copy the session ID before the call, since the response may be
+     * stored in the object that holds the request's token.
+     */
+    TimelineObserver *timeline = channel->timeline();
+    std::string sessionID;
+    if (timeline)
+    {
+        sessionID = request.token().id();
+        timeline->onTimelinePoint(sessionID, POINT_UPDATE_SENT,
+                                  std::chrono::steady_clock::now());
+    }
+
+    UnaryTrace trace(*channel, CALL_UPDATE_SESSION, request);
+    grpc::Status status = channel->stub()->UpdateSession(&ctx, request, response);
+    if (timeline && status.ok())
+    {
+        timeline->onTimelinePoint(sessionID, POINT_UPDATE_RECEIVED,
+                                  std::chrono::steady_clock::now());
+    }
+    channel->reportStatus(status);
+    trace.finish(status, *response);
     if (!status.ok())
     {
         throw ClientError(status);
     }
+}
 
-    return response;
+void Client::updateSessionAsync(
+    const cobaltspeech::diatheke::SessionInput &request,
+    SessionCallback callback)
+{
+    // The request is serialized when the call starts, so it does not
+    // need to outlive this function.
+    std::shared_ptr<ChannelLease> channel =
+        mChannels->acquire(request.token().id());
+
+    /*
+     * Mark the response before the caller's callback runs. The call
+     * holds the lease, which keeps the observer alive until then.
+     */
+    TimelineObserver *timeline = channel->timeline();
+    if (timeline)
+    {
+        std::string sessionID = request.token().id();
+        timeline->onTimelinePoint(sessionID, POINT_UPDATE_SENT,
+                                  std::chrono::steady_clock::now());
+        SessionCallback next = callback;
+        callback = [timeline, sessionID,
+                    next](const grpc::Status &status,
+                          cobaltspeech::diatheke::SessionOutput &output) {
+            if (status.ok())
+            {
+                timeline->onTimelinePoint(sessionID, POINT_UPDATE_RECEIVED,
+                                          std::chrono::steady_clock::now());
+            }
+            next(status, output);
+        };
+    }
+
+    auto call = new AsyncUnaryCall<cobaltspeech::diatheke::SessionOutput>(
+        channel, mPool, callback);
+    setContextDeadline(call->context);
+    call->start(&DiathekeGRPC::Stub::PrepareAsyncUpdateSession, request,
+                CALL_UPDATE_SESSION);
 }
 
 } // namespace Diatheke
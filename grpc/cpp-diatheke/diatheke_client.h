@@ -17,9 +17,12 @@
 #ifndef DIATHEKE_CLIENT_H
 #define DIATHEKE_CLIENT_H
 
+#include <functional>
+#include <future>
 #include <map>
 #include <memory>
 #include <string>
+#include <vector>
 
 #include <grpcpp/security/credentials.h>
 
@@ -31,6 +34,14 @@
 namespace Diatheke
 {
 
+class ASRStreamPool;
+class ASRStreamPoolPrivate;
+class ChannelPool;
+class CompletionQueuePool;
+class TimelineObserver;
+class TraceWriter;
+class TTSCache;
+
 /*
  * Client is an object used to interact with the Diatheke
  * gRPC API.
@@ -38,6 +49,17 @@ namespace Diatheke
 class Client
 {
 public:
+    /*
+     * Callback types used by the asynchronous methods. Callbacks are
+     * invoked from one of the client's completion queue threads, so
+     * they should return quickly and must not throw. If the status is
+     * not OK, the output is left empty.
+     */
+    using SessionCallback =
+        std::function<void(const grpc::Status &status,
+                           cobaltspeech::diatheke::SessionOutput &output)>;
+    using StatusCallback = std::function<void(const grpc::Status &status)>;
+
     /*
      * Create a new insecure client that is connected to a Diatheke server
      * instance running at the given url. Note that for security reasons
@@ -59,6 +81,34 @@ public:
      */
     Client(const std::string &url, const grpc::SslCredentialsOptions &opts);
 
+    /*
+     * Create a new client that balances requests across several Diatheke
+     * server instances running at the given urls. New sessions go to the
+     * healthy server with the fewest requests and streams in flight, and
+     * later requests for a session (including its ASR streams) go to the
+     * server that created it. The session ID is used to keep track of
+     * this, until the session is deleted.
+     *
+     * A server is considered unhealthy for a few seconds after a request
+     * to it fails because it was unavailable. Sessions on an unhealthy
+     * server move to another server on their next request. The failed
+     * request itself is not retried.
+     *
+     * The second version uses TLS/SSL to communicate with the servers,
+     * as described above.
+     */
+    Client(const std::vector<std::string> &urls);
+    Client(const std::vector<std::string> &urls,
+           const grpc::SslCredentialsOptions &opts);
+
+    /*
+     * Create a new client that uses the given channel, for example an
+     * in-process channel to a server running in the same program (see
+     * grpc::Server::InProcessChannel()). setChannelCount() has no effect
+     * on such a client.
+     */
+    explicit Client(const std::shared_ptr<grpc::Channel> &channel);
+
     ~Client();
 
     // Returns version information from the server.
@@ -126,6 +176,28 @@ public:
              const std::string &storyID,
              const std::map<std::string, std::string> &params);
 
+    /*
+     * Variants of the methods above that store the updated session in
+     * the given output instead of returning a new one. Passing the same
+     * output object every turn lets its buffers (e.g., for the session
+     * token) be reused instead of reallocated. The output may be the
+     * object that holds the given token.
+     */
+    void processText(const cobaltspeech::diatheke::TokenData &token,
+                     const std::string &text,
+                     cobaltspeech::diatheke::SessionOutput *output);
+    void processASRResult(const cobaltspeech::diatheke::TokenData &token,
+                          const cobaltspeech::diatheke::ASRResult &result,
+                          cobaltspeech::diatheke::SessionOutput *output);
+    void
+    processCommandResult(const cobaltspeech::diatheke::TokenData &token,
+                         const cobaltspeech::diatheke::CommandResult &result,
+                         cobaltspeech::diatheke::SessionOutput *output);
+    void setStory(const cobaltspeech::diatheke::TokenData &token,
+                  const std::string &storyID,
+                  const std::map<std::string, std::string> &params,
+                  cobaltspeech::diatheke::SessionOutput *output);
+
     /*
      * Create a new stream to transcribe audio for the given
      * session token.
@@ -133,12 +205,38 @@ public:
     ASRStream
     newSessionASRStream(const cobaltspeech::diatheke::TokenData &token);
 
+    /*
+     * Create a new ASR stream without sending a session token. This lets
+     * the stream be opened ahead of time (e.g., while a reply is still
+     * playing) so that setup does not delay the first audio. The token
+     * must be sent with ASRStream::sendToken() before any audio will be
+     * recognized. See also ASRStreamPool.
+     */
+    ASRStream newASRStream();
+
+    /*
+     * Create a new ASR stream as above, on the server assigned to the
+     * given session. This does not block, so the token may then be sent
+     * with ASRStream::sendTokenAsync().
+     */
+    ASRStream newASRStream(const std::string &sessionID);
+
     /*
      * Create a new stream to receive TTS audio from Diatheke
-     * based on the given ReplyAction.
+     * based on the given ReplyAction. If a TTS cache is set and
+     * it has audio for the reply, the stream plays back the
+     * cached audio instead.
      */
     TTSStream newTTSStream(const cobaltspeech::diatheke::ReplyAction &reply);
 
+    /*
+     * Create a new TTS stream as above for a reply from the session with
+     * the given token. The token is only used to report the stream's
+     * timeline points for the session (see setTimelineObserver()).
+     */
+    TTSStream newTTSStream(const cobaltspeech::diatheke::ReplyAction &reply,
+                           const cobaltspeech::diatheke::TokenData &token);
+
     /*
      * Create a new stream for transcriptions, usually in response to a
      * TranscribeAction.
@@ -146,6 +244,67 @@ public:
     TranscribeStream
     newTranscribeStream(const cobaltspeech::diatheke::TranscribeAction &action);
 
+    /*
+     * Asynchronous versions of the session methods above. Each request
+     * is sent without blocking the calling thread. The variants that
+     * return a std::future will store a ClientError in the future if
+     * the request fails. The variants that take a callback will call it
+     * from one of the client's completion queue threads when the request
+     * is done.
+     *
+     * Requests are serviced by a small, fixed pool of threads (see
+     * setAsyncThreadCount()), regardless of how many are in flight.
+     * The same threads run all ASR, TTS and Transcribe streams created
+     * by this client.
+     */
+    std::future<cobaltspeech::diatheke::SessionOutput>
+    createSessionAsync(const std::string &modelID);
+    void createSessionAsync(const std::string &modelID,
+                            SessionCallback callback);
+
+    std::future<cobaltspeech::diatheke::SessionOutput>
+    createSessionWithWakeWordAsync(const std::string &modelID,
+                                   const std::string &wakeword);
+    void createSessionWithWakeWordAsync(const std::string &modelID,
+                                        const std::string &wakeword,
+                                        SessionCallback callback);
+
+    std::future<void>
+    deleteSessionAsync(const cobaltspeech::diatheke::TokenData &token);
+    void deleteSessionAsync(const cobaltspeech::diatheke::TokenData &token,
+                            StatusCallback callback);
+
+    std::future<cobaltspeech::diatheke::SessionOutput>
+    processTextAsync(const cobaltspeech::diatheke::TokenData &token,
+                     const std::string &text);
+    void processTextAsync(const cobaltspeech::diatheke::TokenData &token,
+                          const std::string &text, SessionCallback callback);
+
+    std::future<cobaltspeech::diatheke::SessionOutput>
+    processASRResultAsync(const cobaltspeech::diatheke::TokenData &token,
+                          const cobaltspeech::diatheke::ASRResult &result);
+    void
+    processASRResultAsync(const cobaltspeech::diatheke::TokenData &token,
+                          const cobaltspeech::diatheke::ASRResult &result,
+                          SessionCallback callback);
+
+    std::future<cobaltspeech::diatheke::SessionOutput> processCommandResultAsync(
+        const cobaltspeech::diatheke::TokenData &token,
+        const cobaltspeech::diatheke::CommandResult &result);
+    void processCommandResultAsync(
+        const cobaltspeech::diatheke::TokenData &token,
+        const cobaltspeech::diatheke::CommandResult &result,
+        SessionCallback callback);
+
+    std::future<cobaltspeech::diatheke::SessionOutput>
+    setStoryAsync(const cobaltspeech::diatheke::TokenData &token,
+                  const std::string &storyID,
+                  const std::map<std::string, std::string> &params);
+    void setStoryAsync(const cobaltspeech::diatheke::TokenData &token,
+                       const std::string &storyID,
+                       const std::map<std::string, std::string> &params,
+                       SessionCallback callback);
+
     /*
      * Set a timeout for server requests in milliseconds. A timeout value of
      * zero indicates no timeout. The default is 30000 (i.e., 30 seconds).
@@ -153,16 +312,89 @@ public:
      */
     void setRequestTimeout(unsigned int milliseconds);
 
+    /*
+     * Set the number of threads used to service asynchronous requests
+     * and streams. The default is 2. Requests and streams already in
+     * flight finish on the threads that were running when they started.
+     *
+     * This replaces the client's thread pool without synchronization, so
+     * it must not be called while another thread may be starting a
+     * request or stream on this client. Call it while setting up the
+     * client, before the client is shared between threads.
+     */
+    void setAsyncThreadCount(unsigned int count);
+
+    /*
+     * Set the number of channels (i.e., separate HTTP/2 connections)
+     * opened to each server. The default is 1. Each request and new
+     * stream uses the channel with the fewest requests and streams in
+     * flight, which keeps a busy client from being limited by one
+     * connection's concurrent stream limit. Requests and streams already
+     * in flight keep using the channel they started on.
+     *
+     * As with setAsyncThreadCount(), this must not be called while
+     * another thread may be starting a request or stream on this client.
+     */
+    void setChannelCount(unsigned int count);
+
+    /*
+     * Set the cache used by newTTSStream(). Audio for replies that are
+     * not in the cache is added to it once synthesized. The cache may be
+     * shared with other clients. A null cache (the default) disables
+     * caching.
+     */
+    void setTTSCache(const std::shared_ptr<TTSCache> &cache);
+
+    /*
+     * Record every request and response of the client's calls and
+     * streams, including audio, in the given trace, which may later be
+     * replayed with a TraceReplayer. Calls already in flight are not
+     * recorded. A null trace (the default) turns tracing off. Audio
+     * played back from the TTS cache is not recorded, since it does not
+     * come from the server.
+     */
+    void setTrace(const std::shared_ptr<TraceWriter> &trace);
+
+    /*
+     * Report the timing of each dialogue turn to the given observer:
+     * when the ASR stream's token, first audio and end of audio are sent
+     * and its result arrives, when UpdateSession requests are sent and
+     * answered, and when TTS streams are requested and their first and
+     * last audio arrive (see TimelinePoint). A TimelineRecorder keeps
+     * these as a SessionTimeline for each session. Calls already in
+     * flight are not reported, nor is audio played back from the TTS
+     * cache. A null observer (the default) turns the reports off, which
+     * leaves one pointer check on each of these paths.
+     */
+    void setTimelineObserver(const std::shared_ptr<TimelineObserver> &observer);
+
 private:
+    friend class ASRStreamPool;
+    friend class ASRStreamPoolPrivate;
+
     using DiathekeGRPC = cobaltspeech::diatheke::Diatheke;
-    std::shared_ptr<DiathekeGRPC::Stub> mStub;
+    std::shared_ptr<ChannelPool> mChannels;
+    std::shared_ptr<CompletionQueuePool> mPool;
+    std::shared_ptr<TTSCache> mTTSCache;
     unsigned int mTimeout;
 
     // Convenience functions
     void setContextDeadline(grpc::ClientContext &ctx);
 
-    cobaltspeech::diatheke::SessionOutput
-    updateSession(const cobaltspeech::diatheke::SessionInput &request);
+    /*
+     * Used by ASRStreamPool to keep streams open to each server, and to
+     * expire them on the client's completion queues.
+     */
+    size_t endpointCount() const;
+    size_t sessionEndpoint(const std::string &sessionID);
+    ASRStream newASRStreamOn(size_t endpoint);
+    std::shared_ptr<CompletionQueuePool> asyncPool() const;
+
+    void updateSession(const cobaltspeech::diatheke::SessionInput &request,
+                       cobaltspeech::diatheke::SessionOutput *response);
+
+    void updateSessionAsync(const cobaltspeech::diatheke::SessionInput &request,
+                            SessionCallback callback);
 };
 
 } // namespace Diatheke
@@ -0,0 +1,278 @@
+/*
+ * Copyright (2021-present) Cobalt Speech and Language, Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Microbenchmarks for the Diatheke client, run against the in-process
+ * fake server. Each benchmark takes a transport argument: 0 for an
+ * in-process channel, which measures only the client and gRPC, or 1 for
+ * a loopback TCP connection. Run with --benchmark_format=json (or
+ * --benchmark_out=<file>) for machine-readable results.
+ *
+ * The allocs_per_op counter includes allocations made by the fake
+ * server, which runs in the same process. It counts calls to operator
+ * new only, so memory that gRPC core and protobuf arenas get from malloc
+ * directly is not included; use it to compare C++ allocations between
+ * versions, not as a total.
+ */
+
+#include "diatheke_audio_helpers.h"
+#include "diatheke_client.h"
+#include "diatheke_fake_server.h"
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <new>
+
+// Count every operator new call made by the process.
+static std::atomic<uint64_t> allocationCount(0);
+
+void *operator new(size_t size)
+{
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    void *ptr = std::malloc(size == 0 ? 1 : size);
+    if (ptr == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+
+void operator delete(void *ptr, size_t) noexcept { std::free(ptr); }
+
+namespace
+{
+
+// The server and clients shared by all of the benchmarks.
+struct BenchEnvironment
+{
+    Diatheke::FakeServer server;
+    std::unique_ptr<Diatheke::Client> clients[2];
+
+    BenchEnvironment()
+    {
+        server.start("127.0.0.1:0");
+        clients[0].reset(new Diatheke::Client(server.inProcessChannel()));
+        clients[1].reset(new Diatheke::Client(server.address()));
+    }
+
+    Diatheke::Client &client(const benchmark::State &state)
+    {
+        return *clients[state.range(0)];
+    }
+};
+
+BenchEnvironment &env()
+{
+    static BenchEnvironment environment;
+    return environment;
+}
+
+/*
+ * Records allocations for the benchmark run that created it, per
+ * operation. Give the number of operations in each iteration if it is
+ * more than one.
+ */
+class AllocationCounter
+{
+public:
+    explicit AllocationCounter(benchmark::State &state,
+                               size_t opsPerIteration = 1)
+        : mState(state),
+          mOpsPerIteration(opsPerIteration),
+          mStart(allocationCount.load())
+    {
+    }
+
+    ~AllocationCounter()
+    {
+        double count = static_cast<double>(allocationCount.load() - mStart);
+        double ops = static_cast<double>(mState.iterations()) *
+                     static_cast<double>(mOpsPerIteration);
+        mState.counters["allocs_per_op"] = benchmark::Counter(count / ops);
+    }
+
+private:
+    benchmark::State &mState;
+    size_t mOpsPerIteration;
+    uint64_t mStart;
+};
+
+// Latency of one synchronous UpdateSession call.
+void BM_UpdateSession(benchmark::State &state)
+{
+    Diatheke::Client &client = env().client(state);
+    cobaltspeech::diatheke::SessionOutput session = client.createSession("fake");
+    std::string text = "what is the weather";
+
+    AllocationCounter allocs(state);
+    for (auto _ : state)
+    {
+        client.processText(session.token(), text, &session);
+    }
+    state.SetItemsProcessed(state.iterations());
+    client.deleteSession(session.token());
+}
+BENCHMARK(BM_UpdateSession)->ArgNames({"transport"})->Arg(0)->Arg(1)->UseRealTime();
+
+// Throughput of UpdateSession with several asynchronous calls in flight.
+void BM_UpdateSessionAsync(benchmark::State &state)
+{
+    Diatheke::Client &client = env().client(state);
+    size_t inFlight = static_cast<size_t>(state.range(1));
+    cobaltspeech::diatheke::SessionOutput session = client.createSession("fake");
+
+    AllocationCounter allocs(state, inFlight);
+    for (auto _ : state)
+    {
+        std::mutex lock;
+        std::condition_variable cond;
+        size_t pending = inFlight;
+        for (size_t i = 0; i < inFlight; i++)
+        {
+            client.processTextAsync(
+                session.token(), "hello",
+                [&](const grpc::Status &, cobaltspeech::diatheke::SessionOutput &) {
+                    std::lock_guard<std::mutex> guard(lock);
+                    if (--pending == 0)
+                    {
+                        cond.notify_one();
+                    }
+                });
+        }
+
+        std::unique_lock<std::mutex> guard(lock);
+        cond.wait(guard, [&] { return pending == 0; });
+    }
+    state.SetItemsProcessed(state.iterations() * inFlight);
+    client.deleteSession(session.token());
+}
+BENCHMARK(BM_UpdateSessionAsync)
+    ->ArgNames({"transport", "in_flight"})
+    ->ArgsProduct({{0, 1}, {16, 64}})
+    ->UseRealTime();
+
+// Audio sent per ASR stream, i.e. ten seconds of 16 kHz audio.
+const size_t streamAudioBytes = 320000;
+
+// Rate at which an ASR stream takes audio, by chunk size.
+void BM_ASRStreamIngest(benchmark::State &state)
+{
+    Diatheke::Client &client = env().client(state);
+    size_t chunkSize = static_cast<size_t>(state.range(1));
+    std::string chunk(chunkSize, '\0');
+    cobaltspeech::diatheke::TokenData token;
+    token.set_id("bench");
+
+    AllocationCounter allocs(state);
+    for (auto _ : state)
+    {
+        Diatheke::ASRStream stream = client.newSessionASRStream(token);
+        for (size_t sent = 0; sent < streamAudioBytes; sent += chunkSize)
+        {
+            stream.sendAudio(chunk.data(), chunk.size());
+        }
+        benchmark::DoNotOptimize(stream.result());
+    }
+    state.SetBytesProcessed(state.iterations() * streamAudioBytes);
+}
+BENCHMARK(BM_ASRStreamIngest)
+    ->ArgNames({"transport", "chunk"})
+    ->ArgsProduct({{0, 1}, {320, 3200, 32000}})
+    ->UseRealTime();
+
+// Provides a fixed amount of silence in chunks of the given size.
+class SilenceReader : public Diatheke::AudioReader
+{
+public:
+    explicit SilenceReader(size_t totalBytes) : mRemaining(totalBytes) {}
+
+    size_t readAudio(char *buffer, size_t buffSize) override
+    {
+        size_t count = std::min(buffSize, mRemaining);
+        memset(buffer, 0, count);
+        mRemaining -= count;
+        return count;
+    }
+
+private:
+    size_t mRemaining;
+};
+
+/*
+ * Rate at which a Transcribe stream takes audio, by chunk size. Results
+ * must be read while sending, so this uses ReadTranscribeAudio().
+ */
+void BM_TranscribeStreamIngest(benchmark::State &state)
+{
+    Diatheke::Client &client = env().client(state);
+    size_t chunkSize = static_cast<size_t>(state.range(1));
+    cobaltspeech::diatheke::TranscribeAction action;
+
+    AllocationCounter allocs(state);
+    for (auto _ : state)
+    {
+        Diatheke::TranscribeStream stream = client.newTranscribeStream(action);
+        SilenceReader reader(streamAudioBytes);
+        Diatheke::ReadTranscribeAudio(
+            stream, &reader, chunkSize,
+            [](const cobaltspeech::diatheke::TranscribeResult &result) {
+                benchmark::DoNotOptimize(result.text().size());
+            });
+    }
+    state.SetBytesProcessed(state.iterations() * streamAudioBytes);
+}
+BENCHMARK(BM_TranscribeStreamIngest)
+    ->ArgNames({"transport", "chunk"})
+    ->ArgsProduct({{0, 1}, {320, 3200, 32000}})
+    ->UseRealTime();
+
+// Rate at which audio is received from a TTS stream, by chunk size.
+void BM_TTSStreamReceive(benchmark::State &state)
+{
+    Diatheke::Client &client = env().client(state);
+    size_t chunkSize = static_cast<size_t>(state.range(1));
+    env().server.setTTSAudio(streamAudioBytes, chunkSize);
+    cobaltspeech::diatheke::ReplyAction reply;
+    reply.set_text("the weather is sunny");
+
+    AllocationCounter allocs(state);
+    std::string buffer;
+    for (auto _ : state)
+    {
+        Diatheke::TTSStream stream = client.newTTSStream(reply);
+        while (stream.receiveAudio(buffer))
+        {
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * streamAudioBytes);
+}
+BENCHMARK(BM_TTSStreamReceive)
+    ->ArgNames({"transport", "chunk"})
+    ->ArgsProduct({{0, 1}, {3200, 32000}})
+    ->UseRealTime();
+
+} // namespace
+
+BENCHMARK_MAIN();
@@ -19,10 +19,13 @@
 namespace Diatheke
 {
 
-ClientError::ClientError(const std::string &msg) : mMsg(msg) {}
+ClientError::ClientError(const std::string &msg)
+    : mMsg(msg), mCode(grpc::StatusCode::UNKNOWN)
+{
+}
 
 ClientError::ClientError(const grpc::Status &status)
-    : mMsg(status.error_message())
+    : mMsg(status.error_message()), mCode(status.error_code())
 {
 }
 
@@ -30,4 +33,6 @@ ClientError::~ClientError() {}
 
 const char *ClientError::what() const noexcept { return mMsg.c_str(); }
 
+grpc::StatusCode ClientError::code() const { return mCode; }
+
 } // namespace Diatheke
@@ -34,8 +34,15 @@ public:
 
     const char *what() const noexcept override;
 
+    /*
+     * Returns the gRPC status code of the error, or UNKNOWN if it did
+     * not come from a call's status.
+     */
+    grpc::StatusCode code() const;
+
 private:
     std::string mMsg;
+    grpc::StatusCode mCode;
 };
 
 } // namespace Diatheke
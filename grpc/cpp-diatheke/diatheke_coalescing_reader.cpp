@@ -0,0 +1,168 @@
+/*
+ * Copyright (2021-present) Cobalt Speech and Language, Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "diatheke_coalescing_reader.h"
+
+#include "diatheke_client_error.h"
+
+namespace Diatheke
+{
+
+CoalescingReader::CoalescingReader(AudioReader *reader, size_t targetBytes,
+                                   unsigned int maxDelayMs)
+    : mReader(reader),
+      mTargetBytes(targetBytes),
+      mMaxDelay(maxDelayMs),
+      mFinished(false),
+      mChunksOut(0),
+      mChunksIn(0),
+      mMinBytes(0),
+      mMaxBytes(0),
+      mHaveReturned(false),
+      mFillTime(0)
+{
+    if (reader == nullptr)
+    {
+        throw ClientError("no audio reader given to coalesce");
+    }
+}
+
+CoalescingReader::~CoalescingReader() {}
+
+void CoalescingReader::setTargetBytes(size_t targetBytes)
+{
+    mTargetBytes = targetBytes;
+}
+
+void CoalescingReader::setMaxDelay(unsigned int milliseconds)
+{
+    mMaxDelay = std::chrono::milliseconds(milliseconds);
+}
+
+void CoalescingReader::setAdaptive(size_t minBytes, size_t maxBytes)
+{
+    if (maxBytes > 0 && minBytes > maxBytes)
+    {
+        throw ClientError("minimum chunk size is larger than the maximum");
+    }
+
+    mMinBytes = minBytes;
+    mMaxBytes = maxBytes;
+    mHaveReturned = false;
+    if (mMaxBytes == 0)
+    {
+        return;
+    }
+
+    if (mTargetBytes < mMinBytes)
+    {
+        mTargetBytes = mMinBytes;
+    }
+    if (mTargetBytes == 0 || mTargetBytes > mMaxBytes)
+    {
+        mTargetBytes = mMaxBytes;
+    }
+}
+
+size_t CoalescingReader::targetBytes() const { return mTargetBytes; }
+
+void CoalescingReader::adapt(std::chrono::steady_clock::time_point now)
+{
+    if (mTargetBytes == 0)
+    {
+        // Chunks are passed through as read.
+        return;
+    }
+
+    std::chrono::steady_clock::duration sendTime = now - mReturned;
+    if (sendTime * 4 > mFillTime)
+    {
+        // Sending is falling behind, so send fewer, larger messages.
+        mTargetBytes = mTargetBytes > mMaxBytes / 2 ? mMaxBytes
+                                                    : mTargetBytes * 2;
+    }
+    else if (sendTime * 16 < mFillTime)
+    {
+        size_t smaller = mTargetBytes - mTargetBytes / 4;
+        mTargetBytes = smaller < mMinBytes ? mMinBytes : smaller;
+    }
+}
+
+size_t CoalescingReader::readAudio(char *buffer, size_t buffSize)
+{
+    if (mFinished)
+    {
+        return 0;
+    }
+
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    if (mMaxBytes > 0 && mHaveReturned)
+    {
+        adapt(start);
+    }
+
+    size_t target = mTargetBytes;
+    if (target == 0 || target > buffSize)
+    {
+        target = buffSize;
+    }
+
+    size_t filled = 0;
+    std::chrono::steady_clock::time_point deadline;
+    while (filled < target)
+    {
+        // Without a target, pass the first chunk straight through.
+        size_t limit = mTargetBytes == 0 ? buffSize : target;
+        size_t n = mReader->readAudio(buffer + filled, limit - filled);
+        if (n == 0)
+        {
+            // Send what we have, and report the end on the next call.
+            mFinished = true;
+            break;
+        }
+
+        mChunksIn++;
+        if (filled == 0)
+        {
+            deadline = std::chrono::steady_clock::now() + mMaxDelay;
+        }
+        filled += n;
+
+        if (mTargetBytes == 0 || std::chrono::steady_clock::now() >= deadline)
+        {
+            break;
+        }
+    }
+
+    if (filled > 0)
+    {
+        mChunksOut++;
+        if (mMaxBytes > 0)
+        {
+            mReturned = std::chrono::steady_clock::now();
+            mFillTime = mReturned - start;
+            mHaveReturned = true;
+        }
+    }
+    return filled;
+}
+
+size_t CoalescingReader::chunksOut() const { return mChunksOut; }
+
+size_t CoalescingReader::chunksIn() const { return mChunksIn; }
+
+} // namespace Diatheke
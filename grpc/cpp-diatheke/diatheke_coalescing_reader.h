@@ -0,0 +1,118 @@
+/*
+ * Copyright (2021-present) Cobalt Speech and Language, Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DIATHEKE_COALESCING_READER_H
+#define DIATHEKE_COALESCING_READER_H
+
+#include "diatheke_audio_helpers.h"
+
+#include <chrono>
+
+namespace Diatheke
+{
+
+/*
+ * CoalescingReader is an AudioReader that combines the small chunks
+ * returned by another reader into larger ones. ReadASRAudio() and
+ * ReadTranscribeAudio() send each chunk they read as one message, so a
+ * reader that returns 10 ms frames results in 100 messages per second
+ * per stream. Wrapping it in a CoalescingReader trades a little latency
+ * for far fewer messages, which matters when running many streams.
+ *
+ * Each call to readAudio() collects audio until it has the target size,
+ * the maximum delay has passed since its first audio arrived, or the
+ * wrapped reader has no more data. The delay is checked between reads
+ * of the wrapped reader, so a chunk may be held for up to one of its
+ * frames longer. Audio is read directly into the caller's buffer, so it
+ * is never copied.
+ *
+ * The target size may also adapt to how fast the stream is taking audio
+ * (see setAdaptive()): while sending a chunk takes a large part of the
+ * time spent collecting it, as when gRPC flow control or a busy server
+ * is holding back writes, chunks grow so fewer messages are queued; once
+ * sends are quick again, chunks shrink back to keep latency low.
+ *
+ * A CoalescingReader is used for a single stream, and should not be
+ * shared between threads.
+ */
+class CoalescingReader : public AudioReader
+{
+public:
+    /*
+     * Create a reader that collects up to targetBytes of audio from the
+     * given reader, waiting at most maxDelayMs milliseconds to fill a
+     * chunk. The buffer size given to ReadASRAudio() or
+     * ReadTranscribeAudio() should be at least targetBytes. The wrapped
+     * reader is not owned, and must outlive this one.
+     */
+    CoalescingReader(AudioReader *reader, size_t targetBytes,
+                     unsigned int maxDelayMs);
+    ~CoalescingReader();
+
+    /*
+     * Set the chunk size and delay for future reads. A target of zero
+     * passes each chunk through as it was read. The target may be
+     * changed between reads (e.g., to use smaller chunks while waiting
+     * for the user to start speaking).
+     */
+    void setTargetBytes(size_t targetBytes);
+    void setMaxDelay(unsigned int milliseconds);
+
+    /*
+     * Let the target size vary between minBytes and maxBytes with the
+     * load on the stream. The time between returning a chunk and the
+     * next call to readAudio() is taken as the time the caller spent
+     * sending it. If that is more than a quarter of the time spent
+     * collecting the chunk, the target doubles; if it is less than a
+     * sixteenth, the target shrinks by a quarter. A maxBytes of zero
+     * turns adaptation off, leaving the target where it is.
+     */
+    void setAdaptive(size_t minBytes, size_t maxBytes);
+
+    // Returns the current target size.
+    size_t targetBytes() const;
+
+    size_t readAudio(char *buffer, size_t buffSize) override;
+
+    // Returns the number of chunks returned and read from the wrapped
+    // reader so far.
+    size_t chunksOut() const;
+    size_t chunksIn() const;
+
+private:
+    AudioReader *mReader;
+    size_t mTargetBytes;
+    std::chrono::milliseconds mMaxDelay;
+    bool mFinished;
+    size_t mChunksOut;
+    size_t mChunksIn;
+
+    // Adaptive sizing
+    size_t mMinBytes;
+    size_t mMaxBytes;
+    bool mHaveReturned;
+    std::chrono::steady_clock::time_point mReturned;
+    std::chrono::steady_clock::duration mFillTime;
+
+    void adapt(std::chrono::steady_clock::time_point now);
+
+    CoalescingReader(const CoalescingReader &) = delete;
+    CoalescingReader &operator=(const CoalescingReader &) = delete;
+};
+
+} // namespace Diatheke
+
+#endif // DIATHEKE_COALESCING_READER_H
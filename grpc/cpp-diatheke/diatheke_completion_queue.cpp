@@ -0,0 +1,137 @@
+/*
+ * Copyright (2021-present) Cobalt Speech and Language, Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "diatheke_completion_queue.h"
+
+namespace Diatheke
+{
+
+AsyncTag::AsyncTag() {}
+AsyncTag::~AsyncTag() {}
+
+/*
+ * The polling loop keeps its own reference to the queue. This lets the
+ * pool be destroyed from one of its own polling threads (e.g., when the
+ * last object holding the pool is released inside proceed()), in which
+ * case that thread is detached and finishes draining on its own.
+ */
+static void pollQueue(std::shared_ptr<grpc::CompletionQueue> cq)
+{
+    void *tag = nullptr;
+    bool ok = false;
+    while (cq->Next(&tag, &ok))
+    {
+        static_cast<AsyncTag *>(tag)->proceed(ok);
+    }
+}
+
+CompletionQueuePool::CompletionQueuePool(unsigned int threadCount) : mNext(0)
+{
+    if (threadCount == 0)
+    {
+        threadCount = 1;
+    }
+
+    for (unsigned int i = 0; i < threadCount; i++)
+    {
+        std::shared_ptr<grpc::CompletionQueue> cq(new grpc::CompletionQueue);
+        mQueues.push_back(cq);
+        mThreads.push_back(std::thread(pollQueue, cq));
+    }
+}
+
+CompletionQueuePool::~CompletionQueuePool()
+{
+    for (size_t i = 0; i < mQueues.size(); i++)
+    {
+        mQueues[i]->Shutdown();
+    }
+
+    for (size_t i = 0; i < mThreads.size(); i++)
+    {
+        if (mThreads[i].get_id() == std::this_thread::get_id())
+        {
+            mThreads[i].detach();
+        }
+        else
+        {
+            mThreads[i].join();
+        }
+    }
+}
+
+grpc::CompletionQueue *CompletionQueuePool::next()
+{
+    unsigned int idx = mNext.fetch_add(1) % mQueues.size();
+    return mQueues[idx].get();
+}
+
+unsigned int CompletionQueuePool::threadCount() const
+{
+    return static_cast<unsigned int>(mQueues.size());
+}
+
+std::shared_ptr<QueueTimer>
+QueueTimer::start(const std::shared_ptr<CompletionQueuePool> &pool,
+                  std::chrono::steady_clock::time_point deadline,
+                  const Callback &callback)
+{
+    std::shared_ptr<QueueTimer> timer(new QueueTimer(pool, callback));
+    timer->mSelf = timer;
+
+    // gRPC deadlines use the system clock.
+    std::chrono::system_clock::time_point when =
+        std::chrono::system_clock::now() +
+        std::chrono::duration_cast<std::chrono::system_clock::duration>(
+            deadline - std::chrono::steady_clock::now());
+    timer->mAlarm.Set(pool->next(), when, timer.get());
+    return timer;
+}
+
+QueueTimer::QueueTimer(const std::shared_ptr<CompletionQueuePool> &pool,
+                       const Callback &callback)
+    : mPool(pool), mCallback(callback), mCancelled(false)
+{
+}
+
+QueueTimer::~QueueTimer() {}
+
+void QueueTimer::cancel()
+{
+    mCancelled = true;
+    mAlarm.Cancel();
+}
+
+void QueueTimer::proceed(bool ok)
+{
+    if (ok && !mCancelled.load())
+    {
+        mCallback();
+    }
+
+    /*
+     * Drop our references last. Releasing ourselves may destroy this
+     * object, and releasing the pool may shut it down (see pollQueue),
+     * so the locals are destroyed in that order after we return.
+     */
+    mCallback = Callback();
+    std::shared_ptr<CompletionQueuePool> pool;
+    pool.swap(mPool);
+    std::shared_ptr<QueueTimer> self;
+    self.swap(mSelf);
+}
+
+} // namespace Diatheke
@@ -0,0 +1,135 @@
+/*
+ * Copyright (2021-present) Cobalt Speech and Language, Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DIATHEKE_COMPLETION_QUEUE_H
+#define DIATHEKE_COMPLETION_QUEUE_H
+
+#include <grpcpp/alarm.h>
+#include <grpcpp/completion_queue.h>
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace Diatheke
+{
+
+/*
+ * AsyncTag is the base class for objects that are given to gRPC as
+ * the tag of an asynchronous operation. When the operation completes,
+ * the CompletionQueuePool calls proceed() from one of its polling
+ * threads. Implementations should return quickly and must not throw.
+ */
+class AsyncTag
+{
+public:
+    AsyncTag();
+    virtual ~AsyncTag();
+
+    /*
+     * Called when the operation associated with this tag completes.
+     * The ok flag is the value reported by the completion queue.
+     */
+    virtual void proceed(bool ok) = 0;
+};
+
+/*
+ * CompletionQueuePool owns a fixed number of gRPC completion queues,
+ * each serviced by a single polling thread. Asynchronous requests are
+ * spread across the queues so that a small, constant number of threads
+ * can keep any number of requests in flight.
+ */
+class CompletionQueuePool
+{
+public:
+    /*
+     * Create a new pool with the given number of completion queues
+     * (and therefore polling threads). A count of zero is treated as
+     * one.
+     */
+    explicit CompletionQueuePool(unsigned int threadCount);
+
+    /*
+     * Shut down the completion queues and wait for the polling threads
+     * to drain them. Objects with operations in flight should hold a
+     * reference to the pool so that it outlives those operations.
+     */
+    ~CompletionQueuePool();
+
+    // Returns the next completion queue to use, in round-robin order.
+    grpc::CompletionQueue *next();
+
+    // Returns the number of polling threads in the pool.
+    unsigned int threadCount() const;
+
+private:
+    std::vector<std::shared_ptr<grpc::CompletionQueue>> mQueues;
+    std::vector<std::thread> mThreads;
+    std::atomic<unsigned int> mNext;
+
+    CompletionQueuePool(const CompletionQueuePool &) = delete;
+    CompletionQueuePool &operator=(const CompletionQueuePool &) = delete;
+};
+
+/*
+ * QueueTimer calls a function from one of a CompletionQueuePool's
+ * polling threads once a deadline has passed, so that timed work does
+ * not need a thread of its own. The timer keeps itself and the pool
+ * alive until it fires or is cancelled. A pending timer holds up the
+ * pool's shutdown, so owners should cancel it when they are destroyed.
+ */
+class QueueTimer : public AsyncTag
+{
+public:
+    using Callback = std::function<void()>;
+
+    // Start a timer that calls the callback at the given deadline.
+    static std::shared_ptr<QueueTimer>
+    start(const std::shared_ptr<CompletionQueuePool> &pool,
+          std::chrono::steady_clock::time_point deadline,
+          const Callback &callback);
+
+    ~QueueTimer() override;
+
+    /*
+     * Cancel the timer without blocking. The callback is not called if
+     * it has not started yet. It is safe to call this after the timer
+     * has fired.
+     */
+    void cancel();
+
+    void proceed(bool ok) override;
+
+private:
+    grpc::Alarm mAlarm;
+    std::shared_ptr<CompletionQueuePool> mPool;
+    std::shared_ptr<QueueTimer> mSelf;
+    Callback mCallback;
+    std::atomic<bool> mCancelled;
+
+    QueueTimer(const std::shared_ptr<CompletionQueuePool> &pool,
+               const Callback &callback);
+
+    QueueTimer(const QueueTimer &) = delete;
+    QueueTimer &operator=(const QueueTimer &) = delete;
+};
+
+} // namespace Diatheke
+
+#endif // DIATHEKE_COMPLETION_QUEUE_H
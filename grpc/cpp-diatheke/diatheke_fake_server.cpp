@@ -0,0 +1,573 @@
+/*
+ * Copyright (2021-present) Cobalt Speech and Language, Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "diatheke_fake_server.h"
+
+#include "diatheke_client_error.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <mutex>
+#include <random>
+#include <thread>
+
+namespace Diatheke
+{
+
+FakeCallOptions::FakeCallOptions()
+    : latencyMs(0),
+      jitterMs(0),
+      chunkIntervalMs(0),
+      errorRate(0.0),
+      errorCode(grpc::StatusCode::UNAVAILABLE)
+{
+}
+
+FakeServerStats::FakeServerStats()
+    : injectedErrors(0), audioBytesIn(0), ttsBytesOut(0)
+{
+    for (int i = 0; i < RPC_COUNT; i++)
+    {
+        calls[i] = 0;
+    }
+}
+
+/* Private data, which is also the service implementation. */
+class FakeServerPrivate : public cobaltspeech::diatheke::Diatheke::Service
+{
+public:
+    // Guards the configuration, the random numbers and the server.
+    mutable std::mutex lock;
+    std::unique_ptr<grpc::Server> server;
+    std::string address;
+
+    FakeCallOptions callOptions[RPC_COUNT];
+    cobaltspeech::diatheke::VersionResponse version;
+    cobaltspeech::diatheke::ListModelsResponse models;
+    std::vector<std::vector<cobaltspeech::diatheke::ActionData>> script;
+    cobaltspeech::diatheke::ASRResult asrResult;
+    size_t asrResultBytes;
+    std::vector<cobaltspeech::diatheke::TranscribeResult> transcribeResults;
+    size_t transcribeBytes;
+    std::string ttsTone;
+    size_t ttsTotalBytes;
+    size_t ttsChunkBytes;
+    std::mt19937 random;
+
+    std::atomic<uint64_t> calls[RPC_COUNT];
+    std::atomic<uint64_t> injectedErrors;
+    std::atomic<uint64_t> audioBytesIn;
+    std::atomic<uint64_t> ttsBytesOut;
+    std::atomic<uint64_t> nextSession;
+
+    FakeServerPrivate()
+        : asrResultBytes(0),
+          transcribeBytes(32000),
+          ttsTotalBytes(32000),
+          ttsChunkBytes(8000),
+          random(1),
+          nextSession(0)
+    {
+        version.set_diatheke("fake");
+        version.set_chosun("fake");
+        version.set_cubic("fake");
+        version.set_luna("fake");
+
+        cobaltspeech::diatheke::ModelInfo *model = models.add_models();
+        model->set_id("fake");
+        model->set_name("Fake Model");
+        model->set_language("en_US");
+        model->set_asr_sample_rate(16000);
+        model->set_tts_sample_rate(16000);
+
+        script.resize(1);
+        script[0].resize(1);
+        script[0][0].mutable_input();
+
+        asrResult.set_text("fake transcript");
+        asrResult.set_confidence(1.0);
+
+        transcribeResults.resize(1);
+        transcribeResults[0].set_text("fake transcript");
+        transcribeResults[0].set_confidence(1.0);
+
+        // One second of a 440 Hz tone, repeated as needed.
+        ttsTone.resize(32000);
+        for (size_t i = 0; i < 16000; i++)
+        {
+            int16_t sample = static_cast<int16_t>(
+                8000 * std::sin(2 * 3.14159265358979 * 440 * i / 16000));
+            memcpy(&ttsTone[2 * i], &sample, 2);
+        }
+
+        resetStats();
+    }
+
+    void resetStats()
+    {
+        for (int i = 0; i < RPC_COUNT; i++)
+        {
+            calls[i] = 0;
+        }
+        injectedErrors = 0;
+        audioBytesIn = 0;
+        ttsBytesOut = 0;
+    }
+
+    /*
+     * Count a call and get its options. Returns false if the call should
+     * fail with an injected error.
+     */
+    bool begin(FakeRPC rpc, FakeCallOptions *options)
+    {
+        calls[rpc]++;
+        std::lock_guard<std::mutex> guard(lock);
+        *options = callOptions[rpc];
+        if (options->errorRate > 0 &&
+            std::uniform_real_distribution<double>(0, 1)(random) <
+                options->errorRate)
+        {
+            injectedErrors++;
+            return false;
+        }
+        return true;
+    }
+
+    // Sleep for the given delay plus random jitter.
+    void delay(unsigned int ms, const FakeCallOptions &options)
+    {
+        unsigned int jitter = 0;
+        if (options.jitterMs > 0)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            jitter = std::uniform_int_distribution<unsigned int>(
+                0, options.jitterMs)(random);
+        }
+
+        if (ms + jitter > 0)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(ms + jitter));
+        }
+    }
+
+    grpc::Status injectedError(const FakeCallOptions &options)
+    {
+        delay(options.latencyMs, options);
+        return grpc::Status(options.errorCode, "injected error");
+    }
+
+    // Fill in the output for the given turn of a session.
+    void sessionTurn(const std::string &id, const std::string &model,
+                     uint64_t turn, cobaltspeech::diatheke::SessionOutput *output)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        output->mutable_token()->set_id(id);
+        output->mutable_token()->set_data(std::to_string(turn));
+        output->mutable_token()->set_metadata(model);
+
+        const std::vector<cobaltspeech::diatheke::ActionData> &actions =
+            script[turn % script.size()];
+        for (size_t i = 0; i < actions.size(); i++)
+        {
+            *output->add_action_list() = actions[i];
+        }
+    }
+
+    grpc::Status Version(grpc::ServerContext *, const cobaltspeech::diatheke::Empty *,
+                         cobaltspeech::diatheke::VersionResponse *response) override
+    {
+        FakeCallOptions options;
+        if (!begin(RPC_VERSION, &options))
+        {
+            return injectedError(options);
+        }
+
+        delay(options.latencyMs, options);
+        std::lock_guard<std::mutex> guard(lock);
+        *response = version;
+        return grpc::Status::OK;
+    }
+
+    grpc::Status
+    ListModels(grpc::ServerContext *, const cobaltspeech::diatheke::Empty *,
+               cobaltspeech::diatheke::ListModelsResponse *response) override
+    {
+        FakeCallOptions options;
+        if (!begin(RPC_LIST_MODELS, &options))
+        {
+            return injectedError(options);
+        }
+
+        delay(options.latencyMs, options);
+        std::lock_guard<std::mutex> guard(lock);
+        *response = models;
+        return grpc::Status::OK;
+    }
+
+    grpc::Status
+    CreateSession(grpc::ServerContext *,
+                  const cobaltspeech::diatheke::SessionStart *request,
+                  cobaltspeech::diatheke::SessionOutput *response) override
+    {
+        FakeCallOptions options;
+        if (!begin(RPC_CREATE_SESSION, &options))
+        {
+            return injectedError(options);
+        }
+
+        delay(options.latencyMs, options);
+        std::string id = "fake-" + std::to_string(nextSession++);
+        sessionTurn(id, request->model_id(), 0, response);
+        return grpc::Status::OK;
+    }
+
+    grpc::Status DeleteSession(grpc::ServerContext *,
+                               const cobaltspeech::diatheke::TokenData *,
+                               cobaltspeech::diatheke::Empty *) override
+    {
+        FakeCallOptions options;
+        if (!begin(RPC_DELETE_SESSION, &options))
+        {
+            return injectedError(options);
+        }
+
+        delay(options.latencyMs, options);
+        return grpc::Status::OK;
+    }
+
+    grpc::Status
+    UpdateSession(grpc::ServerContext *,
+                  const cobaltspeech::diatheke::SessionInput *request,
+                  cobaltspeech::diatheke::SessionOutput *response) override
+    {
+        FakeCallOptions options;
+        if (!begin(RPC_UPDATE_SESSION, &options))
+        {
+            return injectedError(options);
+        }
+
+        // The token data holds the number of the session's last turn.
+        uint64_t turn = 0;
+        try
+        {
+            turn = std::stoull(request->token().data()) + 1;
+        }
+        catch (const std::exception &)
+        {
+            return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                                "invalid session token");
+        }
+
+        delay(options.latencyMs, options);
+        sessionTurn(request->token().id(), request->token().metadata(), turn,
+                    response);
+        return grpc::Status::OK;
+    }
+
+    grpc::Status StreamASR(grpc::ServerContext *,
+                           grpc::ServerReader<cobaltspeech::diatheke::ASRInput>
+                               *reader,
+                           cobaltspeech::diatheke::ASRResult *response) override
+    {
+        FakeCallOptions options;
+        if (!begin(RPC_STREAM_ASR, &options))
+        {
+            return injectedError(options);
+        }
+
+        size_t afterBytes;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            afterBytes = asrResultBytes;
+            *response = asrResult;
+        }
+
+        cobaltspeech::diatheke::ASRInput input;
+        size_t bytes = 0;
+        while (reader->Read(&input))
+        {
+            bytes += input.audio().size();
+            audioBytesIn += input.audio().size();
+            if (afterBytes > 0 && bytes >= afterBytes)
+            {
+                break;
+            }
+        }
+
+        delay(options.latencyMs, options);
+        return grpc::Status::OK;
+    }
+
+    grpc::Status StreamTTS(
+        grpc::ServerContext *context, const cobaltspeech::diatheke::ReplyAction *,
+        grpc::ServerWriter<cobaltspeech::diatheke::TTSAudio> *writer) override
+    {
+        FakeCallOptions options;
+        if (!begin(RPC_STREAM_TTS, &options))
+        {
+            return injectedError(options);
+        }
+
+        size_t total, chunkSize;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            total = ttsTotalBytes;
+            chunkSize = ttsChunkBytes;
+        }
+
+        delay(options.latencyMs, options);
+        cobaltspeech::diatheke::TTSAudio audio;
+        for (size_t sent = 0; sent < total; sent += chunkSize)
+        {
+            if (context->IsCancelled())
+            {
+                return grpc::Status::CANCELLED;
+            }
+
+            if (sent > 0)
+            {
+                delay(options.chunkIntervalMs, options);
+            }
+
+            // Copy the chunk from the tone, wrapping around its end.
+            size_t size = std::min(chunkSize, total - sent);
+            std::string *data = audio.mutable_audio();
+            data->clear();
+            while (data->size() < size)
+            {
+                size_t offset = (sent + data->size()) % ttsTone.size();
+                data->append(ttsTone, offset,
+                             std::min(size - data->size(), ttsTone.size() - offset));
+            }
+
+            if (!writer->Write(audio))
+            {
+                break;
+            }
+            ttsBytesOut += size;
+        }
+        return grpc::Status::OK;
+    }
+
+    grpc::Status Transcribe(
+        grpc::ServerContext *,
+        grpc::ServerReaderWriter<cobaltspeech::diatheke::TranscribeResult,
+                                 cobaltspeech::diatheke::TranscribeInput>
+            *stream) override
+    {
+        FakeCallOptions options;
+        if (!begin(RPC_TRANSCRIBE, &options))
+        {
+            return injectedError(options);
+        }
+
+        std::vector<cobaltspeech::diatheke::TranscribeResult> results;
+        size_t everyBytes;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            results = transcribeResults;
+            everyBytes = transcribeBytes;
+        }
+
+        cobaltspeech::diatheke::TranscribeInput input;
+        size_t bytes = 0;
+        size_t next = 0;
+        bool first = true;
+        while (stream->Read(&input))
+        {
+            bytes += input.audio().size();
+            audioBytesIn += input.audio().size();
+            while (everyBytes > 0 && !results.empty() &&
+                   bytes >= everyBytes * (next + 1))
+            {
+                delay(first ? options.latencyMs : options.chunkIntervalMs,
+                      options);
+                first = false;
+                stream->Write(results[next % results.size()]);
+                next++;
+            }
+        }
+
+        if (!results.empty())
+        {
+            delay(first ? options.latencyMs : options.chunkIntervalMs, options);
+            stream->Write(results.back());
+        }
+        return grpc::Status::OK;
+    }
+};
+
+FakeServer::FakeServer() : dPtr(std::make_shared<FakeServerPrivate>()) {}
+
+FakeServer::~FakeServer() { shutdown(); }
+
+void FakeServer::start(const std::string &address)
+{
+    std::lock_guard<std::mutex> guard(dPtr->lock);
+    if (dPtr->server)
+    {
+        throw ClientError("fake Diatheke server is already running");
+    }
+
+    grpc::ServerBuilder builder;
+    int port = 0;
+    if (!address.empty())
+    {
+        builder.AddListeningPort(address, grpc::InsecureServerCredentials(),
+                                 &port);
+    }
+    builder.RegisterService(dPtr.get());
+    dPtr->server = builder.BuildAndStart();
+    if (!dPtr->server || (!address.empty() && port == 0))
+    {
+        dPtr->server.reset();
+        throw ClientError("could not start fake Diatheke server");
+    }
+
+    // Replace the requested port (which may be 0) with the real one.
+    dPtr->address.clear();
+    if (!address.empty())
+    {
+        dPtr->address = address.substr(0, address.rfind(':') + 1) +
+                        std::to_string(port);
+    }
+}
+
+void FakeServer::shutdown()
+{
+    std::unique_ptr<grpc::Server> server;
+    {
+        std::lock_guard<std::mutex> guard(dPtr->lock);
+        server.swap(dPtr->server);
+    }
+
+    // Calls in progress need the lock to finish.
+    if (server)
+    {
+        server->Shutdown(std::chrono::system_clock::now());
+        server->Wait();
+    }
+}
+
+std::string FakeServer::address() const
+{
+    std::lock_guard<std::mutex> guard(dPtr->lock);
+    return dPtr->address;
+}
+
+std::shared_ptr<grpc::Channel> FakeServer::inProcessChannel()
+{
+    std::lock_guard<std::mutex> guard(dPtr->lock);
+    if (!dPtr->server)
+    {
+        throw ClientError("fake Diatheke server is not running");
+    }
+    return dPtr->server->InProcessChannel(grpc::ChannelArguments());
+}
+
+void FakeServer::setCallOptions(FakeRPC rpc, const FakeCallOptions &options)
+{
+    std::lock_guard<std::mutex> guard(dPtr->lock);
+    dPtr->callOptions[rpc] = options;
+}
+
+void FakeServer::setCallOptions(const FakeCallOptions &options)
+{
+    std::lock_guard<std::mutex> guard(dPtr->lock);
+    for (int i = 0; i < RPC_COUNT; i++)
+    {
+        dPtr->callOptions[i] = options;
+    }
+}
+
+void FakeServer::setVersion(const cobaltspeech::diatheke::VersionResponse &version)
+{
+    std::lock_guard<std::mutex> guard(dPtr->lock);
+    dPtr->version = version;
+}
+
+void FakeServer::setModels(
+    const std::vector<cobaltspeech::diatheke::ModelInfo> &models)
+{
+    std::lock_guard<std::mutex> guard(dPtr->lock);
+    dPtr->models.clear_models();
+    for (size_t i = 0; i < models.size(); i++)
+    {
+        *dPtr->models.add_models() = models[i];
+    }
+}
+
+void FakeServer::setScript(
+    const std::vector<std::vector<cobaltspeech::diatheke::ActionData>> &turns)
+{
+    if (turns.empty())
+    {
+        throw ClientError("fake Diatheke script has no turns");
+    }
+
+    std::lock_guard<std::mutex> guard(dPtr->lock);
+    dPtr->script = turns;
+}
+
+void FakeServer::setASRResult(const cobaltspeech::diatheke::ASRResult &result,
+                              size_t afterBytes)
+{
+    std::lock_guard<std::mutex> guard(dPtr->lock);
+    dPtr->asrResult = result;
+    dPtr->asrResultBytes = afterBytes;
+}
+
+void FakeServer::setTranscribeResults(
+    const std::vector<cobaltspeech::diatheke::TranscribeResult> &results,
+    size_t everyBytes)
+{
+    std::lock_guard<std::mutex> guard(dPtr->lock);
+    dPtr->transcribeResults = results;
+    dPtr->transcribeBytes = everyBytes;
+}
+
+void FakeServer::setTTSAudio(size_t totalBytes, size_t chunkBytes)
+{
+    std::lock_guard<std::mutex> guard(dPtr->lock);
+    dPtr->ttsTotalBytes = totalBytes;
+    dPtr->ttsChunkBytes = chunkBytes == 0 ? totalBytes : chunkBytes;
+}
+
+void FakeServer::setSeed(unsigned int seed)
+{
+    std::lock_guard<std::mutex> guard(dPtr->lock);
+    dPtr->random.seed(seed);
+}
+
+FakeServerStats FakeServer::stats() const
+{
+    FakeServerStats result;
+    for (int i = 0; i < RPC_COUNT; i++)
+    {
+        result.calls[i] = dPtr->calls[i];
+    }
+    result.injectedErrors = dPtr->injectedErrors;
+    result.audioBytesIn = dPtr->audioBytesIn;
+    result.ttsBytesOut = dPtr->ttsBytesOut;
+    return result;
+}
+
+void FakeServer::resetStats() { dPtr->resetStats(); }
+
+} // namespace Diatheke
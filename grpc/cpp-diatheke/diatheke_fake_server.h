@@ -0,0 +1,188 @@
+/*
+ * Copyright (2021-present) Cobalt Speech and Language, Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DIATHEKE_FAKE_SERVER_H
+#define DIATHEKE_FAKE_SERVER_H
+
+#include "diatheke.grpc.pb.h"
+
+#include <grpcpp/grpcpp.h>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace Diatheke
+{
+
+// The RPCs of the Diatheke service, used to configure a FakeServer.
+enum FakeRPC
+{
+    RPC_VERSION,
+    RPC_LIST_MODELS,
+    RPC_CREATE_SESSION,
+    RPC_DELETE_SESSION,
+    RPC_UPDATE_SESSION,
+    RPC_STREAM_ASR,
+    RPC_STREAM_TTS,
+    RPC_TRANSCRIBE,
+    RPC_COUNT
+};
+
+/*
+ * FakeCallOptions sets the timing and failures of one RPC. Times are
+ * in milliseconds.
+ */
+struct FakeCallOptions
+{
+    /*
+     * Delay before the response of a unary call, the result of an ASR
+     * stream, or the first message of a TTS or Transcribe stream.
+     */
+    unsigned int latencyMs;
+
+    // A random extra delay, up to this long, added to every delay.
+    unsigned int jitterMs;
+
+    // Delay between the messages of a TTS or Transcribe stream.
+    unsigned int chunkIntervalMs;
+
+    // Fraction of calls, from 0 to 1, that fail with errorCode.
+    double errorRate;
+    grpc::StatusCode errorCode;
+
+    FakeCallOptions();
+};
+
+// FakeServerStats counts what a FakeServer has done.
+struct FakeServerStats
+{
+    // Number of calls made to each RPC, indexed by FakeRPC.
+    uint64_t calls[RPC_COUNT];
+
+    // Number of calls that failed because of error injection.
+    uint64_t injectedErrors;
+
+    // Bytes of audio received by ASR and Transcribe streams.
+    uint64_t audioBytesIn;
+
+    // Bytes of audio sent by TTS streams.
+    uint64_t ttsBytesOut;
+
+    FakeServerStats();
+};
+
+class FakeServerPrivate;
+
+/*
+ * FakeServer is an in-process implementation of the Diatheke service,
+ * for testing and measuring clients without a Diatheke deployment. It
+ * returns scripted session actions, canned ASR and Transcribe results,
+ * and synthetic TTS audio (a tone), with configurable latency, jitter,
+ * chunk sizes and error injection for each RPC.
+ *
+ * A Client may connect to it over the network, or through an in-process
+ * channel, which skips the network stack entirely:
+ *
+ *     Diatheke::FakeServer server;
+ *     server.start();
+ *     Diatheke::Client client(server.inProcessChannel());
+ *
+ * The server may be configured while it is running.
+ */
+class FakeServer
+{
+public:
+    FakeServer();
+    ~FakeServer();
+
+    /*
+     * Start the server. If an address is given (e.g., "127.0.0.1:0" to
+     * pick a free port), the server also listens on it. Throws a
+     * ClientError if the server cannot be started.
+     */
+    void start(const std::string &address = "");
+
+    // Stop the server, cancelling calls in progress.
+    void shutdown();
+
+    /*
+     * Returns the address the server listens on, with the chosen port,
+     * or an empty string if it only accepts in-process channels.
+     */
+    std::string address() const;
+
+    // Returns a channel that calls the server without using the network.
+    std::shared_ptr<grpc::Channel> inProcessChannel();
+
+    // Set the timing and failures of one RPC, or of all RPCs.
+    void setCallOptions(FakeRPC rpc, const FakeCallOptions &options);
+    void setCallOptions(const FakeCallOptions &options);
+
+    // Set the responses of the Version and ListModels RPCs.
+    void setVersion(const cobaltspeech::diatheke::VersionResponse &version);
+    void setModels(const std::vector<cobaltspeech::diatheke::ModelInfo> &models);
+
+    /*
+     * Set the actions returned for each turn of a session. CreateSession
+     * returns the first list, and each UpdateSession returns the next,
+     * starting over after the last. The default script waits for user
+     * input every turn.
+     */
+    void setScript(
+        const std::vector<std::vector<cobaltspeech::diatheke::ActionData>> &turns);
+
+    /*
+     * Set the result of ASR streams. The result is returned when the
+     * client finishes sending, or once afterBytes of audio have been
+     * received, if afterBytes is not zero.
+     */
+    void setASRResult(const cobaltspeech::diatheke::ASRResult &result,
+                      size_t afterBytes = 0);
+
+    /*
+     * Set the results of Transcribe streams. One result is sent, in
+     * turn, for every everyBytes of audio received, and the last one is
+     * also sent when the client finishes sending.
+     */
+    void setTranscribeResults(
+        const std::vector<cobaltspeech::diatheke::TranscribeResult> &results,
+        size_t everyBytes);
+
+    /*
+     * Set the amount of audio sent by each TTS stream, and the size of
+     * its messages, in bytes. The default is one second of 16 kHz,
+     * 16-bit audio in 8000 byte messages.
+     */
+    void setTTSAudio(size_t totalBytes, size_t chunkBytes);
+
+    // Seed the random numbers used for jitter and error injection.
+    void setSeed(unsigned int seed);
+
+    FakeServerStats stats() const;
+    void resetStats();
+
+private:
+    std::shared_ptr<FakeServerPrivate> dPtr; // Opaque pointer
+
+    FakeServer(const FakeServer &) = delete;
+    FakeServer &operator=(const FakeServer &) = delete;
+};
+
+} // namespace Diatheke
+
+#endif // DIATHEKE_FAKE_SERVER_H
@@ -0,0 +1,1396 @@
+/*
+ * Copyright (2021-present) Cobalt Speech and Language, Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * diatheke_loadgen simulates many concurrent callers talking to a
+ * Diatheke server. Each caller runs full dialogue turns:
+ *
+ *   CreateSession -> ASR audio at real-time pace -> ProcessASRResult
+ *   -> TTS for each reply -> DeleteSession
+ *
+ * using audio from a corpus of WAV files. The load follows a schedule
+ * of stages, either as a number of concurrent callers (closed loop) or
+ * as a rate of new sessions per second (open loop, with Poisson
+ * arrivals). The latency of each stage is reported as percentiles,
+ * along with error rates.
+ *
+ * Callers do not each have a thread. Their steps run on a small pool
+ * of scheduler threads, and the requests and streams use the client's
+ * asynchronous API, so one machine can run thousands of sessions.
+ */
+
+#include "diatheke_client.h"
+#include "diatheke_client_error.h"
+#include "diatheke_mmap_audio_reader.h"
+#include "diatheke_trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+
+// Set by SIGINT or SIGTERM to end the run early.
+volatile std::sig_atomic_t stopRequested = 0;
+
+void onSignal(int) { stopRequested = 1; }
+
+// Returns the milliseconds from start to end.
+double millisecondsBetween(std::chrono::steady_clock::time_point start,
+                           std::chrono::steady_clock::time_point end)
+{
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+/*
+ * Stages of a session whose latency is measured. A failed request or
+ * stream counts as an error for its stage.
+ */
+enum LatencyStage
+{
+    // The CreateSession request.
+    STAGE_CREATE_SESSION,
+
+    // How late the latest audio chunk of a turn was sent, compared to
+    // real time. This grows if the load generator itself is overloaded.
+    STAGE_AUDIO_LAG,
+
+    // From the end of the audio to the ASR result.
+    STAGE_ASR_RESULT,
+
+    // The ProcessASRResult (i.e., UpdateSession) request.
+    STAGE_PROCESS_ASR_RESULT,
+
+    // From the TTS request to its first and last audio.
+    STAGE_TTS_FIRST_AUDIO,
+    STAGE_TTS_DRAIN,
+
+    // The DeleteSession request.
+    STAGE_DELETE_SESSION,
+
+    // From the end of the audio to the first TTS audio of the reply,
+    // i.e. what the caller would hear as the server's response time.
+    STAGE_TURN,
+
+    STAGE_COUNT
+};
+
+const char *stageNames[STAGE_COUNT] = {
+    "create_session",     "audio_lag",       "asr_result",
+    "process_asr_result", "tts_first_audio", "tts_drain",
+    "delete_session",     "turn"};
+
+/*
+ * One stage of the load schedule. The load changes linearly from the
+ * previous stage's level to this level over the given time, so a stage
+ * with the same level as the one before holds the load steady.
+ */
+struct ScheduleStage
+{
+    double level;
+    double seconds;
+};
+
+/*
+ * Sets level to the load the schedule calls for at the given time.
+ * Returns false once the schedule is over.
+ */
+bool scheduleLevel(const std::vector<ScheduleStage> &schedule,
+                   double elapsed, double *level)
+{
+    double start = 0.0;
+    double from = 0.0;
+    for (size_t i = 0; i < schedule.size(); i++)
+    {
+        const ScheduleStage &stage = schedule[i];
+        if (elapsed < start + stage.seconds)
+        {
+            *level = from + (stage.level - from) * (elapsed - start) / stage.seconds;
+            return true;
+        }
+        start += stage.seconds;
+        from = stage.level;
+    }
+    return false;
+}
+
+struct Options
+{
+    std::vector<std::string> servers;
+    bool tls;
+    std::string model;
+    std::vector<std::string> files;
+
+    // Schedule levels are arrivals per second if openLoop is set, and
+    // concurrent callers otherwise.
+    bool openLoop;
+    std::vector<ScheduleStage> schedule;
+
+    unsigned int turns;
+    unsigned int chunkMs;
+    unsigned int threads;
+    unsigned int channels;
+    unsigned int maxActive;
+    unsigned int reportInterval;
+    unsigned int seed;
+    std::string jsonPath;
+    std::string tracePath;
+
+    Options()
+        : tls(false),
+          openLoop(false),
+          turns(1),
+          chunkMs(20),
+          threads(8),
+          channels(4),
+          maxActive(10000),
+          reportInterval(5),
+          seed(1)
+    {
+    }
+};
+
+// Percentiles and error counts for one stage, in milliseconds.
+struct StageSummary
+{
+    uint64_t count;
+    uint64_t errors;
+    double p50;
+    double p95;
+    double p99;
+    double max;
+
+    StageSummary() : count(0), errors(0), p50(0), p95(0), p99(0), max(0) {}
+
+    double errorRate() const
+    {
+        uint64_t total = count + errors;
+        return total > 0 ? static_cast<double>(errors) / total : 0.0;
+    }
+};
+
+// Collects latencies and errors from all of the callers.
+class Recorder
+{
+public:
+    Recorder() : mErrors() {}
+
+    void record(LatencyStage stage, double milliseconds)
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mSamples[stage].push_back(milliseconds);
+    }
+
+    void error(LatencyStage stage, const std::string &message)
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mErrors[stage]++;
+        mMessages[std::string(stageNames[stage]) + ": " + message]++;
+    }
+
+    StageSummary summary(LatencyStage stage)
+    {
+        std::vector<double> samples;
+        StageSummary summary;
+        {
+            std::lock_guard<std::mutex> lock(mLock);
+            samples = mSamples[stage];
+            summary.errors = mErrors[stage];
+        }
+
+        summary.count = samples.size();
+        if (samples.empty())
+        {
+            return summary;
+        }
+
+        std::sort(samples.begin(), samples.end());
+        summary.p50 = percentile(samples, 50.0);
+        summary.p95 = percentile(samples, 95.0);
+        summary.p99 = percentile(samples, 99.0);
+        summary.max = samples.back();
+        return summary;
+    }
+
+    uint64_t errorCount()
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        uint64_t total = 0;
+        for (int i = 0; i < STAGE_COUNT; i++)
+        {
+            total += mErrors[i];
+        }
+        return total;
+    }
+
+    // Returns how many times each error message was seen.
+    std::map<std::string, uint64_t> errorMessages()
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        return mMessages;
+    }
+
+private:
+    std::mutex mLock;
+    std::vector<double> mSamples[STAGE_COUNT];
+    uint64_t mErrors[STAGE_COUNT];
+    std::map<std::string, uint64_t> mMessages;
+
+    // Nearest-rank percentile of the sorted samples.
+    static double percentile(const std::vector<double> &sorted, double p)
+    {
+        size_t rank = static_cast<size_t>(std::ceil(p / 100.0 * sorted.size()));
+        return sorted[rank > 0 ? rank - 1 : 0];
+    }
+};
+
+/*
+ * Scheduler runs tasks at given times on a fixed pool of threads. Tasks
+ * due at the same time run in the order they were posted.
+ */
+class Scheduler
+{
+public:
+    explicit Scheduler(unsigned int threads) : mStopping(false), mSequence(0)
+    {
+        for (unsigned int i = 0; i < std::max(threads, 1u); i++)
+        {
+            mThreads.push_back(std::thread(&Scheduler::run, this));
+        }
+    }
+
+    // Runs the tasks that are already due, then stops the threads.
+    ~Scheduler()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mLock);
+            mStopping = true;
+        }
+        mCond.notify_all();
+        for (size_t i = 0; i < mThreads.size(); i++)
+        {
+            mThreads[i].join();
+        }
+    }
+
+    void post(std::chrono::steady_clock::time_point when,
+              const std::function<void()> &task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mLock);
+            Task entry = {when, mSequence++, task};
+            mQueue.push(entry);
+        }
+        mCond.notify_one();
+    }
+
+private:
+    struct Task
+    {
+        std::chrono::steady_clock::time_point when;
+        uint64_t sequence;
+        std::function<void()> run;
+
+        // Orders the priority queue so the earliest task is on top.
+        bool operator<(const Task &other) const
+        {
+            if (when != other.when)
+            {
+                return when > other.when;
+            }
+            return sequence > other.sequence;
+        }
+    };
+
+    std::mutex mLock;
+    std::condition_variable mCond;
+    std::priority_queue<Task> mQueue;
+    std::vector<std::thread> mThreads;
+    bool mStopping;
+    uint64_t mSequence;
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mLock);
+        while (true)
+        {
+            if (mQueue.empty())
+            {
+                if (mStopping)
+                {
+                    return;
+                }
+                mCond.wait(lock);
+                continue;
+            }
+
+            std::chrono::steady_clock::time_point when = mQueue.top().when;
+            if (std::chrono::steady_clock::now() < when)
+            {
+                mCond.wait_until(lock, when);
+                continue;
+            }
+
+            Task task = mQueue.top();
+            mQueue.pop();
+            lock.unlock();
+            task.run();
+            lock.lock();
+        }
+    }
+};
+
+class Conversation;
+
+// LoadGenerator starts callers following the schedule and tracks them.
+class LoadGenerator
+{
+public:
+    LoadGenerator(const Options &options, Diatheke::Client &client,
+                  const std::vector<std::string> &corpus,
+                  unsigned int bytesPerSecond);
+
+    // Run the schedule, then wait for the callers in progress to finish.
+    void run();
+
+    void printReport(std::ostream &out);
+    void writeJSON(std::ostream &out);
+
+    // Used by the callers.
+    Diatheke::Client &client() { return *mClient; }
+    Scheduler &scheduler() { return mScheduler; }
+    Recorder &recorder() { return mRecorder; }
+    const Options &options() const { return mOptions; }
+    size_t chunkBytes() const { return mChunkBytes; }
+    std::chrono::microseconds audioOffset(size_t bytes) const;
+    const std::string &nextAudio();
+    void turnDone() { mTurnsDone++; }
+    void conversationDone(bool ok);
+
+private:
+    const Options &mOptions;
+    Diatheke::Client *mClient;
+    const std::vector<std::string> &mCorpus;
+    unsigned int mBytesPerSecond;
+    size_t mChunkBytes;
+    Recorder mRecorder;
+    std::atomic<size_t> mNextAudio;
+
+    std::mutex mLock;
+    std::condition_variable mCond;
+    unsigned int mActive;
+    uint64_t mStarted;
+    uint64_t mCompleted;
+    uint64_t mFailed;
+    uint64_t mRejected;
+    std::atomic<uint64_t> mTurnsDone;
+    double mWallSeconds;
+
+    // Declared last so that its threads stop before the rest is destroyed.
+    Scheduler mScheduler;
+
+    void startConversation();
+    void printProgress(double elapsed);
+};
+
+/*
+ * Conversation is one caller's session. Each step either posts the next
+ * step to the scheduler or starts an asynchronous request whose callback
+ * does, so only one step of a conversation runs at a time.
+ */
+class Conversation : public std::enable_shared_from_this<Conversation>
+{
+public:
+    explicit Conversation(LoadGenerator *generator);
+
+    void start();
+
+private:
+    LoadGenerator *mGen;
+    cobaltspeech::diatheke::SessionOutput mSession;
+    bool mHasSession;
+    bool mFailed;
+    unsigned int mTurns;
+
+    // The current turn's audio and ASR stream.
+    const std::string *mAudio;
+    size_t mAudioPos;
+    double mMaxLag;
+    std::unique_ptr<Diatheke::ASRStream> mASR;
+    std::chrono::steady_clock::time_point mAudioStart;
+    std::chrono::steady_clock::time_point mSpeechEnd;
+    grpc::Status mASRStatus;
+    cobaltspeech::diatheke::ASRResult mASRResult;
+
+    // The replies to the current turn, and the TTS stream for one.
+    std::vector<cobaltspeech::diatheke::ReplyAction> mReplies;
+    size_t mReply;
+    std::unique_ptr<Diatheke::TTSStream> mTTS;
+    grpc::Status mTTSStatus;
+    bool mFirstAudio;
+
+    // When the current request or stream started.
+    std::chrono::steady_clock::time_point mStepStart;
+
+    void startTurn();
+    void tokenSent(bool ok);
+    void sendAudio();
+    void audioSent(bool ok, size_t size);
+    void finishAudio();
+    void processResult();
+    void playReply();
+    void receiveReply();
+    void finishReply();
+    void endTurn();
+    void endSession();
+    void fail(LatencyStage stage, const std::string &message);
+
+    void post(void (Conversation::*step)(),
+              std::chrono::steady_clock::time_point when);
+    void record(LatencyStage stage, std::chrono::steady_clock::time_point since);
+};
+
+LoadGenerator::LoadGenerator(const Options &options, Diatheke::Client &client,
+                             const std::vector<std::string> &corpus,
+                             unsigned int bytesPerSecond)
+    : mOptions(options),
+      mClient(&client),
+      mCorpus(corpus),
+      mBytesPerSecond(bytesPerSecond),
+      mChunkBytes(0),
+      mNextAudio(0),
+      mActive(0),
+      mStarted(0),
+      mCompleted(0),
+      mFailed(0),
+      mRejected(0),
+      mTurnsDone(0),
+      mWallSeconds(0),
+      mScheduler(options.threads)
+{
+    // Whole 16-bit samples, and at least one.
+    mChunkBytes = static_cast<size_t>(bytesPerSecond) * options.chunkMs / 1000;
+    mChunkBytes = std::max<size_t>(mChunkBytes & ~static_cast<size_t>(1), 2);
+}
+
+std::chrono::microseconds LoadGenerator::audioOffset(size_t bytes) const
+{
+    return std::chrono::microseconds(static_cast<uint64_t>(bytes) * 1000000 /
+                                     mBytesPerSecond);
+}
+
+const std::string &LoadGenerator::nextAudio()
+{
+    return mCorpus[mNextAudio++ % mCorpus.size()];
+}
+
+void LoadGenerator::startConversation()
+{
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mActive++;
+        mStarted++;
+    }
+    std::make_shared<Conversation>(this)->start();
+}
+
+void LoadGenerator::conversationDone(bool ok)
+{
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mActive--;
+        if (ok)
+        {
+            mCompleted++;
+        }
+        else
+        {
+            mFailed++;
+        }
+
+        // Notify under the lock, since run() may return once it sees no
+        // active callers.
+        mCond.notify_all();
+    }
+}
+
+void LoadGenerator::run()
+{
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point nextReport =
+        start + std::chrono::seconds(mOptions.reportInterval);
+
+    /*
+     * Open-loop arrivals are a Poisson process whose rate follows the
+     * schedule. Candidates arrive at the schedule's peak rate and are
+     * kept with probability rate / peak (i.e., by thinning).
+     */
+    double peakRate = 0.0;
+    for (size_t i = 0; i < mOptions.schedule.size(); i++)
+    {
+        peakRate = std::max(peakRate, mOptions.schedule[i].level);
+    }
+    std::mt19937 random(mOptions.seed);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    std::exponential_distribution<double> gap(peakRate > 0 ? peakRate : 1.0);
+    std::chrono::steady_clock::time_point nextArrival =
+        start + std::chrono::microseconds(
+                    static_cast<int64_t>(gap(random) * 1000000));
+
+    while (!stopRequested)
+    {
+        std::chrono::steady_clock::time_point now =
+            std::chrono::steady_clock::now();
+        double elapsed = std::chrono::duration<double>(now - start).count();
+        double level;
+        if (!scheduleLevel(mOptions.schedule, elapsed, &level))
+        {
+            break;
+        }
+
+        if (mOptions.openLoop)
+        {
+            while (peakRate > 0 && nextArrival <= now)
+            {
+                double at =
+                    std::chrono::duration<double>(nextArrival - start).count();
+                double rate = 0.0;
+                scheduleLevel(mOptions.schedule, at, &rate);
+                if (uniform(random) * peakRate < rate)
+                {
+                    bool full;
+                    {
+                        std::lock_guard<std::mutex> lock(mLock);
+                        full = mActive >= mOptions.maxActive;
+                        if (full)
+                        {
+                            mRejected++;
+                        }
+                    }
+                    if (!full)
+                    {
+                        startConversation();
+                    }
+                }
+                nextArrival += std::chrono::microseconds(
+                    static_cast<int64_t>(gap(random) * 1000000));
+            }
+        }
+        else
+        {
+            // Callers above the target are not replaced when they finish.
+            unsigned int target = static_cast<unsigned int>(std::lround(level));
+            target = std::min(target, mOptions.maxActive);
+            while (true)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(mLock);
+                    if (mActive >= target)
+                    {
+                        break;
+                    }
+                }
+                startConversation();
+            }
+        }
+
+        if (mOptions.reportInterval > 0 && now >= nextReport)
+        {
+            printProgress(elapsed);
+            nextReport += std::chrono::seconds(mOptions.reportInterval);
+        }
+
+        std::chrono::steady_clock::time_point wake =
+            now + std::chrono::milliseconds(20);
+        if (mOptions.openLoop && peakRate > 0)
+        {
+            wake = std::min(wake, nextArrival);
+        }
+        std::unique_lock<std::mutex> lock(mLock);
+        mCond.wait_until(lock, wake);
+    }
+
+    // Let the callers in progress finish their sessions.
+    std::unique_lock<std::mutex> lock(mLock);
+    while (mActive > 0)
+    {
+        mCond.wait_for(lock, std::chrono::seconds(1));
+        std::chrono::steady_clock::time_point now =
+            std::chrono::steady_clock::now();
+        if (mOptions.reportInterval > 0 && now >= nextReport)
+        {
+            lock.unlock();
+            printProgress(std::chrono::duration<double>(now - start).count());
+            nextReport += std::chrono::seconds(mOptions.reportInterval);
+            lock.lock();
+        }
+    }
+    mWallSeconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+}
+
+void LoadGenerator::printProgress(double elapsed)
+{
+    StageSummary turn = mRecorder.summary(STAGE_TURN);
+    std::lock_guard<std::mutex> lock(mLock);
+    std::fprintf(stderr,
+                 "%7.1fs  active %u  started %llu  completed %llu  failed %llu"
+                 "  rejected %llu  errors %llu  turn p95 %.1f ms\n",
+                 elapsed, mActive, static_cast<unsigned long long>(mStarted),
+                 static_cast<unsigned long long>(mCompleted),
+                 static_cast<unsigned long long>(mFailed),
+                 static_cast<unsigned long long>(mRejected),
+                 static_cast<unsigned long long>(mRecorder.errorCount()),
+                 turn.p95);
+}
+
+void LoadGenerator::printReport(std::ostream &out)
+{
+    char line[256];
+    std::snprintf(line, sizeof(line),
+                  "sessions: %llu started, %llu completed, %llu failed, "
+                  "%llu rejected; %llu turns in %.1f s\n\n",
+                  static_cast<unsigned long long>(mStarted),
+                  static_cast<unsigned long long>(mCompleted),
+                  static_cast<unsigned long long>(mFailed),
+                  static_cast<unsigned long long>(mRejected),
+                  static_cast<unsigned long long>(mTurnsDone.load()),
+                  mWallSeconds);
+    out << line;
+
+    std::snprintf(line, sizeof(line), "%-20s %9s %8s %8s %10s %10s %10s %10s\n",
+                  "stage", "count", "errors", "error%", "p50 ms", "p95 ms",
+                  "p99 ms", "max ms");
+    out << line;
+    for (int i = 0; i < STAGE_COUNT; i++)
+    {
+        StageSummary s = mRecorder.summary(static_cast<LatencyStage>(i));
+        std::snprintf(line, sizeof(line),
+                      "%-20s %9llu %8llu %8.2f %10.1f %10.1f %10.1f %10.1f\n",
+                      stageNames[i], static_cast<unsigned long long>(s.count),
+                      static_cast<unsigned long long>(s.errors),
+                      s.errorRate() * 100.0, s.p50, s.p95, s.p99, s.max);
+        out << line;
+    }
+
+    std::map<std::string, uint64_t> messages = mRecorder.errorMessages();
+    if (!messages.empty())
+    {
+        out << "\nerrors:\n";
+        for (std::map<std::string, uint64_t>::const_iterator it = messages.begin();
+             it != messages.end(); ++it)
+        {
+            out << "  " << it->second << " x " << it->first << "\n";
+        }
+    }
+}
+
+// Returns the string quoted and escaped for JSON.
+std::string jsonString(const std::string &str)
+{
+    std::string out = "\"";
+    for (size_t i = 0; i < str.size(); i++)
+    {
+        char c = str[i];
+        if (c == '"' || c == '\\')
+        {
+            out += '\\';
+            out += c;
+        }
+        else if (static_cast<unsigned char>(c) < 0x20)
+        {
+            char escaped[8];
+            std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out += escaped;
+        }
+        else
+        {
+            out += c;
+        }
+    }
+    return out + "\"";
+}
+
+void LoadGenerator::writeJSON(std::ostream &out)
+{
+    out << "{\"sessions_started\":" << mStarted
+        << ",\"sessions_completed\":" << mCompleted
+        << ",\"sessions_failed\":" << mFailed
+        << ",\"sessions_rejected\":" << mRejected
+        << ",\"turns\":" << mTurnsDone.load()
+        << ",\"wall_seconds\":" << mWallSeconds << ",\"stages\":{";
+    for (int i = 0; i < STAGE_COUNT; i++)
+    {
+        StageSummary s = mRecorder.summary(static_cast<LatencyStage>(i));
+        out << (i > 0 ? "," : "") << "\"" << stageNames[i] << "\":{"
+            << "\"count\":" << s.count << ",\"errors\":" << s.errors
+            << ",\"error_rate\":" << s.errorRate() << ",\"p50_ms\":" << s.p50
+            << ",\"p95_ms\":" << s.p95 << ",\"p99_ms\":" << s.p99
+            << ",\"max_ms\":" << s.max << "}";
+    }
+    out << "},\"errors\":{";
+
+    std::map<std::string, uint64_t> messages = mRecorder.errorMessages();
+    for (std::map<std::string, uint64_t>::const_iterator it = messages.begin();
+         it != messages.end(); ++it)
+    {
+        out << (it != messages.begin() ? "," : "") << jsonString(it->first)
+            << ":" << it->second;
+    }
+    out << "}}\n";
+}
+
+Conversation::Conversation(LoadGenerator *generator)
+    : mGen(generator),
+      mHasSession(false),
+      mFailed(false),
+      mTurns(0),
+      mAudio(nullptr),
+      mAudioPos(0),
+      mMaxLag(0),
+      mReply(0),
+      mFirstAudio(false)
+{
+}
+
+void Conversation::start()
+{
+    std::shared_ptr<Conversation> self = shared_from_this();
+    mStepStart = std::chrono::steady_clock::now();
+    mGen->client().createSessionAsync(
+        mGen->options().model,
+        [self](const grpc::Status &status,
+               cobaltspeech::diatheke::SessionOutput &output) {
+            if (!status.ok())
+            {
+                self->fail(STAGE_CREATE_SESSION,
+                           Diatheke::ClientError(status).what());
+                return;
+            }
+            self->record(STAGE_CREATE_SESSION, self->mStepStart);
+            self->mSession.Swap(&output);
+            self->mHasSession = true;
+            self->post(&Conversation::startTurn,
+                       std::chrono::steady_clock::now());
+        });
+}
+
+void Conversation::startTurn()
+{
+    mAudio = &mGen->nextAudio();
+    mAudioPos = 0;
+    mMaxLag = 0;
+    try
+    {
+        mASR.reset(new Diatheke::ASRStream(
+            mGen->client().newASRStream(mSession.token().id())));
+    }
+    catch (const std::exception &e)
+    {
+        fail(STAGE_ASR_RESULT, e.what());
+        return;
+    }
+
+    // The caller starts talking once the stream has the session token.
+    std::shared_ptr<Conversation> self = shared_from_this();
+    mASR->sendTokenAsync(mSession.token(),
+                         [self](bool ok) { self->tokenSent(ok); });
+}
+
+void Conversation::tokenSent(bool ok)
+{
+    // If the server ends the stream early, it already has a result.
+    if (!ok)
+    {
+        finishAudio();
+        return;
+    }
+
+    // Each chunk is sent once the caller would have finished saying it.
+    mAudioStart = std::chrono::steady_clock::now();
+    size_t size = std::min(mGen->chunkBytes(), mAudio->size());
+    post(&Conversation::sendAudio, mAudioStart + mGen->audioOffset(size));
+}
+
+void Conversation::sendAudio()
+{
+    size_t size = std::min(mGen->chunkBytes(), mAudio->size() - mAudioPos);
+    std::chrono::steady_clock::time_point due =
+        mAudioStart + mGen->audioOffset(mAudioPos + size);
+    mMaxLag = std::max(mMaxLag, millisecondsBetween(
+                                    due, std::chrono::steady_clock::now()));
+
+    // Scheduler threads never wait on the stream, so a slow server does
+    // not hold up other callers' audio.
+    std::shared_ptr<Conversation> self = shared_from_this();
+    mASR->sendAudioAsync(mAudio->data() + mAudioPos, size,
+                         [self, size](bool ok) { self->audioSent(ok, size); });
+}
+
+void Conversation::audioSent(bool ok, size_t size)
+{
+    // If the server ends the stream early, it already has a result.
+    if (!ok)
+    {
+        finishAudio();
+        return;
+    }
+
+    mAudioPos += size;
+    if (mAudioPos < mAudio->size())
+    {
+        size = std::min(mGen->chunkBytes(), mAudio->size() - mAudioPos);
+        post(&Conversation::sendAudio,
+             mAudioStart + mGen->audioOffset(mAudioPos + size));
+        return;
+    }
+    finishAudio();
+}
+
+void Conversation::finishAudio()
+{
+    mGen->recorder().record(STAGE_AUDIO_LAG, std::max(mMaxLag, 0.0));
+    mSpeechEnd = std::chrono::steady_clock::now();
+
+    std::shared_ptr<Conversation> self = shared_from_this();
+    mASR->resultAsync([self](const grpc::Status &status,
+                             cobaltspeech::diatheke::ASRResult &result) {
+        if (status.ok())
+        {
+            self->record(STAGE_ASR_RESULT, self->mSpeechEnd);
+        }
+
+        // Release the stream from a scheduler thread, not its own callback.
+        self->mASRStatus = status;
+        self->mASRResult.Swap(&result);
+        self->post(&Conversation::processResult,
+                   std::chrono::steady_clock::now());
+    });
+}
+
+void Conversation::processResult()
+{
+    mASR.reset();
+    if (!mASRStatus.ok())
+    {
+        fail(STAGE_ASR_RESULT, Diatheke::ClientError(mASRStatus).what());
+        return;
+    }
+
+    std::shared_ptr<Conversation> self = shared_from_this();
+    mStepStart = std::chrono::steady_clock::now();
+    mGen->client().processASRResultAsync(
+        mSession.token(), mASRResult,
+        [self](const grpc::Status &status,
+               cobaltspeech::diatheke::SessionOutput &output) {
+            if (!status.ok())
+            {
+                self->fail(STAGE_PROCESS_ASR_RESULT,
+                           Diatheke::ClientError(status).what());
+                return;
+            }
+            self->record(STAGE_PROCESS_ASR_RESULT, self->mStepStart);
+            self->mSession.Swap(&output);
+
+            self->mReplies.clear();
+            self->mReply = 0;
+            for (int i = 0; i < self->mSession.action_list_size(); i++)
+            {
+                const cobaltspeech::diatheke::ActionData &action =
+                    self->mSession.action_list(i);
+                if (action.has_reply())
+                {
+                    self->mReplies.push_back(action.reply());
+                }
+            }
+            self->post(&Conversation::playReply,
+                       std::chrono::steady_clock::now());
+        });
+}
+
+void Conversation::playReply()
+{
+    if (mReply >= mReplies.size())
+    {
+        endTurn();
+        return;
+    }
+
+    mStepStart = std::chrono::steady_clock::now();
+    mFirstAudio = true;
+    try
+    {
+        mTTS.reset(new Diatheke::TTSStream(
+            mGen->client().newTTSStream(mReplies[mReply])));
+    }
+    catch (const std::exception &e)
+    {
+        fail(STAGE_TTS_DRAIN, e.what());
+        return;
+    }
+    receiveReply();
+}
+
+void Conversation::receiveReply()
+{
+    // The audio is received as fast as the server sends it.
+    std::shared_ptr<Conversation> self = shared_from_this();
+    mTTS->receiveAudioAsync([self](bool hasAudio, std::string &,
+                                   const grpc::Status &status) {
+        if (hasAudio)
+        {
+            if (self->mFirstAudio)
+            {
+                self->mFirstAudio = false;
+                self->record(STAGE_TTS_FIRST_AUDIO, self->mStepStart);
+                if (self->mReply == 0)
+                {
+                    self->record(STAGE_TURN, self->mSpeechEnd);
+                }
+            }
+            self->receiveReply();
+            return;
+        }
+
+        // Release the stream from a scheduler thread, not its own callback.
+        self->mTTSStatus = status;
+        self->post(&Conversation::finishReply,
+                   std::chrono::steady_clock::now());
+    });
+}
+
+void Conversation::finishReply()
+{
+    mTTS.reset();
+    if (!mTTSStatus.ok())
+    {
+        fail(STAGE_TTS_DRAIN, Diatheke::ClientError(mTTSStatus).what());
+        return;
+    }
+    record(STAGE_TTS_DRAIN, mStepStart);
+    mReply++;
+    playReply();
+}
+
+void Conversation::endTurn()
+{
+    mTurns++;
+    mGen->turnDone();
+    if (mTurns < mGen->options().turns)
+    {
+        startTurn();
+        return;
+    }
+    endSession();
+}
+
+void Conversation::endSession()
+{
+    std::shared_ptr<Conversation> self = shared_from_this();
+    if (!mHasSession)
+    {
+        mGen->conversationDone(!mFailed);
+        return;
+    }
+
+    mHasSession = false;
+    mStepStart = std::chrono::steady_clock::now();
+    mGen->client().deleteSessionAsync(
+        mSession.token(), [self](const grpc::Status &status) {
+            if (status.ok())
+            {
+                self->record(STAGE_DELETE_SESSION, self->mStepStart);
+            }
+            else
+            {
+                self->mGen->recorder().error(
+                    STAGE_DELETE_SESSION, Diatheke::ClientError(status).what());
+                self->mFailed = true;
+            }
+            self->mGen->conversationDone(!self->mFailed);
+        });
+}
+
+void Conversation::fail(LatencyStage stage, const std::string &message)
+{
+    mGen->recorder().error(stage, message);
+    mFailed = true;
+    if (mASR)
+    {
+        mASR->cancel();
+        mASR.reset();
+    }
+    if (mTTS)
+    {
+        mTTS->cancel();
+        mTTS.reset();
+    }
+    endSession();
+}
+
+void Conversation::post(void (Conversation::*step)(),
+                        std::chrono::steady_clock::time_point when)
+{
+    mGen->scheduler().post(when, std::bind(step, shared_from_this()));
+}
+
+void Conversation::record(LatencyStage stage,
+                          std::chrono::steady_clock::time_point since)
+{
+    mGen->recorder().record(
+        stage, millisecondsBetween(since, std::chrono::steady_clock::now()));
+}
+
+void printUsage(const char *program)
+{
+    std::fprintf(
+        stderr,
+        "Usage: %s --server <url> --model <id> [options] <file.wav>...\n"
+        "\n"
+        "Runs dialogue turns for many concurrent callers, using 16-bit mono\n"
+        "WAV files at the model's ASR sample rate as the callers' speech.\n"
+        "\n"
+        "Connection:\n"
+        "  --server <url>         Diatheke server (may be repeated, or a\n"
+        "                         comma-separated list, to balance servers)\n"
+        "  --tls                  Connect with TLS\n"
+        "  --model <id>           Diatheke model to create sessions with\n"
+        "  --channels <n>         Connections per server (default 4)\n"
+        "  --threads <n>          Threads for callers and for the client's\n"
+        "                         streams (default 8)\n"
+        "\n"
+        "Load (closed loop by default):\n"
+        "  --callers <n>          Concurrent callers (default 1)\n"
+        "  --rate <n>             Open loop: new sessions per second\n"
+        "  --ramp-up <s>          Ramp up linearly to the load (default 0)\n"
+        "  --duration <s>         Hold the load after ramp-up (default 60)\n"
+        "  --stage <level>:<s>    Instead of the above, ramp to callers (or\n"
+        "                         sessions per second with --open-loop) over\n"
+        "                         s seconds; may be repeated\n"
+        "  --open-loop            Treat stage levels as arrival rates\n"
+        "  --max-active <n>       Most sessions at once; open-loop arrivals\n"
+        "                         beyond it are rejected (default 10000)\n"
+        "\n"
+        "Sessions:\n"
+        "  --turns <n>            Turns per session (default 1)\n"
+        "  --chunk-ms <ms>        Audio sent per ASR message (default 20)\n"
+        "\n"
+        "Output:\n"
+        "  --report-interval <s>  Progress report interval, 0 for none\n"
+        "                         (default 5)\n"
+        "  --json <file>          Write the final report as JSON\n"
+        "  --trace <file>         Record the traffic for diatheke_replay\n"
+        "  --seed <n>             Seed for open-loop arrivals (default 1)\n",
+        program);
+}
+
+// Splits a comma-separated list, skipping empty items.
+void appendList(const std::string &list, std::vector<std::string> *items)
+{
+    size_t start = 0;
+    while (start <= list.size())
+    {
+        size_t end = list.find(',', start);
+        if (end == std::string::npos)
+        {
+            end = list.size();
+        }
+        if (end > start)
+        {
+            items->push_back(list.substr(start, end - start));
+        }
+        start = end + 1;
+    }
+}
+
+// Parses the command line into options. Returns false if it is invalid.
+bool parseArgs(int argc, char *argv[], Options *opts)
+{
+    double callers = 1.0;
+    double rate = -1.0;
+    double rampUp = 0.0;
+    double duration = 60.0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg.compare(0, 2, "--") != 0)
+        {
+            opts->files.push_back(arg);
+            continue;
+        }
+
+        if (arg == "--tls")
+        {
+            opts->tls = true;
+            continue;
+        }
+        if (arg == "--open-loop")
+        {
+            opts->openLoop = true;
+            continue;
+        }
+        if (arg == "--help")
+        {
+            return false;
+        }
+
+        if (i + 1 >= argc)
+        {
+            std::fprintf(stderr, "missing value for %s\n", arg.c_str());
+            return false;
+        }
+        std::string value = argv[++i];
+
+        if (arg == "--server")
+        {
+            appendList(value, &opts->servers);
+        }
+        else if (arg == "--model")
+        {
+            opts->model = value;
+        }
+        else if (arg == "--callers")
+        {
+            callers = std::atof(value.c_str());
+        }
+        else if (arg == "--rate")
+        {
+            rate = std::atof(value.c_str());
+            opts->openLoop = true;
+        }
+        else if (arg == "--ramp-up")
+        {
+            rampUp = std::atof(value.c_str());
+        }
+        else if (arg == "--duration")
+        {
+            duration = std::atof(value.c_str());
+        }
+        else if (arg == "--stage")
+        {
+            size_t colon = value.find(':');
+            if (colon == std::string::npos)
+            {
+                std::fprintf(stderr, "invalid stage: %s\n", value.c_str());
+                return false;
+            }
+            ScheduleStage stage = {std::atof(value.substr(0, colon).c_str()),
+                                   std::atof(value.substr(colon + 1).c_str())};
+            opts->schedule.push_back(stage);
+        }
+        else if (arg == "--max-active")
+        {
+            opts->maxActive = std::strtoul(value.c_str(), nullptr, 10);
+        }
+        else if (arg == "--turns")
+        {
+            opts->turns = std::strtoul(value.c_str(), nullptr, 10);
+        }
+        else if (arg == "--chunk-ms")
+        {
+            opts->chunkMs = std::strtoul(value.c_str(), nullptr, 10);
+        }
+        else if (arg == "--threads")
+        {
+            opts->threads = std::strtoul(value.c_str(), nullptr, 10);
+        }
+        else if (arg == "--channels")
+        {
+            opts->channels = std::strtoul(value.c_str(), nullptr, 10);
+        }
+        else if (arg == "--report-interval")
+        {
+            opts->reportInterval = std::strtoul(value.c_str(), nullptr, 10);
+        }
+        else if (arg == "--seed")
+        {
+            opts->seed = std::strtoul(value.c_str(), nullptr, 10);
+        }
+        else if (arg == "--json")
+        {
+            opts->jsonPath = value;
+        }
+        else if (arg == "--trace")
+        {
+            opts->tracePath = value;
+        }
+        else
+        {
+            std::fprintf(stderr, "unknown option: %s\n", arg.c_str());
+            return false;
+        }
+    }
+
+    if (opts->schedule.empty())
+    {
+        double level = rate >= 0 ? rate : callers;
+        ScheduleStage ramp = {level, rampUp};
+        ScheduleStage hold = {level, duration};
+        opts->schedule.push_back(ramp);
+        opts->schedule.push_back(hold);
+    }
+
+    for (size_t i = 0; i < opts->schedule.size(); i++)
+    {
+        if (opts->schedule[i].level < 0 || opts->schedule[i].seconds < 0)
+        {
+            std::fprintf(stderr, "stage levels and times must not be negative\n");
+            return false;
+        }
+    }
+
+    if (opts->servers.empty() || opts->model.empty() || opts->files.empty())
+    {
+        std::fprintf(stderr, "a server, model and audio files are required\n");
+        return false;
+    }
+    if (opts->turns == 0 || opts->chunkMs == 0 || opts->threads == 0 ||
+        opts->channels == 0)
+    {
+        std::fprintf(stderr,
+                     "turns, chunk size, threads and channels must be positive\n");
+        return false;
+    }
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    Options opts;
+    if (!parseArgs(argc, argv, &opts))
+    {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    try
+    {
+        std::unique_ptr<Diatheke::Client> client;
+        if (opts.tls)
+        {
+            grpc::SslCredentialsOptions ssl;
+            client.reset(new Diatheke::Client(opts.servers, ssl));
+        }
+        else
+        {
+            client.reset(new Diatheke::Client(opts.servers));
+        }
+        client->setAsyncThreadCount(opts.threads);
+        client->setChannelCount(opts.channels);
+        if (!opts.tracePath.empty())
+        {
+            client->setTrace(
+                std::make_shared<Diatheke::TraceWriter>(opts.tracePath));
+        }
+
+        // Find the model, so the audio can be checked against it.
+        cobaltspeech::diatheke::ListModelsResponse models = client->listModels();
+        const cobaltspeech::diatheke::ModelInfo *model = nullptr;
+        for (int i = 0; i < models.models_size(); i++)
+        {
+            if (models.models(i).id() == opts.model)
+            {
+                model = &models.models(i);
+            }
+        }
+        if (model == nullptr)
+        {
+            std::fprintf(stderr, "model %s not found\n", opts.model.c_str());
+            return 1;
+        }
+        if (model->asr_sample_rate() == 0)
+        {
+            std::fprintf(stderr, "model %s does not have ASR\n",
+                         opts.model.c_str());
+            return 1;
+        }
+
+        // Load the corpus into memory so callers do not wait on the disk.
+        std::vector<std::string> corpus;
+        for (size_t i = 0; i < opts.files.size(); i++)
+        {
+            Diatheke::MmapAudioReader reader(opts.files[i]);
+            reader.validate(*model);
+            std::string audio(reader.audioSize(), '\0');
+            size_t size = 0;
+            while (size < audio.size())
+            {
+                size_t count = reader.readAudio(&audio[size], audio.size() - size);
+                if (count == 0)
+                {
+                    break;
+                }
+                size += count;
+            }
+            audio.resize(size);
+            if (audio.empty())
+            {
+                std::fprintf(stderr, "%s has no audio\n", opts.files[i].c_str());
+                return 1;
+            }
+            corpus.push_back(audio);
+        }
+
+        std::signal(SIGINT, onSignal);
+        std::signal(SIGTERM, onSignal);
+
+        LoadGenerator generator(opts, *client, corpus,
+                                model->asr_sample_rate() * 2);
+        generator.run();
+        generator.printReport(std::cout);
+
+        if (!opts.jsonPath.empty())
+        {
+            std::ofstream json(opts.jsonPath.c_str());
+            generator.writeJSON(json);
+            if (!json)
+            {
+                std::fprintf(stderr, "failed to write %s\n",
+                             opts.jsonPath.c_str());
+                return 1;
+            }
+        }
+    }
+    catch (const std::exception &e)
+    {
+        std::fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,155 @@
+/*
+ * Copyright (2021-present) Cobalt Speech and Language, Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "diatheke_mapped_file.h"
+
+#include "diatheke_client_error.h"
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace Diatheke
+{
+
+#ifdef _WIN32
+
+MappedFile::MappedFile(const std::string &path)
+    : mData(nullptr), mSize(0), mFile(INVALID_HANDLE_VALUE), mMapping(nullptr)
+{
+    mFile = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (mFile == INVALID_HANDLE_VALUE)
+    {
+        throw ClientError("could not open file " + path);
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(mFile, &size))
+    {
+        CloseHandle(mFile);
+        throw ClientError("could not get the size of file " + path);
+    }
+
+    mSize = static_cast<size_t>(size.QuadPart);
+    if (mSize == 0)
+    {
+        // Empty files cannot be mapped.
+        return;
+    }
+
+    mMapping = CreateFileMappingA(mFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mMapping == nullptr)
+    {
+        CloseHandle(mFile);
+        throw ClientError("could not map file " + path);
+    }
+
+    mData = static_cast<const char *>(
+        MapViewOfFile(mMapping, FILE_MAP_READ, 0, 0, 0));
+    if (mData == nullptr)
+    {
+        CloseHandle(mMapping);
+        CloseHandle(mFile);
+        throw ClientError("could not map file " + path);
+    }
+}
+
+MappedFile::~MappedFile()
+{
+    if (mData != nullptr)
+    {
+        UnmapViewOfFile(mData);
+    }
+
+    if (mMapping != nullptr)
+    {
+        CloseHandle(mMapping);
+    }
+
+    CloseHandle(mFile);
+}
+
+#else
+
+MappedFile::MappedFile(const std::string &path) : mData(nullptr), mSize(0)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        throw ClientError("could not open file " + path);
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0)
+    {
+        close(fd);
+        throw ClientError("could not get the size of file " + path);
+    }
+
+    mSize = static_cast<size_t>(info.st_size);
+    if (mSize == 0)
+    {
+        // Empty files cannot be mapped.
+        close(fd);
+        return;
+    }
+
+    // The mapping stays valid after the file is closed.
+    void *data = mmap(nullptr, mSize, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        throw ClientError("could not map file " + path);
+    }
+
+    mData = static_cast<const char *>(data);
+}
+
+MappedFile::~MappedFile()
+{
+    if (mData != nullptr)
+    {
+        munmap(const_cast<char *>(mData), mSize);
+    }
+}
+
+#endif
+
+void MappedFile::adviseSequential()
+{
+#ifndef _WIN32
+    if (mData != nullptr)
+    {
+        // Failure only means the hint is ignored.
+        madvise(const_cast<char *>(mData), mSize, MADV_SEQUENTIAL);
+    }
+#endif
+}
+
+const char *MappedFile::data() const { return mData; }
+
+size_t MappedFile::size() const { return mSize; }
+
+} // namespace Diatheke
@@ -0,0 +1,71 @@
+/*
+ * Copyright (2021-present) Cobalt Speech and Language, Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DIATHEKE_MAPPED_FILE_H
+#define DIATHEKE_MAPPED_FILE_H
+
+#include <cstddef>
+#include <string>
+
+namespace Diatheke
+{
+
+/*
+ * MappedFile maps the contents of a file into memory for reading. The
+ * operating system pages the data in as it is used, so large files can
+ * be read without copying them into the heap. The mapping is removed
+ * when the object is destroyed.
+ */
+class MappedFile
+{
+public:
+    /*
+     * Map the whole file at the given path as read-only. Throws a
+     * ClientError if the file cannot be opened or mapped.
+     */
+    explicit MappedFile(const std::string &path);
+    ~MappedFile();
+
+    // Returns the mapped data, which is null if the file is empty.
+    const char *data() const;
+
+    // Returns the size of the file in bytes.
+    size_t size() const;
+
+    /*
+     * Tell the operating system that the data will be read once from
+     * start to end, so it can read ahead more aggressively and drop
+     * pages behind the reader sooner. This is only a hint, and does
+     * nothing on Windows.
+     */
+    void adviseSequential();
+
+private:
+    const char *mData;
+    size_t mSize;
+
+#ifdef _WIN32
+    void *mFile;
+    void *mMapping;
+#endif
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+};
+
+} // namespace Diatheke
+
+#endif // DIATHEKE_MAPPED_FILE_H
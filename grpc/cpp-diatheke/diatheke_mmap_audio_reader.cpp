@@ -0,0 +1,219 @@
+/*
+ * Copyright (2021-present) Cobalt Speech and Language, Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "diatheke_mmap_audio_reader.h"
+
+#include "diatheke_client_error.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace Diatheke
+{
+
+// WAV format tags.
+static const uint16_t wavePCM = 1;
+static const uint16_t waveFloat = 3;
+static const uint16_t waveExtensible = 0xFFFE;
+
+// Read little-endian integers from a byte buffer.
+static uint16_t readU16(const char *data)
+{
+    const unsigned char *b = reinterpret_cast<const unsigned char *>(data);
+    return static_cast<uint16_t>(b[0] | (b[1] << 8));
+}
+
+static uint32_t readU32(const char *data)
+{
+    const unsigned char *b = reinterpret_cast<const unsigned char *>(data);
+    return static_cast<uint32_t>(b[0]) | (static_cast<uint32_t>(b[1]) << 8) |
+           (static_cast<uint32_t>(b[2]) << 16) |
+           (static_cast<uint32_t>(b[3]) << 24);
+}
+
+MmapAudioReader::MmapAudioReader(const std::string &path)
+    : mFile(path),
+      mPath(path),
+      mSampleRate(0),
+      mFormat(SAMPLE_INT16),
+      mChannels(0),
+      mAudio(nullptr),
+      mSize(0),
+      mPos(0)
+{
+    parseWAV();
+    mFile.adviseSequential();
+}
+
+MmapAudioReader::MmapAudioReader(const std::string &path,
+                                 unsigned int sampleRate, SampleFormat format,
+                                 unsigned int channels)
+    : mFile(path),
+      mPath(path),
+      mSampleRate(sampleRate),
+      mFormat(format),
+      mChannels(channels),
+      mAudio(mFile.data()),
+      mSize(mFile.size()),
+      mPos(0)
+{
+    if (channels == 0)
+    {
+        throw ClientError("audio channel count is zero");
+    }
+
+    // Ignore a partial frame at the end.
+    size_t frameBytes = SampleSize(format) * channels;
+    mSize -= mSize % frameBytes;
+    mFile.adviseSequential();
+}
+
+MmapAudioReader::~MmapAudioReader() {}
+
+unsigned int MmapAudioReader::sampleRate() const { return mSampleRate; }
+
+SampleFormat MmapAudioReader::format() const { return mFormat; }
+
+unsigned int MmapAudioReader::channels() const { return mChannels; }
+
+size_t MmapAudioReader::audioSize() const { return mSize; }
+
+double MmapAudioReader::duration() const
+{
+    size_t bytesPerSecond = SampleSize(mFormat) * mChannels * mSampleRate;
+    return bytesPerSecond == 0 ? 0.0
+                               : static_cast<double>(mSize) / bytesPerSecond;
+}
+
+void MmapAudioReader::validate(
+    const cobaltspeech::diatheke::ModelInfo &model) const
+{
+    if (mFormat != SAMPLE_INT16 || mChannels != 1)
+    {
+        throw ClientError(mPath + " is not 16-bit mono audio");
+    }
+
+    if (mSampleRate != model.asr_sample_rate())
+    {
+        throw ClientError(mPath + " has sample rate " +
+                          std::to_string(mSampleRate) + ", but model " +
+                          model.id() + " expects " +
+                          std::to_string(model.asr_sample_rate()));
+    }
+}
+
+size_t MmapAudioReader::nextChunk(const char **data, size_t maxBytes)
+{
+    size_t frameBytes = SampleSize(mFormat) * mChannels;
+    size_t count = std::min(maxBytes - maxBytes % frameBytes, mSize - mPos);
+    if (count == 0)
+    {
+        count = std::min(frameBytes, mSize - mPos);
+    }
+
+    *data = mAudio + mPos;
+    mPos += count;
+    return count;
+}
+
+size_t MmapAudioReader::readAudio(char *buffer, size_t buffSize)
+{
+    // Unlike nextChunk(), this does not need to keep frames whole.
+    size_t count = std::min(buffSize, mSize - mPos);
+    if (count > 0)
+    {
+        memcpy(buffer, mAudio + mPos, count);
+        mPos += count;
+    }
+    return count;
+}
+
+void MmapAudioReader::rewind() { mPos = 0; }
+
+void MmapAudioReader::parseWAV()
+{
+    const char *data = mFile.data();
+    size_t size = mFile.size();
+    if (size < 12 || memcmp(data, "RIFF", 4) != 0 ||
+        memcmp(data + 8, "WAVE", 4) != 0)
+    {
+        throw ClientError(mPath + " is not a WAV file");
+    }
+
+    // Walk the chunks, which are padded to an even size.
+    uint16_t tag = 0;
+    uint16_t bits = 0;
+    size_t pos = 12;
+    while (pos + 8 <= size)
+    {
+        const char *chunk = data + pos;
+        size_t chunkSize = readU32(chunk + 4);
+        size_t body = pos + 8;
+        if (memcmp(chunk, "fmt ", 4) == 0 && chunkSize >= 16 &&
+            body + 16 <= size)
+        {
+            tag = readU16(data + body);
+            mChannels = readU16(data + body + 2);
+            mSampleRate = readU32(data + body + 4);
+            bits = readU16(data + body + 14);
+
+            // The real tag is the start of the sub-format GUID.
+            if (tag == waveExtensible && chunkSize >= 40 && body + 26 <= size)
+            {
+                tag = readU16(data + body + 24);
+            }
+        }
+        else if (memcmp(chunk, "data", 4) == 0)
+        {
+            // Streamed files may not have the real size in the header.
+            mAudio = data + body;
+            mSize = std::min(chunkSize, size - body);
+            break;
+        }
+        pos = body + chunkSize + (chunkSize & 1);
+    }
+
+    if (mAudio == nullptr || mChannels == 0 || mSampleRate == 0)
+    {
+        throw ClientError(mPath + " is missing its WAV format or data");
+    }
+
+    if (tag == wavePCM && bits == 16)
+    {
+        mFormat = SAMPLE_INT16;
+    }
+    else if (tag == wavePCM && bits == 24)
+    {
+        mFormat = SAMPLE_INT24;
+    }
+    else if (tag == wavePCM && bits == 32)
+    {
+        mFormat = SAMPLE_INT32;
+    }
+    else if (tag == waveFloat && bits == 32)
+    {
+        mFormat = SAMPLE_FLOAT32;
+    }
+    else
+    {
+        throw ClientError(mPath + " has an unsupported WAV sample format");
+    }
+
+    size_t frameBytes = SampleSize(mFormat) * mChannels;
+    mSize -= mSize % frameBytes;
+}
+
+} // namespace Diatheke
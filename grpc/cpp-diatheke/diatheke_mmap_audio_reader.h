@@ -0,0 +1,106 @@
+/*
+ * Copyright (2021-present) Cobalt Speech and Language, Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DIATHEKE_MMAP_AUDIO_READER_H
+#define DIATHEKE_MMAP_AUDIO_READER_H
+
+#include "diatheke.grpc.pb.h"
+#include "diatheke_audio_helpers.h"
+#include "diatheke_mapped_file.h"
+#include "diatheke_pcm_convert.h"
+
+#include <string>
+
+namespace Diatheke
+{
+
+/*
+ * MmapAudioReader is an AudioReader for WAV or raw PCM files that maps
+ * the file into memory instead of reading it. The mapping is marked for
+ * sequential access, so large files are paged in ahead of the reader
+ * and do not stay in memory once read.
+ *
+ * readAudio() copies from the mapping into the caller's buffer. To skip
+ * even that copy, use nextChunk() to get a pointer into the mapping and
+ * pass it to ASRStream::sendAudio() or TranscribeStream::sendAudio().
+ */
+class MmapAudioReader : public AudioReader
+{
+public:
+    /*
+     * Map the WAV file at the given path, taking the audio format from
+     * its header. Throws a ClientError if the file cannot be mapped or
+     * is not a PCM or float WAV file.
+     */
+    explicit MmapAudioReader(const std::string &path);
+
+    /*
+     * Map a raw PCM file (i.e., one without a header) with the given
+     * format.
+     */
+    MmapAudioReader(const std::string &path, unsigned int sampleRate,
+                    SampleFormat format = SAMPLE_INT16,
+                    unsigned int channels = 1);
+    ~MmapAudioReader();
+
+    unsigned int sampleRate() const;
+    SampleFormat format() const;
+    unsigned int channels() const;
+
+    // Returns the size in bytes of the audio, and its length in seconds.
+    size_t audioSize() const;
+    double duration() const;
+
+    /*
+     * Throw a ClientError if the audio cannot be sent as is to the given
+     * model's ASR, i.e. it is not 16-bit mono audio at the model's ASR
+     * sample rate. Other audio may be converted first using a
+     * PCMConvertingReader and a ResamplingReader.
+     */
+    void validate(const cobaltspeech::diatheke::ModelInfo &model) const;
+
+    /*
+     * Set data to point at the next chunk of audio in the mapping, and
+     * return its size. The chunk holds whole frames, up to maxBytes
+     * (but at least one frame). Returns zero at the end of the audio.
+     * The data stays valid for the life of the reader.
+     */
+    size_t nextChunk(const char **data, size_t maxBytes);
+
+    size_t readAudio(char *buffer, size_t buffSize) override;
+
+    // Start reading from the beginning of the audio again.
+    void rewind();
+
+private:
+    MappedFile mFile;
+    std::string mPath;
+    unsigned int mSampleRate;
+    SampleFormat mFormat;
+    unsigned int mChannels;
+    const char *mAudio;
+    size_t mSize;
+    size_t mPos;
+
+    void parseWAV();
+
+    MmapAudioReader(const MmapAudioReader &) = delete;
+    MmapAudioReader &operator=(const MmapAudioReader &) = delete;
+};
+
+} // namespace Diatheke
+
+#endif // DIATHEKE_MMAP_AUDIO_READER_H
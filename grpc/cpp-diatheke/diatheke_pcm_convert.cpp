@@ -0,0 +1,484 @@
+/*
+ * Copyright (2021-present) Cobalt Speech and Language, Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "diatheke_pcm_convert.h"
+
+#include "diatheke_client_error.h"
+#include "diatheke_simd.h"
+
+#include <cmath>
+#include <cstring>
+
+namespace Diatheke
+{
+
+void ConvertFloatToInt16(const float *input, int16_t *output, size_t count)
+{
+    size_t i = 0;
+
+    /*
+     * Clamp before converting, since out of range values convert to the
+     * most negative integer. Max comes first so that NaN is replaced by
+     * the lower limit, as in the scalar version.
+     */
+#if defined(DIATHEKE_SIMD_AVX2)
+    const __m256 scale = _mm256_set1_ps(32768.0f);
+    const __m256 lo = _mm256_set1_ps(-32768.0f);
+    const __m256 hi = _mm256_set1_ps(32767.0f);
+    for (; i + 16 <= count; i += 16)
+    {
+        __m256 a = _mm256_mul_ps(_mm256_loadu_ps(input + i), scale);
+        __m256 b = _mm256_mul_ps(_mm256_loadu_ps(input + i + 8), scale);
+        a = _mm256_min_ps(_mm256_max_ps(a, lo), hi);
+        b = _mm256_min_ps(_mm256_max_ps(b, lo), hi);
+        __m256i packed = _mm256_packs_epi32(_mm256_cvtps_epi32(a),
+                                            _mm256_cvtps_epi32(b));
+
+        // Packing works within 128-bit lanes, so put them back in order.
+        packed = _mm256_permute4x64_epi64(packed, 0xD8);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(output + i), packed);
+    }
+#elif defined(DIATHEKE_SIMD_SSE2)
+    const __m128 scale = _mm_set1_ps(32768.0f);
+    const __m128 lo = _mm_set1_ps(-32768.0f);
+    const __m128 hi = _mm_set1_ps(32767.0f);
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128 a = _mm_mul_ps(_mm_loadu_ps(input + i), scale);
+        __m128 b = _mm_mul_ps(_mm_loadu_ps(input + i + 4), scale);
+        a = _mm_min_ps(_mm_max_ps(a, lo), hi);
+        b = _mm_min_ps(_mm_max_ps(b, lo), hi);
+        __m128i packed = _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(output + i), packed);
+    }
+#elif defined(DIATHEKE_SIMD_NEON) && defined(__aarch64__)
+    const float32x4_t lo = vdupq_n_f32(-32768.0f);
+    const float32x4_t hi = vdupq_n_f32(32767.0f);
+    for (; i + 8 <= count; i += 8)
+    {
+        float32x4_t a = vmulq_n_f32(vld1q_f32(input + i), 32768.0f);
+        float32x4_t b = vmulq_n_f32(vld1q_f32(input + i + 4), 32768.0f);
+        a = vminq_f32(vmaxnmq_f32(a, lo), hi);
+        b = vminq_f32(vmaxnmq_f32(b, lo), hi);
+        vst1q_s16(output + i, vcombine_s16(vqmovn_s32(vcvtnq_s32_f32(a)),
+                                           vqmovn_s32(vcvtnq_s32_f32(b))));
+    }
+#endif
+
+    for (; i < count; i++)
+    {
+        float value = input[i] * 32768.0f;
+        if (value >= 32767.0f)
+        {
+            output[i] = 32767;
+        }
+        else if (value > -32768.0f)
+        {
+            output[i] = static_cast<int16_t>(std::lrint(value));
+        }
+        else
+        {
+            output[i] = -32768;
+        }
+    }
+}
+
+void ConvertInt16ToFloat(const int16_t *input, float *output, size_t count)
+{
+    const float scale = 1.0f / 32768.0f;
+    size_t i = 0;
+
+#if defined(DIATHEKE_SIMD_AVX2)
+    const __m256 vscale = _mm256_set1_ps(scale);
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(input + i));
+        __m256 f = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(v));
+        _mm256_storeu_ps(output + i, _mm256_mul_ps(f, vscale));
+    }
+#elif defined(DIATHEKE_SIMD_SSE2)
+    const __m128 vscale = _mm_set1_ps(scale);
+    for (; i + 8 <= count; i += 8)
+    {
+        // Sign extend by unpacking into the high halves, then shifting.
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(input + i));
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+        _mm_storeu_ps(output + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), vscale));
+        _mm_storeu_ps(output + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), vscale));
+    }
+#elif defined(DIATHEKE_SIMD_NEON)
+    for (; i + 8 <= count; i += 8)
+    {
+        int16x8_t v = vld1q_s16(input + i);
+        float32x4_t lo = vcvtq_f32_s32(vmovl_s16(vget_low_s16(v)));
+        float32x4_t hi = vcvtq_f32_s32(vmovl_s16(vget_high_s16(v)));
+        vst1q_f32(output + i, vmulq_n_f32(lo, scale));
+        vst1q_f32(output + i + 4, vmulq_n_f32(hi, scale));
+    }
+#endif
+
+    for (; i < count; i++)
+    {
+        output[i] = input[i] * scale;
+    }
+}
+
+void ConvertInt32ToInt16(const int32_t *input, int16_t *output, size_t count)
+{
+    size_t i = 0;
+
+#if defined(DIATHEKE_SIMD_AVX2)
+    for (; i + 16 <= count; i += 16)
+    {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(input + i));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(input + i + 8));
+        __m256i packed = _mm256_packs_epi32(_mm256_srai_epi32(a, 16),
+                                            _mm256_srai_epi32(b, 16));
+        packed = _mm256_permute4x64_epi64(packed, 0xD8);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(output + i), packed);
+    }
+#elif defined(DIATHEKE_SIMD_SSE2)
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(input + i));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(input + i + 4));
+        __m128i packed = _mm_packs_epi32(_mm_srai_epi32(a, 16), _mm_srai_epi32(b, 16));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(output + i), packed);
+    }
+#elif defined(DIATHEKE_SIMD_NEON)
+    for (; i + 8 <= count; i += 8)
+    {
+        int16x4_t a = vshrn_n_s32(vld1q_s32(input + i), 16);
+        int16x4_t b = vshrn_n_s32(vld1q_s32(input + i + 4), 16);
+        vst1q_s16(output + i, vcombine_s16(a, b));
+    }
+#endif
+
+    for (; i < count; i++)
+    {
+        output[i] = static_cast<int16_t>(input[i] >> 16);
+    }
+}
+
+void ConvertInt24ToInt16(const char *input, int16_t *output, size_t count)
+{
+    // The high two bytes of each sample are already a 16-bit sample.
+    const unsigned char *in = reinterpret_cast<const unsigned char *>(input);
+    for (size_t i = 0; i < count; i++)
+    {
+        output[i] = static_cast<int16_t>(in[3 * i + 1] | (in[3 * i + 2] << 8));
+    }
+}
+
+void DownmixToMono(const int16_t *input, int16_t *output, size_t frames,
+                   unsigned int channels)
+{
+    if (channels == 1)
+    {
+        memcpy(output, input, frames * sizeof(int16_t));
+        return;
+    }
+
+    if (channels != 2)
+    {
+        for (size_t i = 0; i < frames; i++)
+        {
+            int32_t sum = 0;
+            for (unsigned int c = 0; c < channels; c++)
+            {
+                sum += input[i * channels + c];
+            }
+            output[i] = static_cast<int16_t>(sum / static_cast<int32_t>(channels));
+        }
+        return;
+    }
+
+    size_t i = 0;
+
+    // Multiplying by 1 in pairs adds each left and right sample.
+#if defined(DIATHEKE_SIMD_AVX2)
+    const __m256i ones = _mm256_set1_epi16(1);
+    for (; i + 16 <= frames; i += 16)
+    {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(input + 2 * i));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(input + 2 * i + 16));
+        __m256i sa = _mm256_srai_epi32(_mm256_madd_epi16(a, ones), 1);
+        __m256i sb = _mm256_srai_epi32(_mm256_madd_epi16(b, ones), 1);
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(sa, sb), 0xD8);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(output + i), packed);
+    }
+#elif defined(DIATHEKE_SIMD_SSE2)
+    const __m128i ones = _mm_set1_epi16(1);
+    for (; i + 8 <= frames; i += 8)
+    {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(input + 2 * i));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(input + 2 * i + 8));
+        __m128i sa = _mm_srai_epi32(_mm_madd_epi16(a, ones), 1);
+        __m128i sb = _mm_srai_epi32(_mm_madd_epi16(b, ones), 1);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(output + i), _mm_packs_epi32(sa, sb));
+    }
+#elif defined(DIATHEKE_SIMD_NEON)
+    for (; i + 8 <= frames; i += 8)
+    {
+        int16x8x2_t v = vld2q_s16(input + 2 * i);
+        vst1q_s16(output + i, vhaddq_s16(v.val[0], v.val[1]));
+    }
+#endif
+
+    for (; i < frames; i++)
+    {
+        int32_t sum = static_cast<int32_t>(input[2 * i]) + input[2 * i + 1];
+        output[i] = static_cast<int16_t>(sum >> 1);
+    }
+}
+
+size_t SampleSize(SampleFormat format)
+{
+    switch (format)
+    {
+    case SAMPLE_INT16:
+        return 2;
+    case SAMPLE_INT24:
+        return 3;
+    case SAMPLE_INT32:
+    case SAMPLE_FLOAT32:
+        return 4;
+    }
+    return 0;
+}
+
+// Converts samples in the given format to 16-bit.
+static void convertToInt16(const char *input, int16_t *output, size_t count,
+                           SampleFormat format)
+{
+    switch (format)
+    {
+    case SAMPLE_INT16:
+        memcpy(output, input, count * sizeof(int16_t));
+        break;
+    case SAMPLE_INT24:
+        ConvertInt24ToInt16(input, output, count);
+        break;
+    case SAMPLE_INT32:
+        ConvertInt32ToInt16(reinterpret_cast<const int32_t *>(input), output,
+                            count);
+        break;
+    case SAMPLE_FLOAT32:
+        ConvertFloatToInt16(reinterpret_cast<const float *>(input), output,
+                            count);
+        break;
+    }
+}
+
+PCMConvertingReader::PCMConvertingReader(AudioReader *reader,
+                                         SampleFormat format,
+                                         unsigned int channels)
+    : mReader(reader),
+      mFormat(format),
+      mChannels(channels),
+      mFrameBytes(SampleSize(format) * channels),
+      mPartial(0)
+{
+    if (reader == nullptr)
+    {
+        throw ClientError("no audio reader given to convert");
+    }
+    if (channels == 0)
+    {
+        throw ClientError("audio channel count is zero");
+    }
+}
+
+PCMConvertingReader::~PCMConvertingReader() {}
+
+size_t PCMConvertingReader::readAudio(char *buffer, size_t buffSize)
+{
+    if (mFormat == SAMPLE_INT16 && mChannels == 1)
+    {
+        // Nothing to convert.
+        return mReader->readAudio(buffer, buffSize);
+    }
+
+    size_t maxFrames = buffSize / sizeof(int16_t);
+    if (maxFrames == 0)
+    {
+        throw ClientError("audio buffer is too small for one sample");
+    }
+
+    // Read until there is at least one whole frame.
+    mInput.resize(maxFrames * mFrameBytes);
+    size_t total = mPartial;
+    while (total < mFrameBytes)
+    {
+        size_t n = mReader->readAudio(&mInput[total], mInput.size() - total);
+        if (n == 0)
+        {
+            return 0;
+        }
+        total += n;
+    }
+
+    size_t frames = total / mFrameBytes;
+    int16_t *out = reinterpret_cast<int16_t *>(buffer);
+    if (mChannels == 1)
+    {
+        convertToInt16(mInput.data(), out, frames, mFormat);
+    }
+    else if (mFormat == SAMPLE_INT16)
+    {
+        DownmixToMono(reinterpret_cast<const int16_t *>(mInput.data()), out,
+                      frames, mChannels);
+    }
+    else
+    {
+        mConverted.resize(frames * mChannels);
+        convertToInt16(mInput.data(), mConverted.data(), mConverted.size(),
+                       mFormat);
+        DownmixToMono(mConverted.data(), out, frames, mChannels);
+    }
+
+    // Keep any partial frame for the next read.
+    mPartial = total - frames * mFrameBytes;
+    memmove(&mInput[0], &mInput[frames * mFrameBytes], mPartial);
+    return frames * sizeof(int16_t);
+}
+
+PCMConvertingWriter::PCMConvertingWriter(AudioWriter *writer,
+                                         SampleFormat format,
+                                         unsigned int channels)
+    : mWriter(writer), mFormat(format), mChannels(channels)
+{
+    if (writer == nullptr)
+    {
+        throw ClientError("no audio writer given to convert");
+    }
+    if (channels == 0)
+    {
+        throw ClientError("audio channel count is zero");
+    }
+}
+
+PCMConvertingWriter::~PCMConvertingWriter() {}
+
+size_t PCMConvertingWriter::writeAudio(const char *buffer, size_t sizeInBytes)
+{
+    // Finish the sample that the last call only partly wrote.
+    while (!mPending.empty())
+    {
+        size_t n = mWriter->writeAudio(mPending.data(), mPending.size());
+        if (n == 0)
+        {
+            return 0;
+        }
+        mPending.erase(0, n);
+    }
+
+    // Complete a sample split across calls, reusing the join buffer.
+    const char *data = buffer;
+    size_t size = sizeInBytes;
+    std::string carried;
+    carried.swap(mOddByte);
+    if (!carried.empty())
+    {
+        mJoined.assign(carried);
+        mJoined.append(buffer, sizeInBytes);
+        data = mJoined.data();
+        size = mJoined.size();
+    }
+    if (size % 2 != 0)
+    {
+        mOddByte.assign(data + size - 1, 1);
+    }
+
+    size_t count = size / 2;
+    size_t sampleSize = SampleSize(mFormat);
+    mOutput.resize(count * mChannels * sampleSize);
+    if (mFormat == SAMPLE_FLOAT32 && mChannels == 1)
+    {
+        mSamples.resize(count);
+        memcpy(mSamples.data(), data, count * 2);
+        ConvertInt16ToFloat(mSamples.data(), reinterpret_cast<float *>(&mOutput[0]),
+                            count);
+    }
+    else
+    {
+        // Widen each sample, then copy it to every channel.
+        char *out = &mOutput[0];
+        for (size_t i = 0; i < count; i++)
+        {
+            int16_t sample;
+            memcpy(&sample, data + 2 * i, 2);
+
+            char bytes[4];
+            if (mFormat == SAMPLE_FLOAT32)
+            {
+                float value = sample * (1.0f / 32768.0f);
+                memcpy(bytes, &value, 4);
+            }
+            else
+            {
+                int32_t value = static_cast<int32_t>(sample) << 16;
+                memcpy(bytes, &value, 4);
+            }
+
+            // The integer formats are the high bytes of the 32-bit value.
+            const char *src = mFormat == SAMPLE_FLOAT32 ? bytes
+                                                        : bytes + 4 - sampleSize;
+            for (unsigned int c = 0; c < mChannels; c++)
+            {
+                memcpy(out, src, sampleSize);
+                out += sampleSize;
+            }
+        }
+    }
+
+    // Stop early if the writer cannot take any more.
+    size_t pos = 0;
+    while (pos < mOutput.size())
+    {
+        size_t n = mWriter->writeAudio(&mOutput[pos], mOutput.size() - pos);
+        if (n == 0)
+        {
+            break;
+        }
+        pos += n;
+    }
+    if (pos == mOutput.size())
+    {
+        return sizeInBytes;
+    }
+
+    /*
+     * Report the input samples that were started, and keep the rest of
+     * the last one to write next time, since retrying it would repeat
+     * the bytes already written. Keep the carried byte if no samples
+     * were started, so that a retry still completes it.
+     */
+    size_t frameSize = mChannels * sampleSize;
+    size_t frames = (pos + frameSize - 1) / frameSize;
+    mPending.assign(mOutput, pos, frames * frameSize - pos);
+    size_t written = frames * 2;
+    mOddByte.clear();
+    if (written < carried.size())
+    {
+        mOddByte.swap(carried);
+        return 0;
+    }
+    return written - carried.size();
+}
+
+} // namespace Diatheke
@@ -0,0 +1,141 @@
+/*
+ * Copyright (2021-present) Cobalt Speech and Language, Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DIATHEKE_PCM_CONVERT_H
+#define DIATHEKE_PCM_CONVERT_H
+
+#include "diatheke_audio_helpers.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace Diatheke
+{
+
+/*
+ * Conversions between PCM sample formats, and from multichannel to mono
+ * audio. Diatheke expects 16-bit mono audio, which capture and playback
+ * devices often do not use.
+ *
+ * The kernels use SSE2/AVX2 or NEON where available (24-bit input is
+ * always converted with scalar code), and give the same results as the
+ * scalar versions. The input and output buffers must not overlap.
+ */
+
+/*
+ * Convert float samples in [-1.0, 1.0] to 16-bit, rounding to nearest.
+ * Values outside the range saturate, and NaN becomes -32768.
+ */
+void ConvertFloatToInt16(const float *input, int16_t *output, size_t count);
+
+// Convert 16-bit samples to floats in [-1.0, 1.0).
+void ConvertInt16ToFloat(const int16_t *input, float *output, size_t count);
+
+// Convert 32-bit samples to 16-bit by dropping the low 16 bits.
+void ConvertInt32ToInt16(const int32_t *input, int16_t *output, size_t count);
+
+/*
+ * Convert packed 24-bit little-endian samples (3 bytes each) to 16-bit
+ * by dropping the low 8 bits.
+ */
+void ConvertInt24ToInt16(const char *input, int16_t *output, size_t count);
+
+/*
+ * Average the channels of each interleaved frame of 16-bit audio to make
+ * mono audio. Stereo is rounded down; other channel counts are rounded
+ * toward zero.
+ */
+void DownmixToMono(const int16_t *input, int16_t *output, size_t frames,
+                   unsigned int channels);
+
+// PCM sample formats understood by the converting reader and writer.
+enum SampleFormat
+{
+    SAMPLE_INT16,   // 16-bit signed little endian
+    SAMPLE_INT24,   // 24-bit signed little endian, packed in 3 bytes
+    SAMPLE_INT32,   // 32-bit signed little endian
+    SAMPLE_FLOAT32, // 32-bit float, in [-1.0, 1.0]
+};
+
+// Returns the size in bytes of one sample in the given format.
+size_t SampleSize(SampleFormat format);
+
+/*
+ * PCMConvertingReader is an AudioReader that converts audio read from
+ * another reader to 16-bit mono, for use with ReadASRAudio() and
+ * ReadTranscribeAudio(). Mono audio is converted straight into the
+ * caller's buffer, and 16-bit audio is downmixed straight into it, so
+ * no extra copies are made. The wrapped reader is not owned and must
+ * outlive this one.
+ */
+class PCMConvertingReader : public AudioReader
+{
+public:
+    PCMConvertingReader(AudioReader *reader, SampleFormat format,
+                        unsigned int channels);
+    ~PCMConvertingReader();
+
+    size_t readAudio(char *buffer, size_t buffSize) override;
+
+private:
+    AudioReader *mReader;
+    SampleFormat mFormat;
+    unsigned int mChannels;
+    size_t mFrameBytes;
+    std::string mInput;
+    std::vector<int16_t> mConverted;
+    size_t mPartial; // Bytes of an incomplete frame left from the last read
+};
+
+/*
+ * PCMConvertingWriter is an AudioWriter that converts 16-bit mono audio
+ * (e.g., from WriteTTSAudio()) to the given format, copying it to each
+ * channel, before passing it to another writer. The wrapped writer is
+ * not owned and must outlive this one.
+ */
+class PCMConvertingWriter : public AudioWriter
+{
+public:
+    PCMConvertingWriter(AudioWriter *writer, SampleFormat format,
+                        unsigned int channels);
+    ~PCMConvertingWriter();
+
+    /*
+     * Convert the audio and write it to the wrapped writer. Returns
+     * sizeInBytes if all of the converted audio was written. If the
+     * wrapped writer stops taking audio, returns the number of input
+     * bytes whose samples were written (which may be zero), so the rest
+     * may be written again later. A sample that was only partly written
+     * counts as written, and the rest of it is written first on the
+     * next call.
+     */
+    size_t writeAudio(const char *buffer, size_t sizeInBytes) override;
+
+private:
+    AudioWriter *mWriter;
+    SampleFormat mFormat;
+    unsigned int mChannels;
+    std::string mOddByte;
+    std::string mJoined;
+    std::vector<int16_t> mSamples;
+    std::string mOutput;
+    std::string mPending;
+};
+
+} // namespace Diatheke
+
+#endif // DIATHEKE_PCM_CONVERT_H
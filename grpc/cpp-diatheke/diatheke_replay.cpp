@@ -0,0 +1,219 @@
+/*
+ * Copyright (2021-present) Cobalt Speech and Language, Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * diatheke_replay sends the traffic recorded in a trace file (see
+ * Client::setTrace()) to a Diatheke server, at the recorded speed or
+ * faster, or prints the records of a trace.
+ */
+
+#include "diatheke_client.h"
+#include "diatheke_trace.h"
+#include "diatheke_trace_replayer.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+const char *eventNames[Diatheke::EVENT_COUNT] = {"send", "receive",
+                                                 "writes_done", "finish"};
+
+void printUsage(const char *program)
+{
+    std::fprintf(
+        stderr,
+        "Usage: %s --server <url> [options] <trace>\n"
+        "       %s --dump <trace>\n"
+        "\n"
+        "Options:\n"
+        "  --server <url>   Diatheke server (may be repeated, or a\n"
+        "                   comma-separated list, to balance servers)\n"
+        "  --tls            Connect with TLS\n"
+        "  --speed <n>      Replay n times faster than recorded, or 0 for\n"
+        "                   as fast as possible (default 1)\n"
+        "  --channels <n>   Connections per server (default 4)\n"
+        "  --threads <n>    Threads for the client's streams (default 4)\n"
+        "  --record <file>  Record the replayed traffic in a new trace\n"
+        "  --dump           Print the records of the trace instead\n",
+        program, program);
+}
+
+// Print one line per record, with times relative to the first record.
+int dumpTrace(const std::string &path)
+{
+    Diatheke::TraceReader reader(path);
+    Diatheke::TraceRecord record;
+    uint64_t first = 0;
+    bool haveFirst = false;
+    while (reader.next(&record))
+    {
+        if (!haveFirst)
+        {
+            first = record.timestamp;
+            haveFirst = true;
+        }
+
+        double offset = (static_cast<double>(record.timestamp) -
+                         static_cast<double>(first)) /
+                        1e6;
+        std::printf("%12.6f  %016llx  %-13s  %-11s  %zu bytes", offset,
+                    static_cast<unsigned long long>(record.callID),
+                    Diatheke::TraceCallName(record.call),
+                    eventNames[record.event], record.payloadSize);
+        if (record.event == Diatheke::EVENT_FINISH)
+        {
+            grpc::Status status = record.status();
+            std::printf("  status %d %s", static_cast<int>(status.error_code()),
+                        status.error_message().c_str());
+        }
+        std::printf("\n");
+    }
+    return 0;
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    std::vector<std::string> servers;
+    bool tls = false;
+    bool dump = false;
+    double speed = 1.0;
+    unsigned int channels = 4;
+    unsigned int threads = 4;
+    std::string recordPath;
+    std::string tracePath;
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--tls")
+        {
+            tls = true;
+        }
+        else if (arg == "--dump")
+        {
+            dump = true;
+        }
+        else if (arg.compare(0, 2, "--") != 0)
+        {
+            tracePath = arg;
+        }
+        else if (i + 1 < argc && arg == "--server")
+        {
+            std::string list = argv[++i];
+            size_t start = 0;
+            while (start <= list.size())
+            {
+                size_t end = list.find(',', start);
+                if (end == std::string::npos)
+                {
+                    end = list.size();
+                }
+                if (end > start)
+                {
+                    servers.push_back(list.substr(start, end - start));
+                }
+                start = end + 1;
+            }
+        }
+        else if (i + 1 < argc && arg == "--speed")
+        {
+            speed = std::atof(argv[++i]);
+        }
+        else if (i + 1 < argc && arg == "--channels")
+        {
+            channels = std::strtoul(argv[++i], nullptr, 10);
+        }
+        else if (i + 1 < argc && arg == "--threads")
+        {
+            threads = std::strtoul(argv[++i], nullptr, 10);
+        }
+        else if (i + 1 < argc && arg == "--record")
+        {
+            recordPath = argv[++i];
+        }
+        else
+        {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (tracePath.empty() || (!dump && servers.empty()) || speed < 0)
+    {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    try
+    {
+        if (dump)
+        {
+            return dumpTrace(tracePath);
+        }
+
+        std::unique_ptr<Diatheke::Client> client;
+        if (tls)
+        {
+            grpc::SslCredentialsOptions ssl;
+            client.reset(new Diatheke::Client(servers, ssl));
+        }
+        else
+        {
+            client.reset(new Diatheke::Client(servers));
+        }
+        client->setAsyncThreadCount(threads);
+        client->setChannelCount(channels);
+        if (!recordPath.empty())
+        {
+            client->setTrace(std::make_shared<Diatheke::TraceWriter>(recordPath));
+        }
+
+        Diatheke::TraceReplayer replayer(*client);
+        replayer.setSpeed(speed);
+        Diatheke::ReplayStats stats = replayer.run(tracePath);
+
+        std::printf("calls:             %llu\n"
+                    "failed:            %llu\n"
+                    "outcome changes:   %llu\n"
+                    "skipped:           %llu\n"
+                    "messages sent:     %llu\n"
+                    "messages received: %llu\n"
+                    "max lag:           %.1f ms\n"
+                    "trace time:        %.1f s\n"
+                    "replay time:       %.1f s\n",
+                    static_cast<unsigned long long>(stats.calls),
+                    static_cast<unsigned long long>(stats.callsFailed),
+                    static_cast<unsigned long long>(stats.outcomeChanges),
+                    static_cast<unsigned long long>(stats.callsSkipped),
+                    static_cast<unsigned long long>(stats.messagesSent),
+                    static_cast<unsigned long long>(stats.messagesReceived),
+                    stats.maxLagMs, stats.traceSeconds, stats.wallSeconds);
+    }
+    catch (const std::exception &e)
+    {
+        std::fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,381 @@
+/*
+ * Copyright (2021-present) Cobalt Speech and Language, Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "diatheke_resampler.h"
+
+#include "diatheke_client_error.h"
+#include "diatheke_simd.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace Diatheke
+{
+
+// Zero crossings of the sinc on each side, for a filter that does not
+// decimate. Decimating filters are made longer to keep the same
+// transition band at the output rate.
+static const size_t halfWidth = 8;
+
+// Fraction of the lower Nyquist frequency that is passed.
+static const double rolloff = 0.94;
+
+static const double pi = 3.14159265358979323846;
+
+// Returns the inner product of two float arrays.
+static float dotProduct(const float *a, const float *b, size_t n)
+{
+    float total = 0.0f;
+    size_t i = 0;
+
+#if defined(DIATHEKE_SIMD_AVX2)
+    __m256 acc = _mm256_setzero_ps();
+    for (; i + 8 <= n; i += 8)
+    {
+        acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_loadu_ps(a + i),
+                                               _mm256_loadu_ps(b + i)));
+    }
+    float lanes[8];
+    _mm256_storeu_ps(lanes, acc);
+    total = ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) +
+            ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+#elif defined(DIATHEKE_SIMD_SSE2)
+    __m128 acc = _mm_setzero_ps();
+    for (; i + 4 <= n; i += 4)
+    {
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(a + i),
+                                         _mm_loadu_ps(b + i)));
+    }
+    float lanes[4];
+    _mm_storeu_ps(lanes, acc);
+    total = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#elif defined(DIATHEKE_SIMD_NEON)
+    float32x4_t acc = vdupq_n_f32(0.0f);
+    for (; i + 4 <= n; i += 4)
+    {
+        acc = vmlaq_f32(acc, vld1q_f32(a + i), vld1q_f32(b + i));
+    }
+    total = (vgetq_lane_f32(acc, 0) + vgetq_lane_f32(acc, 1)) +
+            (vgetq_lane_f32(acc, 2) + vgetq_lane_f32(acc, 3));
+#endif
+
+    for (; i < n; i++)
+    {
+        total += a[i] * b[i];
+    }
+    return total;
+}
+
+static int16_t toSample(float value)
+{
+    // Round to nearest, saturating at the limits of 16 bits.
+    if (value >= 32767.0f)
+    {
+        return 32767;
+    }
+    if (value <= -32768.0f)
+    {
+        return -32768;
+    }
+    return static_cast<int16_t>(std::lrint(value));
+}
+
+static size_t gcd(size_t a, size_t b)
+{
+    while (b != 0)
+    {
+        size_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+Resampler::Resampler(unsigned int inputRate, unsigned int outputRate)
+    : mInputRate(inputRate), mOutputRate(outputRate), mTime(0)
+{
+    if (inputRate == 0 || outputRate == 0)
+    {
+        throw ClientError("resampler sample rate is zero");
+    }
+
+    size_t div = gcd(inputRate, outputRate);
+    mUp = outputRate / div;
+    mDown = inputRate / div;
+
+    // Round the taps up to a multiple of 8 to suit the vector kernels.
+    double ratio = std::max(1.0, static_cast<double>(mDown) / mUp);
+    mTaps = static_cast<size_t>(std::ceil(2 * halfWidth * ratio));
+    mTaps = (mTaps + 7) / 8 * 8;
+
+    /*
+     * Design the prototype lowpass filter at the interpolated rate, with
+     * a Blackman window. The cutoff is at the lower of the two Nyquist
+     * frequencies, and the gain of mUp makes up for the zeros that
+     * interpolation inserts.
+     */
+    size_t length = mTaps * mUp;
+    double cutoff = rolloff * std::min(1.0, static_cast<double>(mUp) / mDown) /
+                    (2.0 * mUp);
+    double center = (length - 1) / 2.0;
+    std::vector<double> prototype(length);
+    for (size_t n = 0; n < length; n++)
+    {
+        double x = n - center;
+        double sinc = x == 0.0 ? 2 * cutoff
+                               : std::sin(2 * pi * cutoff * x) / (pi * x);
+        double window = 0.42 - 0.5 * std::cos(2 * pi * n / (length - 1)) +
+                        0.08 * std::cos(4 * pi * n / (length - 1));
+        prototype[n] = sinc * window * mUp;
+    }
+
+    // Split the filter into phases, reversing each so that it lines up
+    // with the oldest to newest samples in the history.
+    mCoeffs.resize(length);
+    for (size_t p = 0; p < mUp; p++)
+    {
+        for (size_t j = 0; j < mTaps; j++)
+        {
+            mCoeffs[p * mTaps + (mTaps - 1 - j)] =
+                static_cast<float>(prototype[p + j * mUp]);
+        }
+    }
+
+    reset();
+}
+
+Resampler::~Resampler() {}
+
+unsigned int Resampler::inputRate() const { return mInputRate; }
+
+unsigned int Resampler::outputRate() const { return mOutputRate; }
+
+size_t Resampler::process(const int16_t *input, size_t count,
+                          std::vector<int16_t> *output)
+{
+    size_t start = output->size();
+    if (mUp == 1 && mDown == 1)
+    {
+        output->insert(output->end(), input, input + count);
+        return count;
+    }
+
+    size_t kept = mTaps - 1;
+    mHistory.resize(kept + count);
+    for (size_t i = 0; i < count; i++)
+    {
+        mHistory[kept + i] = input[i];
+    }
+
+    // Each output sample uses the phase and newest input sample at its
+    // position in the interpolated stream.
+    size_t end = count * mUp;
+    for (; mTime < end; mTime += mDown)
+    {
+        size_t i = mTime / mUp;
+        size_t p = mTime % mUp;
+        float y = dotProduct(&mCoeffs[p * mTaps], &mHistory[i], mTaps);
+        output->push_back(toSample(y));
+    }
+    mTime -= end;
+
+    // Keep the newest samples for the next call.
+    mHistory.erase(mHistory.begin(), mHistory.end() - kept);
+    return output->size() - start;
+}
+
+size_t Resampler::process(const char *input, size_t sizeInBytes,
+                          std::string *output)
+{
+    // Complete a sample split across calls.
+    mSamples.clear();
+    if (!mOddByte.empty() && sizeInBytes > 0)
+    {
+        mOddByte.push_back(*input);
+        input++;
+        sizeInBytes--;
+        int16_t sample;
+        memcpy(&sample, mOddByte.data(), 2);
+        mOddByte.clear();
+        process(&sample, 1, &mSamples);
+    }
+
+    size_t count = sizeInBytes / 2;
+    mInputSamples.resize(count);
+    memcpy(mInputSamples.data(), input, count * 2);
+    process(mInputSamples.data(), count, &mSamples);
+    if (sizeInBytes % 2 != 0)
+    {
+        mOddByte.assign(input + sizeInBytes - 1, 1);
+    }
+
+    output->append(reinterpret_cast<const char *>(mSamples.data()),
+                   mSamples.size() * 2);
+    return mSamples.size() * 2;
+}
+
+size_t Resampler::flush(std::vector<int16_t> *output)
+{
+    if (mUp == 1 && mDown == 1)
+    {
+        return 0;
+    }
+
+    // Push zeros through the filter until its center has passed the
+    // last real sample.
+    size_t delay = (mTaps + 1) / 2;
+    std::vector<int16_t> zeros(delay, 0);
+    size_t count = process(zeros.data(), zeros.size(), output);
+    reset();
+    return count;
+}
+
+size_t Resampler::flush(std::string *output)
+{
+    mSamples.clear();
+    flush(&mSamples);
+    output->append(reinterpret_cast<const char *>(mSamples.data()),
+                   mSamples.size() * 2);
+    return mSamples.size() * 2;
+}
+
+void Resampler::reset()
+{
+    mHistory.assign(mTaps - 1, 0.0f);
+    mTime = 0;
+    mOddByte.clear();
+}
+
+ResamplingReader::ResamplingReader(AudioReader *reader,
+                                   unsigned int inputRate,
+                                   unsigned int outputRate)
+    : mReader(reader),
+      mResampler(inputRate, outputRate),
+      mOutputPos(0),
+      mFinished(false)
+{
+    if (reader == nullptr)
+    {
+        throw ClientError("no audio reader given to resample");
+    }
+}
+
+ResamplingReader::ResamplingReader(
+    AudioReader *reader, unsigned int inputRate,
+    const cobaltspeech::diatheke::ModelInfo &model)
+    : ResamplingReader(reader, inputRate, model.asr_sample_rate())
+{
+}
+
+ResamplingReader::~ResamplingReader() {}
+
+size_t ResamplingReader::readAudio(char *buffer, size_t buffSize)
+{
+    while (mOutputPos == mOutput.size())
+    {
+        if (mFinished)
+        {
+            return 0;
+        }
+        mOutput.clear();
+        mOutputPos = 0;
+
+        // Read about as much input as fills the caller's buffer.
+        size_t size = static_cast<size_t>(
+            static_cast<double>(buffSize) * mResampler.inputRate() /
+            mResampler.outputRate());
+        size = std::max<size_t>(size & ~static_cast<size_t>(1), 2);
+        mInput.resize(size);
+        size_t n = mReader->readAudio(&mInput[0], size);
+        if (n == 0)
+        {
+            mFinished = true;
+            mResampler.flush(&mOutput);
+        }
+        else
+        {
+            mResampler.process(mInput.data(), n, &mOutput);
+        }
+    }
+
+    size_t count = std::min(buffSize, mOutput.size() - mOutputPos);
+    memcpy(buffer, &mOutput[mOutputPos], count);
+    mOutputPos += count;
+    return count;
+}
+
+ResamplingWriter::ResamplingWriter(AudioWriter *writer,
+                                   unsigned int inputRate,
+                                   unsigned int outputRate)
+    : mWriter(writer), mResampler(inputRate, outputRate)
+{
+    if (writer == nullptr)
+    {
+        throw ClientError("no audio writer given to resample");
+    }
+}
+
+ResamplingWriter::ResamplingWriter(
+    AudioWriter *writer, const cobaltspeech::diatheke::ModelInfo &model,
+    unsigned int outputRate)
+    : ResamplingWriter(writer, model.tts_sample_rate(), outputRate)
+{
+}
+
+ResamplingWriter::~ResamplingWriter() {}
+
+size_t ResamplingWriter::writeAudio(const char *buffer, size_t sizeInBytes)
+{
+    mOutput.clear();
+    mResampler.process(buffer, sizeInBytes, &mOutput);
+    size_t written = writeOutput();
+    if (written == mOutput.size())
+    {
+        return sizeInBytes;
+    }
+
+    // Report the share of the input whose audio was written, in whole
+    // samples.
+    size_t consumed = static_cast<size_t>(
+        static_cast<double>(sizeInBytes) * written / mOutput.size());
+    return consumed & ~static_cast<size_t>(1);
+}
+
+void ResamplingWriter::flush()
+{
+    mOutput.clear();
+    mResampler.flush(&mOutput);
+    writeOutput();
+}
+
+size_t ResamplingWriter::writeOutput()
+{
+    // Stop early if the writer cannot take any more.
+    size_t pos = 0;
+    while (pos < mOutput.size())
+    {
+        size_t n = mWriter->writeAudio(&mOutput[pos], mOutput.size() - pos);
+        if (n == 0)
+        {
+            break;
+        }
+        pos += n;
+    }
+    return pos;
+}
+
+} // namespace Diatheke
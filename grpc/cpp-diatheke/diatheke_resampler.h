@@ -0,0 +1,166 @@
+/*
+ * Copyright (2021-present) Cobalt Speech and Language, Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DIATHEKE_RESAMPLER_H
+#define DIATHEKE_RESAMPLER_H
+
+#include "diatheke.grpc.pb.h"
+#include "diatheke_audio_helpers.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace Diatheke
+{
+
+/*
+ * Resampler converts a stream of 16-bit mono samples from one sample
+ * rate to another. It uses a polyphase windowed-sinc filter, with the
+ * inner products computed using SSE/AVX2 or NEON where available.
+ * Filter state is kept between calls to process(), so audio can be
+ * given in chunks of any size without clicks at the boundaries.
+ *
+ * The output is delayed by about half the filter length (under a
+ * millisecond at the input rate). Call flush() at the end of the
+ * stream to get the last of the output.
+ */
+class Resampler
+{
+public:
+    Resampler(unsigned int inputRate, unsigned int outputRate);
+    ~Resampler();
+
+    unsigned int inputRate() const;
+    unsigned int outputRate() const;
+
+    /*
+     * Resample count samples from the input, appending the results to
+     * output. Returns the number of samples appended.
+     */
+    size_t process(const int16_t *input, size_t count,
+                   std::vector<int16_t> *output);
+
+    /*
+     * Version of process() that works on bytes of 16-bit little-endian
+     * PCM, for use with AudioReader and AudioWriter buffers. An odd byte
+     * at the end is kept until the next call.
+     */
+    size_t process(const char *input, size_t sizeInBytes, std::string *output);
+
+    // Append the samples still held in the filter to the output.
+    size_t flush(std::vector<int16_t> *output);
+    size_t flush(std::string *output);
+
+    // Clear the filter state, to start a new stream.
+    void reset();
+
+private:
+    unsigned int mInputRate;
+    unsigned int mOutputRate;
+    size_t mUp;   // Interpolation factor
+    size_t mDown; // Decimation factor
+    size_t mTaps; // Filter taps for each phase
+
+    // Coefficients for each phase, in reverse order.
+    std::vector<float> mCoeffs;
+
+    // The last mTaps - 1 input samples, followed by the new ones.
+    std::vector<float> mHistory;
+
+    // Position of the next output sample relative to the first new input
+    // sample, in units of the interpolated rate.
+    size_t mTime;
+
+    // Buffers reused by the byte versions of process().
+    std::string mOddByte;
+    std::vector<int16_t> mInputSamples;
+    std::vector<int16_t> mSamples;
+
+    Resampler(const Resampler &) = delete;
+    Resampler &operator=(const Resampler &) = delete;
+};
+
+/*
+ * ResamplingReader is an AudioReader that resamples the audio read from
+ * another reader, for use with ReadASRAudio() and ReadTranscribeAudio()
+ * when the audio source does not match the model's ASR sample rate. The
+ * wrapped reader is not owned and must outlive this one.
+ */
+class ResamplingReader : public AudioReader
+{
+public:
+    ResamplingReader(AudioReader *reader, unsigned int inputRate,
+                     unsigned int outputRate);
+
+    // Resample to the model's ASR sample rate.
+    ResamplingReader(AudioReader *reader, unsigned int inputRate,
+                     const cobaltspeech::diatheke::ModelInfo &model);
+    ~ResamplingReader();
+
+    size_t readAudio(char *buffer, size_t buffSize) override;
+
+private:
+    AudioReader *mReader;
+    Resampler mResampler;
+    std::string mInput;
+    std::string mOutput;
+    size_t mOutputPos;
+    bool mFinished;
+};
+
+/*
+ * ResamplingWriter is an AudioWriter that resamples audio before passing
+ * it to another writer, for use with WriteTTSAudio() when the playback
+ * device does not match the model's TTS sample rate. The wrapped writer
+ * is not owned and must outlive this one. Call flush() after the last
+ * of the audio has been written.
+ */
+class ResamplingWriter : public AudioWriter
+{
+public:
+    ResamplingWriter(AudioWriter *writer, unsigned int inputRate,
+                     unsigned int outputRate);
+
+    // Resample from the model's TTS sample rate.
+    ResamplingWriter(AudioWriter *writer,
+                     const cobaltspeech::diatheke::ModelInfo &model,
+                     unsigned int outputRate);
+    ~ResamplingWriter();
+
+    /*
+     * Resample the audio and write it to the wrapped writer. Returns
+     * sizeInBytes if all of the resampled audio was written. If the
+     * wrapped writer stops taking audio, returns the part of the input
+     * that was written (which may be zero); the rest is dropped, so the
+     * output should be treated as failed.
+     */
+    size_t writeAudio(const char *buffer, size_t sizeInBytes) override;
+
+    // Write the last of the resampled audio.
+    void flush();
+
+private:
+    AudioWriter *mWriter;
+    Resampler mResampler;
+    std::string mOutput;
+
+    size_t writeOutput();
+};
+
+} // namespace Diatheke
+
+#endif // DIATHEKE_RESAMPLER_H
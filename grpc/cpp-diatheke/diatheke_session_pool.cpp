@@ -0,0 +1,264 @@
+/*
+ * Copyright (2021-present) Cobalt Speech and Language, Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "diatheke_session_pool.h"
+
+#include "diatheke_client.h"
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <utility>
+
+namespace Diatheke
+{
+
+static unsigned int defaultMaxIdle = 32;
+
+/* The sessions kept for one model ID and wakeword. */
+struct SessionPoolEntry
+{
+    unsigned int target;
+    unsigned int pending;
+    std::deque<cobaltspeech::diatheke::SessionOutput> ready;
+
+    SessionPoolEntry() : target(0), pending(0) {}
+};
+
+/*
+ * Private data struct. Callbacks for sessions being created hold a
+ * reference to it, so it may briefly outlive the SessionPool object.
+ */
+struct SessionPoolPrivate
+{
+    using Key = std::pair<std::string, std::string>;
+
+    Client *client;
+    std::mutex lock;
+    std::condition_variable cond;
+    std::map<Key, SessionPoolEntry> entries;
+    unsigned int maxIdle;
+    unsigned int idle;    // Ready or pending sessions across all entries
+    unsigned int pending; // Pending sessions across all entries
+    bool closed;
+
+    SessionPoolPrivate(Client *c)
+        : client(c), maxIdle(defaultMaxIdle), idle(0), pending(0),
+          closed(false)
+    {
+    }
+
+    /*
+     * Returns the number of sessions to create to bring the given entry
+     * up to its target, and marks them as pending. Must be called with
+     * the lock held.
+     */
+    unsigned int reserve(SessionPoolEntry &entry)
+    {
+        if (closed)
+        {
+            return 0;
+        }
+
+        unsigned int have = static_cast<unsigned int>(entry.ready.size()) +
+                            entry.pending;
+        unsigned int count = entry.target > have ? entry.target - have : 0;
+        unsigned int room = maxIdle > idle ? maxIdle - idle : 0;
+        if (count > room)
+        {
+            count = room;
+        }
+
+        entry.pending += count;
+        pending += count;
+        idle += count;
+        return count;
+    }
+};
+
+// Start creating the given number of sessions for the given entry.
+static void createSessions(const std::shared_ptr<SessionPoolPrivate> &data,
+                           const SessionPoolPrivate::Key &key,
+                           unsigned int count)
+{
+    for (unsigned int i = 0; i < count; i++)
+    {
+        data->client->createSessionWithWakeWordAsync(
+            key.first, key.second,
+            [data, key](const grpc::Status &status,
+                        cobaltspeech::diatheke::SessionOutput &output) {
+                unsigned int more = 0;
+                {
+                    std::lock_guard<std::mutex> lock(data->lock);
+                    SessionPoolEntry &entry = data->entries[key];
+                    entry.pending--;
+                    data->pending--;
+                    if (status.ok())
+                    {
+                        entry.ready.push_back(std::move(output));
+                    }
+                    else
+                    {
+                        // Don't retry right away, in case the server is
+                        // down. The next acquire() will try again.
+                        data->idle--;
+                    }
+
+                    if (data->pending == 0)
+                    {
+                        data->cond.notify_all();
+                    }
+
+                    if (status.ok())
+                    {
+                        more = data->reserve(entry);
+                    }
+                }
+
+                createSessions(data, key, more);
+            });
+    }
+}
+
+SessionPool::SessionPool(Client &client)
+    : dPtr(std::make_shared<SessionPoolPrivate>(&client))
+{
+}
+
+SessionPool::~SessionPool()
+{
+    std::deque<cobaltspeech::diatheke::SessionOutput> sessions;
+    {
+        std::unique_lock<std::mutex> lock(dPtr->lock);
+        dPtr->closed = true;
+        while (dPtr->pending > 0)
+        {
+            dPtr->cond.wait(lock);
+        }
+
+        for (auto iter = dPtr->entries.begin(); iter != dPtr->entries.end();
+             iter++)
+        {
+            std::deque<cobaltspeech::diatheke::SessionOutput> &ready =
+                iter->second.ready;
+            for (size_t i = 0; i < ready.size(); i++)
+            {
+                sessions.push_back(std::move(ready[i]));
+            }
+        }
+        dPtr->entries.clear();
+    }
+
+    // Clean up the idle sessions without waiting for the server.
+    for (size_t i = 0; i < sessions.size(); i++)
+    {
+        dPtr->client->deleteSessionAsync(sessions[i].token(),
+                                         [](const grpc::Status &) {});
+    }
+}
+
+void SessionPool::setTarget(const std::string &modelID, unsigned int count)
+{
+    this->setTarget(modelID, "", count);
+}
+
+void SessionPool::setTarget(const std::string &modelID,
+                            const std::string &wakeword, unsigned int count)
+{
+    SessionPoolPrivate::Key key(modelID, wakeword);
+    std::deque<cobaltspeech::diatheke::SessionOutput> extra;
+    unsigned int more = 0;
+    {
+        std::lock_guard<std::mutex> lock(dPtr->lock);
+        SessionPoolEntry &entry = dPtr->entries[key];
+        entry.target = count;
+        while (entry.ready.size() > count)
+        {
+            extra.push_back(std::move(entry.ready.back()));
+            entry.ready.pop_back();
+            dPtr->idle--;
+        }
+
+        more = dPtr->reserve(entry);
+    }
+
+    for (size_t i = 0; i < extra.size(); i++)
+    {
+        dPtr->client->deleteSessionAsync(extra[i].token(),
+                                         [](const grpc::Status &) {});
+    }
+
+    createSessions(dPtr, key, more);
+}
+
+void SessionPool::setMaxIdle(unsigned int count)
+{
+    std::lock_guard<std::mutex> lock(dPtr->lock);
+    dPtr->maxIdle = count;
+}
+
+cobaltspeech::diatheke::SessionOutput
+SessionPool::acquire(const std::string &modelID)
+{
+    return this->acquire(modelID, "");
+}
+
+cobaltspeech::diatheke::SessionOutput
+SessionPool::acquire(const std::string &modelID, const std::string &wakeword)
+{
+    SessionPoolPrivate::Key key(modelID, wakeword);
+    cobaltspeech::diatheke::SessionOutput session;
+    bool found = false;
+    unsigned int more = 0;
+    {
+        std::lock_guard<std::mutex> lock(dPtr->lock);
+        SessionPoolEntry &entry = dPtr->entries[key];
+        if (!entry.ready.empty())
+        {
+            session = std::move(entry.ready.front());
+            entry.ready.pop_front();
+            dPtr->idle--;
+            found = true;
+        }
+
+        more = dPtr->reserve(entry);
+    }
+
+    createSessions(dPtr, key, more);
+    if (found)
+    {
+        return session;
+    }
+
+    // Nothing was ready, so create one now.
+    return dPtr->client->createSessionWithWakeWord(modelID, wakeword);
+}
+
+unsigned int SessionPool::idleCount(const std::string &modelID,
+                                    const std::string &wakeword)
+{
+    std::lock_guard<std::mutex> lock(dPtr->lock);
+    auto iter = dPtr->entries.find(SessionPoolPrivate::Key(modelID, wakeword));
+    if (iter == dPtr->entries.end())
+    {
+        return 0;
+    }
+
+    return static_cast<unsigned int>(iter->second.ready.size());
+}
+
+} // namespace Diatheke
@@ -0,0 +1,96 @@
+/*
+ * Copyright (2021-present) Cobalt Speech and Language, Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DIATHEKE_SESSION_POOL_H
+#define DIATHEKE_SESSION_POOL_H
+
+#include "diatheke.grpc.pb.h"
+
+#include <memory>
+#include <string>
+
+namespace Diatheke
+{
+
+class Client;
+class SessionPoolPrivate;
+
+/*
+ * SessionPool keeps a number of ready-made sessions for each model ID
+ * (and wakeword), so that a new session can be handed out without
+ * waiting for a round-trip to the server. Sessions are created in the
+ * background using the client's asynchronous methods, and the pool is
+ * refilled each time a session is taken from it.
+ *
+ * It is safe to use the pool from multiple threads. The client must
+ * outlive the pool.
+ */
+class SessionPool
+{
+public:
+    explicit SessionPool(Client &client);
+
+    /*
+     * Waits for sessions that are still being created, then deletes all
+     * idle sessions in the pool.
+     */
+    ~SessionPool();
+
+    /*
+     * Set the number of idle sessions to keep ready for the given model
+     * ID and wakeword (which may be empty to use the model's default).
+     * New sessions are created in the background. If there are already
+     * more idle sessions than the new count, the extra ones are deleted.
+     */
+    void setTarget(const std::string &modelID, unsigned int count);
+    void setTarget(const std::string &modelID, const std::string &wakeword,
+                   unsigned int count);
+
+    /*
+     * Set the maximum number of idle sessions kept across all models,
+     * including sessions that are still being created. The default is
+     * 32. This does not delete sessions that are already in the pool.
+     */
+    void setMaxIdle(unsigned int count);
+
+    /*
+     * Returns a session for the given model ID and wakeword. If the pool
+     * has one ready it is returned immediately. Otherwise a new session
+     * is created with the client (which may throw a ClientError, as with
+     * Client::createSession()). Either way, the pool is refilled in the
+     * background.
+     *
+     * The caller owns the returned session, and should delete it with
+     * the client when it is done.
+     */
+    cobaltspeech::diatheke::SessionOutput acquire(const std::string &modelID);
+    cobaltspeech::diatheke::SessionOutput
+    acquire(const std::string &modelID, const std::string &wakeword);
+
+    // Returns the number of idle sessions ready for the given model.
+    unsigned int idleCount(const std::string &modelID,
+                           const std::string &wakeword = "");
+
+private:
+    std::shared_ptr<SessionPoolPrivate> dPtr; // Opaque pointer
+
+    SessionPool(const SessionPool &) = delete;
+    SessionPool &operator=(const SessionPool &) = delete;
+};
+
+} // namespace Diatheke
+
+#endif // DIATHEKE_SESSION_POOL_H
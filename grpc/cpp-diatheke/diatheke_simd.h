@@ -0,0 +1,49 @@
+/*
+ * Copyright (2021-present) Cobalt Speech and Language, Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DIATHEKE_SIMD_H
+#define DIATHEKE_SIMD_H
+
+/*
+ * Internal header that selects the vector instruction set used by the
+ * audio processing kernels. The selection is made when the library is
+ * compiled:
+ *
+ *  - AVX2 if the compiler targets it (see the DIATHEKE_ENABLE_AVX2
+ *    CMake option).
+ *  - SSE2 on other x86-64 builds, where it is always available.
+ *  - NEON on ARM builds that support it.
+ *
+ * Defining DIATHEKE_NO_SIMD forces the scalar versions, which are also
+ * used for whatever is left over at the end of a buffer. This header
+ * is not part of the public API.
+ */
+
+#if !defined(DIATHEKE_NO_SIMD)
+#if defined(__AVX2__)
+#define DIATHEKE_SIMD_AVX2
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define DIATHEKE_SIMD_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define DIATHEKE_SIMD_NEON
+#include <arm_neon.h>
+#endif
+#endif
+
+#endif // DIATHEKE_SIMD_H
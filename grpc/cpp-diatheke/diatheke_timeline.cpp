@@ -0,0 +1,129 @@
+/*
+ * Copyright (2021-present) Cobalt Speech and Language, Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "diatheke_timeline.h"
+
+namespace Diatheke
+{
+
+const char *TimelinePointName(TimelinePoint point)
+{
+    switch (point)
+    {
+    case POINT_ASR_TOKEN_SENT:
+        return "asr_token_sent";
+    case POINT_ASR_FIRST_AUDIO_SENT:
+        return "asr_first_audio_sent";
+    case POINT_ASR_WRITES_DONE:
+        return "asr_writes_done";
+    case POINT_ASR_RESULT:
+        return "asr_result";
+    case POINT_UPDATE_SENT:
+        return "update_sent";
+    case POINT_UPDATE_RECEIVED:
+        return "update_received";
+    case POINT_TTS_SENT:
+        return "tts_sent";
+    case POINT_TTS_FIRST_AUDIO:
+        return "tts_first_audio";
+    case POINT_TTS_LAST_AUDIO:
+        return "tts_last_audio";
+    default:
+        return "unknown";
+    }
+}
+
+TimelineObserver::~TimelineObserver() {}
+
+void TimelineObserver::onSessionEnded(const std::string &) {}
+
+SessionTimeline::SessionTimeline() : mMarked(0) {}
+
+void SessionTimeline::mark(TimelinePoint point, TimePoint time)
+{
+    if (point == POINT_ASR_TOKEN_SENT)
+    {
+        // A new turn.
+        this->clear();
+    }
+    else if (this->has(point) && point != POINT_TTS_LAST_AUDIO)
+    {
+        return;
+    }
+
+    mTimes[point] = time;
+    mMarked |= 1u << point;
+}
+
+bool SessionTimeline::has(TimelinePoint point) const
+{
+    return (mMarked & (1u << point)) != 0;
+}
+
+SessionTimeline::TimePoint SessionTimeline::time(TimelinePoint point) const
+{
+    return mTimes[point];
+}
+
+double SessionTimeline::millisecondsBetween(TimelinePoint from,
+                                            TimelinePoint to) const
+{
+    if (!this->has(from) || !this->has(to))
+    {
+        return -1.0;
+    }
+
+    return std::chrono::duration<double, std::milli>(mTimes[to] - mTimes[from])
+        .count();
+}
+
+void SessionTimeline::clear() { mMarked = 0; }
+
+TimelineRecorder::TimelineRecorder() {}
+
+TimelineRecorder::~TimelineRecorder() {}
+
+void TimelineRecorder::onTimelinePoint(
+    const std::string &sessionID, TimelinePoint point,
+    std::chrono::steady_clock::time_point time)
+{
+    std::lock_guard<std::mutex> lock(mLock);
+    mTimelines[sessionID].mark(point, time);
+}
+
+void TimelineRecorder::onSessionEnded(const std::string &sessionID)
+{
+    this->remove(sessionID);
+}
+
+SessionTimeline TimelineRecorder::timeline(const std::string &sessionID) const
+{
+    std::lock_guard<std::mutex> lock(mLock);
+    auto iter = mTimelines.find(sessionID);
+    if (iter == mTimelines.end())
+    {
+        return SessionTimeline();
+    }
+    return iter->second;
+}
+
+void TimelineRecorder::remove(const std::string &sessionID)
+{
+    std::lock_guard<std::mutex> lock(mLock);
+    mTimelines.erase(sessionID);
+}
+
+} // namespace Diatheke
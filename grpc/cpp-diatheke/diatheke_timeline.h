@@ -0,0 +1,166 @@
+/*
+ * Copyright (2021-present) Cobalt Speech and Language, Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DIATHEKE_TIMELINE_H
+#define DIATHEKE_TIMELINE_H
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace Diatheke
+{
+
+/*
+ * The points in a dialogue turn that a TimelineObserver is told about.
+ * Points for messages sent are taken when the client hands the message
+ * to gRPC, and points for messages received when gRPC hands them to the
+ * client.
+ */
+enum TimelinePoint
+{
+    // The session token was sent on an ASR stream. Only the first token
+    // sent on each stream is reported.
+    POINT_ASR_TOKEN_SENT,
+
+    // The first audio was sent on an ASR stream.
+    POINT_ASR_FIRST_AUDIO_SENT,
+
+    // The client ended the audio on an ASR stream to ask for a result.
+    POINT_ASR_WRITES_DONE,
+
+    // The result of an ASR stream arrived.
+    POINT_ASR_RESULT,
+
+    // An UpdateSession request (e.g., processASRResult()) was sent, and
+    // its response arrived.
+    POINT_UPDATE_SENT,
+    POINT_UPDATE_RECEIVED,
+
+    // A TTS stream was requested, and its first and last audio arrived.
+    POINT_TTS_SENT,
+    POINT_TTS_FIRST_AUDIO,
+    POINT_TTS_LAST_AUDIO,
+
+    POINT_COUNT
+};
+
+// Returns the name of the point, e.g. "asr_result".
+const char *TimelinePointName(TimelinePoint point);
+
+/*
+ * TimelineObserver is told when each call on the client's dialogue path
+ * reaches a TimelinePoint (see Client::setTimelineObserver()). Methods
+ * are called from the thread that reached the point, which may be the
+ * caller's thread or one of the client's completion queue threads, so
+ * they must be thread-safe and should return quickly.
+ */
+class TimelineObserver
+{
+public:
+    virtual ~TimelineObserver();
+
+    /*
+     * Called when the session with the given ID reaches the given point
+     * at the given time. The session ID is empty for a TTS stream that
+     * was not created for a session (see Client::newTTSStream()).
+     */
+    virtual void onTimelinePoint(const std::string &sessionID,
+                                 TimelinePoint point,
+                                 std::chrono::steady_clock::time_point time) = 0;
+
+    /*
+     * Called once the session with the given ID is deleted. The default
+     * does nothing.
+     */
+    virtual void onSessionEnded(const std::string &sessionID);
+};
+
+/*
+ * SessionTimeline holds the times one session reached each point during
+ * its current turn. A turn starts when the session token is sent on a
+ * new ASR stream, which clears the points of the previous turn. Within a
+ * turn, the first time is kept for each point, except for
+ * POINT_TTS_LAST_AUDIO, which keeps the latest.
+ */
+class SessionTimeline
+{
+public:
+    using TimePoint = std::chrono::steady_clock::time_point;
+
+    SessionTimeline();
+
+    // Record that the given point was reached at the given time.
+    void mark(TimelinePoint point, TimePoint time);
+
+    // Returns true if the given point was reached during this turn.
+    bool has(TimelinePoint point) const;
+
+    // Returns the time the point was reached, if has() is true.
+    TimePoint time(TimelinePoint point) const;
+
+    /*
+     * Returns the milliseconds from one point to another, or a negative
+     * value if either point was not reached. For example, the time from
+     * the end of speech to the first TTS audio is
+     * millisecondsBetween(POINT_ASR_WRITES_DONE, POINT_TTS_FIRST_AUDIO).
+     */
+    double millisecondsBetween(TimelinePoint from, TimelinePoint to) const;
+
+    // Forget all of the points.
+    void clear();
+
+private:
+    TimePoint mTimes[POINT_COUNT];
+    uint32_t mMarked;
+};
+
+/*
+ * TimelineRecorder is a TimelineObserver that keeps a SessionTimeline
+ * for each session, until the session is deleted.
+ */
+class TimelineRecorder : public TimelineObserver
+{
+public:
+    TimelineRecorder();
+    ~TimelineRecorder() override;
+
+    void onTimelinePoint(const std::string &sessionID, TimelinePoint point,
+                         std::chrono::steady_clock::time_point time) override;
+    void onSessionEnded(const std::string &sessionID) override;
+
+    /*
+     * Returns a copy of the given session's timeline. The timeline is
+     * empty if the session has not reached any points.
+     */
+    SessionTimeline timeline(const std::string &sessionID) const;
+
+    // Forget the timeline of the given session.
+    void remove(const std::string &sessionID);
+
+private:
+    mutable std::mutex mLock;
+    std::unordered_map<std::string, SessionTimeline> mTimelines;
+
+    TimelineRecorder(const TimelineRecorder &) = delete;
+    TimelineRecorder &operator=(const TimelineRecorder &) = delete;
+};
+
+} // namespace Diatheke
+
+#endif // DIATHEKE_TIMELINE_H
@@ -0,0 +1,402 @@
+/*
+ * Copyright (2021-present) Cobalt Speech and Language, Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "diatheke_trace.h"
+
+#include "diatheke_client_error.h"
+
+#include <chrono>
+#include <cstring>
+#include <random>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace Diatheke
+{
+
+static const char traceMagic[8] = {'D', 'I', 'A', 'T', 'R', 'A', 'C', 'E'};
+static const uint32_t traceVersion = 1;
+static const size_t traceHeaderSize = sizeof(traceMagic) + 4;
+
+// Size of a record's fields after its size, not counting the payload.
+static const size_t recordFieldsSize = 8 + 8 + 1 + 1;
+
+// Buffer records so that tracing audio does not write for every chunk.
+static const size_t writeBufferSize = 1 << 20;
+
+static void putUint32(char *out, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        out[i] = static_cast<char>(value >> (8 * i));
+    }
+}
+
+static void putUint64(char *out, uint64_t value)
+{
+    for (int i = 0; i < 8; i++)
+    {
+        out[i] = static_cast<char>(value >> (8 * i));
+    }
+}
+
+static uint32_t getUint32(const char *in)
+{
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        value |= static_cast<uint32_t>(static_cast<unsigned char>(in[i]))
+                 << (8 * i);
+    }
+    return value;
+}
+
+static uint64_t getUint64(const char *in)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        value |= static_cast<uint64_t>(static_cast<unsigned char>(in[i]))
+                 << (8 * i);
+    }
+    return value;
+}
+
+/*
+ * Seek and tell with 64-bit offsets, since traces of audio easily grow
+ * past the 2 GiB a long can hold on Windows.
+ */
+static bool seekFile(std::FILE *file, int64_t offset, int whence)
+{
+#ifdef _WIN32
+    return _fseeki64(file, offset, whence) == 0;
+#else
+    return fseeko(file, static_cast<off_t>(offset), whence) == 0;
+#endif
+}
+
+// Returns the size of the file, or -1 if it cannot be found.
+static int64_t fileSize(std::FILE *file)
+{
+    if (!seekFile(file, 0, SEEK_END))
+    {
+        return -1;
+    }
+#ifdef _WIN32
+    return _ftelli64(file);
+#else
+    return static_cast<int64_t>(ftello(file));
+#endif
+}
+
+// Throws a ClientError unless data starts with a trace header.
+static void checkHeader(const char *data, size_t size, const std::string &path)
+{
+    if (size < traceHeaderSize ||
+        memcmp(data, traceMagic, sizeof(traceMagic)) != 0)
+    {
+        throw ClientError(path + " is not a Diatheke trace");
+    }
+
+    uint32_t version = getUint32(data + sizeof(traceMagic));
+    if (version != traceVersion)
+    {
+        throw ClientError(path + " has unsupported trace version " +
+                          std::to_string(version));
+    }
+}
+
+const char *TraceCallName(TraceCall call)
+{
+    switch (call)
+    {
+    case CALL_VERSION:
+        return "Version";
+    case CALL_LIST_MODELS:
+        return "ListModels";
+    case CALL_CREATE_SESSION:
+        return "CreateSession";
+    case CALL_DELETE_SESSION:
+        return "DeleteSession";
+    case CALL_UPDATE_SESSION:
+        return "UpdateSession";
+    case CALL_STREAM_ASR:
+        return "StreamASR";
+    case CALL_STREAM_TTS:
+        return "StreamTTS";
+    case CALL_TRANSCRIBE:
+        return "Transcribe";
+    default:
+        return "Unknown";
+    }
+}
+
+TraceWriter::TraceWriter(const std::string &path)
+    : mFile(nullptr), mNextID(1), mRecords(0), mOk(true)
+{
+    mFile = std::fopen(path.c_str(), "ab+");
+    if (mFile == nullptr)
+    {
+        throw ClientError("could not open trace file " + path);
+    }
+    std::setvbuf(mFile, nullptr, _IOFBF, writeBufferSize);
+
+    // Check the header of an existing trace, or write one for a new file.
+    int64_t size = fileSize(mFile);
+    if (size < 0)
+    {
+        std::fclose(mFile);
+        throw ClientError("could not get the size of trace file " + path);
+    }
+    if (size > 0)
+    {
+        char header[traceHeaderSize];
+        seekFile(mFile, 0, SEEK_SET);
+        size_t count = std::fread(header, 1, sizeof(header), mFile);
+        if (count != sizeof(header))
+        {
+            std::fclose(mFile);
+            throw ClientError(path + " is not a Diatheke trace");
+        }
+        try
+        {
+            checkHeader(header, count, path);
+            truncateTornRecord(path, size);
+        }
+        catch (...)
+        {
+            std::fclose(mFile);
+            throw;
+        }
+        seekFile(mFile, 0, SEEK_END);
+    }
+    else
+    {
+        char header[traceHeaderSize];
+        memcpy(header, traceMagic, sizeof(traceMagic));
+        putUint32(header + sizeof(traceMagic), traceVersion);
+        if (std::fwrite(header, 1, sizeof(header), mFile) != sizeof(header))
+        {
+            std::fclose(mFile);
+            throw ClientError("could not write trace file " + path);
+        }
+    }
+
+    /*
+     * Start the call IDs at a random offset, so that calls from separate
+     * runs appended to the same trace have different IDs.
+     */
+    std::random_device random;
+    mNextID = (static_cast<uint64_t>(random()) << 32) + 1;
+}
+
+/*
+ * Find the end of the last whole record, reading only the record sizes,
+ * and cut off anything after it. Otherwise new records would follow a
+ * partial one, and readers would stop before reaching them.
+ */
+void TraceWriter::truncateTornRecord(const std::string &path, int64_t size)
+{
+    int64_t end = static_cast<int64_t>(traceHeaderSize);
+    while (size - end >= 4)
+    {
+        char sizeField[4];
+        if (!seekFile(mFile, end, SEEK_SET) ||
+            std::fread(sizeField, 1, sizeof(sizeField), mFile) !=
+                sizeof(sizeField))
+        {
+            // Never cut the trace short on a read error.
+            throw ClientError("could not read trace file " + path);
+        }
+
+        uint32_t recordSize = getUint32(sizeField);
+        if (size - end - 4 < static_cast<int64_t>(recordSize))
+        {
+            break;
+        }
+        end += 4 + static_cast<int64_t>(recordSize);
+    }
+
+    if (end == size)
+    {
+        return;
+    }
+
+#ifdef _WIN32
+    int result = _chsize_s(_fileno(mFile), end);
+#else
+    int result = ftruncate(fileno(mFile), static_cast<off_t>(end));
+#endif
+    if (result != 0)
+    {
+        throw ClientError("could not remove the incomplete record at the end "
+                          "of " + path);
+    }
+}
+
+TraceWriter::~TraceWriter()
+{
+    std::fclose(mFile);
+}
+
+uint64_t TraceWriter::newCallID() { return mNextID++; }
+
+void TraceWriter::writeMessage(uint64_t callID, TraceCall call,
+                               TraceEvent event,
+                               const google::protobuf::MessageLite &msg)
+{
+    if (!mOk.load())
+    {
+        return;
+    }
+
+    // Serialize before taking the lock.
+    std::string payload;
+    msg.SerializeToString(&payload);
+    this->writeRecord(callID, call, event, payload.data(), payload.size());
+}
+
+void TraceWriter::writeEvent(uint64_t callID, TraceCall call, TraceEvent event)
+{
+    this->writeRecord(callID, call, event, nullptr, 0);
+}
+
+void TraceWriter::writeStatus(uint64_t callID, TraceCall call,
+                              const grpc::Status &status)
+{
+    std::string payload(4, '\0');
+    putUint32(&payload[0], static_cast<uint32_t>(status.error_code()));
+    payload += status.error_message();
+    this->writeRecord(callID, call, EVENT_FINISH, payload.data(),
+                      payload.size());
+}
+
+void TraceWriter::flush()
+{
+    std::lock_guard<std::mutex> lock(mLock);
+    if (std::fflush(mFile) != 0)
+    {
+        mOk = false;
+    }
+}
+
+uint64_t TraceWriter::recordCount() const { return mRecords.load(); }
+
+bool TraceWriter::ok() const { return mOk.load(); }
+
+void TraceWriter::writeRecord(uint64_t callID, TraceCall call, TraceEvent event,
+                              const char *payload, size_t size)
+{
+    if (!mOk.load())
+    {
+        return;
+    }
+
+    uint64_t timestamp =
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch())
+            .count();
+
+    char fields[4 + recordFieldsSize];
+    putUint32(fields, static_cast<uint32_t>(recordFieldsSize + size));
+    putUint64(fields + 4, timestamp);
+    putUint64(fields + 12, callID);
+    fields[20] = static_cast<char>(call);
+    fields[21] = static_cast<char>(event);
+
+    std::lock_guard<std::mutex> lock(mLock);
+    if (std::fwrite(fields, 1, sizeof(fields), mFile) != sizeof(fields) ||
+        (size > 0 && std::fwrite(payload, 1, size, mFile) != size))
+    {
+        mOk = false;
+        return;
+    }
+    mRecords++;
+}
+
+TraceRecord::TraceRecord()
+    : timestamp(0), callID(0), call(CALL_VERSION), event(EVENT_SEND),
+      payload(nullptr), payloadSize(0)
+{
+}
+
+bool TraceRecord::parse(google::protobuf::MessageLite *msg) const
+{
+    return msg->ParseFromArray(payload, static_cast<int>(payloadSize));
+}
+
+grpc::Status TraceRecord::status() const
+{
+    if (event != EVENT_FINISH || payloadSize < 4)
+    {
+        return grpc::Status(grpc::StatusCode::UNKNOWN, "no status in record");
+    }
+
+    grpc::StatusCode code = static_cast<grpc::StatusCode>(getUint32(payload));
+    return grpc::Status(code, std::string(payload + 4, payloadSize - 4));
+}
+
+TraceReader::TraceReader(const std::string &path)
+    : mFile(path), mPath(path), mPos(traceHeaderSize)
+{
+    checkHeader(mFile.data(), mFile.size(), path);
+    mFile.adviseSequential();
+}
+
+TraceReader::~TraceReader() {}
+
+bool TraceReader::next(TraceRecord *record)
+{
+    const char *data = mFile.data();
+    size_t size = mFile.size();
+    if (size - mPos < 4)
+    {
+        return false;
+    }
+
+    size_t recordSize = getUint32(data + mPos);
+    if (size - mPos - 4 < recordSize)
+    {
+        // The writer stopped partway through this record.
+        return false;
+    }
+
+    const char *fields = data + mPos + 4;
+    if (recordSize < recordFieldsSize ||
+        static_cast<unsigned char>(fields[16]) >= CALL_COUNT ||
+        static_cast<unsigned char>(fields[17]) >= EVENT_COUNT)
+    {
+        throw ClientError("invalid record in " + mPath + " at offset " +
+                          std::to_string(mPos));
+    }
+
+    record->timestamp = getUint64(fields);
+    record->callID = getUint64(fields + 8);
+    record->call = static_cast<TraceCall>(fields[16]);
+    record->event = static_cast<TraceEvent>(fields[17]);
+    record->payload = fields + recordFieldsSize;
+    record->payloadSize = recordSize - recordFieldsSize;
+    mPos += 4 + recordSize;
+    return true;
+}
+
+void TraceReader::rewind() { mPos = traceHeaderSize; }
+
+} // namespace Diatheke
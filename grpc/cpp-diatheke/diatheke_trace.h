@@ -0,0 +1,207 @@
+/*
+ * Copyright (2021-present) Cobalt Speech and Language, Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DIATHEKE_TRACE_H
+#define DIATHEKE_TRACE_H
+
+#include "diatheke_mapped_file.h"
+
+#include <google/protobuf/message_lite.h>
+#include <grpcpp/support/status.h>
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+
+namespace Diatheke
+{
+
+/*
+ * A trace file records the messages a Client sends and receives, so the
+ * same traffic can be replayed later (see TraceReplayer). The file starts
+ * with the 8 byte magic "DIATRACE" and a 32-bit format version, followed
+ * by records. Each record is:
+ *
+ *   uint32  size of the rest of the record
+ *   uint64  time, in microseconds since the Unix epoch
+ *   uint64  call ID, which is unique to one request or stream
+ *   uint8   TraceCall
+ *   uint8   TraceEvent
+ *   ...     payload (see TraceEvent)
+ *
+ * All integers are little-endian. Records are only ever appended, so a
+ * trace may hold several runs of a program, and a trace cut short by a
+ * crash is readable up to its last whole record. The call IDs of each
+ * TraceWriter share the same random upper 32 bits, which tells the runs
+ * in a trace apart.
+ */
+
+// The RPC a traced call is for.
+enum TraceCall
+{
+    CALL_VERSION,
+    CALL_LIST_MODELS,
+    CALL_CREATE_SESSION,
+    CALL_DELETE_SESSION,
+    CALL_UPDATE_SESSION,
+    CALL_STREAM_ASR,
+    CALL_STREAM_TTS,
+    CALL_TRANSCRIBE,
+    CALL_COUNT
+};
+
+// Returns the name of the call's RPC, e.g. "CreateSession".
+const char *TraceCallName(TraceCall call);
+
+enum TraceEvent
+{
+    // A request message was sent. The payload is the serialized message.
+    EVENT_SEND,
+
+    // A response message was received. The payload is the serialized
+    // message.
+    EVENT_RECEIVE,
+
+    // The client finished sending on a stream. There is no payload.
+    EVENT_WRITES_DONE,
+
+    // The call ended. The payload is the uint32 status code followed by
+    // the error message.
+    EVENT_FINISH,
+
+    EVENT_COUNT
+};
+
+/*
+ * TraceWriter appends records to a trace file. It is thread-safe, and
+ * may be shared by several clients (see Client::setTrace()).
+ */
+class TraceWriter
+{
+public:
+    /*
+     * Open the trace file at the given path, creating it if it does not
+     * exist. Records are appended to an existing trace, after removing
+     * an incomplete last record left by a run that was cut short. Throws
+     * a ClientError if the file cannot be opened or is not a trace.
+     */
+    explicit TraceWriter(const std::string &path);
+
+    // Flushes and closes the file.
+    ~TraceWriter();
+
+    // Returns a new call ID for a request or stream.
+    uint64_t newCallID();
+
+    // Append a record with the given message as its payload.
+    void writeMessage(uint64_t callID, TraceCall call, TraceEvent event,
+                      const google::protobuf::MessageLite &msg);
+
+    // Append a record without a payload.
+    void writeEvent(uint64_t callID, TraceCall call, TraceEvent event);
+
+    // Append an EVENT_FINISH record with the given status.
+    void writeStatus(uint64_t callID, TraceCall call,
+                     const grpc::Status &status);
+
+    // Write buffered records to the file.
+    void flush();
+
+    // Returns the number of records written.
+    uint64_t recordCount() const;
+
+    /*
+     * Returns false if writing to the file failed. Tracing stops after a
+     * failure, rather than reporting an error to the calls being traced.
+     */
+    bool ok() const;
+
+private:
+    std::mutex mLock;
+    std::FILE *mFile;
+    std::atomic<uint64_t> mNextID;
+    std::atomic<uint64_t> mRecords;
+    std::atomic<bool> mOk;
+
+    void truncateTornRecord(const std::string &path, int64_t size);
+    void writeRecord(uint64_t callID, TraceCall call, TraceEvent event,
+                     const char *payload, size_t size);
+
+    TraceWriter(const TraceWriter &) = delete;
+    TraceWriter &operator=(const TraceWriter &) = delete;
+};
+
+/*
+ * TraceRecord is one record read from a trace. The payload points into
+ * the TraceReader's mapping of the file, and is valid for the life of
+ * the reader.
+ */
+struct TraceRecord
+{
+    uint64_t timestamp;
+    uint64_t callID;
+    TraceCall call;
+    TraceEvent event;
+    const char *payload;
+    size_t payloadSize;
+
+    TraceRecord();
+
+    // Parse the payload of an EVENT_SEND or EVENT_RECEIVE record.
+    bool parse(google::protobuf::MessageLite *msg) const;
+
+    // Returns the status of an EVENT_FINISH record.
+    grpc::Status status() const;
+};
+
+/*
+ * TraceReader reads the records of a trace file in order. The file is
+ * mapped into memory rather than read, so audio payloads are not copied.
+ */
+class TraceReader
+{
+public:
+    /*
+     * Map the trace file at the given path. Throws a ClientError if it
+     * cannot be mapped or is not a trace.
+     */
+    explicit TraceReader(const std::string &path);
+    ~TraceReader();
+
+    /*
+     * Read the next record. Returns false at the end of the trace, or at
+     * an incomplete last record. Throws a ClientError if the record is
+     * not valid.
+     */
+    bool next(TraceRecord *record);
+
+    // Start reading from the first record again.
+    void rewind();
+
+private:
+    MappedFile mFile;
+    std::string mPath;
+    size_t mPos;
+
+    TraceReader(const TraceReader &) = delete;
+    TraceReader &operator=(const TraceReader &) = delete;
+};
+
+} // namespace Diatheke
+
+#endif // DIATHEKE_TRACE_H
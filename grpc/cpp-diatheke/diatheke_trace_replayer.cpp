@@ -0,0 +1,752 @@
+/*
+ * Copyright (2021-present) Cobalt Speech and Language, Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "diatheke_trace_replayer.h"
+
+#include "diatheke_client.h"
+#include "diatheke_client_error.h"
+#include "diatheke_trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace Diatheke
+{
+
+// Finished threads are joined after this many new ones are started.
+static const size_t joinInterval = 64;
+
+ReplayStats::ReplayStats()
+    : calls(0), callsFailed(0), outcomeChanges(0), callsSkipped(0),
+      messagesSent(0), messagesReceived(0), maxLagMs(0), traceSeconds(0),
+      wallSeconds(0)
+{
+}
+
+/* The records of one recorded call, in the order they were written. */
+struct ReplayCall
+{
+    TraceCall call;
+    std::vector<TraceRecord> records;
+    bool finished;
+    grpc::Status status;
+
+    ReplayCall() : call(CALL_VERSION), finished(false) {}
+
+    // Returns the first record of the given kind, or null if there is none.
+    const TraceRecord *find(TraceEvent event) const
+    {
+        for (size_t i = 0; i < records.size(); i++)
+        {
+            if (records[i].event == event)
+            {
+                return &records[i];
+            }
+        }
+        return nullptr;
+    }
+
+    bool cancelled() const
+    {
+        return finished && status.error_code() == grpc::StatusCode::CANCELLED;
+    }
+
+    // Returns the ID of the session the call belongs to, if any.
+    std::string sessionID() const
+    {
+        const TraceRecord *send = find(EVENT_SEND);
+        switch (call)
+        {
+        case CALL_CREATE_SESSION:
+        {
+            const TraceRecord *receive = find(EVENT_RECEIVE);
+            cobaltspeech::diatheke::SessionOutput output;
+            if (receive && receive->parse(&output))
+            {
+                return output.token().id();
+            }
+            break;
+        }
+        case CALL_UPDATE_SESSION:
+        {
+            cobaltspeech::diatheke::SessionInput input;
+            if (send && send->parse(&input))
+            {
+                return input.token().id();
+            }
+            break;
+        }
+        case CALL_DELETE_SESSION:
+        {
+            cobaltspeech::diatheke::TokenData token;
+            if (send && send->parse(&token))
+            {
+                return token.id();
+            }
+            break;
+        }
+        case CALL_STREAM_ASR:
+        {
+            cobaltspeech::diatheke::ASRInput input;
+            if (send && send->parse(&input) && input.has_token())
+            {
+                return input.token().id();
+            }
+            break;
+        }
+        default:
+            break;
+        }
+        return std::string();
+    }
+};
+
+/* Calls that are replayed one after another on the same thread. */
+struct ReplayGroup
+{
+    std::vector<const ReplayCall *> calls;
+    uint64_t start;
+};
+
+/*
+ * The recorded time range of one run of the traced program, and how far
+ * its records are moved back to remove the idle time before it.
+ */
+struct ReplaySpan
+{
+    uint64_t start;
+    uint64_t end;
+    uint64_t shift;
+
+    explicit ReplaySpan(uint64_t timestamp)
+        : start(timestamp), end(timestamp), shift(0)
+    {
+    }
+};
+
+/* The live state of a replayed session. */
+struct ReplaySession
+{
+    cobaltspeech::diatheke::TokenData token;
+    bool live;
+    bool failed;
+
+    ReplaySession() : live(false), failed(false) {}
+
+    // Returns the live token in place of the recorded one, if there is one.
+    const cobaltspeech::diatheke::TokenData &
+    tokenFor(const cobaltspeech::diatheke::TokenData &recorded) const
+    {
+        return live ? token : recorded;
+    }
+};
+
+/* Throws a ClientError if the record's message cannot be parsed. */
+static void parseRecord(const TraceRecord &record,
+                        google::protobuf::MessageLite *msg)
+{
+    if (!record.parse(msg))
+    {
+        throw ClientError(std::string("invalid message in trace for ") +
+                          TraceCallName(record.call));
+    }
+}
+
+/* State shared by the threads of one replay. */
+class ReplayRun
+{
+public:
+    ReplayRun(Client *client, double speed, uint64_t traceStart)
+        : mClient(client), mSpeed(speed), mTraceStart(traceStart),
+          mStart(std::chrono::steady_clock::now())
+    {
+    }
+
+    // Wait until the recorded time, scaled by the speed, has come.
+    void waitFor(uint64_t timestamp)
+    {
+        if (mSpeed <= 0)
+        {
+            return;
+        }
+
+        std::chrono::steady_clock::time_point due =
+            mStart + std::chrono::microseconds(static_cast<int64_t>(
+                         (timestamp - mTraceStart) / mSpeed));
+        std::chrono::steady_clock::time_point now =
+            std::chrono::steady_clock::now();
+        if (now < due)
+        {
+            std::this_thread::sleep_until(due);
+            return;
+        }
+
+        double lag =
+            std::chrono::duration<double, std::milli>(now - due).count();
+        std::lock_guard<std::mutex> lock(mLock);
+        mStats.maxLagMs = std::max(mStats.maxLagMs, lag);
+    }
+
+    void runGroup(const ReplayGroup &group)
+    {
+        ReplaySession session;
+        for (size_t i = 0; i < group.calls.size(); i++)
+        {
+            const ReplayCall &call = *group.calls[i];
+            if (session.failed)
+            {
+                std::lock_guard<std::mutex> lock(mLock);
+                mStats.callsSkipped++;
+                continue;
+            }
+
+            uint64_t sent = 0;
+            uint64_t received = 0;
+            bool ok = true;
+            try
+            {
+                ok = replayCall(call, &session, &sent, &received);
+            }
+            catch (const std::exception &)
+            {
+                ok = false;
+            }
+
+            if (!ok && call.call == CALL_CREATE_SESSION)
+            {
+                session.failed = true;
+            }
+
+            std::lock_guard<std::mutex> lock(mLock);
+            mStats.calls++;
+            mStats.messagesSent += sent;
+            mStats.messagesReceived += received;
+            if (!ok)
+            {
+                mStats.callsFailed++;
+            }
+            if (call.finished && ok != call.status.ok())
+            {
+                mStats.outcomeChanges++;
+            }
+        }
+    }
+
+    ReplayStats stats()
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        return mStats;
+    }
+
+private:
+    Client *mClient;
+    double mSpeed;
+    uint64_t mTraceStart;
+    std::chrono::steady_clock::time_point mStart;
+    std::mutex mLock;
+    ReplayStats mStats;
+
+    /*
+     * Replay the call, counting the messages sent and received. Returns
+     * false (or throws) if the call failed.
+     */
+    bool replayCall(const ReplayCall &call, ReplaySession *session,
+                    uint64_t *sent, uint64_t *received)
+    {
+        const TraceRecord *request = call.find(EVENT_SEND);
+        if (!request)
+        {
+            // The call ended before anything was sent.
+            return true;
+        }
+
+        switch (call.call)
+        {
+        case CALL_VERSION:
+            waitFor(request->timestamp);
+            (*sent)++;
+            mClient->version();
+            (*received)++;
+            return true;
+
+        case CALL_LIST_MODELS:
+            waitFor(request->timestamp);
+            (*sent)++;
+            mClient->listModels();
+            (*received)++;
+            return true;
+
+        case CALL_CREATE_SESSION:
+        {
+            cobaltspeech::diatheke::SessionStart start;
+            parseRecord(*request, &start);
+            waitFor(request->timestamp);
+            (*sent)++;
+            cobaltspeech::diatheke::SessionOutput output =
+                mClient->createSessionWithWakeWord(start.model_id(),
+                                                   start.wakeword());
+            (*received)++;
+            session->token.Swap(output.mutable_token());
+            session->live = true;
+            return true;
+        }
+
+        case CALL_UPDATE_SESSION:
+            return replayUpdate(*request, session, sent, received);
+
+        case CALL_DELETE_SESSION:
+        {
+            cobaltspeech::diatheke::TokenData token;
+            parseRecord(*request, &token);
+            waitFor(request->timestamp);
+            (*sent)++;
+            mClient->deleteSession(session->tokenFor(token));
+            (*received)++;
+            session->live = false;
+            return true;
+        }
+
+        case CALL_STREAM_ASR:
+            return replayASR(call, *session, sent, received);
+
+        case CALL_STREAM_TTS:
+            return replayTTS(call, *request, sent, received);
+
+        case CALL_TRANSCRIBE:
+            return replayTranscribe(call, sent, received);
+
+        default:
+            return false;
+        }
+    }
+
+    bool replayUpdate(const TraceRecord &request, ReplaySession *session,
+                      uint64_t *sent, uint64_t *received)
+    {
+        cobaltspeech::diatheke::SessionInput input;
+        parseRecord(request, &input);
+        const cobaltspeech::diatheke::TokenData &token =
+            session->tokenFor(input.token());
+
+        waitFor(request.timestamp);
+        (*sent)++;
+        cobaltspeech::diatheke::SessionOutput output;
+        switch (input.input_case())
+        {
+        case cobaltspeech::diatheke::SessionInput::kText:
+            mClient->processText(token, input.text().text(), &output);
+            break;
+        case cobaltspeech::diatheke::SessionInput::kAsr:
+            mClient->processASRResult(token, input.asr(), &output);
+            break;
+        case cobaltspeech::diatheke::SessionInput::kCmd:
+            mClient->processCommandResult(token, input.cmd(), &output);
+            break;
+        case cobaltspeech::diatheke::SessionInput::kStory:
+        {
+            std::map<std::string, std::string> params(
+                input.story().parameters().begin(),
+                input.story().parameters().end());
+            mClient->setStory(token, input.story().story_id(), params, &output);
+            break;
+        }
+        default:
+            throw ClientError("UpdateSession in trace has no input");
+        }
+        (*received)++;
+
+        session->token.Swap(output.mutable_token());
+        session->live = true;
+        return true;
+    }
+
+    bool replayASR(const ReplayCall &call, const ReplaySession &session,
+                   uint64_t *sent, uint64_t *received)
+    {
+        std::unique_ptr<ASRStream> stream;
+        bool sending = true;
+        for (size_t i = 0; i < call.records.size(); i++)
+        {
+            const TraceRecord &record = call.records[i];
+            if (record.event != EVENT_SEND)
+            {
+                // Stop at the first sign that the client was done.
+                waitFor(record.timestamp);
+                break;
+            }
+
+            cobaltspeech::diatheke::ASRInput input;
+            parseRecord(record, &input);
+            waitFor(record.timestamp);
+            (*sent)++;
+            if (!stream && input.has_token())
+            {
+                stream.reset(new ASRStream(
+                    mClient->newSessionASRStream(session.tokenFor(input.token()))));
+                continue;
+            }
+            if (!stream)
+            {
+                stream.reset(new ASRStream(mClient->newASRStream()));
+            }
+            if (!sending)
+            {
+                continue;
+            }
+
+            // Stop sending once the server has a result.
+            if (input.has_token())
+            {
+                sending = stream->sendToken(session.tokenFor(input.token()));
+            }
+            else
+            {
+                sending = stream->sendAudio(input.audio());
+            }
+        }
+
+        if (call.cancelled())
+        {
+            stream->cancel();
+            return false;
+        }
+        stream->result();
+        (*received)++;
+        return true;
+    }
+
+    bool replayTTS(const ReplayCall &call, const TraceRecord &request,
+                   uint64_t *sent, uint64_t *received)
+    {
+        cobaltspeech::diatheke::ReplyAction reply;
+        parseRecord(request, &reply);
+
+        // A stream that was cancelled (e.g., for barge-in) is cancelled
+        // again after the same number of messages.
+        uint64_t limit = 0;
+        for (size_t i = 0; i < call.records.size(); i++)
+        {
+            if (call.records[i].event == EVENT_RECEIVE)
+            {
+                limit++;
+            }
+        }
+
+        waitFor(request.timestamp);
+        (*sent)++;
+        TTSStream stream = mClient->newTTSStream(reply);
+        std::string audio;
+        uint64_t count = 0;
+        while (!(call.cancelled() && count >= limit) &&
+               stream.receiveAudio(audio))
+        {
+            count++;
+        }
+        *received += count;
+
+        if (call.cancelled())
+        {
+            waitFor(call.records.back().timestamp);
+            stream.cancel();
+            return false;
+        }
+        return true;
+    }
+
+    bool replayTranscribe(const ReplayCall &call, uint64_t *sent,
+                          uint64_t *received)
+    {
+        // Results are received on the client's threads while sending.
+        struct Receiver
+        {
+            std::mutex lock;
+            std::condition_variable cond;
+            bool done;
+            uint64_t count;
+            TranscribeStream::ResultCallback next;
+        };
+        std::shared_ptr<Receiver> receiver = std::make_shared<Receiver>();
+        receiver->done = false;
+        receiver->count = 0;
+
+        std::unique_ptr<TranscribeStream> stream;
+        bool finished = false;
+        for (size_t i = 0; i < call.records.size(); i++)
+        {
+            const TraceRecord &record = call.records[i];
+            if (record.event == EVENT_RECEIVE)
+            {
+                continue;
+            }
+            waitFor(record.timestamp);
+            if (record.event != EVENT_SEND)
+            {
+                finished = record.event == EVENT_WRITES_DONE;
+                break;
+            }
+
+            cobaltspeech::diatheke::TranscribeInput input;
+            parseRecord(record, &input);
+            (*sent)++;
+            if (!stream)
+            {
+                stream.reset(new TranscribeStream(
+                    mClient->newTranscribeStream(input.action())));
+
+                TranscribeStream reader = *stream;
+                std::weak_ptr<Receiver> weak = receiver;
+                receiver->next =
+                    [weak, reader](bool ok,
+                                   cobaltspeech::diatheke::TranscribeResult &) mutable {
+                        std::shared_ptr<Receiver> r = weak.lock();
+                        if (!r)
+                        {
+                            return;
+                        }
+                        if (ok)
+                        {
+                            r->count++;
+                            reader.receiveResultAsync(r->next);
+                            return;
+                        }
+                        std::lock_guard<std::mutex> lock(r->lock);
+                        r->done = true;
+                        r->cond.notify_all();
+                    };
+                stream->receiveResultAsync(receiver->next);
+                continue;
+            }
+
+            if (input.has_action())
+            {
+                stream->sendAction(input.action());
+            }
+            else
+            {
+                stream->sendAudio(input.audio());
+            }
+        }
+
+        if (!stream)
+        {
+            return true;
+        }
+        if (finished)
+        {
+            stream->sendFinished();
+        }
+        else
+        {
+            stream->cancel();
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(receiver->lock);
+            receiver->cond.wait(lock, [&receiver] { return receiver->done; });
+        }
+        *received += receiver->count;
+        receiver->next = nullptr;
+        stream->close();
+        return finished;
+    }
+};
+
+TraceReplayer::TraceReplayer(Client &client) : mClient(&client), mSpeed(1.0)
+{
+}
+
+TraceReplayer::~TraceReplayer() {}
+
+void TraceReplayer::setSpeed(double speed) { mSpeed = std::max(speed, 0.0); }
+
+ReplayStats TraceReplayer::run(const std::string &path)
+{
+    // Collect the records of each call, in the order the calls started.
+    TraceReader reader(path);
+    std::vector<std::unique_ptr<ReplayCall>> calls;
+    std::unordered_map<uint64_t, ReplayCall *> callsByID;
+    std::unordered_map<uint64_t, ReplaySpan> runs;
+    TraceRecord record;
+    while (reader.next(&record))
+    {
+        // Each TraceWriter picks the upper half of its call IDs at random.
+        uint64_t runID = record.callID >> 32;
+        auto run = runs.find(runID);
+        if (run == runs.end())
+        {
+            runs.insert(std::make_pair(runID, ReplaySpan(record.timestamp)));
+        }
+        else
+        {
+            run->second.start = std::min(run->second.start, record.timestamp);
+            run->second.end = std::max(run->second.end, record.timestamp);
+        }
+
+        ReplayCall *&call = callsByID[record.callID];
+        if (!call)
+        {
+            calls.push_back(std::unique_ptr<ReplayCall>(new ReplayCall()));
+            call = calls.back().get();
+            call->call = record.call;
+        }
+        call->records.push_back(record);
+        if (record.event == EVENT_FINISH)
+        {
+            call->finished = true;
+            call->status = record.status();
+        }
+    }
+
+    /*
+     * Remove the gaps between runs. Runs are merged into spans where they
+     * overlap, and each span is moved back by the idle time before it.
+     */
+    std::vector<ReplaySpan> spans;
+    for (auto iter = runs.begin(); iter != runs.end(); ++iter)
+    {
+        spans.push_back(iter->second);
+    }
+    std::sort(spans.begin(), spans.end(),
+              [](const ReplaySpan &a, const ReplaySpan &b) {
+                  return a.start < b.start;
+              });
+    uint64_t first = spans.empty() ? 0 : spans.front().start;
+    uint64_t last = first;
+    uint64_t idle = 0;
+    std::vector<ReplaySpan> merged;
+    for (size_t i = 0; i < spans.size(); i++)
+    {
+        if (merged.empty() || spans[i].start > merged.back().end)
+        {
+            if (!merged.empty())
+            {
+                idle += spans[i].start - merged.back().end;
+            }
+            spans[i].shift = idle;
+            merged.push_back(spans[i]);
+        }
+        else
+        {
+            merged.back().end = std::max(merged.back().end, spans[i].end);
+        }
+        last = std::max(last, merged.back().end - merged.back().shift);
+    }
+    if (merged.size() > 1)
+    {
+        for (size_t i = 0; i < calls.size(); i++)
+        {
+            std::vector<TraceRecord> &records = calls[i]->records;
+            for (size_t j = 0; j < records.size(); j++)
+            {
+                // Find the last span that starts at or before the record.
+                auto span = std::upper_bound(
+                    merged.begin(), merged.end(), records[j].timestamp,
+                    [](uint64_t timestamp, const ReplaySpan &s) {
+                        return timestamp < s.start;
+                    });
+                records[j].timestamp -= (span - 1)->shift;
+            }
+        }
+    }
+
+    // Group the calls by session.
+    std::vector<ReplayGroup> groups;
+    std::unordered_map<std::string, size_t> groupsBySession;
+    for (size_t i = 0; i < calls.size(); i++)
+    {
+        const ReplayCall *call = calls[i].get();
+        std::string sessionID = call->sessionID();
+        if (!sessionID.empty())
+        {
+            auto iter = groupsBySession.find(sessionID);
+            if (iter != groupsBySession.end())
+            {
+                groups[iter->second].calls.push_back(call);
+                continue;
+            }
+            groupsBySession[sessionID] = groups.size();
+        }
+
+        ReplayGroup group;
+        group.calls.push_back(call);
+        group.start = call->records.front().timestamp;
+        groups.push_back(group);
+    }
+    std::stable_sort(groups.begin(), groups.end(),
+                     [](const ReplayGroup &a, const ReplayGroup &b) {
+                         return a.start < b.start;
+                     });
+
+    // Start a thread for each group when its first call is due.
+    ReplayRun run(mClient, mSpeed, first);
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    struct Worker
+    {
+        std::thread thread;
+        std::shared_ptr<std::atomic<bool>> done;
+    };
+    std::vector<Worker> workers;
+    for (size_t i = 0; i < groups.size(); i++)
+    {
+        run.waitFor(groups[i].start);
+
+        Worker worker;
+        worker.done = std::make_shared<std::atomic<bool>>(false);
+        std::shared_ptr<std::atomic<bool>> done = worker.done;
+        const ReplayGroup *group = &groups[i];
+        ReplayRun *replay = &run;
+        worker.thread = std::thread([replay, group, done]() {
+            replay->runGroup(*group);
+            *done = true;
+        });
+        workers.push_back(std::move(worker));
+
+        if (workers.size() % joinInterval == 0)
+        {
+            auto finished = std::partition(
+                workers.begin(), workers.end(),
+                [](const Worker &w) { return !w.done->load(); });
+            for (auto iter = finished; iter != workers.end(); ++iter)
+            {
+                iter->thread.join();
+            }
+            workers.erase(finished, workers.end());
+        }
+    }
+    for (size_t i = 0; i < workers.size(); i++)
+    {
+        workers[i].thread.join();
+    }
+
+    ReplayStats stats = run.stats();
+    stats.traceSeconds = (last - first) / 1e6;
+    stats.wallSeconds = std::chrono::duration<double>(
+                            std::chrono::steady_clock::now() - start)
+                            .count();
+    return stats;
+}
+
+} // namespace Diatheke
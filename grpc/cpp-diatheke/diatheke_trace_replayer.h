@@ -0,0 +1,111 @@
+/*
+ * Copyright (2021-present) Cobalt Speech and Language, Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DIATHEKE_TRACE_REPLAYER_H
+#define DIATHEKE_TRACE_REPLAYER_H
+
+#include <cstdint>
+#include <string>
+
+namespace Diatheke
+{
+
+class Client;
+
+// ReplayStats reports what happened while replaying a trace.
+struct ReplayStats
+{
+    // Number of calls replayed, and how many of those failed.
+    uint64_t calls;
+    uint64_t callsFailed;
+
+    /*
+     * Number of calls whose outcome (success or failure) was different
+     * from the recording.
+     */
+    uint64_t outcomeChanges;
+
+    // Number of calls skipped because the session they belong to could
+    // not be created.
+    uint64_t callsSkipped;
+
+    // Number of messages sent and received on the replayed calls.
+    uint64_t messagesSent;
+    uint64_t messagesReceived;
+
+    /*
+     * The longest a message was sent after its scheduled time, in
+     * milliseconds. This grows if the server (or the replaying machine)
+     * cannot keep up with the requested speed.
+     */
+    double maxLagMs;
+
+    /*
+     * Time taken by the recording, not counting the time between runs
+     * (see TraceReplayer), and by the replay, in seconds.
+     */
+    double traceSeconds;
+    double wallSeconds;
+
+    ReplayStats();
+};
+
+/*
+ * TraceReplayer sends the traffic recorded in a trace (see
+ * Client::setTrace()) to a server again, using the given client. Each
+ * request and stream message is sent at the same time relative to the
+ * start of the trace as when it was recorded, divided by the speed.
+ *
+ * The calls of a session run one after another, in recorded order, and
+ * use the session token returned by the live server rather than the
+ * recorded one. This keeps each session consistent with the server's
+ * replies, even when the replay falls behind. Calls not tied to a
+ * session (e.g., TTS and Transcribe streams) run on their own. Each
+ * session and call runs on its own thread while it is in progress.
+ *
+ * A trace that holds several runs of a program (appended to the same
+ * file at different times) is replayed with the idle time between the
+ * runs removed, so each run starts as soon as the previous one ends.
+ * Runs that overlap, such as several processes tracing to one file at
+ * once, keep their recorded timing relative to each other.
+ */
+class TraceReplayer
+{
+public:
+    explicit TraceReplayer(Client &client);
+    ~TraceReplayer();
+
+    /*
+     * Set the replay speed as a multiple of the recorded speed. The
+     * default is 1. A speed of zero sends everything as fast as possible.
+     */
+    void setSpeed(double speed);
+
+    /*
+     * Replay the trace at the given path, and return once all of its
+     * calls are done. Throws a ClientError if the trace cannot be read.
+     * Errors from the calls themselves are counted in the stats.
+     */
+    ReplayStats run(const std::string &path);
+
+private:
+    Client *mClient;
+    double mSpeed;
+};
+
+} // namespace Diatheke
+
+#endif // DIATHEKE_TRACE_REPLAYER_H
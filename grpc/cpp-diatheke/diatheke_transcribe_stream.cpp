@@ -16,25 +16,75 @@
 
 #include "diatheke_transcribe_stream.h"
 
+#include "diatheke_async_stream.h"
 #include "diatheke_client_error.h"
 
 namespace Diatheke
 {
+
+/* gRPC state for the stream, which may outlive the TranscribeStream object. */
+struct TranscribeStreamCall
+    : public AsyncStreamCall<TranscribeStream::GRPCReaderWriter>
+{
+    cobaltspeech::diatheke::TranscribeResult result;
+
+    // Reused for every audio chunk, so its buffer is only allocated once.
+    cobaltspeech::diatheke::TranscribeInput audioRequest;
+
+    TranscribeStreamCall(const std::shared_ptr<ChannelLease> &channel,
+                         const std::shared_ptr<CompletionQueuePool> &pool)
+        : AsyncStreamCall<TranscribeStream::GRPCReaderWriter>(channel, pool,
+                                                              CALL_TRANSCRIBE)
+    {
+    }
+};
+
+/* Private data struct */
+struct TranscribeStreamPrivate
+{
+    std::shared_ptr<TranscribeStreamCall> call;
+
+    ~TranscribeStreamPrivate() { call->shutdown(); }
+};
+
 TranscribeStream::TranscribeStream(
-    const std::shared_ptr<grpc::ClientContext> &ctx,
-    const std::shared_ptr<GRPCReaderWriter> &stream)
-    : mContext(ctx), mStream(stream)
+    const std::shared_ptr<ChannelLease> &channel,
+    const std::shared_ptr<CompletionQueuePool> &pool)
+    : dPtr(std::make_shared<TranscribeStreamPrivate>())
 {
+    /*
+     * We don't set a deadline on the context because we expect the
+     * stream to be long-lived.
+     */
+    std::shared_ptr<TranscribeStreamCall> call =
+        std::make_shared<TranscribeStreamCall>(channel, pool);
+    call->stream =
+        call->stub()->PrepareAsyncTranscribe(&call->context, call->queue());
+    call->start();
+    dPtr->call = call;
 }
 
 TranscribeStream::~TranscribeStream() {}
 
 bool TranscribeStream::sendAudio(const std::string &data)
 {
-    // Set up the request and write to the input stream
-    cobaltspeech::diatheke::TranscribeInput request;
-    request.set_audio(data);
-    return mStream->Write(request);
+    return this->sendAudio(data.data(), data.size());
+}
+
+bool TranscribeStream::sendAudio(const char *data, size_t size)
+{
+    // Copy the audio into the reused request and write to the input stream
+    TranscribeStreamCall *call = dPtr->call.get();
+    call->audioRequest.mutable_audio()->assign(data, size);
+    return call->write(call->audioRequest);
+}
+
+bool TranscribeStream::sendAudio(std::string &&data)
+{
+    // Swap the audio into the reused request and write to the input stream
+    TranscribeStreamCall *call = dPtr->call.get();
+    call->audioRequest.mutable_audio()->swap(data);
+    return call->write(call->audioRequest);
 }
 
 bool TranscribeStream::sendAction(const cobaltspeech::diatheke::TranscribeAction &action)
@@ -42,12 +92,12 @@ bool TranscribeStream::sendAction(const cobaltspeech::diatheke::TranscribeAction
     // Set up the request and write to the input stream
     cobaltspeech::diatheke::TranscribeInput request;
     *(request.mutable_action()) = action;
-    return mStream->Write(request);
+    return dPtr->call->write(request);
 }
 
 void TranscribeStream::sendFinished()
 {
-    if (!mStream->WritesDone())
+    if (!dPtr->call->writesDone() && !dPtr->call->cancelled())
     {
         throw ClientError("failed to finish sending");
     }
@@ -55,18 +105,33 @@ void TranscribeStream::sendFinished()
 
 bool TranscribeStream::receiveResult(cobaltspeech::diatheke::TranscribeResult *result)
 {
-    return mStream->Read(result);
+    return dPtr->call->read(result);
+}
+
+void TranscribeStream::receiveResultAsync(ResultCallback callback)
+{
+    std::shared_ptr<TranscribeStreamCall> call = dPtr->call;
+    call->readAsync(&call->result,
+                    [call, callback](bool ok) { callback(ok, call->result); });
 }
 
 void TranscribeStream::close()
 {
-    grpc::Status status = mStream->Finish();
-    if(!status.ok())
+    grpc::Status status = dPtr->call->finish();
+    if(!status.ok() && !dPtr->call->cancelled())
     {
         throw ClientError(status);
     }
 }
 
-TranscribeStream::GRPCReaderWriter *TranscribeStream::getStream() { return mStream.get(); }
+void TranscribeStream::cancel()
+{
+    dPtr->call->cancel();
+}
+
+TranscribeStream::GRPCReaderWriter *TranscribeStream::getStream()
+{
+    return dPtr->call->stream.get();
+}
 
 } // namespace Diatheke
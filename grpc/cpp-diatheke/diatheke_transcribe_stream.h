@@ -19,25 +19,39 @@
 
 #include "diatheke.grpc.pb.h"
 
+#include <functional>
 #include <memory>
 #include <string>
 
 namespace Diatheke
 {
 
+class ChannelLease;
+class CompletionQueuePool;
+class TranscribeStreamPrivate;
+
 class TranscribeStream
 {
 public:
-    using GRPCReaderWriter = grpc::ClientReaderWriter<cobaltspeech::diatheke::TranscribeInput,
-                                                      cobaltspeech::diatheke::TranscribeResult>;
+    using GRPCReaderWriter = grpc::ClientAsyncReaderWriter<cobaltspeech::diatheke::TranscribeInput,
+                                                           cobaltspeech::diatheke::TranscribeResult>;
+
+    /*
+     * Callback used by receiveResultAsync(). If ok is true, the result
+     * holds the next TranscribeResult from the server, which the callback
+     * may swap or move from. Otherwise there are no more results.
+     */
+    using ResultCallback = std::function<void(
+        bool ok, cobaltspeech::diatheke::TranscribeResult &result)>;
 
     /*
      * Create a new Transcribe stream object using the given gRPC objects.
-     * Most callers should use Client::newTranscribeStream() instead
-     * of creating a new stream directly.
+     * The stream runs on the given completion queue pool, so no thread is
+     * created for it. Most callers should use Client::newTranscribeStream()
+     * instead of creating a new stream directly.
      */
-    TranscribeStream(const std::shared_ptr<grpc::ClientContext> &ctx,
-                     const std::shared_ptr<GRPCReaderWriter> &stream);
+    TranscribeStream(const std::shared_ptr<ChannelLease> &channel,
+                     const std::shared_ptr<CompletionQueuePool> &pool);
     ~TranscribeStream();
 
     /*
@@ -52,6 +66,20 @@ public:
      */
     bool sendAudio(const std::string &data);
 
+    /*
+     * Send size bytes of audio data from the given buffer. This avoids
+     * building a temporary string for the audio.
+     */
+    bool sendAudio(const char *data, size_t size);
+
+    /*
+     * Send the given audio data, taking its contents instead of copying
+     * them. After the call, data holds a buffer left over from a previous
+     * call (with unspecified contents) that may be reused for the next
+     * chunk, so alternating calls don't allocate or copy.
+     */
+    bool sendAudio(std::string &&data);
+
     /*
      * Send the given TranscribeAction to Diatheke to update the speech
      * recognition context. The action must first be sent on the stream
@@ -81,6 +109,15 @@ public:
      */
     bool receiveResult(cobaltspeech::diatheke::TranscribeResult *result);
 
+    /*
+     * Start waiting for the next TranscribeResult without blocking. The
+     * callback is called from one of the client's completion queue threads
+     * when the result arrives or the stream ends, so it should return
+     * quickly and must not throw. It may call receiveResultAsync() again
+     * to continue reading. Only one receive may be pending at a time.
+     */
+    void receiveResultAsync(ResultCallback callback);
+
     /*
      * Close the stream. This should be called exactly once when both:
      *
@@ -93,6 +130,15 @@ public:
      */
     void close();
 
+    /*
+     * Cancel the stream right away. Any send or receive in progress
+     * (including one blocked on another thread) returns false, as do
+     * later calls, and sendFinished() and close() do not report an
+     * error. It is safe to call this from any thread. close() should
+     * still be called afterwards.
+     */
+    void cancel();
+
     /*
      * Provides access to the underlying gRPC stream without
      * transferring ownership of the stream.
@@ -100,8 +146,7 @@ public:
     GRPCReaderWriter *getStream();
 
 private:
-    std::shared_ptr<grpc::ClientContext> mContext;
-    std::shared_ptr<GRPCReaderWriter> mStream;
+    std::shared_ptr<TranscribeStreamPrivate> dPtr; // Opaque pointer
 };
 
 } // namespace Diatheke
@@ -0,0 +1,403 @@
+/*
+ * Copyright (2021-present) Cobalt Speech and Language, Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "diatheke_tts_cache.h"
+
+#include "diatheke_client_error.h"
+#include "diatheke_mapped_file.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <random>
+
+namespace Diatheke
+{
+
+/*
+ * Cache files hold the following, in native byte order:
+ *   - The magic string below
+ *   - The key size (uint32) and the key
+ *   - The chunk count (uint32) and the end offset of each chunk (uint32)
+ *   - The audio
+ * The key is stored so that hash collisions in the file name are caught.
+ */
+static const char fileMagic[8] = {'D', 'T', 'T', 'S', 'C', '0', '0', '1'};
+
+// The most entries that may wait to be written to disk.
+static const size_t maxPendingWrites = 1024;
+
+static std::string cacheKey(const cobaltspeech::diatheke::ReplyAction &reply)
+{
+    std::string key = reply.luna_model();
+    key.push_back('\0');
+    key += reply.text();
+    return key;
+}
+
+// Returns the name of the cache file for the given key (a 64-bit FNV-1a hash).
+static std::string cacheFileName(const std::string &key)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < key.size(); i++)
+    {
+        hash ^= static_cast<unsigned char>(key[i]);
+        hash *= 1099511628211ULL;
+    }
+
+    static const char digits[] = "0123456789abcdef";
+    std::string name(16, '0');
+    for (int i = 15; i >= 0; i--)
+    {
+        name[i] = digits[hash & 0xf];
+        hash >>= 4;
+    }
+
+    return name + ".tts";
+}
+
+// Reads a uint32 from the data at the given offset, if there is room.
+static bool readUInt32(const char *data, size_t size, size_t &offset,
+                       uint32_t &value)
+{
+    if (size - offset < sizeof(value))
+    {
+        return false;
+    }
+
+    std::memcpy(&value, data + offset, sizeof(value));
+    offset += sizeof(value);
+    return true;
+}
+
+TTSCacheEntry::TTSCacheEntry(std::string audio, std::vector<uint32_t> chunkEnds)
+    : mAudio(std::move(audio)), mChunkEnds(std::move(chunkEnds))
+{
+    mData = mAudio.data();
+    mSize = mAudio.size();
+}
+
+TTSCacheEntry::TTSCacheEntry(const std::shared_ptr<MappedFile> &file,
+                             const char *data, size_t size,
+                             std::vector<uint32_t> chunkEnds)
+    : mFile(file), mData(data), mSize(size), mChunkEnds(std::move(chunkEnds))
+{
+}
+
+TTSCacheEntry::~TTSCacheEntry() {}
+
+size_t TTSCacheEntry::chunkCount() const { return mChunkEnds.size(); }
+
+void TTSCacheEntry::copyChunk(size_t index, std::string &buffer) const
+{
+    size_t start = index == 0 ? 0 : mChunkEnds[index - 1];
+    buffer.assign(mData + start, mChunkEnds[index] - start);
+}
+
+size_t TTSCacheEntry::size() const { return mSize; }
+
+TTSCache::TTSCache(size_t maxMemoryBytes)
+    : mMaxMemory(maxMemoryBytes), mMemoryUsage(0), mWriting(false),
+      mStopping(false), mTempCounter(0)
+{
+    /*
+     * Other processes may share the disk directory, so temporary names
+     * start with a random prefix rather than anything local to us.
+     */
+    std::random_device random;
+    mTempPrefix = std::to_string(random()) + std::to_string(random());
+}
+
+TTSCache::~TTSCache()
+{
+    {
+        std::lock_guard<std::mutex> lock(mWriteLock);
+        mStopping = true;
+        mWriteCond.notify_all();
+    }
+
+    if (mWriter.joinable())
+    {
+        mWriter.join();
+    }
+}
+
+void TTSCache::setDiskDirectory(const std::string &directory)
+{
+    std::lock_guard<std::mutex> lock(mLock);
+    mDiskDirectory = directory;
+}
+
+std::shared_ptr<const TTSCacheEntry>
+TTSCache::find(const cobaltspeech::diatheke::ReplyAction &reply)
+{
+    std::string key = cacheKey(reply);
+    std::string directory;
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        auto iter = mIndex.find(key);
+        if (iter != mIndex.end())
+        {
+            // Move the entry to the front of the LRU list.
+            mLRU.splice(mLRU.begin(), mLRU, iter->second);
+            return iter->second->second;
+        }
+
+        directory = mDiskDirectory;
+    }
+
+    if (directory.empty())
+    {
+        return std::shared_ptr<const TTSCacheEntry>();
+    }
+
+    // Don't hold the lock while reading the file.
+    std::shared_ptr<const TTSCacheEntry> entry = readFile(directory, key);
+    if (entry)
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        store(key, entry);
+    }
+
+    return entry;
+}
+
+void TTSCache::insert(const cobaltspeech::diatheke::ReplyAction &reply,
+                      const std::shared_ptr<const TTSCacheEntry> &entry)
+{
+    std::string key = cacheKey(reply);
+    std::string directory;
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        store(key, entry);
+        directory = mDiskDirectory;
+    }
+
+    if (directory.empty())
+    {
+        return;
+    }
+
+    // Hand the entry to the writer thread, starting it if needed.
+    std::lock_guard<std::mutex> lock(mWriteLock);
+    if (mWrites.size() >= maxPendingWrites)
+    {
+        // The disk tier is best-effort, so skip the entry.
+        return;
+    }
+
+    PendingWrite write = {directory, key, entry};
+    mWrites.push_back(std::move(write));
+    if (!mWriter.joinable())
+    {
+        mWriter = std::thread(&TTSCache::runWriter, this);
+    }
+    mWriteCond.notify_all();
+}
+
+void TTSCache::flush()
+{
+    std::unique_lock<std::mutex> lock(mWriteLock);
+    while (!mWrites.empty() || mWriting)
+    {
+        mWriteCond.wait(lock);
+    }
+}
+
+void TTSCache::clear()
+{
+    std::lock_guard<std::mutex> lock(mLock);
+    mLRU.clear();
+    mIndex.clear();
+    mMemoryUsage = 0;
+}
+
+size_t TTSCache::memoryUsage()
+{
+    std::lock_guard<std::mutex> lock(mLock);
+    return mMemoryUsage;
+}
+
+void TTSCache::store(const std::string &key,
+                     const std::shared_ptr<const TTSCacheEntry> &entry)
+{
+    auto iter = mIndex.find(key);
+    if (iter != mIndex.end())
+    {
+        mMemoryUsage -= iter->second->second->size();
+        mLRU.erase(iter->second);
+        mIndex.erase(iter);
+    }
+
+    if (entry->size() > mMaxMemory)
+    {
+        // It would only push everything else out.
+        return;
+    }
+
+    mLRU.push_front(std::make_pair(key, entry));
+    mIndex[key] = mLRU.begin();
+    mMemoryUsage += entry->size();
+
+    // Evict the least recently used entries.
+    while (mMemoryUsage > mMaxMemory)
+    {
+        mMemoryUsage -= mLRU.back().second->size();
+        mIndex.erase(mLRU.back().first);
+        mLRU.pop_back();
+    }
+}
+
+std::shared_ptr<const TTSCacheEntry>
+TTSCache::readFile(const std::string &directory, const std::string &key)
+{
+    std::string path = directory + "/" + cacheFileName(key);
+
+    // A missing file is a cache miss, not an error.
+    std::ifstream exists(path.c_str());
+    if (!exists)
+    {
+        return std::shared_ptr<const TTSCacheEntry>();
+    }
+    exists.close();
+
+    std::shared_ptr<MappedFile> file;
+    try
+    {
+        file = std::make_shared<MappedFile>(path);
+    }
+    catch (const ClientError &)
+    {
+        return std::shared_ptr<const TTSCacheEntry>();
+    }
+
+    // Check the header, and treat anything unexpected as a miss.
+    const char *data = file->data();
+    size_t size = file->size();
+    size_t offset = sizeof(fileMagic);
+    uint32_t keySize = 0;
+    if (size < offset || std::memcmp(data, fileMagic, offset) != 0 ||
+        !readUInt32(data, size, offset, keySize) || size - offset < keySize ||
+        key.compare(0, std::string::npos, data + offset, keySize) != 0)
+    {
+        return std::shared_ptr<const TTSCacheEntry>();
+    }
+    offset += keySize;
+
+    uint32_t chunkCount = 0;
+    if (!readUInt32(data, size, offset, chunkCount) ||
+        (size - offset) / sizeof(uint32_t) < chunkCount)
+    {
+        return std::shared_ptr<const TTSCacheEntry>();
+    }
+
+    std::vector<uint32_t> chunkEnds(chunkCount);
+    uint32_t previous = 0;
+    for (uint32_t i = 0; i < chunkCount; i++)
+    {
+        readUInt32(data, size, offset, chunkEnds[i]);
+        if (chunkEnds[i] < previous)
+        {
+            return std::shared_ptr<const TTSCacheEntry>();
+        }
+        previous = chunkEnds[i];
+    }
+
+    if (size - offset != previous)
+    {
+        return std::shared_ptr<const TTSCacheEntry>();
+    }
+
+    return std::shared_ptr<const TTSCacheEntry>(
+        new TTSCacheEntry(file, data + offset, previous, std::move(chunkEnds)));
+}
+
+void TTSCache::writeFile(const std::string &directory, const std::string &key,
+                         const TTSCacheEntry &entry)
+{
+    /*
+     * Write to a temporary file first and then rename it, so that other
+     * readers never see a partial file.
+     */
+    std::string path = directory + "/" + cacheFileName(key);
+    std::string tempPath = path + ".tmp" + mTempPrefix + "-" +
+                           std::to_string(mTempCounter.fetch_add(1));
+
+    /*
+     * Open in exclusive mode ("x"), so we never write into a file that
+     * another process also picked, however unlikely that is.
+     */
+    std::FILE *out = std::fopen(tempPath.c_str(), "wbx");
+    if (out == nullptr)
+    {
+        return;
+    }
+
+    uint32_t keySize = static_cast<uint32_t>(key.size());
+    uint32_t chunkCount = static_cast<uint32_t>(entry.mChunkEnds.size());
+    bool ok = std::fwrite(fileMagic, sizeof(fileMagic), 1, out) == 1 &&
+              std::fwrite(&keySize, sizeof(keySize), 1, out) == 1 &&
+              std::fwrite(key.data(), 1, key.size(), out) == key.size() &&
+              std::fwrite(&chunkCount, sizeof(chunkCount), 1, out) == 1 &&
+              std::fwrite(entry.mChunkEnds.data(), sizeof(uint32_t),
+                          chunkCount, out) == chunkCount &&
+              std::fwrite(entry.mData, 1, entry.mSize, out) == entry.mSize;
+    if (std::fclose(out) != 0 || !ok)
+    {
+        // The disk tier is best-effort, so just skip this entry.
+        std::remove(tempPath.c_str());
+        return;
+    }
+
+    if (std::rename(tempPath.c_str(), path.c_str()) != 0)
+    {
+        // On some platforms rename fails if the file already exists, in
+        // which case another writer got there first.
+        std::remove(tempPath.c_str());
+    }
+}
+
+void TTSCache::runWriter()
+{
+    std::unique_lock<std::mutex> lock(mWriteLock);
+    while (true)
+    {
+        // Pending writes are finished even when stopping.
+        if (mWrites.empty())
+        {
+            if (mStopping)
+            {
+                return;
+            }
+            mWriteCond.wait(lock);
+            continue;
+        }
+
+        PendingWrite write = std::move(mWrites.front());
+        mWrites.pop_front();
+        mWriting = true;
+        lock.unlock();
+
+        writeFile(write.directory, write.key, *write.entry);
+        write.entry.reset();
+
+        lock.lock();
+        mWriting = false;
+        mWriteCond.notify_all();
+    }
+}
+
+} // namespace Diatheke
@@ -0,0 +1,180 @@
+/*
+ * Copyright (2021-present) Cobalt Speech and Language, Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DIATHEKE_TTS_CACHE_H
+#define DIATHEKE_TTS_CACHE_H
+
+#include "diatheke.grpc.pb.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace Diatheke
+{
+
+class MappedFile;
+
+/*
+ * TTSCacheEntry holds the synthesized audio for one reply, split into
+ * the same chunks the server sent it in. Entries are immutable, so they
+ * can be shared by any number of streams.
+ */
+class TTSCacheEntry
+{
+public:
+    /*
+     * Create an entry from the given audio, where chunkEnds holds the
+     * offset of the end of each chunk.
+     */
+    TTSCacheEntry(std::string audio, std::vector<uint32_t> chunkEnds);
+    ~TTSCacheEntry();
+
+    // Returns the number of audio chunks.
+    size_t chunkCount() const;
+
+    // Store a copy of the chunk at the given index in the buffer.
+    void copyChunk(size_t index, std::string &buffer) const;
+
+    // Returns the total size of the audio in bytes.
+    size_t size() const;
+
+private:
+    friend class TTSCache;
+
+    std::string mAudio;
+    std::shared_ptr<MappedFile> mFile;
+    const char *mData;
+    size_t mSize;
+    std::vector<uint32_t> mChunkEnds;
+
+    // Create an entry that refers to audio in a mapped cache file.
+    TTSCacheEntry(const std::shared_ptr<MappedFile> &file, const char *data,
+                  size_t size, std::vector<uint32_t> chunkEnds);
+
+    TTSCacheEntry(const TTSCacheEntry &) = delete;
+    TTSCacheEntry &operator=(const TTSCacheEntry &) = delete;
+};
+
+/*
+ * TTSCache stores synthesized audio for replies, keyed on the reply text
+ * and Luna model, so that replies that are repeated often (e.g., fixed
+ * prompts) don't have to be synthesized again. Give a cache to
+ * Client::setTTSCache() to use it with Client::newTTSStream().
+ *
+ * Recently used entries are kept in memory, up to the given size. If a
+ * disk directory is set, every entry is also written to a file there,
+ * and entries that are not in memory are read back by memory-mapping
+ * their file. Files are written on a background thread, so streams
+ * that add audio to the cache do not wait for the disk. The disk tier
+ * may be shared by several processes, and it survives restarts.
+ *
+ * It is safe to use the cache from multiple threads.
+ */
+class TTSCache
+{
+public:
+    // Create a cache that keeps up to maxMemoryBytes of audio in memory.
+    explicit TTSCache(size_t maxMemoryBytes);
+
+    // Finishes writing any entries still waiting for the disk.
+    ~TTSCache();
+
+    /*
+     * Set the directory for the disk tier, which must already exist. An
+     * empty string (the default) disables the disk tier.
+     */
+    void setDiskDirectory(const std::string &directory);
+
+    /*
+     * Returns the cached audio for the given reply, or null if it is not
+     * in the cache.
+     */
+    std::shared_ptr<const TTSCacheEntry>
+    find(const cobaltspeech::diatheke::ReplyAction &reply);
+
+    /*
+     * Add audio for the given reply to the cache, replacing any previous
+     * entry. If the disk tier is enabled, the entry is queued to be
+     * written to disk by a background thread. Errors writing to disk are
+     * ignored, and entries are not written if too many are already
+     * waiting.
+     */
+    void insert(const cobaltspeech::diatheke::ReplyAction &reply,
+                const std::shared_ptr<const TTSCacheEntry> &entry);
+
+    // Wait until the entries queued for the disk have been written.
+    void flush();
+
+    // Remove all entries from memory. The disk tier is not changed.
+    void clear();
+
+    // Returns the size of the audio currently held in memory.
+    size_t memoryUsage();
+
+private:
+    using LRUList =
+        std::list<std::pair<std::string, std::shared_ptr<const TTSCacheEntry>>>;
+
+    std::mutex mLock;
+    size_t mMaxMemory;
+    size_t mMemoryUsage;
+    LRUList mLRU; // Most recently used first
+    std::unordered_map<std::string, LRUList::iterator> mIndex;
+    std::string mDiskDirectory;
+
+    // Entries waiting to be written to disk by the writer thread.
+    struct PendingWrite
+    {
+        std::string directory;
+        std::string key;
+        std::shared_ptr<const TTSCacheEntry> entry;
+    };
+
+    std::mutex mWriteLock;
+    std::condition_variable mWriteCond;
+    std::deque<PendingWrite> mWrites;
+    bool mWriting;
+    bool mStopping;
+    std::thread mWriter;
+
+    // Makes temporary file names unique to this cache.
+    std::string mTempPrefix;
+    std::atomic<unsigned int> mTempCounter;
+
+    void store(const std::string &key,
+               const std::shared_ptr<const TTSCacheEntry> &entry);
+    std::shared_ptr<const TTSCacheEntry>
+    readFile(const std::string &directory, const std::string &key);
+    void writeFile(const std::string &directory, const std::string &key,
+                   const TTSCacheEntry &entry);
+    void runWriter();
+
+    TTSCache(const TTSCache &) = delete;
+    TTSCache &operator=(const TTSCache &) = delete;
+};
+
+} // namespace Diatheke
+
+#endif // DIATHEKE_TTS_CACHE_H
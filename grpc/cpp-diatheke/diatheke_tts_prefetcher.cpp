@@ -0,0 +1,322 @@
+/*
+ * Copyright (2021-present) Cobalt Speech and Language, Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "diatheke_tts_prefetcher.h"
+
+#include "diatheke_audio_helpers.h"
+#include "diatheke_client.h"
+#include "diatheke_client_error.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+namespace Diatheke
+{
+
+/* The synthesis state and buffered audio of one reply. */
+struct TTSPrefetchReply
+{
+    cobaltspeech::diatheke::ReplyAction reply;
+    std::shared_ptr<TTSStream> stream;
+    std::deque<std::string> chunks;
+    grpc::Status status;
+    bool done;
+
+    TTSPrefetchReply() : done(false) {}
+};
+
+/*
+ * Private data struct. TTS callbacks hold a reference to it, so it may
+ * briefly outlive the TTSPrefetcher object.
+ */
+struct TTSPrefetcherPrivate
+{
+    Client *client;
+
+    // The session the replies are for, if known, for timeline reports.
+    cobaltspeech::diatheke::TokenData token;
+
+    unsigned int maxStreams;
+    std::mutex lock;
+    std::condition_variable cond;
+    std::vector<TTSPrefetchReply> replies;
+    size_t nextReply;
+    unsigned int openStreams;
+
+    // Number of streams being created outside the lock.
+    unsigned int creating;
+    bool closed;
+
+    TTSPrefetcherPrivate(Client *c, unsigned int max)
+        : client(c), maxStreams(max == 0 ? 1 : max), nextReply(0),
+          openStreams(0), creating(0), closed(false)
+    {
+    }
+};
+
+static void readNextChunk(const std::shared_ptr<TTSPrefetcherPrivate> &data,
+                          size_t index);
+
+/*
+ * Open streams for the next replies in order, up to the stream limit.
+ * This may be called from a completion queue thread, so it must not block.
+ */
+static void startStreams(const std::shared_ptr<TTSPrefetcherPrivate> &data)
+{
+    // Claim the next replies under the lock.
+    std::vector<size_t> started;
+    {
+        std::lock_guard<std::mutex> lock(data->lock);
+        while (!data->closed && data->openStreams < data->maxStreams &&
+               data->nextReply < data->replies.size())
+        {
+            started.push_back(data->nextReply);
+            data->nextReply++;
+            data->openStreams++;
+        }
+        if (started.empty())
+        {
+            return;
+        }
+        data->creating++;
+    }
+
+    /*
+     * Create the streams without the lock. With a disk cache, looking up
+     * the reply may read a file, which must not hold up the callbacks of
+     * the other streams. The replies and token are not changed after
+     * construction, so they may be read here.
+     */
+    std::vector<std::shared_ptr<TTSStream>> streams;
+    grpc::Status error;
+    try
+    {
+        for (size_t i = 0; i < started.size(); i++)
+        {
+            streams.push_back(std::make_shared<TTSStream>(data->client->newTTSStream(
+                data->replies[started[i]].reply, data->token)));
+        }
+    }
+    catch (const std::exception &e)
+    {
+        // Report the failure to readers of the replies without a stream.
+        error = grpc::Status(grpc::StatusCode::UNKNOWN, e.what());
+    }
+
+    // Publish them, unless the prefetcher was destroyed meanwhile, in
+    // which case they are cancelled when released after the lock.
+    bool closed;
+    {
+        std::lock_guard<std::mutex> lock(data->lock);
+        closed = data->closed;
+        for (size_t i = 0; i < started.size() && !closed; i++)
+        {
+            TTSPrefetchReply &entry = data->replies[started[i]];
+            if (i < streams.size())
+            {
+                entry.stream = streams[i];
+            }
+            else
+            {
+                entry.status = error;
+                entry.done = true;
+                data->openStreams--;
+            }
+        }
+        data->creating--;
+        data->cond.notify_all();
+    }
+
+    if (closed)
+    {
+        return;
+    }
+    for (size_t i = 0; i < streams.size(); i++)
+    {
+        readNextChunk(data, started[i]);
+    }
+
+    // Move on to the replies after one that could not be started.
+    if (streams.size() < started.size())
+    {
+        startStreams(data);
+    }
+}
+
+static void readNextChunk(const std::shared_ptr<TTSPrefetcherPrivate> &data,
+                          size_t index)
+{
+    std::shared_ptr<TTSStream> stream;
+    {
+        std::lock_guard<std::mutex> lock(data->lock);
+        stream = data->replies[index].stream;
+    }
+
+    if (!stream)
+    {
+        // The prefetcher was destroyed.
+        return;
+    }
+
+    stream->receiveAudioAsync([data, index](bool hasAudio, std::string &audio,
+                                            const grpc::Status &status) {
+        std::shared_ptr<TTSStream> finished;
+        {
+            std::lock_guard<std::mutex> lock(data->lock);
+            TTSPrefetchReply &entry = data->replies[index];
+            if (hasAudio && data->closed)
+            {
+                // Nobody will read the audio.
+            }
+            else if (hasAudio)
+            {
+                entry.chunks.push_back(std::string());
+                entry.chunks.back().swap(audio);
+            }
+            else
+            {
+                entry.status = status;
+                entry.done = true;
+                finished.swap(entry.stream);
+                data->openStreams--;
+            }
+            data->cond.notify_all();
+        }
+
+        if (hasAudio)
+        {
+            readNextChunk(data, index);
+        }
+        else
+        {
+            startStreams(data);
+        }
+    });
+}
+
+TTSPrefetcher::TTSPrefetcher(
+    Client &client, const cobaltspeech::diatheke::SessionOutput &output,
+    unsigned int maxStreams)
+    : dPtr(std::make_shared<TTSPrefetcherPrivate>(&client, maxStreams))
+{
+    dPtr->token = output.token();
+    for (int i = 0; i < output.action_list_size(); i++)
+    {
+        const cobaltspeech::diatheke::ActionData &action = output.action_list(i);
+        if (action.has_reply())
+        {
+            dPtr->replies.push_back(TTSPrefetchReply());
+            dPtr->replies.back().reply = action.reply();
+        }
+    }
+
+    startStreams(dPtr);
+}
+
+TTSPrefetcher::TTSPrefetcher(
+    Client &client,
+    const std::vector<cobaltspeech::diatheke::ReplyAction> &replies,
+    unsigned int maxStreams)
+    : dPtr(std::make_shared<TTSPrefetcherPrivate>(&client, maxStreams))
+{
+    dPtr->replies.resize(replies.size());
+    for (size_t i = 0; i < replies.size(); i++)
+    {
+        dPtr->replies[i].reply = replies[i];
+    }
+
+    startStreams(dPtr);
+}
+
+TTSPrefetcher::~TTSPrefetcher()
+{
+    // Destroying the streams cancels them. The last references are
+    // released after the lock, when this function returns.
+    std::vector<std::shared_ptr<TTSStream>> streams;
+    {
+        // Wait for streams being created, which use the client.
+        std::unique_lock<std::mutex> lock(dPtr->lock);
+        dPtr->closed = true;
+        while (dPtr->creating > 0)
+        {
+            dPtr->cond.wait(lock);
+        }
+        for (size_t i = 0; i < dPtr->replies.size(); i++)
+        {
+            TTSPrefetchReply &entry = dPtr->replies[i];
+            if (entry.stream)
+            {
+                streams.push_back(entry.stream);
+                entry.stream.reset();
+            }
+            entry.chunks.clear();
+        }
+    }
+}
+
+size_t TTSPrefetcher::replyCount() const { return dPtr->replies.size(); }
+
+const cobaltspeech::diatheke::ReplyAction &
+TTSPrefetcher::reply(size_t index) const
+{
+    return dPtr->replies.at(index).reply;
+}
+
+bool TTSPrefetcher::receiveAudio(size_t index, std::string &buffer)
+{
+    if (index >= dPtr->replies.size())
+    {
+        throw ClientError("TTSPrefetcher reply index out of range");
+    }
+
+    std::unique_lock<std::mutex> lock(dPtr->lock);
+    TTSPrefetchReply &entry = dPtr->replies[index];
+    while (entry.chunks.empty() && !entry.done)
+    {
+        dPtr->cond.wait(lock);
+    }
+
+    if (!entry.chunks.empty())
+    {
+        buffer.swap(entry.chunks.front());
+        entry.chunks.pop_front();
+        return true;
+    }
+
+    if (!entry.status.ok())
+    {
+        throw ClientError(entry.status);
+    }
+
+    return false;
+}
+
+void TTSPrefetcher::writeAudio(size_t index, AudioWriter *writer)
+{
+    std::string buffer;
+    while (this->receiveAudio(index, buffer))
+    {
+        // Write the audio chunk
+        size_t bytesWritten = writer->writeAudio(buffer.data(), buffer.size());
+        if (bytesWritten != buffer.size())
+        {
+            throw ClientError("AudioWriter did not write all data");
+        }
+    }
+}
+
+} // namespace Diatheke
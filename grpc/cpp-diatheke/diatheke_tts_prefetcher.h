@@ -0,0 +1,99 @@
+/*
+ * Copyright (2021-present) Cobalt Speech and Language, Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DIATHEKE_TTS_PREFETCHER_H
+#define DIATHEKE_TTS_PREFETCHER_H
+
+#include "diatheke.grpc.pb.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace Diatheke
+{
+
+class AudioWriter;
+class Client;
+class TTSPrefetcherPrivate;
+
+/*
+ * TTSPrefetcher synthesizes several replies ahead of time, so that each
+ * reply after the first can start playing without waiting for the
+ * server. A TTS stream is opened for every reply in order, with a limited
+ * number open at a time, and their audio is buffered until it is read.
+ *
+ * Replies are identified by their index in the list of replies (which,
+ * for a SessionOutput, counts only the reply actions). The audio for
+ * each reply may be read as soon as it starts to arrive, even while the
+ * rest of it is still being synthesized.
+ *
+ * The client must outlive the prefetcher.
+ */
+class TTSPrefetcher
+{
+public:
+    /*
+     * Start synthesizing every ReplyAction in the action list of the
+     * given session output, with at most maxStreams TTS streams open at
+     * a time. A maxStreams of zero is treated as one.
+     */
+    TTSPrefetcher(Client &client,
+                  const cobaltspeech::diatheke::SessionOutput &output,
+                  unsigned int maxStreams = 2);
+
+    // Start synthesizing the given replies, as above.
+    TTSPrefetcher(Client &client,
+                  const std::vector<cobaltspeech::diatheke::ReplyAction> &replies,
+                  unsigned int maxStreams = 2);
+
+    /*
+     * Cancels any TTS streams that are still open and discards any audio
+     * that has not been read.
+     */
+    ~TTSPrefetcher();
+
+    // Returns the number of replies being synthesized.
+    size_t replyCount() const;
+
+    // Returns the reply at the given index.
+    const cobaltspeech::diatheke::ReplyAction &reply(size_t index) const;
+
+    /*
+     * Waits for the next chunk of audio data for the reply at the given
+     * index, and stores it in the given buffer. Returns false when there
+     * is no more audio for that reply. Throws a ClientError if the reply
+     * could not be synthesized.
+     */
+    bool receiveAudio(size_t index, std::string &buffer);
+
+    /*
+     * Send all audio for the reply at the given index to the writer,
+     * waiting for more audio as needed. This is the prefetched version
+     * of WriteTTSAudio().
+     */
+    void writeAudio(size_t index, AudioWriter *writer);
+
+private:
+    std::shared_ptr<TTSPrefetcherPrivate> dPtr; // Opaque pointer
+
+    TTSPrefetcher(const TTSPrefetcher &) = delete;
+    TTSPrefetcher &operator=(const TTSPrefetcher &) = delete;
+};
+
+} // namespace Diatheke
+
+#endif // DIATHEKE_TTS_PREFETCHER_H
@@ -16,36 +16,224 @@
 
 #include "diatheke_tts_stream.h"
 
+#include "diatheke_async_stream.h"
 #include "diatheke_client_error.h"
+#include "diatheke_tts_cache.h"
+
+#include <atomic>
+#include <chrono>
 
 namespace Diatheke
 {
-TTSStream::TTSStream(const std::shared_ptr<grpc::ClientContext> &ctx,
-                     const std::shared_ptr<GRPCReader> &stream)
-    : mClosed(false), mContext(ctx), mStream(stream)
+
+/* gRPC state for the stream, which may outlive the TTSStream object. */
+struct TTSStreamCall : public AsyncStreamCall<TTSStream::GRPCReader>
+{
+    /*
+     * Reused for every chunk. Parsing a new chunk into it keeps the
+     * capacity of its audio buffer, which we swap with the caller's.
+     */
+    cobaltspeech::diatheke::TTSAudio response;
+
+    /*
+     * If a cache is set, the audio received so far is recorded here and
+     * added to the cache when the stream finishes successfully.
+     */
+    std::shared_ptr<TTSCache> cache;
+    cobaltspeech::diatheke::ReplyAction reply;
+    std::string recordedAudio;
+    std::vector<uint32_t> recordedChunkEnds;
+
+    /*
+     * If the call has a timeline observer, the session the reply is for
+     * and the time the latest chunk arrived, which is reported as the
+     * last audio once the stream ends.
+     */
+    std::string sessionID;
+    bool audioReceived;
+    std::chrono::steady_clock::time_point lastAudio;
+
+    TTSStreamCall(const std::shared_ptr<ChannelLease> &channel,
+                  const std::shared_ptr<CompletionQueuePool> &pool)
+        : AsyncStreamCall<TTSStream::GRPCReader>(channel, pool,
+                                                 CALL_STREAM_TTS),
+          audioReceived(false)
+    {
+    }
+
+    // Called when a chunk arrives, to mark the first audio.
+    void markChunk()
+    {
+        TimelineObserver *observer = timeline();
+        if (!observer)
+        {
+            return;
+        }
+
+        lastAudio = std::chrono::steady_clock::now();
+        if (!audioReceived)
+        {
+            audioReceived = true;
+            observer->onTimelinePoint(sessionID, POINT_TTS_FIRST_AUDIO,
+                                      lastAudio);
+        }
+    }
+
+    // Called once the stream ends, to mark the last audio.
+    void markEnd()
+    {
+        TimelineObserver *observer = timeline();
+        if (observer && audioReceived && status.ok())
+        {
+            audioReceived = false;
+            observer->onTimelinePoint(sessionID, POINT_TTS_LAST_AUDIO,
+                                      lastAudio);
+        }
+    }
+
+    // Record the chunk in the response, if the stream is being cached.
+    void recordChunk()
+    {
+        if (cache)
+        {
+            recordedAudio += response.audio();
+            recordedChunkEnds.push_back(
+                static_cast<uint32_t>(recordedAudio.size()));
+        }
+    }
+
+    /*
+     * Add the recorded audio to the cache if the status is OK. A stream
+     * cancelled by the caller (e.g., on barge-in) holds only part of the
+     * reply, so it is never cached.
+     */
+    void storeRecording()
+    {
+        if (cache && status.ok() && !cancelled())
+        {
+            cache->insert(reply, std::make_shared<TTSCacheEntry>(
+                                     std::move(recordedAudio),
+                                     std::move(recordedChunkEnds)));
+        }
+        cache.reset();
+    }
+};
+
+/* Private data struct */
+struct TTSStreamPrivate
+{
+    std::shared_ptr<TTSStreamCall> call;
+    bool closed;
+
+    // Used instead of the call when playing back cached audio.
+    std::shared_ptr<const TTSCacheEntry> cached;
+    std::atomic<size_t> nextChunk;
+    std::atomic<bool> cachedCancelled;
+    TTSStream::AudioCallback pendingCallback;
+    bool delivering;
+
+    TTSStreamPrivate()
+        : closed(false), nextChunk(0), cachedCancelled(false), delivering(false)
+    {
+    }
+
+    ~TTSStreamPrivate()
+    {
+        if (call)
+        {
+            call->shutdown();
+        }
+    }
+
+    // Copy the next cached chunk into the buffer, if there is one.
+    bool nextCachedChunk(std::string &buffer)
+    {
+        size_t index = nextChunk.fetch_add(1);
+        if (index >= cached->chunkCount())
+        {
+            nextChunk = cached->chunkCount();
+            return false;
+        }
+
+        cached->copyChunk(index, buffer);
+        return true;
+    }
+};
+
+TTSStream::TTSStream(const std::shared_ptr<ChannelLease> &channel,
+                     const std::shared_ptr<CompletionQueuePool> &pool,
+                     const cobaltspeech::diatheke::ReplyAction &reply)
+    : TTSStream(channel, pool, reply, std::shared_ptr<TTSCache>())
+{
+}
+
+TTSStream::TTSStream(const std::shared_ptr<ChannelLease> &channel,
+                     const std::shared_ptr<CompletionQueuePool> &pool,
+                     const cobaltspeech::diatheke::ReplyAction &reply,
+                     const std::shared_ptr<TTSCache> &cache,
+                     const std::string &sessionID)
+    : dPtr(std::make_shared<TTSStreamPrivate>())
 {
+    /*
+     * We don't set a deadline on the context because we expect the
+     * stream to be long-lived.
+     */
+    std::shared_ptr<TTSStreamCall> call =
+        std::make_shared<TTSStreamCall>(channel, pool);
+    if (cache)
+    {
+        call->cache = cache;
+        call->reply = reply;
+    }
+    TimelineObserver *observer = call->timeline();
+    if (observer)
+    {
+        call->sessionID = sessionID;
+        observer->onTimelinePoint(sessionID, POINT_TTS_SENT,
+                                  std::chrono::steady_clock::now());
+    }
+    call->traceMessage(EVENT_SEND, reply);
+    call->stream = call->stub()->PrepareAsyncStreamTTS(&call->context, reply,
+                                                       call->queue());
+    call->start();
+    dPtr->call = call;
+}
+
+TTSStream::TTSStream(const std::shared_ptr<const TTSCacheEntry> &audio)
+    : dPtr(std::make_shared<TTSStreamPrivate>())
+{
+    dPtr->cached = audio;
 }
 
 TTSStream::~TTSStream() {}
 
 bool TTSStream::receiveAudio(std::string &buffer)
 {
-    cobaltspeech::diatheke::TTSAudio response;
-    if (mStream->Read(&response))
+    if (dPtr->cached)
     {
-        buffer = response.audio();
+        return dPtr->nextCachedChunk(buffer);
+    }
+
+    TTSStreamCall *call = dPtr->call.get();
+    if (!call->cancelled() && call->read(&call->response))
+    {
+        call->markChunk();
+        call->recordChunk();
+        call->response.mutable_audio()->swap(buffer);
         return true;
     }
 
-    if (!mClosed)
+    if (!dPtr->closed)
     {
-        mClosed = true;
+        dPtr->closed = true;
 
         // Close the stream and get the gRPC status. This is
         // one of the nuances of C++ that we don't have to do
         // in other languages.
-        grpc::Status status = mStream->Finish();
-        if (!status.ok())
+        grpc::Status status = call->finish();
+        call->markEnd();
+        call->storeRecording();
+        if (!status.ok() && !call->cancelled())
         {
             throw ClientError(status);
         }
@@ -54,6 +242,97 @@ bool TTSStream::receiveAudio(std::string &buffer)
     return false;
 }
 
-TTSStream::GRPCReader *TTSStream::getStream() { return mStream.get(); }
+void TTSStream::receiveAudioAsync(AudioCallback callback)
+{
+    if (dPtr->cached)
+    {
+        /*
+         * Cached audio is delivered right away. If the callback asks for
+         * the next chunk, we loop here instead of recursing. The local
+         * reference keeps our data alive if the callback destroys this
+         * object.
+         */
+        std::shared_ptr<TTSStreamPrivate> data = dPtr;
+        data->pendingCallback = callback;
+        if (data->delivering)
+        {
+            return;
+        }
+
+        data->delivering = true;
+        while (data->pendingCallback)
+        {
+            AudioCallback next;
+            next.swap(data->pendingCallback);
+
+            std::string chunk;
+            bool hasAudio = data->nextCachedChunk(chunk);
+            next(hasAudio, chunk, grpc::Status::OK);
+        }
+        data->delivering = false;
+        return;
+    }
+
+    std::shared_ptr<TTSStreamCall> call = dPtr->call;
+    call->readAsync(&call->response, [call, callback](bool ok) {
+        if (ok)
+        {
+            call->markChunk();
+            call->recordChunk();
+            callback(true, *(call->response.mutable_audio()), call->status);
+            return;
+        }
+
+        // Get the final status of the stream before reporting the end.
+        auto reportEnd = [call, callback](bool) {
+            call->markEnd();
+            call->storeRecording();
+            std::string empty;
+            callback(false, empty, call->status);
+        };
+        if (!call->finishAsync(reportEnd))
+        {
+            /*
+             * The status was already requested, by an earlier receive or
+             * by cancel(). Report the end once it has arrived.
+             */
+            call->finishOp.then(reportEnd);
+        }
+    });
+}
+
+void TTSStream::cancel()
+{
+    if (dPtr->call)
+    {
+        dPtr->call->cancel();
+    }
+    else
+    {
+        // Skip the rest of the cached audio.
+        dPtr->cachedCancelled = true;
+        dPtr->nextChunk = dPtr->cached->chunkCount();
+    }
+}
+
+bool TTSStream::cancelled() const
+{
+    if (dPtr->call)
+    {
+        return dPtr->call->cancelled();
+    }
+
+    return dPtr->cachedCancelled.load();
+}
+
+TTSStream::GRPCReader *TTSStream::getStream()
+{
+    if (!dPtr->call)
+    {
+        return nullptr;
+    }
+
+    return dPtr->call->stream.get();
+}
 
 } // namespace Diatheke
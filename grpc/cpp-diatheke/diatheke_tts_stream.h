@@ -19,23 +19,63 @@
 
 #include "diatheke.grpc.pb.h"
 
+#include <functional>
 #include <memory>
+#include <string>
 
 namespace Diatheke
 {
 
+class ChannelLease;
+class CompletionQueuePool;
+class TTSCache;
+class TTSCacheEntry;
+class TTSStreamPrivate;
+
 class TTSStream
 {
 public:
-    using GRPCReader = grpc::ClientReader<cobaltspeech::diatheke::TTSAudio>;
+    using GRPCReader =
+        grpc::ClientAsyncReader<cobaltspeech::diatheke::TTSAudio>;
+
+    /*
+     * Callback used by receiveAudioAsync(). If hasAudio is true, the
+     * next chunk of audio is stored in the given buffer, which the
+     * callback may swap or move from. Otherwise there is no more audio
+     * to receive, and status holds the final status of the stream.
+     */
+    using AudioCallback = std::function<void(
+        bool hasAudio, std::string &audio, const grpc::Status &status)>;
+
+    /*
+     * Create a new TTSStream object that synthesizes the given reply.
+     * The stream runs on the given completion queue pool, so no thread
+     * is created for it. Most callers should use Client::newTTSStream()
+     * instead of creating the stream directly.
+     */
+    TTSStream(const std::shared_ptr<ChannelLease> &channel,
+              const std::shared_ptr<CompletionQueuePool> &pool,
+              const cobaltspeech::diatheke::ReplyAction &reply);
+
+    /*
+     * Create a new TTSStream as above, and add the audio it receives to
+     * the given cache if the stream finishes successfully. The stream's
+     * timeline points, if the channel has an observer, are reported for
+     * the given session.
+     */
+    TTSStream(const std::shared_ptr<ChannelLease> &channel,
+              const std::shared_ptr<CompletionQueuePool> &pool,
+              const cobaltspeech::diatheke::ReplyAction &reply,
+              const std::shared_ptr<TTSCache> &cache,
+              const std::string &sessionID = std::string());
 
     /*
-     * Create a new TTSStream object using the given gRPC objects.
-     * Most callers should use Client::newTTSStream() instead of
-     * creating the stream directly.
+     * Create a new TTSStream that plays back cached audio without
+     * contacting the server. The audio is received in the same chunks
+     * as when it was synthesized, and receiveAudioAsync() calls its
+     * callback from the calling thread.
      */
-    TTSStream(const std::shared_ptr<grpc::ClientContext> &ctx,
-              const std::shared_ptr<GRPCReader> &stream);
+    explicit TTSStream(const std::shared_ptr<const TTSCacheEntry> &audio);
 
     ~TTSStream();
 
@@ -43,19 +83,51 @@ public:
      * Waits for the next chunk of audio data from the server,
      * and stores the audio data in the given buffer. Returns
      * false when there is no more audio to receive.
+     *
+     * The audio is swapped into the buffer rather than copied, and the
+     * buffer's previous storage is reused to receive the next chunk. Calling
+     * this in a loop with the same buffer does not copy or allocate once
+     * the buffers are large enough.
      */
     bool receiveAudio(std::string &buffer);
 
+    /*
+     * Starts waiting for the next chunk of audio data without blocking.
+     * The callback is called from one of the client's completion queue
+     * threads when the audio arrives or the stream ends, so it should
+     * return quickly and must not throw. It may call receiveAudioAsync()
+     * again to continue reading. Only one receive may be pending at a
+     * time.
+     */
+    void receiveAudioAsync(AudioCallback callback);
+
+    /*
+     * Stop receiving audio right away, e.g., when the user starts talking
+     * over the reply. The server is told to stop synthesizing, and any
+     * receive in progress (including one blocked on another thread)
+     * returns. After this, receiveAudio() returns false without an error,
+     * and receiveAudioAsync() reports the end of the stream with a
+     * CANCELLED status. It is safe to call this from any thread, and more
+     * than once.
+     */
+    void cancel();
+
+    /*
+     * Returns true if cancel() has been called on this stream. A stream
+     * that ends with a CANCELLED status without having been cancelled
+     * was stopped by the server or the channel, which is an error.
+     */
+    bool cancelled() const;
+
     /*
      * Provides access to the underlying gRPC stream without
-     * transferring ownership of the stream.
+     * transferring ownership of the stream. Returns null if the
+     * stream plays back cached audio.
      */
     GRPCReader *getStream();
 
 private:
-    bool mClosed;
-    std::shared_ptr<grpc::ClientContext> mContext;
-    std::shared_ptr<GRPCReader> mStream;
+    std::shared_ptr<TTSStreamPrivate> dPtr; // Opaque pointer
 };
 
 } // namespace Diatheke
@@ -0,0 +1,301 @@
+/*
+ * Copyright (2021-present) Cobalt Speech and Language, Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "diatheke_voice_gate.h"
+
+#include "diatheke_client_error.h"
+#include "diatheke_simd.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace Diatheke
+{
+
+// Returns the sum of the squares of the given samples.
+static uint64_t sumSquares(const int16_t *x, size_t n)
+{
+    uint64_t total = 0;
+    size_t i = 0;
+
+#if defined(DIATHEKE_SIMD_AVX2)
+    // Pairs of squares fit in an unsigned 32-bit lane, so widen them to
+    // 64 bits before adding.
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc = zero;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(x + i));
+        __m256i sq = _mm256_madd_epi16(v, v);
+        acc = _mm256_add_epi64(acc, _mm256_unpacklo_epi32(sq, zero));
+        acc = _mm256_add_epi64(acc, _mm256_unpackhi_epi32(sq, zero));
+    }
+    uint64_t lanes[4];
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(lanes), acc);
+    total = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#elif defined(DIATHEKE_SIMD_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(x + i));
+        __m128i sq = _mm_madd_epi16(v, v);
+        acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(sq, zero));
+        acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(sq, zero));
+    }
+    uint64_t lanes[2];
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes), acc);
+    total = lanes[0] + lanes[1];
+#elif defined(DIATHEKE_SIMD_NEON)
+    int64x2_t acc = vdupq_n_s64(0);
+    for (; i + 8 <= n; i += 8)
+    {
+        int16x8_t v = vld1q_s16(x + i);
+        acc = vpadalq_s32(acc, vmull_s16(vget_low_s16(v), vget_low_s16(v)));
+        acc = vpadalq_s32(acc, vmull_s16(vget_high_s16(v), vget_high_s16(v)));
+    }
+    total = vgetq_lane_s64(acc, 0) + vgetq_lane_s64(acc, 1);
+#endif
+
+    for (; i < n; i++)
+    {
+        total += static_cast<uint64_t>(static_cast<int32_t>(x[i]) * x[i]);
+    }
+    return total;
+}
+
+// Returns the number of times the sign changes between adjacent samples.
+static size_t zeroCrossings(const int16_t *x, size_t n)
+{
+    size_t total = 0;
+    size_t i = 1;
+
+    /*
+     * Shifting each sample right by 15 gives -1 for negative samples and
+     * 0 otherwise, so XOR with the previous sample's gives -1 for each
+     * crossing. Multiplying by -1 in pairs adds them up as positives.
+     */
+#if defined(DIATHEKE_SIMD_AVX2)
+    const __m256i neg = _mm256_set1_epi16(-1);
+    __m256i acc = _mm256_setzero_si256();
+    for (; i + 16 <= n; i += 16)
+    {
+        __m256i cur = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(x + i));
+        __m256i prev = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(x + i - 1));
+        __m256i diff = _mm256_xor_si256(_mm256_srai_epi16(cur, 15),
+                                        _mm256_srai_epi16(prev, 15));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(diff, neg));
+    }
+    int32_t lanes[8];
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(lanes), acc);
+    for (int j = 0; j < 8; j++)
+    {
+        total += lanes[j];
+    }
+#elif defined(DIATHEKE_SIMD_SSE2)
+    const __m128i neg = _mm_set1_epi16(-1);
+    __m128i acc = _mm_setzero_si128();
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128i cur = _mm_loadu_si128(reinterpret_cast<const __m128i *>(x + i));
+        __m128i prev = _mm_loadu_si128(reinterpret_cast<const __m128i *>(x + i - 1));
+        __m128i diff = _mm_xor_si128(_mm_srai_epi16(cur, 15),
+                                     _mm_srai_epi16(prev, 15));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(diff, neg));
+    }
+    int32_t lanes[4];
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes), acc);
+    total = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#elif defined(DIATHEKE_SIMD_NEON)
+    int32x4_t acc = vdupq_n_s32(0);
+    for (; i + 8 <= n; i += 8)
+    {
+        int16x8_t diff = veorq_s16(vshrq_n_s16(vld1q_s16(x + i), 15),
+                                   vshrq_n_s16(vld1q_s16(x + i - 1), 15));
+        acc = vpadalq_s16(acc, diff);
+    }
+    total = -(vgetq_lane_s32(acc, 0) + vgetq_lane_s32(acc, 1) +
+              vgetq_lane_s32(acc, 2) + vgetq_lane_s32(acc, 3));
+#endif
+
+    for (; i < n; i++)
+    {
+        total += (x[i] < 0) != (x[i - 1] < 0);
+    }
+    return total;
+}
+
+/*
+ * Returns the size in bytes of the given duration of 16-bit audio, to
+ * the nearest whole sample. This is exact for rates that are not a
+ * multiple of 1000 Hz (e.g., 22050 Hz), and for rates below 1000 Hz.
+ */
+static size_t bytesForMs(unsigned int sampleRate, unsigned int ms)
+{
+    uint64_t samples = (static_cast<uint64_t>(sampleRate) * ms + 500) / 1000;
+    return static_cast<size_t>(samples * 2);
+}
+
+VoiceGateOptions::VoiceGateOptions()
+    : sampleRate(16000),
+      frameMs(10),
+      energyThreshold(500),
+      zeroCrossingRate(0.3f),
+      preRollMs(300),
+      maxPauseMs(1500)
+{
+}
+
+VoiceGateStats::VoiceGateStats()
+    : bytesRead(0), bytesSent(0), speechSegments(0)
+{
+}
+
+VoiceActivityGate::VoiceActivityGate(AudioReader *reader,
+                                     const VoiceGateOptions &options)
+    : mReader(reader),
+      mOptions(options),
+      mOpen(false),
+      mFinished(false),
+      mPauseBytes(0),
+      mOutputPos(0)
+{
+    if (reader == nullptr)
+    {
+        throw ClientError("no audio reader given to the voice gate");
+    }
+
+    mFrameBytes = bytesForMs(options.sampleRate, options.frameMs);
+    mPreRollBytes = bytesForMs(options.sampleRate, options.preRollMs);
+    mMaxPauseBytes = bytesForMs(options.sampleRate, options.maxPauseMs);
+    if (mFrameBytes == 0)
+    {
+        throw ClientError("voice gate frame size is zero");
+    }
+}
+
+VoiceActivityGate::~VoiceActivityGate() {}
+
+size_t VoiceActivityGate::readAudio(char *buffer, size_t buffSize)
+{
+    while (mOutputPos == mOutput.size())
+    {
+        if (mFinished)
+        {
+            return 0;
+        }
+        mOutput.clear();
+        mOutputPos = 0;
+
+        // Read more audio after what is left of the last partial frame.
+        size_t start = mInput.size();
+        mInput.resize(start + buffSize);
+        size_t n = mReader->readAudio(&mInput[start], buffSize);
+        mInput.resize(start + n);
+        mStats.bytesRead += n;
+
+        size_t pos = 0;
+        for (; pos + mFrameBytes <= mInput.size(); pos += mFrameBytes)
+        {
+            processFrame(&mInput[pos]);
+        }
+        mInput.erase(0, pos);
+
+        if (n == 0)
+        {
+            // Send the last partial frame if the gate is open.
+            mFinished = true;
+            if (mOpen)
+            {
+                mOutput.append(mInput);
+            }
+            mInput.clear();
+        }
+        mStats.bytesSent += mOutput.size();
+    }
+
+    size_t count = std::min(buffSize, mOutput.size() - mOutputPos);
+    memcpy(buffer, &mOutput[mOutputPos], count);
+    mOutputPos += count;
+    return count;
+}
+
+bool VoiceActivityGate::isOpen() const { return mOpen; }
+
+VoiceGateStats VoiceActivityGate::stats() const { return mStats; }
+
+bool VoiceActivityGate::isSpeech(const int16_t *samples, size_t count,
+                                 const VoiceGateOptions &options)
+{
+    if (count == 0)
+    {
+        return false;
+    }
+
+    // Compare mean squares, which avoids taking a square root.
+    double meanSquare = static_cast<double>(sumSquares(samples, count)) / count;
+    double threshold = static_cast<double>(options.energyThreshold) *
+                       options.energyThreshold;
+    if (meanSquare >= threshold)
+    {
+        return true;
+    }
+
+    if (options.zeroCrossingRate > 0 && meanSquare >= threshold / 4)
+    {
+        size_t crossings = zeroCrossings(samples, count);
+        return crossings >= options.zeroCrossingRate * count;
+    }
+    return false;
+}
+
+void VoiceActivityGate::processFrame(const char *frame)
+{
+    // Frames start at even offsets in the string's buffer.
+    const int16_t *samples = reinterpret_cast<const int16_t *>(frame);
+    if (isSpeech(samples, mFrameBytes / 2, mOptions))
+    {
+        if (!mOpen)
+        {
+            // Start with the pre-roll, so the onset is not cut off.
+            mOpen = true;
+            mStats.speechSegments++;
+            mOutput.append(mPreRoll);
+            mPreRoll.clear();
+        }
+        mPauseBytes = 0;
+        mOutput.append(frame, mFrameBytes);
+        return;
+    }
+
+    if (mOpen && mPauseBytes < mMaxPauseBytes)
+    {
+        // Send the start of a pause, then hold back the rest.
+        mPauseBytes += mFrameBytes;
+        mOpen = mPauseBytes < mMaxPauseBytes;
+        mOutput.append(frame, mFrameBytes);
+        return;
+    }
+
+    mOpen = false;
+    mPreRoll.append(frame, mFrameBytes);
+    if (mPreRoll.size() > mPreRollBytes)
+    {
+        mPreRoll.erase(0, mPreRoll.size() - mPreRollBytes);
+    }
+}
+
+} // namespace Diatheke
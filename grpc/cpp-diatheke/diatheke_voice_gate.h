@@ -0,0 +1,148 @@
+/*
+ * Copyright (2021-present) Cobalt Speech and Language, Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DIATHEKE_VOICE_GATE_H
+#define DIATHEKE_VOICE_GATE_H
+
+#include "diatheke_audio_helpers.h"
+
+#include <cstdint>
+#include <string>
+
+namespace Diatheke
+{
+
+/*
+ * VoiceGateOptions configures a VoiceActivityGate. Times are given in
+ * milliseconds of audio. The defaults suit 16 kHz, 16-bit mono audio.
+ */
+struct VoiceGateOptions
+{
+    // Sample rate of the audio, in Hz.
+    unsigned int sampleRate;
+
+    // Length of the frames that are classified as speech or silence.
+    unsigned int frameMs;
+
+    /*
+     * Frames with an RMS level (in 16-bit sample units) at or above this
+     * threshold are speech.
+     */
+    unsigned int energyThreshold;
+
+    /*
+     * Quieter frames (down to half of the energy threshold) are also
+     * speech if at least this fraction of their samples cross zero, which
+     * catches soft fricatives such as "s" and "f". Zero disables this.
+     */
+    float zeroCrossingRate;
+
+    // Audio kept from before speech starts, so its onset is not cut off.
+    unsigned int preRollMs;
+
+    /*
+     * Silence after speech that is still sent, so the server can detect
+     * the end of the utterance. Longer pauses are shortened to this, and
+     * silence is held back again until the next speech. This should be
+     * longer than the server's end-of-utterance timeout.
+     */
+    unsigned int maxPauseMs;
+
+    VoiceGateOptions();
+};
+
+// VoiceGateStats reports how much audio a VoiceActivityGate held back.
+struct VoiceGateStats
+{
+    // Bytes read from the wrapped reader.
+    uint64_t bytesRead;
+
+    // Bytes passed on to the stream.
+    uint64_t bytesSent;
+
+    // Number of times speech started after being held back.
+    unsigned int speechSegments;
+
+    VoiceGateStats();
+};
+
+/*
+ * VoiceActivityGate is an AudioReader that holds back silence read from
+ * another reader, for use with ReadASRAudio() and ReadTranscribeAudio().
+ * This saves bandwidth and server processing while waiting for the user
+ * to speak. Leading silence is dropped except for a short pre-roll, and
+ * long pauses are shortened.
+ *
+ * Frames are classified by their energy and zero-crossing rate, using
+ * SSE2/AVX2 or NEON where available. The audio must be 16-bit, little
+ * endian, mono PCM. Because silence is dropped rather than delayed,
+ * readAudio() blocks while the wrapped reader provides silence.
+ *
+ * A VoiceActivityGate is used for a single stream, and should not be
+ * shared between threads.
+ */
+class VoiceActivityGate : public AudioReader
+{
+public:
+    /*
+     * Create a gate that reads from the given reader, which is not owned
+     * and must outlive the gate.
+     */
+    explicit VoiceActivityGate(AudioReader *reader,
+                               const VoiceGateOptions &options = VoiceGateOptions());
+    ~VoiceActivityGate();
+
+    size_t readAudio(char *buffer, size_t buffSize) override;
+
+    // Returns true if the gate is currently passing audio through.
+    bool isOpen() const;
+
+    // Returns the statistics so far.
+    VoiceGateStats stats() const;
+
+    /*
+     * Returns true if the given frame of 16-bit samples would be
+     * classified as speech with the given options.
+     */
+    static bool isSpeech(const int16_t *samples, size_t count,
+                         const VoiceGateOptions &options);
+
+private:
+    AudioReader *mReader;
+    VoiceGateOptions mOptions;
+    size_t mFrameBytes;
+    size_t mPreRollBytes;
+    size_t mMaxPauseBytes;
+
+    bool mOpen;
+    bool mFinished;
+    size_t mPauseBytes;
+    VoiceGateStats mStats;
+
+    std::string mInput;   // Audio read but not yet classified.
+    std::string mPreRoll; // Recent silence, while the gate is closed.
+    std::string mOutput;  // Audio waiting to be returned.
+    size_t mOutputPos;
+
+    void processFrame(const char *frame);
+
+    VoiceActivityGate(const VoiceActivityGate &) = delete;
+    VoiceActivityGate &operator=(const VoiceActivityGate &) = delete;
+};
+
+} // namespace Diatheke
+
+#endif // DIATHEKE_VOICE_GATE_H